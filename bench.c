@@ -0,0 +1,1428 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "vfs.h"
+
+#define DEFAULT_POOL (8 * 1024 * 1024)
+#define MAX_RECORD (64 * 1024)
+#define MAX_STREAMS 64
+#define RING_DEPTH 256
+#define RING_BATCH 64
+#define SPILL_TEMP "/tmp/vfs_bench.spill"
+#define JOURNAL_TEMP "/tmp/vfs_bench.journal"
+#define NEEDS_THREADS 1     // -t
+#define NEEDS_CHECKSUM 2    // -c
+
+// Operations timed by the harness
+enum
+{
+    OP_CREATE,
+    OP_WRITE,
+    OP_APPEND,
+    OP_READ,
+    OP_UNLINK,
+    OP_SEARCH,
+    OP_SCRUB,
+    OP_COUNT
+};
+
+static const char *opNames[OP_COUNT] = { "create", "write", "append", "read", "unlink", "search", "scrub" };
+
+// Latency samples for one operation type
+typedef struct OpSamples
+{
+    long long *ns;
+    int count;
+    int capacity;
+    int failures;
+} OPSAMPLES;
+
+typedef struct Workload
+{
+    const char *name;
+    void (*run)(int scale);
+    int needs;          // NEEDS_*, skipped without them
+} WORKLOAD;
+
+// What -A compares between allocation policies
+typedef struct RunSummary
+{
+    double opsPerSec;
+    long long worstP99;     // highest p99 of any operation
+    size_t poolUsed;
+    size_t slack;
+    double fragmentation;
+    int failures;
+} RUNSUMMARY;
+
+// One ring entry in flight
+typedef struct RingSlot
+{
+    int op;
+    int file;
+    int len;
+    int batch;              // entries submitted together with this one
+    long long submitted;
+    char buf[32];
+} RINGSLOT;
+
+typedef struct BenchThread
+{
+    pthread_t handle;
+    int id;
+    int scale;
+    void (*body)(int id, int scale);
+    OPSAMPLES samples[OP_COUNT];
+} BENCHTHREAD;
+
+static OPSAMPLES mainSamples[OP_COUNT];
+static __thread OPSAMPLES *samples = mainSamples;
+static __thread unsigned long long rngState;
+static __thread char readBuf[MAX_RECORD];
+static char payload[MAX_RECORD];
+static int jsonOutput = 0;
+static int compareMode = 0;
+static int threadCount = 0;
+static unsigned long long baseSeed;
+static int checkFailed = 0;
+static const char *spillPath = NULL;
+
+// xorshift64*, so runs with the same seed replay the same operations
+static unsigned long long nextRandom()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 2685821657736338717ULL;
+}
+
+static int randomRange(int lo, int hi)
+{
+    return lo + (int)(nextRandom() % (unsigned long long)(hi - lo + 1));
+}
+
+static long long nowNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void record(int op, long long ns, int ret)
+{
+    OPSAMPLES *s = &samples[op];
+    
+    if (ret < 0)
+    {
+        s->failures++;
+        return;
+    }
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 1024;
+        s->ns = (long long *)realloc(s->ns, s->capacity * sizeof(long long));
+    }
+    s->ns[s->count++] = ns;
+}
+
+static __thread int lastRet;
+
+// Time one engine call and record its latency under op
+#define TIMED(op, call) \
+    do { \
+        long long t0_ = nowNs(); \
+        int ret_ = (call); \
+        record((op), nowNs() - t0_, ret_); \
+        lastRet = ret_; \
+    } while (0)
+
+static int createFile(const char *path, int size)
+{
+    int fd;
+    
+    TIMED(OP_CREATE, vfs_open(path, VFS_RDWR | VFS_CREAT | VFS_EXCL, VFS_PERM_RDWR));
+    if ((fd = lastRet) < 0)
+        return fd;
+    TIMED(OP_WRITE, vfs_write(fd, payload, size));
+    return fd;
+}
+
+static void removeFile(const char *path, int fd)
+{
+    vfs_close(fd);
+    TIMED(OP_UNLINK, vfs_unlink(path));
+}
+
+// Many small files created, read back and deleted in rounds
+static void runSmallFiles(int scale)
+{
+    char path[64];
+    int fds[1000], round, i;
+    
+    for (round = 0; round < 10 * scale; round++)
+    {
+        for (i = 0; i < 1000; i++)
+        {
+            sprintf(path, "/small%d", i);
+            fds[i] = createFile(path, randomRange(16, 256));
+        }
+        for (i = 0; i < 1000; i++)
+        {
+            if (fds[i] >= 0)
+                TIMED(OP_READ, vfs_pread(fds[i], readBuf, 256, 0));
+        }
+        for (i = 0; i < 1000; i++)
+        {
+            sprintf(path, "/small%d", i);
+            if (fds[i] >= 0)
+                removeFile(path, fds[i]);
+        }
+    }
+}
+
+// Config-sized files of a few dozen bytes, small enough to stay in their inodes
+static void runTinyFiles(int scale)
+{
+    char path[64];
+    int fds[1000], round, i;
+    
+    for (round = 0; round < 10 * scale; round++)
+    {
+        for (i = 0; i < 1000; i++)
+        {
+            sprintf(path, "/tiny%d", i);
+            fds[i] = createFile(path, randomRange(8, 48));
+        }
+        for (i = 0; i < 1000; i++)
+        {
+            if (fds[i] >= 0)
+                TIMED(OP_READ, vfs_pread(fds[i], readBuf, 64, 0));
+        }
+        for (i = 0; i < 1000; i++)
+        {
+            sprintf(path, "/tiny%d", i);
+            if (fds[i] >= 0)
+                removeFile(path, fds[i]);
+        }
+    }
+}
+
+// Random creates and deletes of mixed sizes that splinter the pool
+static void runChurn(int scale)
+{
+    char path[64];
+    int fds[900], i, n;
+    
+    for (i = 0; i < 900; i++)
+        fds[i] = -1;
+    for (n = 0; n < 50000 * scale; n++)
+    {
+        i = randomRange(0, 899);
+        sprintf(path, "/churn%d", i);
+        if (fds[i] >= 0)
+        {
+            removeFile(path, fds[i]);
+            fds[i] = -1;
+        }
+        else
+        {
+            int size = (nextRandom() % 8 == 0) ? randomRange(4096, 32768) : randomRange(64, 4096);
+            fds[i] = createFile(path, size);
+            if (fds[i] >= 0 && lastRet < 0)
+            {
+                removeFile(path, fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+}
+
+// A handful of log files receiving small appends, truncated now and then
+static void runAppendLog(int scale)
+{
+    char path[64];
+    int fds[64], i, n;
+    
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/log%d", i);
+        fds[i] = createFile(path, 0);
+    }
+    for (n = 0; n < 100000 * scale; n++)
+    {
+        i = randomRange(0, 63);
+        if (nextRandom() % 300 == 0)
+            TIMED(OP_WRITE, vfs_ftruncate(fds[i], 0));
+        else
+            TIMED(OP_APPEND, vfs_append(fds[i], payload, randomRange(32, 200)));
+    }
+}
+
+static RINGSLOT ringSlots[RING_DEPTH];
+
+// Take the completions that are there, or wait for one. Every entry is
+// charged its batch's submit-to-completion time over the batch size.
+static int reapRing(struct vfs_ring *ring, int *freeSlots, int freeCount, int *fds, long *sizes, int *busy, int wait)
+{
+    struct vfs_cqe cqes[RING_BATCH];
+    long long now;
+    int count, i;
+    
+    count = vfs_ring_reap(ring, cqes, RING_BATCH, wait);
+    now = nowNs();
+    for (i = 0; i < count; i++)
+    {
+        RINGSLOT *slot = &ringSlots[cqes[i].userData];
+        int ret = cqes[i].result;
+        
+        if (slot->op != OP_COUNT)
+            record(slot->op, (now - slot->submitted) / slot->batch, ret);
+        if (slot->op == OP_CREATE)
+            fds[slot->file] = ret;
+        else if (slot->op == OP_APPEND && ret > 0)
+            sizes[slot->file] += ret;
+        else if (slot->op == OP_READ && ret >= 0 && (ret != slot->len || memcmp(slot->buf, payload, ret) != 0))
+        {
+            fprintf(stderr, "ring_append: read back the wrong data from /ring%d\n", slot->file);
+            checkFailed = 1;
+        }
+        if (slot->file >= 0)
+            busy[slot->file]--;
+        freeSlots[freeCount++] = (int)cqes[i].userData;
+    }
+    return freeCount;
+}
+
+// append_log's traffic through a ring: opens, appends, read-backs, closes
+// and unlinks go in batches, with several batches in flight. With -t the
+// ring gets that many workers, otherwise vfs_submit runs each batch.
+static void runRingAppend(int scale)
+{
+    char paths[64][16];
+    long sizes[64];
+    int fds[64], busy[64], freeSlots[RING_DEPTH], freeCount = RING_DEPTH;
+    int phase, i, n = 0, total = 100000 * scale;
+    struct vfs_ring *ring;
+    
+    if ((ring = vfs_ring_create(RING_DEPTH, threadCount)) == NULL)
+    {
+        fprintf(stderr, "ring_append: vfs_ring_create failed\n");
+        checkFailed = 1;
+        return;
+    }
+    for (i = 0; i < RING_DEPTH; i++)
+        freeSlots[i] = i;
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(paths[i], "/ring%d", i);
+        fds[i] = -1;
+        sizes[i] = 0;
+        busy[i] = 0;
+    }
+    
+    // Opens, then the appends and reads, then closes and unlinks
+    for (phase = 0; phase < 4; phase++)
+    {
+        int next = 0;
+        
+        for (i = 0; phase == 2 && i < 64; i++)
+        {
+            struct vfs_stat st;
+            
+            if (fds[i] >= 0 && (vfs_fstat(fds[i], &st) != VFS_OK || (long)st.size != sizes[i]))
+            {
+                fprintf(stderr, "ring_append: %s lost appends\n", paths[i]);
+                checkFailed = 1;
+            }
+        }
+        for (;;)
+        {
+            int batch = 0, slots[RING_BATCH];
+            
+            while (batch < RING_BATCH && freeCount > 0)
+            {
+                struct vfs_sqe *sqe;
+                RINGSLOT *slot;
+                int file;
+                
+                if (phase == 1 ? n == total : next == 64)
+                    break;
+                if (phase == 1)
+                {
+                    file = randomRange(0, 63);
+                    n++;
+                }
+                else
+                    file = next++;
+                if ((phase == 1 || phase == 2) && fds[file] < 0)
+                    continue;
+                // Logs are cut back between rounds of traffic, like append_log
+                if (phase == 1 && busy[file] == 0 && sizes[file] > 32768)
+                {
+                    TIMED(OP_WRITE, vfs_ftruncate(fds[file], 0));
+                    sizes[file] = 0;
+                }
+                if ((sqe = vfs_ring_sqe(ring)) == NULL)
+                    break;
+                slots[batch] = freeSlots[--freeCount];
+                slot = &ringSlots[slots[batch]];
+                slot->file = file;
+                slot->len = 0;
+                sqe->userData = (unsigned long long)(slot - ringSlots);
+                if (phase == 0)
+                {
+                    slot->op = OP_CREATE;
+                    sqe->op = VFS_RING_OPEN;
+                    sqe->path = paths[file];
+                    sqe->flags = VFS_RDWR | VFS_CREAT | VFS_EXCL;
+                    sqe->perm = VFS_PERM_RDWR;
+                }
+                else if (phase == 2)
+                {
+                    slot->op = OP_COUNT;
+                    sqe->op = VFS_RING_CLOSE;
+                    sqe->fd = fds[file];
+                    fds[file] = -1;
+                    slot->file = -1;
+                }
+                else if (phase == 3)
+                {
+                    slot->op = OP_UNLINK;
+                    sqe->op = VFS_RING_UNLINK;
+                    sqe->path = paths[file];
+                }
+                else if (sizes[file] > 0 && nextRandom() % 5 == 0)
+                {
+                    slot->op = OP_READ;
+                    // Every append is at least 32 bytes of payload
+                    slot->len = 32;
+                    sqe->op = VFS_RING_PREAD;
+                    sqe->fd = fds[file];
+                    sqe->buf = slot->buf;
+                    sqe->len = slot->len;
+                }
+                else
+                {
+                    slot->op = OP_APPEND;
+                    sqe->op = VFS_RING_APPEND;
+                    sqe->fd = fds[file];
+                    sqe->buf = payload;
+                    sqe->len = randomRange(32, 200);
+                }
+                if (slot->file >= 0)
+                    busy[file]++;
+                batch++;
+            }
+            if (batch > 0)
+            {
+                long long start = nowNs();
+                
+                for (i = 0; i < batch; i++)
+                {
+                    ringSlots[slots[i]].batch = batch;
+                    ringSlots[slots[i]].submitted = start;
+                }
+                vfs_submit(ring);
+            }
+            if (freeCount == RING_DEPTH && batch == 0)
+                break;
+            freeCount = reapRing(ring, freeSlots, freeCount, fds, sizes, busy, batch == 0 || freeCount == 0);
+        }
+    }
+    vfs_ring_destroy(ring);
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "ring_append: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Populated files read at random offsets with the occasional in-place rewrite
+static void runReadScan(int scale)
+{
+    char path[64];
+    int fds[800], i, n;
+    
+    for (i = 0; i < 800; i++)
+    {
+        sprintf(path, "/data%d", i);
+        fds[i] = createFile(path, randomRange(1024, 4096));
+    }
+    for (n = 0; n < 200000 * scale; n++)
+    {
+        i = randomRange(0, 799);
+        if (nextRandom() % 20 == 0)
+            TIMED(OP_WRITE, vfs_pwrite(fds[i], payload, randomRange(64, 1024), randomRange(0, 1023)));
+        else
+            TIMED(OP_READ, vfs_pread(fds[i], readBuf, randomRange(64, 4096), randomRange(0, 1023)));
+    }
+}
+
+// Sample every 64th byte, enough to notice a rewrite of the range
+static unsigned int viewSum(const struct vfs_view *view)
+{
+    unsigned int sum = 0;
+    size_t i;
+    
+    for (i = 0; i < view->len; i += 64)
+        sum = sum * 31 + (unsigned char)view->data[i];
+    return sum;
+}
+
+// Large reads through vfs_map instead of copies. The last few views stay
+// mapped across later rewrites and must still show the bytes they had.
+static void runMapScan(int scale)
+{
+    struct vfs_view views[4];
+    unsigned int sums[4];
+    char path[64];
+    int fds[64], i, n, v;
+    
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/big%d", i);
+        fds[i] = createFile(path, 65536);
+    }
+    for (v = 0; v < 4; v++)
+    {
+        views[v].len = 0;
+        views[v].block = -1;
+    }
+    for (n = 0; n < 50000 * scale; n++)
+    {
+        long offset = randomRange(0, 49151);
+        int len = randomRange(4096, 16384), done = 0;
+        
+        i = randomRange(0, 63);
+        if (fds[i] < 0)
+            continue;
+        if (nextRandom() % 10 == 0)
+        {
+            TIMED(OP_WRITE, vfs_pwrite(fds[i], payload + 1, len, offset));
+            continue;
+        }
+        v = n % 4;
+        if (views[v].len > 0 && viewSum(&views[v]) != sums[v])
+        {
+            fprintf(stderr, "map_scan: a mapped view changed under its reader\n");
+            checkFailed = 1;
+        }
+        vfs_unmap(&views[v]);
+        // Each view covers at most one extent, the last one is kept
+        do
+        {
+            long long t0 = nowNs();
+            int ret = vfs_map(fds[i], offset + done, len - done, &views[v]);
+            
+            record(OP_READ, nowNs() - t0, ret);
+            if (ret <= 0)
+                break;
+            sums[v] = viewSum(&views[v]);
+            done += ret;
+            if (done < len)
+                vfs_unmap(&views[v]);
+        } while (done < len);
+    }
+    for (v = 0; v < 4; v++)
+        vfs_unmap(&views[v]);
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "map_scan: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Many copies of the same content, left in place so the report shows the
+// pool they occupy; with -d they share blocks
+static void runDupFiles(int scale)
+{
+    char path[64];
+    int i, n;
+    
+    for (n = 0; n < 256 * scale; n++)
+    {
+        int fd;
+        sprintf(path, "/dup%d", n);
+        if ((fd = createFile(path, 16384)) < 0)
+            continue;
+        TIMED(OP_APPEND, vfs_append(fd, payload, 4096));
+        for (i = 0; i < 4; i++)
+        {
+            TIMED(OP_READ, vfs_pread(fd, readBuf, 4096, i * 4096));
+            if (lastRet == 4096 && memcmp(readBuf, payload + i * 4096, 4096) != 0)
+            {
+                fprintf(stderr, "dup_files: %s reads back wrong data\n", path);
+                checkFailed = 1;
+            }
+        }
+        vfs_close(fd);
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "dup_files: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Files written once and left alone while a compressor pass runs every
+// round, then all of them read back; with -z the pool needs only the
+// packed copies of the old rounds
+static void runColdFiles(int scale)
+{
+    char path[64];
+    int fds[64], round, i, maxSize = (16384 * scale < MAX_RECORD) ? 16384 * scale : MAX_RECORD;
+    
+    for (round = 0; round < 15; round++)
+    {
+        for (i = 0; i < 64; i++)
+        {
+            sprintf(path, "/cold%d_%d", round, i);
+            fds[i] = createFile(path, randomRange(4096, maxSize));
+            if (fds[i] >= 0)
+                vfs_close(fds[i]);
+        }
+        vfs_compress_cold();
+    }
+    for (round = 0; round < 15; round++)
+    {
+        for (i = 0; i < 64; i++)
+        {
+            int fd;
+            sprintf(path, "/cold%d_%d", round, i);
+            if ((fd = vfs_open(path, VFS_READ, 0)) < 0)
+                continue;
+            TIMED(OP_READ, vfs_pread(fd, readBuf, 4096, 0));
+            if (lastRet == 4096 && memcmp(readBuf, payload, 4096) != 0)
+            {
+                fprintf(stderr, "cold_files: %s reads back wrong data\n", path);
+                checkFailed = 1;
+            }
+            vfs_close(fd);
+        }
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "cold_files: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Twice the default pool in 64K files, 90% of reads on the first 32 and
+// the rest anywhere; the backing file from -S, or a temporary one, holds
+// what does not fit and the hot set should end up back in the pool
+static void runSpillFiles(int scale)
+{
+    struct vfs_spill_policy spill = { spillPath ? spillPath : SPILL_TEMP, 4096, 4 };
+    char path[64];
+    int fds[256], i, n;
+    
+    if (vfs_set_spill(&spill) != VFS_OK)
+    {
+        fprintf(stderr, "spill_files: cannot spill to %s\n", spill.path);
+        checkFailed = 1;
+        return;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        sprintf(path, "/tier%d", i);
+        fds[i] = createFile(path, MAX_RECORD);
+    }
+    for (n = 0; n < 20000 * scale; n++)
+    {
+        int offset = randomRange(0, MAX_RECORD - 4096);
+        
+        i = (nextRandom() % 10 != 0) ? randomRange(0, 31) : randomRange(32, 255);
+        if (fds[i] < 0)
+            continue;
+        TIMED(OP_READ, vfs_pread(fds[i], readBuf, 4096, offset));
+        if (lastRet == 4096 && memcmp(readBuf, payload + offset, 4096) != 0)
+        {
+            fprintf(stderr, "spill_files: /tier%d reads back wrong data\n", i);
+            checkFailed = 1;
+        }
+    }
+    for (i = 0; i < 256; i++)
+    {
+        sprintf(path, "/tier%d", i);
+        if (fds[i] >= 0)
+            removeFile(path, fds[i]);
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "spill_files: consistency check failed\n");
+        checkFailed = 1;
+    }
+    if (spillPath == NULL)
+        remove(SPILL_TEMP);
+}
+
+// Journal the workload's changes to a fresh temporary journal
+static int startJournal(const char *name, unsigned int commitMicros, int waitCommit)
+{
+    struct vfs_journal_policy journal = { JOURNAL_TEMP, NULL, commitMicros, 1024 * 1024, 0, waitCommit };
+    
+    remove(JOURNAL_TEMP);
+    if (vfs_set_journal(&journal) != VFS_OK)
+    {
+        fprintf(stderr, "%s: cannot journal to %s\n", name, JOURNAL_TEMP);
+        checkFailed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void stopJournal(const char *name)
+{
+    struct vfs_journal_policy off = { NULL, NULL, 0, 0, 0, 0 };
+    
+    if (vfs_commit() != VFS_OK)
+    {
+        fprintf(stderr, "%s: journal commit failed\n", name);
+        checkFailed = 1;
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "%s: consistency check failed\n", name);
+        checkFailed = 1;
+    }
+    vfs_set_journal(&off);
+    remove(JOURNAL_TEMP);
+}
+
+// append_log traffic with every change journaled and a vfs_commit every
+// 64 appends in place of fsync, so groups grow as large as the lag allows
+static void runJournalLog(int scale)
+{
+    char path[64];
+    int fds[64], i, n;
+    
+    if (startJournal("journal_log", 1000, 0) != 0)
+        return;
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/jlog%d", i);
+        fds[i] = createFile(path, 0);
+    }
+    for (n = 0; n < 20000 * scale; n++)
+    {
+        i = randomRange(0, 63);
+        TIMED(OP_APPEND, vfs_append(fds[i], payload, randomRange(32, 200)));
+        if (n % 64 == 63)
+            vfs_commit();
+    }
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/jlog%d", i);
+        removeFile(path, fds[i]);
+    }
+    stopJournal("journal_log");
+}
+
+static void countMatch(unsigned int inodeNo, const char *name, long offset, void *arg)
+{
+    (void)inodeNo;
+    (void)name;
+    (void)offset;
+    (*(int *)arg)++;
+}
+
+// Whole-pool content searches for a word planted in some of the files: a
+// few across the seam between two extents, some in files small enough to
+// be inline, and with -z in files compressed before the searches start.
+// The payload never spells it on its own. VFS_SEARCH_KERNEL picks a
+// narrower kernel than the CPU allows.
+static void runSearchScan(int scale)
+{
+    char path[64];
+    int i, n, planted = 0, found;
+    
+    for (i = 0; i < 64; i++)
+    {
+        int fd, head = (i % 4 == 0) ? 64 * 1024 : randomRange(48 * 1024, 64 * 1024);
+        
+        sprintf(path, "/hay%d", i);
+        if ((fd = createFile(path, head)) < 0)
+            continue;
+        TIMED(OP_APPEND, vfs_append(fd, payload, randomRange(1024, 16384)));
+        if (i % 4 == 0 && vfs_pwrite(fd, "needle", 6, head - 3) == 6)
+            planted++;
+        else if (i % 3 == 0 && vfs_pwrite(fd, "needle", 6, randomRange(0, head)) == 6)
+            planted++;
+        vfs_close(fd);
+    }
+    for (i = 0; i < 32; i++)
+    {
+        int fd, size = randomRange(16, VFS_INLINE_MAX);
+        
+        sprintf(path, "/straw%d", i);
+        if ((fd = createFile(path, size)) < 0)
+            continue;
+        if (i % 2 == 0 && vfs_pwrite(fd, "needle", 6, randomRange(0, size - 6)) == 6)
+            planted++;
+        vfs_close(fd);
+    }
+    // Every file is cold by the second pass
+    vfs_compress_cold();
+    vfs_compress_cold();
+    for (n = 0; n < 200 * scale; n++)
+    {
+        found = 0;
+        TIMED(OP_SEARCH, vfs_search("needle", 6, countMatch, &found));
+        if (found != planted)
+        {
+            fprintf(stderr, "search_scan: found %d of %d planted words\n", found, planted);
+            checkFailed = 1;
+            break;
+        }
+    }
+}
+
+// Files built by appends and overwritten in place, so their checksums are
+// carried forward and patched rather than computed once, with verified
+// reads and a full scrub every 256 operations. Then a byte is flipped
+// behind the engine's back through a view, which the read covering it and
+// the next scrub must both catch, in that file alone.
+static void runScrubFiles(int scale)
+{
+    struct vfs_view view;
+    struct vfs_stats st;
+    char path[64];
+    int fds[64], sizes[64], i, n;
+    
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/scrub%d", i);
+        sizes[i] = randomRange(4096, MAX_RECORD / 2);
+        fds[i] = createFile(path, sizes[i]);
+    }
+    for (n = 0; n < 4000 * scale && !checkFailed; n++)
+    {
+        int kind = randomRange(0, 9), len = randomRange(64, 4096), offset;
+        
+        i = randomRange(0, 63);
+        if (fds[i] < 0)
+            continue;
+        offset = randomRange(0, sizes[i] - 64);
+        // Every file stays a prefix of the payload, so reads can be checked
+        if (kind < 5)
+            TIMED(OP_WRITE, vfs_pwrite(fds[i], payload + offset, len, offset));
+        else if (kind < 7 && sizes[i] + len <= MAX_RECORD)
+            TIMED(OP_APPEND, vfs_append(fds[i], payload + sizes[i], len));
+        else
+            TIMED(OP_READ, vfs_pread(fds[i], readBuf, len, offset));
+        if (kind < 5 && lastRet > 0 && offset + lastRet > sizes[i])
+            sizes[i] = offset + lastRet;
+        else if (kind >= 5 && kind < 7 && lastRet > 0)
+            sizes[i] += lastRet;
+        else if (kind >= 7 && lastRet > 0 && memcmp(readBuf, payload + offset, lastRet) != 0)
+        {
+            fprintf(stderr, "scrub_files: /scrub%d reads back wrong data\n", i);
+            checkFailed = 1;
+        }
+        if (n % 256 == 255)
+        {
+            TIMED(OP_SCRUB, vfs_scrub());
+            if (lastRet != 0)
+            {
+                fprintf(stderr, "scrub_files: scrub found %d damaged files in an intact pool\n", lastRet);
+                checkFailed = 1;
+            }
+        }
+    }
+    
+    // Views are read-only; writing through one is the damage to catch
+    if (fds[0] >= 0 && vfs_map(fds[0], 100, 1, &view) == 1)
+    {
+        ((char *)view.data)[0] ^= 1;
+        vfs_unmap(&view);
+        if (vfs_pread(fds[0], readBuf, 4096, 0) != VFS_EIO)
+        {
+            fprintf(stderr, "scrub_files: a read of damaged data went through\n");
+            checkFailed = 1;
+        }
+        TIMED(OP_SCRUB, vfs_scrub());
+        if (lastRet != 1 || vfs_get_stats(&st) != VFS_OK || st.corruptInodes != 1)
+        {
+            fprintf(stderr, "scrub_files: scrub found %d damaged files instead of 1\n", lastRet);
+            checkFailed = 1;
+        }
+    }
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/scrub%d", i);
+        if (fds[i] >= 0)
+            removeFile(path, fds[i]);
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "scrub_files: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+static void *threadMain(void *arg)
+{
+    BENCHTHREAD *t = (BENCHTHREAD *)arg;
+    
+    samples = t->samples;
+    rngState = baseSeed * 2654435761ULL + 1000 + t->id;
+    t->body(t->id, t->scale);
+    return NULL;
+}
+
+// Run body on every thread, then fold their samples into the main set
+static void runThreads(void (*body)(int id, int scale), int scale)
+{
+    BENCHTHREAD *threads = (BENCHTHREAD *)calloc(threadCount, sizeof(BENCHTHREAD));
+    int i, op;
+    
+    for (i = 0; i < threadCount; i++)
+    {
+        threads[i].id = i;
+        threads[i].scale = scale;
+        threads[i].body = body;
+        pthread_create(&threads[i].handle, NULL, threadMain, &threads[i]);
+    }
+    for (i = 0; i < threadCount; i++)
+    {
+        pthread_join(threads[i].handle, NULL);
+        for (op = 0; op < OP_COUNT; op++)
+        {
+            OPSAMPLES *from = &threads[i].samples[op];
+            int k;
+            for (k = 0; k < from->count; k++)
+                record(op, from->ns[k], 0);
+            samples[op].failures += from->failures;
+            free(from->ns);
+        }
+    }
+    free(threads);
+}
+
+// Each thread reads its own set of files at random offsets
+static void mtReadBody(int id, int scale)
+{
+    char path[64];
+    int fds[64], i, n;
+    
+    sprintf(path, "/t%d", id);
+    vfs_mkdir(path);
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/t%d/data%d", id, i);
+        fds[i] = createFile(path, 4096);
+    }
+    for (n = 0; n < 200000 * scale; n++)
+    {
+        i = randomRange(0, 63);
+        if (fds[i] >= 0)
+            TIMED(OP_READ, vfs_pread(fds[i], readBuf, randomRange(64, 2048), randomRange(0, 2047)));
+    }
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(path, "/t%d/data%d", id, i);
+        if (fds[i] >= 0)
+            removeFile(path, fds[i]);
+    }
+}
+
+static void runMtRead(int scale)
+{
+    runThreads(mtReadBody, scale);
+}
+
+// Threads race on one shared set of names with every kind of operation
+static void mtStressBody(int id, int scale)
+{
+    char path[64];
+    int fds[32], i, n;
+    
+    (void)id;
+    for (i = 0; i < 32; i++)
+        fds[i] = -1;
+    for (n = 0; n < 20000 * scale; n++)
+    {
+        int slot = randomRange(0, 31), name = randomRange(0, 255);
+        
+        sprintf(path, "/shared%d", name);
+        switch (nextRandom() % 8)
+        {
+        case 0:
+            if (fds[slot] >= 0)
+                vfs_close(fds[slot]);
+            TIMED(OP_CREATE, vfs_open(path, VFS_RDWR | VFS_CREAT, VFS_PERM_RDWR));
+            fds[slot] = lastRet;
+            break;
+        case 1:
+            TIMED(OP_UNLINK, vfs_unlink(path));
+            break;
+        case 2:
+            if (fds[slot] >= 0)
+                TIMED(OP_WRITE, vfs_pwrite(fds[slot], payload, randomRange(1, 8192), randomRange(0, 16384)));
+            break;
+        case 3:
+            if (fds[slot] >= 0)
+                TIMED(OP_APPEND, vfs_append(fds[slot], payload, randomRange(1, 512)));
+            break;
+        case 4:
+            if (fds[slot] >= 0)
+                TIMED(OP_WRITE, vfs_ftruncate(fds[slot], randomRange(0, 8192)));
+            break;
+        case 5:
+            if (fds[slot] >= 0)
+            {
+                vfs_close(fds[slot]);
+                fds[slot] = -1;
+            }
+            break;
+        default:
+            if (fds[slot] >= 0)
+                TIMED(OP_READ, vfs_pread(fds[slot], readBuf, 4096, randomRange(0, 16384)));
+            break;
+        }
+        if (n % 4096 == 0)
+            vfs_defragment(16 * 1024);
+    }
+    for (i = 0; i < 32; i++)
+    {
+        if (fds[i] >= 0)
+            vfs_close(fds[i]);
+    }
+}
+
+static void runMtStress(int scale)
+{
+    runThreads(mtStressBody, scale);
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "mt_stress: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Threads share a few hot files, 95% reads with the odd overwrite
+static void mtReadMostlyBody(int id, int scale)
+{
+    char path[64];
+    int fds[16], i, n;
+    
+    (void)id;
+    for (i = 0; i < 16; i++)
+    {
+        sprintf(path, "/hot%d", i);
+        fds[i] = vfs_open(path, VFS_RDWR, 0);
+    }
+    for (n = 0; n < 200000 * scale; n++)
+    {
+        i = randomRange(0, 15);
+        if (fds[i] < 0)
+            continue;
+        if (nextRandom() % 20 == 0)
+            TIMED(OP_WRITE, vfs_pwrite(fds[i], payload, randomRange(64, 1024), randomRange(0, 16383)));
+        else
+            TIMED(OP_READ, vfs_pread(fds[i], readBuf, randomRange(64, 2048), randomRange(0, 16383)));
+    }
+    for (i = 0; i < 16; i++)
+    {
+        if (fds[i] >= 0)
+            vfs_close(fds[i]);
+    }
+}
+
+static void runMtReadMostly(int scale)
+{
+    char path[64];
+    int fds[16], i;
+    
+    for (i = 0; i < 16; i++)
+    {
+        sprintf(path, "/hot%d", i);
+        fds[i] = createFile(path, 16384);
+    }
+    runThreads(mtReadMostlyBody, scale);
+    for (i = 0; i < 16; i++)
+    {
+        sprintf(path, "/hot%d", i);
+        if (fds[i] >= 0)
+            removeFile(path, fds[i]);
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "mt_read_mostly: consistency check failed\n");
+        checkFailed = 1;
+    }
+}
+
+// Every append waits for its commit; threads waiting together share one flush
+static void mtJournalBody(int id, int scale)
+{
+    char path[64];
+    int fds[8], i, n;
+    
+    for (i = 0; i < 8; i++)
+    {
+        sprintf(path, "/t%d_jlog%d", id, i);
+        fds[i] = createFile(path, 0);
+    }
+    for (n = 0; n < 2000 * scale; n++)
+    {
+        i = randomRange(0, 7);
+        TIMED(OP_APPEND, vfs_append(fds[i], payload, randomRange(32, 200)));
+    }
+    for (i = 0; i < 8; i++)
+    {
+        sprintf(path, "/t%d_jlog%d", id, i);
+        removeFile(path, fds[i]);
+    }
+}
+
+static void runMtJournal(int scale)
+{
+    if (startJournal("mt_journal", 200, 1) != 0)
+        return;
+    runThreads(mtJournalBody, scale);
+    stopJournal("mt_journal");
+}
+
+static const WORKLOAD workloads[] = {
+    { "small_files", runSmallFiles, 0 },
+    { "tiny_files", runTinyFiles, 0 },
+    { "churn", runChurn, 0 },
+    { "append_log", runAppendLog, 0 },
+    { "ring_append", runRingAppend, 0 },
+    { "read_scan", runReadScan, 0 },
+    { "map_scan", runMapScan, 0 },
+    { "dup_files", runDupFiles, 0 },
+    { "cold_files", runColdFiles, 0 },
+    { "spill_files", runSpillFiles, 0 },
+    { "journal_log", runJournalLog, 0 },
+    { "search_scan", runSearchScan, 0 },
+    { "scrub_files", runScrubFiles, NEEDS_CHECKSUM },
+    { "mt_read", runMtRead, NEEDS_THREADS },
+    { "mt_stress", runMtStress, NEEDS_THREADS },
+    { "mt_read_mostly", runMtReadMostly, NEEDS_THREADS },
+    { "mt_journal", runMtJournal, NEEDS_THREADS },
+};
+
+static int compareNs(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    
+    return (x > y) - (x < y);
+}
+
+static long long percentile(OPSAMPLES *s, double p)
+{
+    int idx = (int)(p * (s->count - 1) + 0.5);
+    
+    return s->ns[idx];
+}
+
+static void report(const char *name, double seconds, RUNSUMMARY *sum)
+{
+    struct vfs_stats st;
+    size_t meta, peak;
+    long long totalOps = 0;
+    int op;
+    
+    meta = vfs_metadata_bytes(&peak);
+    if (vfs_get_stats(&st) != VFS_OK)
+        memset(&st, 0, sizeof(st));
+    memset(sum, 0, sizeof(*sum));
+    if (!jsonOutput && !compareMode)
+    {
+        if (threadCount > 0)
+            printf("\n%s (%.3f s, %d threads)\n", name, seconds, threadCount);
+        else
+            printf("\n%s (%.3f s)\n", name, seconds);
+        printf("  %-8s %10s %12s %10s %10s %10s %8s\n", "op", "count", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "failed");
+    }
+    
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        OPSAMPLES *s = &samples[op];
+        long long total = 0;
+        int i;
+        
+        if (s->count == 0 && s->failures == 0)
+            continue;
+        qsort(s->ns, s->count, sizeof(long long), compareNs);
+        for (i = 0; i < s->count; i++)
+            total += s->ns[i];
+        sum->failures += s->failures;
+        
+        if (s->count == 0)
+        {
+            if (jsonOutput)
+                printf("{\"workload\":\"%s\",\"policy\":\"%s\",\"op\":\"%s\",\"count\":0,\"failures\":%d}\n",
+                       name, vfs_alloc_name(st.allocPolicy), opNames[op], s->failures);
+            else if (!compareMode)
+                printf("  %-8s %10d %12s %10s %10s %10s %8d\n", opNames[op], 0, "-", "-", "-", "-", s->failures);
+            continue;
+        }
+        if (percentile(s, 0.99) > sum->worstP99)
+            sum->worstP99 = percentile(s, 0.99);
+        if (jsonOutput)
+            printf("{\"workload\":\"%s\",\"policy\":\"%s\",\"op\":\"%s\",\"count\":%d,\"ops_per_sec\":%.0f,"
+                   "\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"failures\":%d}\n",
+                   name, vfs_alloc_name(st.allocPolicy), opNames[op], s->count, s->count / (total / 1e9),
+                   percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999), s->failures);
+        else if (!compareMode)
+            printf("  %-8s %10d %12.0f %10lld %10lld %10lld %8d\n", opNames[op], s->count,
+                   s->count / (total / 1e9), percentile(s, 0.5), percentile(s, 0.99),
+                   percentile(s, 0.999), s->failures);
+    }
+    
+    for (op = 0; op < OP_COUNT; op++)
+        totalOps += samples[op].count;
+    sum->opsPerSec = totalOps / seconds;
+    sum->poolUsed = st.usedBytes;
+    sum->slack = st.slackBytes;
+    sum->fragmentation = vfs_fragmentation();
+    if (jsonOutput)
+        printf("{\"workload\":\"%s\",\"policy\":\"%s\",\"seconds\":%.6f,\"threads\":%d,\"ops_per_sec\":%.0f,"
+               "\"peak_meta_bytes\":%zu,\"meta_bytes\":%zu,\"pool_used_bytes\":%zu,\"slack_bytes\":%zu,"
+               "\"fragmentation\":%.4f,\"journal_records\":%llu,\"journal_commits\":%llu,"
+               "\"search_bytes\":%llu,\"search_ns\":%llu,\"scrub_bytes\":%llu,\"checksum_errors\":%llu}\n",
+               name, vfs_alloc_name(st.allocPolicy), seconds, threadCount, totalOps / seconds, peak, meta,
+               st.usedBytes, st.slackBytes, sum->fragmentation, st.journalRecords, st.journalCommits,
+               st.searchBytes, st.searchNs, st.scrubBytes, st.checksumErrors);
+    else if (!compareMode)
+    {
+        printf("  %.0f ops/sec overall, peak metadata %zu bytes, pool used %zu bytes, final fragmentation %.3f\n",
+               totalOps / seconds, peak, st.usedBytes, vfs_fragmentation());
+        if (st.journalRecords > 0)
+            printf("  journal: %llu records in %llu commits\n", st.journalRecords, st.journalCommits);
+        if (st.searches > 0)
+            printf("  search: %llu scans at %.0f MB/s with the %s kernel\n", st.searches,
+                   st.searchBytes * 1e3 / (st.searchNs ? st.searchNs : 1), vfs_search_kernel());
+        if (st.scrubPasses > 0 || st.checksumErrors > 0)
+            printf("  checksum: %llu scrub passes over %llu bytes with the %s kernel, %llu failed checks\n",
+                   st.scrubPasses, st.scrubBytes, vfs_checksum_kernel(), st.checksumErrors);
+    }
+}
+
+// One row per policy for a workload run under each of them
+static void compareTable(const char *name, const RUNSUMMARY *sums)
+{
+    int p;
+    
+    printf("\n%s\n", name);
+    printf("  %-10s %12s %10s %12s %10s %8s %8s\n", "policy", "ops/sec", "p99 ns", "pool used", "slack", "frag", "failed");
+    for (p = 0; p < VFS_ALLOC_COUNT; p++)
+        printf("  %-10s %12.0f %10lld %12zu %10zu %8.3f %8d\n", vfs_alloc_name(p), sums[p].opsPerSec,
+               sums[p].worstP99, sums[p].poolUsed, sums[p].slack, sums[p].fragmentation, sums[p].failures);
+}
+
+static int policyByName(const char *name)
+{
+    int p;
+    
+    for (p = 0; p < VFS_ALLOC_COUNT; p++)
+    {
+        if (strcmp(name, vfs_alloc_name(p)) == 0)
+            return p;
+    }
+    return -1;
+}
+
+// Replay traces given with -r instead of running the workloads
+static int runReplay(const char *const *paths, int count)
+{
+    struct vfs_replay_stats st;
+    struct vfs_stats pool;
+    int err;
+    
+    if ((err = vfs_replay_streams(paths, count, &st)) != VFS_OK)
+    {
+        fprintf(stderr, "replay: %s\n", vfs_strerror(err));
+        return 1;
+    }
+    if (vfs_get_stats(&pool) != VFS_OK)
+        pool.allocPolicy = VFS_ALLOC_SEGREGATED;
+    if (jsonOutput)
+        printf("{\"workload\":\"replay\",\"policy\":\"%s\",\"streams\":%d,\"seconds\":%.6f,\"ops\":%llu,"
+               "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,"
+               "\"mismatches\":%llu,\"pool_used_bytes\":%zu,\"fragmentation\":%.4f}\n",
+               vfs_alloc_name(pool.allocPolicy), st.streams, st.seconds, st.ops, st.opsPerSec,
+               st.p50Ns, st.p99Ns, st.p999Ns, st.maxNs, st.mismatches, st.poolUsed, st.fragmentation);
+    else
+    {
+        printf("\nreplay (%.3f s, %d streams)\n", st.seconds, st.streams);
+        printf("  %llu ops, %.0f ops/sec, p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n",
+               st.ops, st.opsPerSec, st.p50Ns, st.p99Ns, st.p999Ns, st.maxNs);
+        printf("  %llu results differ from the recording, pool used %zu bytes, final fragmentation %.3f\n",
+               st.mismatches, st.poolUsed, st.fragmentation);
+    }
+    if (vfs_check(stderr) != VFS_OK)
+    {
+        fprintf(stderr, "replay: consistency check failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n scale] [-p pool_bytes] [-m max_pool_bytes] [-H] [-d] [-c] [-z level] "
+            "[-a policy | -A] [-S spill_file] [-J journal] [-w workload [-R trace]] [-r trace ...] [-t threads] [-j]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long seed = 42;
+    const char *only = NULL, *record = NULL;
+    const char *traces[MAX_STREAMS];
+    int traceCount = 0;
+    struct vfs_config config = { DEFAULT_POOL, 0, 0, 0, VFS_ALLOC_SEGREGATED };
+    struct vfs_compress_policy policy = { VFS_COMPRESS_OFF, 1, 1024, 1024 * 1024 };
+    struct vfs_spill_policy spill = { NULL, 4096, 4 };
+    struct vfs_journal_policy journal = { NULL, NULL, 1000, 1024 * 1024, 0, 0 };
+    struct vfs_scrub_policy scrub = { 1, 64 * 1024 * 1024 };
+    RUNSUMMARY sums[VFS_ALLOC_COUNT];
+    int scale = 1, i, op, p;
+    
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+            jsonOutput = 1;
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            scale = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-H") == 0)
+            config.flags |= VFS_INIT_HUGEPAGES;
+        else if (strcmp(argv[i], "-d") == 0)
+            config.flags |= VFS_INIT_DEDUP;
+        else if (strcmp(argv[i], "-c") == 0)
+            config.flags |= VFS_INIT_CHECKSUM;
+        else if (i + 1 < argc && strcmp(argv[i], "-a") == 0)
+        {
+            if ((config.allocPolicy = policyByName(argv[++i])) < 0)
+                usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-A") == 0)
+            compareMode = 1;
+        else if (i + 1 < argc && strcmp(argv[i], "-z") == 0)
+            policy.level = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+            config.poolSize = strtoull(argv[++i], NULL, 10);
+        else if (i + 1 < argc && strcmp(argv[i], "-m") == 0)
+            config.maxPoolSize = strtoull(argv[++i], NULL, 10);
+        else if (i + 1 < argc && strcmp(argv[i], "-S") == 0)
+            spillPath = spill.path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-J") == 0)
+            journal.path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-R") == 0)
+            record = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-r") == 0 && traceCount < MAX_STREAMS)
+            traces[traceCount++] = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-w") == 0)
+            only = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-t") == 0)
+            threadCount = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+    if (scale < 1 || threadCount < 0 || policy.level < VFS_COMPRESS_OFF || policy.level > VFS_COMPRESS_BEST ||
+        (record != NULL && (only == NULL || compareMode)))
+        usage(argv[0]);
+    if (threadCount > 0 || traceCount > 1)
+        config.flags |= VFS_INIT_CONCURRENT;
+    baseSeed = seed;
+    
+    for (i = 0; i < MAX_RECORD; i++)
+        payload[i] = 'a' + i % 26;
+    
+    if (traceCount > 0)
+    {
+        int err, ret;
+        
+        if ((err = vfs_init_config(&config)) != VFS_OK)
+        {
+            fprintf(stderr, "vfs_init: %s\n", vfs_strerror(err));
+            return 1;
+        }
+        vfs_set_compression(&policy);
+        if (config.flags & VFS_INIT_CHECKSUM)
+            vfs_set_scrub(&scrub);
+        if (spill.path != NULL)
+            vfs_set_spill(&spill);
+        if (journal.path != NULL)
+        {
+            remove(journal.path);
+            vfs_set_journal(&journal);
+        }
+        ret = runReplay(traces, traceCount);
+        vfs_shutdown();
+        return ret;
+    }
+    
+    for (i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+    {
+        if (only != NULL && strcmp(only, workloads[i].name) != 0)
+            continue;
+        if (((workloads[i].needs & NEEDS_THREADS) && threadCount == 0) ||
+            ((workloads[i].needs & NEEDS_CHECKSUM) && !(config.flags & VFS_INIT_CHECKSUM)))
+            continue;
+        // -A replays the same seeded operations under every policy
+        for (p = 0; p < VFS_ALLOC_COUNT; p++)
+        {
+            long long start;
+            int err;
+            
+            if (compareMode)
+                config.allocPolicy = p;
+            // With -t every workload runs on the thread-safe engine
+            if ((err = vfs_init_config(&config)) != VFS_OK)
+            {
+                fprintf(stderr, "vfs_init: %s\n", vfs_strerror(err));
+                return 1;
+            }
+            vfs_set_compression(&policy);
+            // With -c reads are verified and, with -t, the scrubber runs behind the workload
+            if (config.flags & VFS_INIT_CHECKSUM)
+                vfs_set_scrub(&scrub);
+            if (spill.path != NULL && (err = vfs_set_spill(&spill)) != VFS_OK)
+            {
+                fprintf(stderr, "vfs_set_spill: %s\n", vfs_strerror(err));
+                return 1;
+            }
+            // Each workload journals from scratch
+            if (journal.path != NULL)
+                remove(journal.path);
+            if (journal.path != NULL && (err = vfs_set_journal(&journal)) != VFS_OK)
+            {
+                fprintf(stderr, "vfs_set_journal: %s\n", vfs_strerror(err));
+                return 1;
+            }
+            rngState = seed * 2654435761ULL + i + 1;
+            for (op = 0; op < OP_COUNT; op++)
+                samples[op].count = samples[op].failures = 0;
+            
+            if (record != NULL && (err = vfs_trace_start(record)) != VFS_OK)
+            {
+                fprintf(stderr, "vfs_trace_start: %s\n", vfs_strerror(err));
+                return 1;
+            }
+            start = nowNs();
+            workloads[i].run(scale);
+            if (record != NULL && (err = vfs_trace_stop()) != VFS_OK)
+                fprintf(stderr, "vfs_trace_stop: %s\n", vfs_strerror(err));
+            report(workloads[i].name, (nowNs() - start) / 1e9, &sums[p]);
+            vfs_shutdown();
+            if (!compareMode)
+                break;
+        }
+        if (compareMode && !jsonOutput)
+            compareTable(workloads[i].name, sums);
+    }
+    return checkFailed;
+}
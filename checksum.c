@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+#include "vfs_internal.h"
+
+// Checksums of the data in the pool. Every extent keeps the CRC32C of the
+// bytes it holds and a packed file that of its compressed block, so a stray
+// write into the pool or an image damaged on disk shows up as a mismatch.
+// Writes keep them current without reading the extent again: an append
+// carries the CRC on over the new bytes, and an overwrite patches it with
+// the CRC of old ^ new moved past the bytes after them, CRCs being linear
+// over GF(2). A truncation recomputes the part kept, checking the whole
+// first. Inline files live in their inode and spilled ones in the backing
+// file, neither is covered.
+//
+// With verifyReads set, reads check the extents they copy from before
+// copying. The scrubber checks every file in inode order: in concurrent
+// mode a background thread at idle priority, held to bytesPerSec, and
+// vfs_scrub for one full pass on the caller. A file failing a check counts
+// as corrupt until it is removed.
+//
+// SSE4.2 has a crc32 instruction for the Castagnoli polynomial; the kernel
+// runs three streams of it side by side and joins them. Without it a
+// slicing-by-8 table does eight bytes per step. VFS_CHECKSUM_KERNEL=table
+// in the environment forces the table.
+
+#define CRC_POLY 0x82f63b78     // Castagnoli, bit-reversed
+#define CRC_LANE 4096           // bytes per stream of the three-way kernel
+#define SCRUB_SLOT_COST 256     // bytes charged per inode visited, so an empty table is not spun on
+#define SCRUB_SLEEP_MIN 1000000 // ns, shorter pauses are saved up
+
+typedef unsigned int (*CRCKERNEL)(unsigned int crc, const unsigned char *p, size_t len);
+
+int checksumEnabled = 0;
+struct vfs_scrub_policy scrubPolicy = { 0, 0 };
+unsigned int corruptInodes = 0;
+unsigned long long checksumErrors = 0;
+static unsigned long long scrubPasses = 0;
+static unsigned long long scrubBytes = 0;
+
+// Set up once per process
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+static CRCKERNEL crcKernel = NULL;
+static const char *kernelName = "table";
+static unsigned int crcTable[8][256];
+static unsigned int x2nTable[32];   // x^(2^n) modulo the polynomial
+static unsigned int laneShift[2];   // moves a CRC past one and two lanes
+
+// Guards the scrubber's state and the policy
+static pthread_mutex_t scrubLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrubWake = PTHREAD_COND_INITIALIZER;
+static pthread_t scrubber;
+static int scrubberRunning = 0;
+static int scrubberStopping = 0;
+
+// a * b modulo the polynomial, both bit-reversed; a must not be 0
+static unsigned int multModP(unsigned int a, unsigned int b)
+{
+    unsigned int m = 1u << 31, p = 0;
+    
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8n) modulo the polynomial, the factor that carries a CRC register
+// past n zero bytes
+static unsigned int zerosFactor(size_t n)
+{
+    unsigned int p = 1u << 31;
+    int k;
+    
+    for (k = 3; n != 0; n >>= 1, k++)
+    {
+        if (n & 1)
+            p = multModP(x2nTable[k & 31], p);
+    }
+    return p;
+}
+
+static unsigned int crcTableRun(unsigned int crc, const unsigned char *p, size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        unsigned int lo = crc ^ (p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24);
+        
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][p[4]] ^ crcTable[2][p[5]] ^ crcTable[1][p[6]] ^ crcTable[0][p[7]];
+    }
+    for (; len > 0; len--)
+        crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC_X86
+// The instruction takes three cycles but issues every cycle, so three
+// independent streams keep it busy
+__attribute__((target("sse4.2")))
+static unsigned int crcSse42Run(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long c = crc, v;
+    
+    for (; len > 0 && ((size_t)p & 7) != 0; len--)
+        c = _mm_crc32_u8((unsigned int)c, *p++);
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE)
+    {
+        unsigned long long c1 = 0, c2 = 0;
+        const unsigned char *end = p + CRC_LANE;
+        const unsigned char *q;
+        
+        for (q = p; q < end; q += 8)
+        {
+            memcpy(&v, q, 8);
+            c = _mm_crc32_u64(c, v);
+            memcpy(&v, q + CRC_LANE, 8);
+            c1 = _mm_crc32_u64(c1, v);
+            memcpy(&v, q + 2 * CRC_LANE, 8);
+            c2 = _mm_crc32_u64(c2, v);
+        }
+        c = multModP(laneShift[1], (unsigned int)c) ^ multModP(laneShift[0], (unsigned int)c1) ^ (unsigned int)c2;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; len--)
+        c = _mm_crc32_u8((unsigned int)c, *p++);
+    return (unsigned int)c;
+}
+#endif
+
+static void pickKernel()
+{
+    const char *want = getenv("VFS_CHECKSUM_KERNEL");
+    unsigned int p;
+    int i, k;
+    
+    for (i = 0; i < 256; i++)
+    {
+        p = i;
+        for (k = 0; k < 8; k++)
+            p = (p & 1) ? (p >> 1) ^ CRC_POLY : p >> 1;
+        crcTable[0][i] = p;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        for (k = 1; k < 8; k++)
+            crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xff];
+    }
+    p = 1u << 30;
+    x2nTable[0] = p;
+    for (i = 1; i < 32; i++)
+        x2nTable[i] = p = multModP(p, p);
+    laneShift[0] = zerosFactor(CRC_LANE);
+    laneShift[1] = zerosFactor(2 * CRC_LANE);
+    
+    crcKernel = crcTableRun;
+#ifdef CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && (want == NULL || strcmp(want, "table") != 0))
+    {
+        crcKernel = crcSse42Run;
+        kernelName = "sse4.2";
+    }
+#else
+    (void)want;
+#endif
+}
+
+// CRC32C of len bytes carried on from crc, 0 to start
+unsigned int crc32c(unsigned int crc, const char *buf, int len)
+{
+    return ~crcKernel(~crc, (const unsigned char *)buf, len);
+}
+
+// crc once len bytes followed by tail more have changed from before to after
+unsigned int crc32cPatch(unsigned int crc, const char *before, const char *after, int len, int tail)
+{
+    unsigned int delta = crcKernel(0, (const unsigned char *)before, len) ^
+                         crcKernel(0, (const unsigned char *)after, len);
+    
+    return crc ^ multModP(zerosFactor(tail), delta);
+}
+
+void checksumSetup(int enabled)
+{
+    pthread_once(&kernelOnce, pickKernel);
+    checksumEnabled = enabled;
+}
+
+// Check inodeNo and count it for the statistics, as scrubInode
+static int scrubStep(unsigned int inodeNo, unsigned long long *bytes)
+{
+    int ret = scrubInode(inodeNo, bytes);
+    
+    __atomic_fetch_add(&scrubBytes, *bytes, __ATOMIC_RELAXED);
+    if (ret < 0)
+        __atomic_fetch_add(&scrubPasses, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void *scrubMain(void *arg)
+{
+    unsigned int inodeNo = 0;
+    unsigned long long bytes;
+    long long owed = 0;
+    struct timespec until;
+    
+    (void)arg;
+#ifdef SCHED_IDLE
+    {
+        // Only what the foreground leaves over
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    }
+#endif
+    pthread_mutex_lock(&scrubLock);
+    while (!scrubberStopping)
+    {
+        pthread_mutex_unlock(&scrubLock);
+        inodeNo = (scrubStep(inodeNo, &bytes) < 0) ? 0 : inodeNo + 1;
+        pthread_mutex_lock(&scrubLock);
+        
+        // Pay for what was read in time, once it adds up to a real pause
+        owed += (long long)((bytes + SCRUB_SLOT_COST) * 1000000000.0 / scrubPolicy.bytesPerSec);
+        if (owed < SCRUB_SLEEP_MIN || scrubberStopping)
+            continue;
+        clock_gettime(CLOCK_REALTIME, &until);
+        owed += until.tv_nsec;
+        until.tv_sec += owed / 1000000000LL;
+        until.tv_nsec = owed % 1000000000LL;
+        owed = 0;
+        pthread_cond_timedwait(&scrubWake, &scrubLock, &until);
+    }
+    pthread_mutex_unlock(&scrubLock);
+    return NULL;
+}
+
+static void stopScrubber()
+{
+    int running;
+    
+    pthread_mutex_lock(&scrubLock);
+    running = scrubberRunning;
+    scrubberStopping = 1;
+    scrubberRunning = 0;
+    pthread_cond_signal(&scrubWake);
+    pthread_mutex_unlock(&scrubLock);
+    if (running)
+        pthread_join(scrubber, NULL);
+}
+
+int vfs_set_scrub(const struct vfs_scrub_policy *policy)
+{
+    if (mainPool == NULL || policy == NULL || !checksumEnabled)
+        return VFS_EINVAL;
+    stopScrubber();
+    pthread_mutex_lock(&scrubLock);
+    scrubPolicy.bytesPerSec = policy->bytesPerSec;
+    __atomic_store_n(&scrubPolicy.verifyReads, policy->verifyReads, __ATOMIC_RELAXED);
+    if (vfsConcurrent && policy->bytesPerSec > 0)
+    {
+        scrubberStopping = 0;
+        scrubberRunning = (pthread_create(&scrubber, NULL, scrubMain, NULL) == 0);
+    }
+    pthread_mutex_unlock(&scrubLock);
+    return VFS_OK;
+}
+
+int vfs_scrub(void)
+{
+    unsigned long long bytes;
+    unsigned int inodeNo;
+    int ret, corrupt = 0;
+    
+    if (mainPool == NULL || !checksumEnabled)
+        return VFS_EINVAL;
+    for (inodeNo = 0; (ret = scrubStep(inodeNo, &bytes)) >= 0; inodeNo++)
+        corrupt += ret;
+    return corrupt;
+}
+
+const char *vfs_checksum_kernel(void)
+{
+    pthread_once(&kernelOnce, pickKernel);
+    return kernelName;
+}
+
+void checksumUsage(struct vfs_stats *st)
+{
+    st->corruptInodes = __atomic_load_n(&corruptInodes, __ATOMIC_RELAXED);
+    st->checksumErrors = __atomic_load_n(&checksumErrors, __ATOMIC_RELAXED);
+    st->scrubPasses = __atomic_load_n(&scrubPasses, __ATOMIC_RELAXED);
+    st->scrubBytes = __atomic_load_n(&scrubBytes, __ATOMIC_RELAXED);
+}
+
+// The corrupt file count stays, it describes the files there are
+void checksumResetStats()
+{
+    __atomic_store_n(&checksumErrors, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&scrubPasses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&scrubBytes, 0, __ATOMIC_RELAXED);
+}
+
+// The scrubber must be gone before the inodes
+void checksumTeardown()
+{
+    stopScrubber();
+    checksumEnabled = 0;
+    scrubPolicy.verifyReads = 0;
+    scrubPolicy.bytesPerSec = 0;
+    corruptInodes = 0;
+    checksumResetStats();
+}
@@ -0,0 +1,383 @@
+#include "vfs_internal.h"
+
+// Cold file compression. A compressed file keeps its whole contents as one
+// LZ-compressed block in the pool instead of extents (see packFile in
+// vfs.c); reads decompress it, keeping a few recently read files in host
+// memory, and the first write turns it back into extents.
+//
+// The codec is a byte-oriented LZ77: each sequence is a token whose high
+// nibble counts literals and low nibble the match length past the minimum
+// (15 meaning more length bytes follow, 255 at a time), the literals, then a
+// 2-byte offset back into the output and the match. The last sequence holds
+// literals only and ends the input.
+
+#define LZ_MIN_MATCH 4
+#define LZ_WINDOW 65535
+#define LZ_HASH_BITS 14
+#define LZ_CHAIN_DEPTH 32
+
+// Decompressed file kept for reads, most recently used first
+typedef struct PackCacheEntry
+{
+    INODE *node;
+    char *data;
+    int size;
+    struct PackCacheEntry *next;
+    struct PackCacheEntry *prev;
+} PACKCACHEENTRY;
+
+struct vfs_compress_policy packPolicy = { VFS_COMPRESS_OFF, 2, 4096, 1024 * 1024 };
+unsigned int packTick = 1;
+unsigned int packedFiles = 0;
+unsigned long long packedRaw = 0;
+unsigned long long packedBytes = 0;
+
+static pthread_mutex_t packCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static PACKCACHEENTRY *packCache = NULL;
+static size_t packCacheBytes = 0;
+static unsigned long long packCacheHits = 0;
+static unsigned long long packCacheMisses = 0;
+
+static unsigned int lzHash(const unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a sequence length beyond what the token holds
+static unsigned char *lzLength(unsigned char *out, unsigned char *end, int len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (out == end)
+            return NULL;
+        *out++ = 255;
+    }
+    if (out == end)
+        return NULL;
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+// Emit litLen literals and then a match, or only the literals when
+// matchLen is 0; NULL when it does not fit before end
+static unsigned char *lzEmit(unsigned char *out, unsigned char *end, const unsigned char *lit,
+                             int litLen, int offset, int matchLen)
+{
+    int extra = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+
+    if (out == end)
+        return NULL;
+    *out++ = (unsigned char)(((litLen < 15) ? litLen : 15) << 4 | ((extra < 15) ? extra : 15));
+    if (litLen >= 15 && (out = lzLength(out, end, litLen - 15)) == NULL)
+        return NULL;
+    if (end - out < litLen)
+        return NULL;
+    memcpy(out, lit, litLen);
+    out += litLen;
+    if (matchLen == 0)
+        return out;
+    if (end - out < 2)
+        return NULL;
+    *out++ = (unsigned char)(offset & 0xff);
+    *out++ = (unsigned char)(offset >> 8);
+    if (extra >= 15 && (out = lzLength(out, end, extra - 15)) == NULL)
+        return NULL;
+    return out;
+}
+
+// Compress size bytes of src into at most cap bytes of dst, returns the
+// compressed size or -1 when it does not fit. VFS_COMPRESS_BEST follows
+// chains of earlier positions with the same hash instead of taking the
+// last one only.
+int lzCompress(const char *src, int size, char *dst, int cap, int level)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst, *end = out + cap;
+    int *head, *chain = NULL;
+    int pos = 0, anchor = 0, depth = (level >= VFS_COMPRESS_BEST) ? LZ_CHAIN_DEPTH : 1, i;
+
+    if ((head = (int *)malloc((1 << LZ_HASH_BITS) * sizeof(int))) == NULL)
+        return -1;
+    if (depth > 1 && (chain = (int *)malloc((LZ_WINDOW + 1) * sizeof(int))) == NULL)
+    {
+        free(head);
+        return -1;
+    }
+    for (i = 0; i < (1 << LZ_HASH_BITS); i++)
+        head[i] = -1;
+
+    while (out != NULL && pos + LZ_MIN_MATCH <= size)
+    {
+        unsigned int h = lzHash(in + pos);
+        int cand = head[h], bestLen = 0, bestOff = 0, tries = depth;
+
+        head[h] = pos;
+        if (chain != NULL)
+            chain[pos & LZ_WINDOW] = cand;
+        for (; cand >= 0 && pos - cand <= LZ_WINDOW && tries > 0; tries--)
+        {
+            if (memcmp(in + cand, in + pos, LZ_MIN_MATCH) == 0)
+            {
+                int len = LZ_MIN_MATCH;
+                while (pos + len < size && in[cand + len] == in[pos + len])
+                    len++;
+                if (len > bestLen)
+                {
+                    bestLen = len;
+                    bestOff = pos - cand;
+                }
+            }
+            if (chain == NULL)
+                break;
+            cand = chain[cand & LZ_WINDOW];
+        }
+        if (bestLen < LZ_MIN_MATCH)
+        {
+            pos++;
+            continue;
+        }
+        out = lzEmit(out, end, in + anchor, pos - anchor, bestOff, bestLen);
+        // Positions inside the match become candidates too, when searching hard
+        if (chain != NULL)
+        {
+            for (i = pos + 1; i < pos + bestLen && i + LZ_MIN_MATCH <= size; i++)
+            {
+                h = lzHash(in + i);
+                chain[i & LZ_WINDOW] = head[h];
+                head[h] = i;
+            }
+        }
+        pos += bestLen;
+        anchor = pos;
+    }
+    if (out != NULL)
+        out = lzEmit(out, end, in + anchor, size - anchor, 0, 0);
+    free(head);
+    free(chain);
+    return (out != NULL) ? (int)(out - (unsigned char *)dst) : -1;
+}
+
+// Read a sequence length continued past the token, -1 when the input ends
+static int lzReadLength(const unsigned char **ip, const unsigned char *iend, int len, int limit)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*ip >= iend || len > limit)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// Decompress size bytes of src into exactly rawSize bytes at dst,
+// returns -1 when the input is not a valid stream of that length
+int lzDecompress(const char *src, int size, char *dst, int rawSize)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + size;
+    unsigned char *op = (unsigned char *)dst, *oend = op + rawSize;
+
+    while (ip < iend)
+    {
+        int token = *ip++, lit = token >> 4, len = token & 15, offset;
+
+        if (lit == 15 && (lit = lzReadLength(&ip, iend, lit, rawSize)) < 0)
+            return -1;
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (len == 15 && (len = lzReadLength(&ip, iend, len, rawSize)) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - (unsigned char *)dst || len > oend - op)
+            return -1;
+        if (offset >= len)
+            memcpy(op, op - offset, len);
+        else
+        {
+            // Overlapping match, repeats the last 'offset' bytes
+            int i;
+            for (i = 0; i < len; i++)
+                op[i] = op[i - offset];
+        }
+        op += len;
+    }
+    return (op == oend) ? 0 : -1;
+}
+
+static void cacheUnlink(PACKCACHEENTRY *ent)
+{
+    if (ent->prev != NULL)
+        ent->prev->next = ent->next;
+    else
+        packCache = ent->next;
+    if (ent->next != NULL)
+        ent->next->prev = ent->prev;
+}
+
+static void cacheFree(PACKCACHEENTRY *ent)
+{
+    cacheUnlink(ent);
+    packCacheBytes -= ent->size;
+    metaFree(ent->data, ent->size);
+    metaFree(ent, sizeof(PACKCACHEENTRY));
+}
+
+// Evict least recently used files until 'limit' bytes remain, the caller
+// holds packCacheLock
+static void cacheTrim(size_t limit)
+{
+    PACKCACHEENTRY *last = packCache;
+
+    while (last != NULL && last->next != NULL)
+        last = last->next;
+    while (last != NULL && packCacheBytes > limit)
+    {
+        PACKCACHEENTRY *prev = last->prev;
+        cacheFree(last);
+        last = prev;
+    }
+}
+
+// Copy from the cached contents of a compressed file, -1 when it is not cached
+int packCacheRead(INODE *node, int pos, char *buf, int len)
+{
+    PACKCACHEENTRY *ent;
+
+    MUTEX_LOCK(&packCacheLock);
+    for (ent = packCache; ent != NULL && ent->node != node; ent = ent->next)
+        ;
+    if (ent == NULL)
+    {
+        packCacheMisses++;
+        MUTEX_UNLOCK(&packCacheLock);
+        return -1;
+    }
+    packCacheHits++;
+    if (ent != packCache)
+    {
+        cacheUnlink(ent);
+        ent->prev = NULL;
+        ent->next = packCache;
+        packCache->prev = ent;
+        packCache = ent;
+    }
+    memcpy(buf, ent->data + pos, len);
+    MUTEX_UNLOCK(&packCacheLock);
+    return len;
+}
+
+// Copy the whole cached contents of a compressed file for a search, -1
+// when it is not cached. Neither the counters nor the LRU order change.
+int packCachePeek(INODE *node, char *buf, int size)
+{
+    PACKCACHEENTRY *ent;
+
+    MUTEX_LOCK(&packCacheLock);
+    for (ent = packCache; ent != NULL && ent->node != node; ent = ent->next)
+        ;
+    if (ent != NULL)
+        memcpy(buf, ent->data, size);
+    MUTEX_UNLOCK(&packCacheLock);
+    return (ent != NULL) ? size : -1;
+}
+
+// Keep the decompressed contents of node, a metaAlloc'd buffer the cache
+// takes over (or frees when it does not fit)
+void packCacheInsert(INODE *node, char *data, int size)
+{
+    PACKCACHEENTRY *ent;
+
+    MUTEX_LOCK(&packCacheLock);
+    for (ent = packCache; ent != NULL && ent->node != node; ent = ent->next)
+        ;
+    // Another reader may have got there first
+    if (ent != NULL || (size_t)size > packPolicy.cacheBytes ||
+        (ent = (PACKCACHEENTRY *)metaAlloc(sizeof(PACKCACHEENTRY))) == NULL)
+    {
+        MUTEX_UNLOCK(&packCacheLock);
+        metaFree(data, size);
+        return;
+    }
+    cacheTrim(packPolicy.cacheBytes - size);
+    ent->node = node;
+    ent->data = data;
+    ent->size = size;
+    ent->prev = NULL;
+    ent->next = packCache;
+    if (packCache != NULL)
+        packCache->prev = ent;
+    packCache = ent;
+    packCacheBytes += size;
+    MUTEX_UNLOCK(&packCacheLock);
+}
+
+// Forget node's cached contents, before its data changes or goes away
+void packCacheDrop(INODE *node)
+{
+    PACKCACHEENTRY *ent;
+
+    MUTEX_LOCK(&packCacheLock);
+    for (ent = packCache; ent != NULL && ent->node != node; ent = ent->next)
+        ;
+    if (ent != NULL)
+        cacheFree(ent);
+    MUTEX_UNLOCK(&packCacheLock);
+}
+
+void packUsage(struct vfs_stats *st)
+{
+    st->packedFiles = packedFiles;
+    st->packedRaw = (size_t)packedRaw;
+    st->packedBytes = (size_t)packedBytes;
+    MUTEX_LOCK(&packCacheLock);
+    st->packCacheBytes = packCacheBytes;
+    st->packCacheHits = packCacheHits;
+    st->packCacheMisses = packCacheMisses;
+    MUTEX_UNLOCK(&packCacheLock);
+}
+
+void packResetStats()
+{
+    MUTEX_LOCK(&packCacheLock);
+    packCacheHits = packCacheMisses = 0;
+    MUTEX_UNLOCK(&packCacheLock);
+}
+
+void packTeardown()
+{
+    MUTEX_LOCK(&packCacheLock);
+    cacheTrim(0);
+    packCacheHits = packCacheMisses = 0;
+    MUTEX_UNLOCK(&packCacheLock);
+    packPolicy.level = VFS_COMPRESS_OFF;
+    packTick = 1;
+    packedFiles = 0;
+    packedRaw = packedBytes = 0;
+}
+
+int vfs_set_compression(const struct vfs_compress_policy *policy)
+{
+    if (mainPool == NULL || policy == NULL ||
+        policy->level < VFS_COMPRESS_OFF || policy->level > VFS_COMPRESS_BEST)
+        return VFS_EINVAL;
+    MUTEX_LOCK(&packCacheLock);
+    packPolicy = *policy;
+    cacheTrim(packPolicy.cacheBytes);
+    MUTEX_UNLOCK(&packCacheLock);
+    return VFS_OK;
+}
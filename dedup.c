@@ -0,0 +1,270 @@
+#include "vfs_internal.h"
+
+// Content index for deduplication. Every full extent written while dedup is
+// on is hashed and looked up here; a match with the same bytes makes the new
+// extent point at the existing block instead, which then counts a reference
+// per extent using it. Indexed blocks have no owner, so compaction leaves
+// them where they are, and their bytes never change: a file about to modify
+// one takes it back (the only reference) or copies it (shared).
+
+typedef struct DedupEntry
+{
+    unsigned long long hash;
+    long long offset;
+    int size;
+    unsigned int refs;
+    struct DedupEntry *hashNext;        // chain by content hash
+    struct DedupEntry *offsetNext;      // chain by pool offset
+} DEDUPENTRY;
+
+static pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
+static DEDUPENTRY **byHash = NULL;
+static DEDUPENTRY **byOffset = NULL;
+static unsigned int dedupBuckets = 0;
+static unsigned long long dedupRefs = 0;
+static unsigned long long dedupSaved = 0;   // bytes the extra references would have used
+
+int dedupEnabled = 0;
+unsigned int dedupBlocks = 0;
+
+// 64-bit hash of a block, eight bytes at a time
+static unsigned long long contentHash(const char *data, int size)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)size;
+    unsigned long long word;
+    int i;
+    
+    for (i = 0; i + 8 <= size; i += 8)
+    {
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    for (; i < size; i++)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static unsigned int offsetSlot(long long offset, unsigned int buckets)
+{
+    return ((unsigned int)(offset ^ (offset >> 32)) * 2654435761u) & (buckets - 1);
+}
+
+static void dedupResize(unsigned int buckets)
+{
+    DEDUPENTRY **hashes = (DEDUPENTRY **)metaCalloc(buckets, sizeof(DEDUPENTRY *));
+    DEDUPENTRY **offsets = (DEDUPENTRY **)metaCalloc(buckets, sizeof(DEDUPENTRY *));
+    unsigned int i;
+    
+    if (hashes == NULL || offsets == NULL)
+    {
+        metaFree(hashes, buckets * sizeof(DEDUPENTRY *));
+        metaFree(offsets, buckets * sizeof(DEDUPENTRY *));
+        return;
+    }
+    for (i = 0; i < dedupBuckets; i++)
+    {
+        DEDUPENTRY *ent = byHash[i];
+        while (ent != NULL)
+        {
+            DEDUPENTRY *nxt = ent->hashNext;
+            unsigned int slot = offsetSlot(ent->offset, buckets);
+            ent->hashNext = hashes[ent->hash & (buckets - 1)];
+            hashes[ent->hash & (buckets - 1)] = ent;
+            ent->offsetNext = offsets[slot];
+            offsets[slot] = ent;
+            ent = nxt;
+        }
+    }
+    metaFree(byHash, dedupBuckets * sizeof(DEDUPENTRY *));
+    metaFree(byOffset, dedupBuckets * sizeof(DEDUPENTRY *));
+    byHash = hashes;
+    byOffset = offsets;
+    dedupBuckets = buckets;
+}
+
+static DEDUPENTRY **findOffset(long long offset)
+{
+    DEDUPENTRY **link = &byOffset[offsetSlot(offset, dedupBuckets)];
+    
+    while (*link != NULL && (*link)->offset != offset)
+        link = &(*link)->offsetNext;
+    return link;
+}
+
+static int dedupInsert(unsigned long long hash, long long offset, int size, unsigned int refs)
+{
+    DEDUPENTRY *ent;
+    unsigned int slot;
+    
+    if (dedupBlocks >= dedupBuckets)
+        dedupResize(dedupBuckets ? dedupBuckets * 2 : 64);
+    if (dedupBuckets == 0 || (ent = (DEDUPENTRY *)metaAlloc(sizeof(DEDUPENTRY))) == NULL)
+        return -1;
+    ent->hash = hash;
+    ent->offset = offset;
+    ent->size = size;
+    ent->refs = refs;
+    ent->hashNext = byHash[hash & (dedupBuckets - 1)];
+    byHash[hash & (dedupBuckets - 1)] = ent;
+    slot = offsetSlot(offset, dedupBuckets);
+    ent->offsetNext = byOffset[slot];
+    byOffset[slot] = ent;
+    dedupRefs += refs;
+    dedupSaved += (unsigned long long)(refs - 1) * size;
+    __atomic_store_n(&dedupBlocks, dedupBlocks + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Unlink the entry *link points at from both chains
+static void dedupRemove(DEDUPENTRY **link)
+{
+    DEDUPENTRY *ent = *link, **hashLink = &byHash[ent->hash & (dedupBuckets - 1)];
+    
+    *link = ent->offsetNext;
+    while (*hashLink != ent)
+        hashLink = &(*hashLink)->hashNext;
+    *hashLink = ent->hashNext;
+    dedupRefs -= ent->refs;
+    __atomic_store_n(&dedupBlocks, dedupBlocks - 1, __ATOMIC_RELAXED);
+    metaFree(ent, sizeof(DEDUPENTRY));
+}
+
+// Index the full block at offset, which the caller has already released
+// from its owner. Returns the offset of an identical block to use instead,
+// now with one more reference, offset itself when it became the entry, or
+// -1 when there was no memory to index it.
+long long dedupBlock(long long offset, int size)
+{
+    unsigned long long hash = contentHash(mainPool + offset, size);
+    DEDUPENTRY *ent;
+    
+    MUTEX_LOCK(&dedupLock);
+    for (ent = (dedupBuckets != 0) ? byHash[hash & (dedupBuckets - 1)] : NULL; ent != NULL; ent = ent->hashNext)
+    {
+        if (ent->hash == hash && ent->size == size && ent->offset != offset &&
+            memcmp(mainPool + ent->offset, mainPool + offset, size) == 0)
+        {
+            ent->refs++;
+            dedupRefs++;
+            dedupSaved += size;
+            offset = ent->offset;
+            MUTEX_UNLOCK(&dedupLock);
+            return offset;
+        }
+    }
+    if (dedupInsert(hash, offset, size, 1) != 0)
+        offset = -1;
+    MUTEX_UNLOCK(&dedupLock);
+    return offset;
+}
+
+// Before the block at offset is modified. Returns 0 when it is not indexed,
+// 1 when the caller held the only reference and has it back to itself, or
+// the reference count when it is shared and has to be copied first.
+unsigned int dedupUnshare(long long offset)
+{
+    DEDUPENTRY **link;
+    unsigned int refs = 0;
+    
+    if (__atomic_load_n(&dedupBlocks, __ATOMIC_RELAXED) == 0)
+        return 0;
+    MUTEX_LOCK(&dedupLock);
+    link = findOffset(offset);
+    if (*link != NULL && (refs = (*link)->refs) == 1)
+        dedupRemove(link);
+    MUTEX_UNLOCK(&dedupLock);
+    return refs;
+}
+
+// Drop one reference to the block at offset, returns 1 when the caller
+// must free it: it was not indexed or this was the last reference
+int dedupRelease(long long offset)
+{
+    DEDUPENTRY **link;
+    int last = 1;
+    
+    if (__atomic_load_n(&dedupBlocks, __ATOMIC_RELAXED) == 0)
+        return 1;
+    MUTEX_LOCK(&dedupLock);
+    link = findOffset(offset);
+    if (*link != NULL)
+    {
+        if ((*link)->refs > 1)
+        {
+            (*link)->refs--;
+            dedupRefs--;
+            dedupSaved -= (*link)->size;
+            last = 0;
+        }
+        else
+            dedupRemove(link);
+    }
+    MUTEX_UNLOCK(&dedupLock);
+    return last;
+}
+
+// References to the block at offset, 0 when it is not indexed
+unsigned int dedupRefCount(long long offset)
+{
+    DEDUPENTRY **link;
+    unsigned int refs = 0;
+    
+    if (__atomic_load_n(&dedupBlocks, __ATOMIC_RELAXED) == 0)
+        return 0;
+    MUTEX_LOCK(&dedupLock);
+    link = findOffset(offset);
+    if (*link != NULL)
+        refs = (*link)->refs;
+    MUTEX_UNLOCK(&dedupLock);
+    return refs;
+}
+
+// Index a block shared by 'refs' extents of a loaded image
+int dedupRestore(long long offset, int size, unsigned int refs)
+{
+    int err;
+    
+    MUTEX_LOCK(&dedupLock);
+    err = dedupInsert(contentHash(mainPool + offset, size), offset, size, refs);
+    MUTEX_UNLOCK(&dedupLock);
+    return err;
+}
+
+// Indexed blocks, extent references to them and the bytes sharing saves
+void dedupUsage(unsigned int *blocks, unsigned long long *refs, unsigned long long *saved)
+{
+    MUTEX_LOCK(&dedupLock);
+    *blocks = dedupBlocks;
+    *refs = dedupRefs;
+    *saved = dedupSaved;
+    MUTEX_UNLOCK(&dedupLock);
+}
+
+void dedupSetup(int enabled)
+{
+    dedupEnabled = enabled;
+}
+
+void dedupTeardown()
+{
+    unsigned int i;
+    
+    for (i = 0; i < dedupBuckets; i++)
+    {
+        while (byHash[i] != NULL)
+        {
+            DEDUPENTRY *ent = byHash[i];
+            byHash[i] = ent->hashNext;
+            metaFree(ent, sizeof(DEDUPENTRY));
+        }
+    }
+    metaFree(byHash, dedupBuckets * sizeof(DEDUPENTRY *));
+    metaFree(byOffset, dedupBuckets * sizeof(DEDUPENTRY *));
+    byHash = byOffset = NULL;
+    dedupBuckets = 0;
+    dedupBlocks = 0;
+    dedupRefs = dedupSaved = 0;
+    dedupEnabled = 0;
+}
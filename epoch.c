@@ -0,0 +1,235 @@
+#include "vfs_internal.h"
+
+// Epoch-based reclamation for the lock-free read path. A reader announces
+// itself in the current epoch; memory it might still see is retired with
+// the epoch at that moment and only reclaimed once the global epoch has
+// moved two steps past it, by which time every such reader has left.
+
+// Readers inside each epoch (mod 3), one cache line per shard
+typedef struct EpochShard
+{
+    unsigned long active[3];
+    char pad[64 - 3 * sizeof(unsigned long)];
+} EPOCHSHARD;
+
+enum retire_kind
+{
+    RETIRE_META,        // metaFree(ptr, size)
+    RETIRE_OBJECT,      // slabFree(cache, ptr)
+    RETIRE_INODE,       // destroy the inode's lock, then free it
+    RETIRE_SPACE        // releaseSpace(position, size)
+};
+
+typedef struct Retired
+{
+    int kind;
+    void *ptr;
+    SLABCACHE *cache;
+    long long position;
+    size_t size;
+    unsigned long epoch;
+    struct Retired *next;
+} RETIRED;
+
+static EPOCHSHARD epochShards[EPOCH_SHARDS] __attribute__((aligned(64)));
+static unsigned long globalEpoch = 0;
+
+// Retired entries, newest first, guarded by retireLock
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+static RETIRED *retiredList = NULL;
+unsigned int retiredBlocks = 0;
+
+static void reclaim(RETIRED *item)
+{
+    switch (item->kind)
+    {
+    case RETIRE_OBJECT:
+        slabFree(item->cache, item->ptr);
+        break;
+    case RETIRE_INODE:
+        pthread_rwlock_destroy(&((INODE *)item->ptr)->lock);
+        slabFree(&inodeCache, item->ptr);
+        break;
+    case RETIRE_SPACE:
+        releaseSpace(item->position, (int)item->size);
+        break;
+    default:
+        metaFree(item->ptr, item->size);
+        break;
+    }
+}
+
+// Queue item for reclamation; outside concurrent mode nobody can be
+// reading it, so it goes straight away
+static void retire(int kind, void *ptr, SLABCACHE *cache, long long position, size_t size)
+{
+    RETIRED *item;
+    
+    if (!vfsConcurrent)
+    {
+        RETIRED now = { kind, ptr, cache, position, size, 0, NULL };
+        reclaim(&now);
+        return;
+    }
+    if (kind == RETIRE_SPACE)
+    {
+        // Compaction must not move a block that is on its way out
+        setBlockOwner(position, NULL);
+        __atomic_fetch_add(&retiredBlocks, 1, __ATOMIC_RELAXED);
+    }
+    if ((item = (RETIRED *)metaAlloc(sizeof(RETIRED))) == NULL)
+    {
+        // Waiting for readers here could deadlock, so leave it be
+        VFS_LOG("epoch: no memory to retire %p, leaking it\n", ptr);
+        return;
+    }
+    item->kind = kind;
+    item->ptr = ptr;
+    item->cache = cache;
+    item->position = position;
+    item->size = size;
+    
+    pthread_mutex_lock(&retireLock);
+    item->epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    item->next = retiredList;
+    __atomic_store_n(&retiredList, item, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&retireLock);
+}
+
+void retireMeta(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+        retire(RETIRE_META, ptr, NULL, 0, size);
+}
+
+void retireObject(SLABCACHE *cache, void *obj)
+{
+    retire(RETIRE_OBJECT, obj, cache, 0, 0);
+}
+
+void retireInode(INODE *node)
+{
+    retire(RETIRE_INODE, node, NULL, 0, 0);
+}
+
+void retireSpace(long long position, int size)
+{
+    retire(RETIRE_SPACE, NULL, NULL, position, size);
+}
+
+// Returns a token for epochExit
+int epochEnter()
+{
+    EPOCHSHARD *shard;
+    unsigned long epoch;
+    int idx;
+    
+    if (!vfsConcurrent)
+        return 0;
+    shard = &epochShards[currentSlot() % EPOCH_SHARDS];
+    for (;;)
+    {
+        epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+        idx = epoch % 3;
+        __atomic_fetch_add(&shard->active[idx], 1, __ATOMIC_SEQ_CST);
+        // An advance may have checked the counter before it was raised
+        if (__atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST) == epoch)
+            return (int)(shard - epochShards) * 3 + idx;
+        __atomic_fetch_sub(&shard->active[idx], 1, __ATOMIC_RELEASE);
+    }
+}
+
+void epochExit(int token)
+{
+    if (vfsConcurrent)
+        __atomic_fetch_sub(&epochShards[token / 3].active[token % 3], 1, __ATOMIC_RELEASE);
+}
+
+// Move to the next epoch if no reader is left in the previous one, the
+// caller holds retireLock
+static int epochAdvance()
+{
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    int i;
+    
+    for (i = 0; i < EPOCH_SHARDS; i++)
+    {
+        if (__atomic_load_n(&epochShards[i].active[(epoch + 2) % 3], __ATOMIC_ACQUIRE) != 0)
+            return 0;
+    }
+    __atomic_store_n(&globalEpoch, epoch + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+// Detach and return the entries every reader has finished with
+static RETIRED *collectReady()
+{
+    RETIRED **link, *ready;
+    unsigned long epoch;
+    
+    epochAdvance();
+    epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    for (link = &retiredList; *link != NULL && (*link)->epoch + 2 > epoch; link = &(*link)->next)
+        ;
+    ready = *link;
+    __atomic_store_n(link, NULL, __ATOMIC_RELAXED);
+    return ready;
+}
+
+// Pool space goes back in batches, so each arena is locked once per batch
+static void reclaimList(RETIRED *item)
+{
+    SPAN spans[RECLAIM_BATCH];
+    int count = 0;
+    
+    while (item != NULL)
+    {
+        RETIRED *nxt = item->next;
+        if (item->kind == RETIRE_SPACE)
+        {
+            spans[count].position = item->position;
+            spans[count].size = (int)item->size;
+            if (++count == RECLAIM_BATCH)
+            {
+                releaseSpans(spans, count);
+                __atomic_fetch_sub(&retiredBlocks, count, __ATOMIC_RELAXED);
+                count = 0;
+            }
+        }
+        else
+            reclaim(item);
+        metaFree(item, sizeof(RETIRED));
+        item = nxt;
+    }
+    if (count > 0)
+    {
+        releaseSpans(spans, count);
+        __atomic_fetch_sub(&retiredBlocks, count, __ATOMIC_RELAXED);
+    }
+}
+
+// Reclaim what is safe without waiting, called after writer operations
+void epochCollect()
+{
+    RETIRED *ready;
+    
+    if (!vfsConcurrent || __atomic_load_n(&retiredList, __ATOMIC_RELAXED) == NULL)
+        return;
+    if (pthread_mutex_trylock(&retireLock) != 0)
+        return;     // someone else is collecting
+    ready = collectReady();
+    pthread_mutex_unlock(&retireLock);
+    reclaimList(ready);
+}
+
+// Reclaim everything, the caller guarantees there are no readers left
+void epochDrain()
+{
+    RETIRED *all;
+    
+    pthread_mutex_lock(&retireLock);
+    all = retiredList;
+    __atomic_store_n(&retiredList, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&retireLock);
+    reclaimList(all);
+}
@@ -0,0 +1,548 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "vfs_internal.h"
+
+// Image layout: the header page, the pool from IMAGE_PAGE on (rounded up to
+// whole pages), then the metadata section: the size of every pool arena,
+// then one IMAGEINODE per live inode, each followed by its extents and an
+// IMAGELINK for every name past the first. Metadata refers to pool offsets
+// only; extents sharing a block all carry its offset, and a compressed file
+// has no extents but the offset of its packed block. An inline file's bytes
+// follow its links.
+#define IMAGE_MAGIC "VFSIMG1"
+#define IMAGE_VERSION 6     // 2: 64-bit extent offsets, 3: hard links and shared blocks, 4: packed files,
+                            // 5: inline files, 6: checksums
+
+typedef struct ImageHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int pageSize;
+    long long poolOffset;
+    long long poolSize;
+    long long metaOffset;
+    long long metaLength;
+    unsigned long long generation;    // bumped by every snapshot or sync
+    unsigned int inodeCount;
+    int totalBlock;
+    int totalInode;
+    unsigned int arenaCount;
+    int flags;                      // VFS_INIT_DEDUP and VFS_INIT_CHECKSUM as they were
+} IMAGEHEADER;
+
+typedef struct ImageInode
+{
+    unsigned int inodeNo;
+    unsigned int parentNo;
+    unsigned int permission;
+    unsigned int fileSize;
+    int isDirectory;
+    int extentCount;
+    unsigned int linkCount;
+    long long packOffset;       // -1 unless the file is compressed
+    int packedSize;
+    unsigned int packCrc;
+    char name[MAX_NAME + 1];
+} IMAGEINODE;
+
+typedef struct ImageLink
+{
+    unsigned int parentNo;
+    char name[MAX_NAME + 1];
+} IMAGELINK;
+
+// Pool range used while rebuilding the block list
+typedef struct ImageClaim
+{
+    long long memOffset;
+    int capacity;
+    int full;
+    INODE *owner;
+} IMAGECLAIM;
+
+unsigned long long *dirtyMap = NULL;
+static int dirtyWords = 0;
+static int imageFd = -1;
+static char *mappedPool = NULL;     // pool mapped from the image, if any
+static size_t mappedLength = 0;
+static unsigned long long generation = 0;
+
+static long long roundPage(long long size)
+{
+    return (size + IMAGE_PAGE - 1) / IMAGE_PAGE * IMAGE_PAGE;
+}
+
+void markDirty(long long offset, int len)
+{
+    long long first, last;
+    
+    if (len <= 0)
+        return;
+    first = offset / IMAGE_PAGE;
+    last = (offset + len - 1) / IMAGE_PAGE;
+    for (; first <= last; first++)
+        __atomic_fetch_or(&dirtyMap[first / 64], 1ULL << (first % 64), __ATOMIC_RELAXED);
+}
+
+// Close the attached image and unmap its pool
+void imageDetach()
+{
+    if (imageFd >= 0)
+        close(imageFd);
+    if (mappedPool != NULL)
+        munmap(mappedPool, mappedLength);
+    metaFree(dirtyMap, dirtyWords * sizeof(unsigned long long));
+    imageFd = -1;
+    mappedPool = NULL;
+    mappedLength = 0;
+    dirtyMap = NULL;
+    dirtyWords = 0;
+    generation = 0;
+}
+
+// Generation of the attached image, 0 when there is none
+unsigned long long imageGeneration()
+{
+    return generation;
+}
+
+static int writeAll(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = (const char *)buf;
+    
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0)
+            return VFS_EIO;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return VFS_OK;
+}
+
+static int readAll(int fd, void *buf, size_t len, off_t offset)
+{
+    char *p = (char *)buf;
+    
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0)
+            return VFS_EIO;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return VFS_OK;
+}
+
+// Bytes an inode keeps inline, saved after its record
+static int inlineLength(unsigned int fileSize, int extentCount, long long packOffset)
+{
+    return (extentCount == 0 && packOffset == -1) ? (int)fileSize : 0;
+}
+
+// Serialize the arena layout and the live inodes, returns a malloc'd
+// buffer of *len bytes
+static char *packMetadata(size_t *len, unsigned int *count, unsigned int *arenas)
+{
+    INODE *node;
+    char *buf, *p;
+    
+    *arenas = (unsigned int)poolLayout(NULL, 0);
+    *len = *arenas * sizeof(int);
+    *count = 0;
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        if (node->linkCount == 0)
+            continue;
+        *len += sizeof(IMAGEINODE) + node->extentCount * sizeof(EXTENT) +
+                (node->linkCount - 1) * sizeof(IMAGELINK) +
+                inlineLength(node->fileSize, node->extentCount, node->packOffset);
+        (*count)++;
+    }
+    if ((buf = p = (char *)malloc(*len)) == NULL)
+        return NULL;
+    poolLayout((int *)p, *arenas);
+    p += *arenas * sizeof(int);
+    
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        IMAGEINODE rec;
+        HARDLINK *link;
+        if (node->linkCount == 0)
+            continue;
+        memset(&rec, 0, sizeof(rec));
+        rec.inodeNo = node->inodeNo;
+        rec.parentNo = node->parentNo;
+        rec.permission = node->fileAccessPermission;
+        rec.fileSize = node->fileSize;
+        rec.isDirectory = (node->dir != NULL);
+        rec.extentCount = node->extentCount;
+        rec.linkCount = node->linkCount;
+        rec.packOffset = node->packOffset;
+        rec.packedSize = node->packedSize;
+        rec.packCrc = node->packCrc;
+        strcpy(rec.name, node->name);
+        memcpy(p, &rec, sizeof(rec));
+        p += sizeof(rec);
+        if (node->extentCount > 0)
+            memcpy(p, node->extents, node->extentCount * sizeof(EXTENT));
+        p += node->extentCount * sizeof(EXTENT);
+        for (link = node->links; link != NULL; link = link->next)
+        {
+            IMAGELINK lrec;
+            memset(&lrec, 0, sizeof(lrec));
+            lrec.parentNo = link->parentNo;
+            strcpy(lrec.name, link->name);
+            memcpy(p, &lrec, sizeof(lrec));
+            p += sizeof(lrec);
+        }
+        memcpy(p, node->inlineData, inlineLength(node->fileSize, node->extentCount, node->packOffset));
+        p += inlineLength(node->fileSize, node->extentCount, node->packOffset);
+    }
+    return buf;
+}
+
+// Write the metadata section and then the header that points at it
+static int writeMetadata(int fd)
+{
+    IMAGEHEADER hdr;
+    unsigned int count, arenas;
+    size_t len;
+    char *meta = packMetadata(&len, &count, &arenas);
+    int err;
+    
+    if (meta == NULL)
+        return VFS_ENOMEM;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.pageSize = IMAGE_PAGE;
+    hdr.poolOffset = IMAGE_PAGE;
+    hdr.poolSize = poolSize;
+    hdr.metaOffset = IMAGE_PAGE + roundPage(poolSize);
+    hdr.metaLength = len;
+    hdr.generation = ++generation;
+    hdr.inodeCount = count;
+    hdr.totalBlock = S.totalBlock;
+    hdr.totalInode = S.totalInode;
+    hdr.arenaCount = arenas;
+    hdr.flags = (dedupEnabled ? VFS_INIT_DEDUP : 0) | (checksumEnabled ? VFS_INIT_CHECKSUM : 0);
+    
+    err = writeAll(fd, meta, len, hdr.metaOffset);
+    free(meta);
+    if (err == VFS_OK && ftruncate(fd, hdr.metaOffset + len) != 0)
+        err = VFS_EIO;
+    if (err == VFS_OK)
+        err = writeAll(fd, &hdr, sizeof(hdr), 0);
+    if (err == VFS_OK && fsync(fd) != 0)
+        err = VFS_EIO;
+    return err;
+}
+
+// Covers the whole reservation, so pages of arenas added later fit too
+static int allocDirtyMap()
+{
+    int words = (int)((roundPage(poolReserve) / IMAGE_PAGE + 63) / 64);
+    
+    dirtyMap = (unsigned long long *)metaCalloc(words, sizeof(unsigned long long));
+    if (dirtyMap == NULL)
+        return VFS_ENOMEM;
+    dirtyWords = words;
+    return VFS_OK;
+}
+
+static int snapshotImage(const char *path)
+{
+    int fd, err;
+    
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return VFS_EIO;
+    
+    err = writeAll(fd, mainPool, poolSize, IMAGE_PAGE);
+    if (err == VFS_OK)
+        err = writeMetadata(fd);
+    if (err != VFS_OK)
+    {
+        close(fd);
+        return err;
+    }
+    
+    // The new file becomes the sync target, a mapped pool stays mapped
+    if (imageFd >= 0)
+        close(imageFd);
+    imageFd = fd;
+    if (dirtyMap == NULL && (err = allocDirtyMap()) != VFS_OK)
+        return err;
+    memset(dirtyMap, 0, dirtyWords * sizeof(unsigned long long));
+    return VFS_OK;
+}
+
+static int syncImage()
+{
+    int word, err;
+    
+
+    for (word = 0; word < dirtyWords; word++)
+    {
+        while (dirtyMap[word] != 0)
+        {
+            long long page = (long long)word * 64 + __builtin_ctzll(dirtyMap[word]);
+            long long start = page * IMAGE_PAGE;
+            int len = (start + IMAGE_PAGE > poolSize) ? (int)(poolSize - start) : IMAGE_PAGE;
+            
+            if ((err = writeAll(imageFd, mainPool + start, len, IMAGE_PAGE + start)) != VFS_OK)
+                return err;
+            dirtyMap[word] &= dirtyMap[word] - 1;
+        }
+    }
+    return writeMetadata(imageFd);
+}
+
+// Both block namespace changes and file I/O while the image is written
+int vfs_snapshot(const char *path)
+{
+    int err;
+    
+    if (mainPool == NULL || path == NULL)
+        return VFS_EINVAL;
+    lockNamespace();
+    if ((err = faultAll()) == VFS_OK)
+        err = snapshotImage(path);
+    // Everything journaled so far is in the image now
+    if (err == VFS_OK && journalEnabled)
+        err = journalRestart(generation);
+    unlockNamespace();
+    return err;
+}
+
+int vfs_sync(void)
+{
+    int err;
+    
+    if (mainPool == NULL || imageFd < 0)
+        return VFS_EINVAL;
+    lockNamespace();
+    if ((err = faultAll()) == VFS_OK)
+        err = syncImage();
+    if (err == VFS_OK && journalEnabled)
+        err = journalRestart(generation);
+    unlockNamespace();
+    return err;
+}
+
+static int compareClaims(const void *a, const void *b)
+{
+    long long x = ((const IMAGECLAIM *)a)->memOffset, y = ((const IMAGECLAIM *)b)->memOffset;
+    
+    return (x > y) - (x < y);
+}
+
+// Rebuild inodes, directories and the block list from the metadata section
+static int restoreMetadata(const IMAGEHEADER *hdr, const char *meta)
+{
+    const char *p = meta + hdr->arenaCount * sizeof(int), *end = meta + hdr->metaLength;
+    IMAGECLAIM *claims = NULL;
+    int claimCount = 0, claimCapacity = 0, refs, i;
+    unsigned int n;
+    INODE *node;
+    
+    for (n = 0; n < hdr->inodeCount; n++)
+    {
+        IMAGEINODE rec;
+        const char *data;
+        if (p + sizeof(rec) > end)
+            break;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.extentCount < 0 || rec.linkCount == 0 ||
+            (rec.packOffset != -1 && (rec.extentCount != 0 || rec.packedSize <= 0)) ||
+            (rec.extentCount == 0 && rec.packOffset == -1 && rec.fileSize > INLINE_MAX) ||
+            p + rec.extentCount * sizeof(EXTENT) + (rec.linkCount - 1) * sizeof(IMAGELINK) +
+            inlineLength(rec.fileSize, rec.extentCount, rec.packOffset) > end)
+            break;
+        
+        rec.name[MAX_NAME] = '\0';
+        data = p + rec.extentCount * sizeof(EXTENT) + (rec.linkCount - 1) * sizeof(IMAGELINK);
+        node = restoreInode(rec.inodeNo, rec.isDirectory, rec.permission, rec.fileSize,
+                            (const EXTENT *)p, rec.extentCount,
+                            inlineLength(rec.fileSize, rec.extentCount, rec.packOffset) > 0 ? data : NULL);
+        if (node == NULL)
+            break;
+        node->parentNo = rec.parentNo;
+        strcpy(node->name, rec.name);
+        p += rec.extentCount * sizeof(EXTENT);
+        for (node->linkCount = 1; node->linkCount < rec.linkCount; node->linkCount++)
+        {
+            IMAGELINK lrec;
+            memcpy(&lrec, p, sizeof(lrec));
+            p += sizeof(lrec);
+            lrec.name[MAX_NAME] = '\0';
+            if (addLink(node, lrec.parentNo, lrec.name) != VFS_OK)
+                break;
+        }
+        if (node->linkCount < rec.linkCount)
+            break;
+        p += inlineLength(rec.fileSize, rec.extentCount, rec.packOffset);
+        
+        if (claimCount + rec.extentCount + 1 > claimCapacity)
+        {
+            int cap = (claimCapacity ? claimCapacity * 2 : 256) + rec.extentCount + 1;
+            IMAGECLAIM *arr = (IMAGECLAIM *)realloc(claims, cap * sizeof(IMAGECLAIM));
+            if (arr == NULL)
+                break;
+            claims = arr;
+            claimCapacity = cap;
+        }
+        for (i = 0; i < node->extentCount; i++)
+        {
+            claims[claimCount].memOffset = node->extents[i].memOffset;
+            claims[claimCount].capacity = node->extents[i].capacity;
+            claims[claimCount].full = (node->extents[i].length == node->extents[i].capacity);
+            claims[claimCount].owner = node;
+            claimCount++;
+        }
+        if (rec.packOffset != -1)
+        {
+            node->packOffset = rec.packOffset;
+            node->packedSize = rec.packedSize;
+            node->packCrc = rec.packCrc;
+            packedFiles++;
+            packedRaw += node->fileSize;
+            packedBytes += node->packedSize;
+            claims[claimCount].memOffset = node->packOffset;
+            claims[claimCount].capacity = node->packedSize;
+            claims[claimCount].full = 0;
+            claims[claimCount].owner = node;
+            claimCount++;
+        }
+    }
+    if (n < hdr->inodeCount || inodeTable == NULL || inodeTable[ROOT_INODE] == NULL)
+    {
+        free(claims);
+        return VFS_EINVAL;
+    }
+    
+    if (claimCount > 1)
+        qsort(claims, claimCount, sizeof(IMAGECLAIM), compareClaims);
+    for (i = 0; i < claimCount; i += refs)
+    {
+        // Extents sharing a block sort next to each other
+        for (refs = 1; i + refs < claimCount && claims[i + refs].memOffset == claims[i].memOffset; refs++)
+        {
+            if (claims[i + refs].capacity != claims[i].capacity)
+                break;
+        }
+        if (i + refs < claimCount && claims[i + refs].memOffset == claims[i].memOffset)
+            break;
+        if (claimSpace(claims[i].memOffset, claims[i].capacity) != 0)
+            break;
+        // Shared blocks go back in the dedup index, as do full ones while it is on
+        if (refs > 1 || (claims[i].full && (hdr->flags & VFS_INIT_DEDUP)))
+        {
+            if (dedupRestore(claims[i].memOffset, claims[i].capacity, refs) != 0)
+                break;
+        }
+        else
+            setBlockOwner(claims[i].memOffset, claims[i].owner);
+    }
+    free(claims);
+    if (i < claimCount)
+        return VFS_EINVAL;
+    
+    // Directory entries last, every parent exists by now
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        INODE *parent;
+        char name[MAX_NAME + 1];
+        if (node->inodeNo == ROOT_INODE)
+            continue;
+        parent = (node->parentNo < inodeTableSize) ? inodeTable[node->parentNo] : NULL;
+        if (parent == NULL || parent->dir == NULL)
+            return VFS_EINVAL;
+        strcpy(name, node->name);
+        linkInode(parent, node, name);
+        if (restoreLinks(node) != VFS_OK)
+            return VFS_EINVAL;
+    }
+    return VFS_OK;
+}
+
+int vfs_load(const char *path)
+{
+    IMAGEHEADER hdr;
+    char *pool, *meta;
+    int fd, err;
+    
+    if (mainPool != NULL || path == NULL)
+        return VFS_EINVAL;
+    if ((fd = open(path, O_RDWR)) < 0)
+        return VFS_ENOENT;
+    if (readAll(fd, &hdr, sizeof(hdr), 0) != VFS_OK ||
+        memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != IMAGE_VERSION || hdr.pageSize != IMAGE_PAGE || hdr.poolOffset % IMAGE_PAGE != 0 ||
+        hdr.poolSize <= 0 || hdr.arenaCount == 0 || hdr.metaLength < (long long)(hdr.arenaCount * sizeof(int)))
+    {
+        close(fd);
+        return VFS_EINVAL;
+    }
+    
+    // Map the pool privately: pages load on first touch and nothing is
+    // copied up front, vfs_sync writes changed pages back explicitly
+    pool = (char *)mmap(NULL, hdr.poolSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, hdr.poolOffset);
+    if (pool == MAP_FAILED)
+    {
+        close(fd);
+        return VFS_EIO;
+    }
+    if ((meta = (char *)malloc(hdr.metaLength)) == NULL)
+    {
+        munmap(pool, hdr.poolSize);
+        close(fd);
+        return VFS_ENOMEM;
+    }
+    if (readAll(fd, meta, hdr.metaLength, hdr.metaOffset) != VFS_OK)
+    {
+        free(meta);
+        munmap(pool, hdr.poolSize);
+        close(fd);
+        return VFS_EIO;
+    }
+    
+    metaPeak = metaBytes;
+    if ((err = mountMemoryPool(pool, hdr.poolSize, (const int *)meta, hdr.arenaCount)) != VFS_OK)
+    {
+        free(meta);
+        munmap(pool, hdr.poolSize);
+        close(fd);
+        return err;
+    }
+    mappedPool = pool;
+    mappedLength = hdr.poolSize;
+    imageFd = fd;
+    generation = hdr.generation;
+    dedupSetup((hdr.flags & VFS_INIT_DEDUP) != 0);
+    checksumSetup((hdr.flags & VFS_INIT_CHECKSUM) != 0);
+    resetStats();
+    S.totalBlock = hdr.totalBlock;
+    S.totalInode = hdr.totalInode;
+    
+    err = restoreMetadata(&hdr, meta);
+    free(meta);
+    if (err == VFS_OK)
+        err = allocDirtyMap();
+    if (err != VFS_OK)
+    {
+        vfs_shutdown();
+        return err;
+    }
+    VFS_LOG("image: loaded %s, %u inodes, generation %llu\n", path, hdr.inodeCount, generation);
+    return VFS_OK;
+}
@@ -0,0 +1,549 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfs_internal.h"
+
+// Write-ahead journal. Every change is logged from under the lock that
+// ordered it: namespace changes by path with the inode number they made or
+// removed, writes with their data at the offset they landed, truncations
+// with the new size. Records gather in a buffer and a flusher thread
+// writes and fdatasyncs them a group at a time, once the oldest has waited
+// commitMicros or commitBytes are waiting, so one flush serves every call
+// in the group.
+//
+// The header names the image generation the records apply on top of, 0
+// for an empty filesystem. A checkpoint writes the image and then starts
+// an empty journal on its new generation, so a crash in between leaves a
+// journal that is recognised as already applied.
+
+#define JOURNAL_MAGIC "VFSJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BUFFER_MAX (64 * 1024 * 1024)  // calls wait for the flusher past this
+#define JOURNAL_SUM_BASIS 2166136261u
+
+typedef struct JournalHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int recordSize;
+    unsigned long long generation;  // image the records apply on top of
+} JOURNALHEADER;
+
+typedef struct JournalRecord
+{
+    unsigned char op;           // JOURNAL_*
+    unsigned char pad;
+    unsigned short pathLen;     // path bytes after the record, "old\0new" for link
+    unsigned int inodeNo;
+    unsigned int perm;          // of a created file
+    int len;                    // data bytes after the path
+    long long offset;           // where a write landed, a truncation's size
+    unsigned int sum;           // over the record with sum 0, its path and data
+    unsigned int pad2;
+} JOURNALRECORD;
+
+int journalEnabled = 0;
+
+// Guards everything below
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journalWork = PTHREAD_COND_INITIALIZER;   // records waiting or a flush wanted
+static pthread_cond_t journalDone = PTHREAD_COND_INITIALIZER;   // a flush finished
+static struct vfs_journal_policy journalPolicy;
+static char *journalImage = NULL;       // copy of the policy's image path
+static int journalFd = -1;
+static long long fileEnd = 0;           // journal bytes on disk
+static int journalFailed = 0;           // a flush failed since the last restart
+static char *pending = NULL;            // records for the next flush
+static size_t pendingFill = 0;
+static size_t pendingCapacity = 0;
+static char *flushing = NULL;           // the group being written
+static size_t flushingCapacity = 0;
+static int flushBusy = 0;
+static long long groupStart = 0;        // when the oldest pending record came in
+// Journal positions in bytes logged since startup, they never go back
+static unsigned long long appendedLsn = 0;
+static unsigned long long durableLsn = 0;   // journalSettle peeks at it without the lock
+static unsigned long long forceLsn = 0; // flush without waiting up to here
+static pthread_t flusher;
+static int flusherRunning = 0;
+static int flusherStopping = 0;
+static int checkpointDue = 0;
+static unsigned long long journalRecords = 0;
+static unsigned long long journalCommits = 0;
+static unsigned long long journalCheckpoints = 0;
+static unsigned long long journalReplayed = 0;
+static unsigned long long journalReplayUs = 0;
+
+// End of the last record this thread logged
+static __thread unsigned long long threadLsn = 0;
+
+static unsigned int journalSum(unsigned int sum, const char *data, size_t len)
+{
+    while (len-- > 0)
+        sum = (sum ^ (unsigned char)*data++) * 16777619u;
+    return sum;
+}
+
+static int readAll(int fd, char *buf, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n <= 0)
+            return VFS_EIO;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return VFS_OK;
+}
+
+static int writeAll(int fd, const char *buf, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n <= 0)
+            return VFS_EIO;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return VFS_OK;
+}
+
+void journalRecord(int op, unsigned int inodeNo, unsigned int perm, long long offset,
+                   const char *path, const char *path2, const char *data, int len)
+{
+    JOURNALRECORD rec;
+    size_t first = (path != NULL) ? strlen(path) : 0;
+    size_t second = (path2 != NULL) ? strlen(path2) + 1 : 0;
+    size_t size, cap;
+    char *p;
+    
+    if (first > MAX_PATH)
+        first = MAX_PATH;
+    if (second > MAX_PATH + 1)
+        second = MAX_PATH + 1;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = (unsigned char)op;
+    rec.pathLen = (unsigned short)(first + second);
+    rec.inodeNo = inodeNo;
+    rec.perm = perm;
+    rec.len = (data != NULL && len > 0) ? len : 0;
+    rec.offset = offset;
+    size = sizeof(rec) + rec.pathLen + rec.len;
+    
+    pthread_mutex_lock(&journalLock);
+    // Past the cap callers wait for the flusher to take the group
+    while (journalFd >= 0 && pendingFill > 0 && pendingFill + size > JOURNAL_BUFFER_MAX)
+    {
+        forceLsn = appendedLsn;
+        pthread_cond_signal(&journalWork);
+        pthread_cond_wait(&journalDone, &journalLock);
+    }
+    if (journalFd < 0)
+    {
+        pthread_mutex_unlock(&journalLock);
+        return;
+    }
+    if (pendingFill + size > pendingCapacity)
+    {
+        for (cap = pendingCapacity ? pendingCapacity * 2 : 64 * 1024; cap < pendingFill + size; cap *= 2)
+            ;
+        if ((p = (char *)realloc(pending, cap)) == NULL)
+        {
+            // The change stays in memory only, vfs_commit reports it
+            journalFailed = 1;
+            pthread_mutex_unlock(&journalLock);
+            return;
+        }
+        pending = p;
+        pendingCapacity = cap;
+    }
+    
+    p = pending + pendingFill;
+    if (first > 0)
+        memcpy(p + sizeof(rec), path, first);
+    if (second > 0)
+    {
+        p[sizeof(rec) + first] = '\0';
+        memcpy(p + sizeof(rec) + first + 1, path2, second - 1);
+    }
+    if (rec.len > 0)
+        memcpy(p + sizeof(rec) + rec.pathLen, data, rec.len);
+    rec.sum = journalSum(journalSum(JOURNAL_SUM_BASIS, (const char *)&rec, sizeof(rec)),
+                         p + sizeof(rec), rec.pathLen + rec.len);
+    memcpy(p, &rec, sizeof(rec));
+    
+    if (pendingFill == 0)
+    {
+        groupStart = statStart();
+        pthread_cond_signal(&journalWork);
+    }
+    pendingFill += size;
+    appendedLsn += size;
+    threadLsn = appendedLsn;
+    journalRecords++;
+    if (journalPolicy.commitBytes > 0 && pendingFill >= journalPolicy.commitBytes)
+        pthread_cond_signal(&journalWork);
+    pthread_mutex_unlock(&journalLock);
+}
+
+// Write the pending group and make it durable, the caller holds journalLock
+static void commitGroup()
+{
+    unsigned long long upTo = appendedLsn;
+    size_t fill = pendingFill, cap = pendingCapacity;
+    char *group = pending;
+    int failed;
+    
+    // New records go to the other buffer meanwhile
+    pending = flushing;
+    pendingCapacity = flushingCapacity;
+    pendingFill = 0;
+    flushing = group;
+    flushingCapacity = cap;
+    flushBusy = 1;
+    pthread_mutex_unlock(&journalLock);
+    
+    failed = writeAll(journalFd, group, fill, fileEnd) != VFS_OK || fdatasync(journalFd) != 0;
+    
+    pthread_mutex_lock(&journalLock);
+    if (failed)
+        journalFailed = 1;
+    else
+        fileEnd += fill;
+    __atomic_store_n(&durableLsn, upTo, __ATOMIC_RELEASE);
+    journalCommits++;
+    flushBusy = 0;
+    if (journalPolicy.checkpointBytes > 0 && fileEnd >= (long long)journalPolicy.checkpointBytes)
+        checkpointDue = 1;
+    pthread_cond_broadcast(&journalDone);
+}
+
+static void *flushMain(void *arg)
+{
+    long long left;
+    struct timespec until;
+    
+    (void)arg;
+    pthread_mutex_lock(&journalLock);
+    for (;;)
+    {
+        while (pendingFill == 0 && !flusherStopping)
+            pthread_cond_wait(&journalWork, &journalLock);
+        if (pendingFill == 0)
+            break;
+        // Let the group grow until its oldest record has waited long enough
+        while (!flusherStopping && forceLsn <= durableLsn &&
+               (journalPolicy.commitBytes == 0 || pendingFill < journalPolicy.commitBytes))
+        {
+            left = groupStart + journalPolicy.commitMicros * 1000LL - statStart();
+            if (left <= 0)
+                break;
+            clock_gettime(CLOCK_REALTIME, &until);
+            left += until.tv_nsec;
+            until.tv_sec += left / 1000000000LL;
+            until.tv_nsec = left % 1000000000LL;
+            pthread_cond_timedwait(&journalWork, &journalLock, &until);
+        }
+        commitGroup();
+    }
+    pthread_mutex_unlock(&journalLock);
+    return NULL;
+}
+
+// Empty the journal and stamp it with the generation it starts from, the
+// caller holds journalLock with no flush running
+static int resetFile(unsigned long long generation)
+{
+    JOURNALHEADER hdr;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.recordSize = sizeof(JOURNALRECORD);
+    hdr.generation = generation;
+    pendingFill = 0;
+    forceLsn = appendedLsn;
+    __atomic_store_n(&durableLsn, appendedLsn, __ATOMIC_RELEASE);
+    checkpointDue = 0;
+    // Cut first: a crash in between leaves no journal rather than old
+    // records under the new generation
+    if (ftruncate(journalFd, 0) != 0 || writeAll(journalFd, (const char *)&hdr, sizeof(hdr), 0) != VFS_OK ||
+        fdatasync(journalFd) != 0)
+    {
+        journalFailed = 1;
+        return VFS_EIO;
+    }
+    fileEnd = sizeof(hdr);
+    journalFailed = 0;
+    return VFS_OK;
+}
+
+// The image now holds everything logged, start over on its generation.
+// The caller holds the namespace, so no change is half logged.
+int journalRestart(unsigned long long generation)
+{
+    int err;
+    
+    pthread_mutex_lock(&journalLock);
+    while (flushBusy)
+        pthread_cond_wait(&journalDone, &journalLock);
+    err = resetFile(generation);
+    journalCheckpoints++;
+    pthread_cond_broadcast(&journalDone);
+    pthread_mutex_unlock(&journalLock);
+    return err;
+}
+
+void journalSettle()
+{
+    unsigned long long lsn = threadLsn;
+    
+    if (journalPolicy.waitCommit && lsn > __atomic_load_n(&durableLsn, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&journalLock);
+        while (journalFd >= 0 && durableLsn < lsn)
+            pthread_cond_wait(&journalDone, &journalLock);
+        pthread_mutex_unlock(&journalLock);
+    }
+    if (__atomic_load_n(&checkpointDue, __ATOMIC_RELAXED) && __atomic_exchange_n(&checkpointDue, 0, __ATOMIC_ACQ_REL))
+        vfs_checkpoint();
+}
+
+int vfs_commit(void)
+{
+    int err;
+    
+    if (!journalEnabled)
+        return VFS_EINVAL;
+    pthread_mutex_lock(&journalLock);
+    forceLsn = appendedLsn;
+    pthread_cond_signal(&journalWork);
+    while (journalFd >= 0 && durableLsn < forceLsn)
+        pthread_cond_wait(&journalDone, &journalLock);
+    err = journalFailed ? VFS_EIO : VFS_OK;
+    pthread_mutex_unlock(&journalLock);
+    return err;
+}
+
+int vfs_checkpoint(void)
+{
+    int err;
+    
+    if (mainPool == NULL)
+        return VFS_EINVAL;
+    if ((err = vfs_sync()) == VFS_EINVAL && journalImage != NULL)
+        err = vfs_snapshot(journalImage);
+    return err;
+}
+
+// Apply one logged change. Data records for files that are gone, because
+// they were unlinked while still open, have nothing left to change.
+static int replayRecord(const JOURNALRECORD *rec, const char *names, const char *data)
+{
+    char path[MAX_PATH + 1], path2[MAX_PATH + 1];
+    int first = (int)strnlen(names, rec->pathLen), second = rec->pathLen - first - 1, ret;
+    
+    memcpy(path, names, first);
+    path[first] = '\0';
+    if (second > 0)
+    {
+        memcpy(path2, names + first + 1, second);
+        path2[second] = '\0';
+    }
+    switch (rec->op)
+    {
+    case JOURNAL_CREATE:
+        return replayCreate(path, rec->inodeNo, rec->perm, 0);
+    case JOURNAL_MKDIR:
+        return replayCreate(path, rec->inodeNo, VFS_PERM_RDWR, 1);
+    case JOURNAL_WRITE:
+        ret = replayWrite(rec->inodeNo, data, rec->len, (long)rec->offset);
+        return (ret == VFS_ENOENT || ret == rec->len) ? VFS_OK : (ret < 0) ? ret : VFS_ENOSPC;
+    case JOURNAL_TRUNCATE:
+        ret = replayTruncate(rec->inodeNo, (long)rec->offset);
+        return (ret == VFS_ENOENT) ? VFS_OK : ret;
+    case JOURNAL_UNLINK:
+        return vfs_unlink(path);
+    case JOURNAL_RMDIR:
+        return vfs_rmdir(path);
+    case JOURNAL_LINK:
+        return (second > 0) ? vfs_link(path, path2) : VFS_ECORRUPT;
+    }
+    return VFS_ECORRUPT;
+}
+
+// Replay the records in buf, returns how many bytes held whole ones. A
+// crash mid-flush leaves a torn or garbled tail, which is where they end.
+static size_t replayRecords(const char *buf, size_t size, int *err)
+{
+    JOURNALRECORD rec;
+    unsigned int sum;
+    size_t pos;
+    
+    for (pos = 0; size - pos >= sizeof(rec); pos += sizeof(rec) + rec.pathLen + rec.len)
+    {
+        memcpy(&rec, buf + pos, sizeof(rec));
+        if (rec.op >= JOURNAL_OP_COUNT || rec.len < 0 || rec.pathLen > 2 * MAX_PATH + 1 ||
+            size - pos - sizeof(rec) < (size_t)rec.pathLen + rec.len)
+            break;
+        sum = rec.sum;
+        rec.sum = 0;
+        if (journalSum(journalSum(JOURNAL_SUM_BASIS, (const char *)&rec, sizeof(rec)),
+                       buf + pos + sizeof(rec), rec.pathLen + rec.len) != sum)
+            break;
+        if (*err == VFS_OK)
+            *err = replayRecord(&rec, buf + pos + sizeof(rec), buf + pos + sizeof(rec) + rec.pathLen);
+        journalReplayed++;
+    }
+    return pos;
+}
+
+// Replay what the journal holds for the filesystem as it is now and leave
+// it ready to append to, or start it over when it belongs elsewhere
+static int openJournal(const char *path)
+{
+    JOURNALHEADER hdr;
+    struct stat info;
+    long long start = statStart();
+    size_t valid;
+    char *buf;
+    int err = VFS_OK;
+    
+    if ((journalFd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return VFS_EIO;
+    if (fstat(journalFd, &info) != 0)
+        return VFS_EIO;
+    if (info.st_size < (off_t)sizeof(hdr) || pread(journalFd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != JOURNAL_VERSION ||
+        hdr.recordSize != sizeof(JOURNALRECORD) || hdr.generation != imageGeneration())
+        return resetFile(imageGeneration());
+    
+    if ((buf = (char *)malloc(info.st_size - sizeof(hdr) + 1)) == NULL)
+        return VFS_ENOMEM;
+    if (readAll(journalFd, buf, info.st_size - sizeof(hdr), sizeof(hdr)) != VFS_OK)
+    {
+        free(buf);
+        return VFS_EIO;
+    }
+    journalReplayed = 0;
+    valid = replayRecords(buf, info.st_size - sizeof(hdr), &err);
+    free(buf);
+    journalReplayUs = (statStart() - start) / 1000;
+    if (err != VFS_OK)
+        return err;
+    // New records go after the last whole one
+    fileEnd = sizeof(hdr) + valid;
+    if (ftruncate(journalFd, fileEnd) != 0)
+        return VFS_EIO;
+    return VFS_OK;
+}
+
+static void startFlusher()
+{
+    pthread_mutex_lock(&journalLock);
+    flusherStopping = 0;
+    flusherRunning = (pthread_create(&flusher, NULL, flushMain, NULL) == 0);
+    pthread_mutex_unlock(&journalLock);
+}
+
+// Flush what is pending, then close the journal
+static void closeJournal()
+{
+    int running;
+    
+    __atomic_store_n(&journalEnabled, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&journalLock);
+    running = flusherRunning;
+    flusherStopping = 1;
+    flusherRunning = 0;
+    pthread_cond_signal(&journalWork);
+    pthread_mutex_unlock(&journalLock);
+    if (running)
+        pthread_join(flusher, NULL);
+    
+    pthread_mutex_lock(&journalLock);
+    if (journalFd >= 0)
+        close(journalFd);
+    journalFd = -1;
+    free(pending);
+    free(flushing);
+    pending = flushing = NULL;
+    pendingFill = pendingCapacity = flushingCapacity = 0;
+    forceLsn = appendedLsn;
+    __atomic_store_n(&durableLsn, appendedLsn, __ATOMIC_RELEASE);
+    fileEnd = 0;
+    journalFailed = checkpointDue = 0;
+    pthread_cond_broadcast(&journalDone);
+    pthread_mutex_unlock(&journalLock);
+    if (journalImage != NULL)
+        metaFree(journalImage, strlen(journalImage) + 1);
+    journalImage = NULL;
+}
+
+int vfs_set_journal(const struct vfs_journal_policy *policy)
+{
+    int err;
+    
+    if (mainPool == NULL || policy == NULL)
+        return VFS_EINVAL;
+    closeJournal();
+    if (policy->path == NULL)
+        return VFS_OK;
+    if (policy->image != NULL)
+    {
+        if ((journalImage = (char *)metaAlloc(strlen(policy->image) + 1)) == NULL)
+            return VFS_ENOMEM;
+        strcpy(journalImage, policy->image);
+    }
+    journalPolicy = *policy;
+    journalPolicy.path = NULL;
+    journalPolicy.image = NULL;
+    
+    // Nothing is logged while the old records replay
+    pthread_mutex_lock(&journalLock);
+    err = openJournal(policy->path);
+    pthread_mutex_unlock(&journalLock);
+    if (err != VFS_OK)
+    {
+        closeJournal();
+        return err;
+    }
+    startFlusher();
+    __atomic_store_n(&journalEnabled, 1, __ATOMIC_RELEASE);
+    return VFS_OK;
+}
+
+void journalUsage(struct vfs_stats *st)
+{
+    pthread_mutex_lock(&journalLock);
+    st->journalRecords = journalRecords;
+    st->journalCommits = journalCommits;
+    st->journalCheckpoints = journalCheckpoints;
+    st->journalFileBytes = (size_t)fileEnd;
+    st->journalReplayed = journalReplayed;
+    st->journalReplayUs = journalReplayUs;
+    pthread_mutex_unlock(&journalLock);
+}
+
+void journalResetStats()
+{
+    pthread_mutex_lock(&journalLock);
+    journalRecords = journalCommits = journalCheckpoints = 0;
+    pthread_mutex_unlock(&journalLock);
+}
+
+void journalTeardown()
+{
+    closeJournal();
+    memset(&journalPolicy, 0, sizeof(journalPolicy));
+    journalReplayed = journalReplayUs = 0;
+    journalResetStats();
+}
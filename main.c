@@ -1,624 +1,403 @@
 #include<stdio.h>
-#include<malloc.h>
 #include<string.h>
-#include<ctype.h>
 #include<stdlib.h>
 
+#include "vfs.h"
+
 #define POOL_SIZE (1024 * 1024)
+#define MAX_POOL_SIZE (64 * 1024 * 1024)
 #define MAX_CONTENT_SIZE 1024
 
-// Block tracking structure
-typedef struct MemoryBlock {
-    int offset;
-    int blockSize;
-    int available;
-    struct MemoryBlock *next;
-} MEMBLOCK;
-
-// Global memory storage
-char *mainPool = NULL;
-MEMBLOCK *blockList = NULL;
-
-// Inode structure
-typedef struct inode
-{
-    unsigned int inodeNo;
-    unsigned int userId;
-    unsigned int groupId;
-    unsigned int linkCount;
-    unsigned int referenceCount;
-    unsigned int fileSize;
-    char fileType[20];
-    char *dataPtr;
-    int memOffset;
-    unsigned fileAccessPermission;
-    struct inode *next;
-} INODE;
-
-// File Table Structure
-typedef struct FileTable
+// Read content typed by the user until ctrl+d
+int readContent(char buffer[])
 {
-    int cnt;
-    int fileOffset;
-    int fileMode;
-    INODE *inodeEntry;
-    struct FileTable *next;
-} FILETABLE;
-
-// UFDT Structure
-typedef struct UFDTable
-{
-    int fdIndex;
-    FILETABLE *fileTableEntry;
-    struct UFDTable *next;
-} UFDT;
+    int ch, idx = 0;
+    
+    while ((ch = getchar()) != EOF && idx < MAX_CONTENT_SIZE)
+    {
+        buffer[idx++] = ch;
+    }
+    clearerr(stdin);
+    return idx;
+}
 
-struct SuperBlock
+void reportError(int err)
 {
-    int totalBlock;
-    int usedBlock;
-    int totalInode;
-    int usedInode;
-} S;
-
-// Function prototypes
-void setupMemoryPool();
-int findContiguousSpace(int requiredSize);
-void releaseSpace(int position, int size);
-void defragmentMemory();
-int makeInode(INODE **inode_head, FILETABLE **ft_head, UFDT **ufdt_head, char fname[], unsigned int perm);
-void makeFile(char **dataPtr, int *memOffset, char *fname);
-void makeFT(FILETABLE ***ft_ptr, UFDT ***ufdt_ptr, INODE *inode);
-void makeUFDT(UFDT ****ufdt_ptr, FILETABLE *ft);
-void showfd(UFDT *head);
-
-// Setup memory storage
-void setupMemoryPool() {
-    mainPool = (char *)malloc(POOL_SIZE);
-    if (mainPool == NULL) {
-        printf("Failed to allocate memory pool!\n");
-        exit(1);
-    }
-    memset(mainPool, 0, POOL_SIZE);
-    
-    blockList = (MEMBLOCK *)malloc(sizeof(MEMBLOCK));
-    blockList->offset = 0;
-    blockList->blockSize = POOL_SIZE;
-    blockList->available = 1;
-    blockList->next = NULL;
-    
-    printf("\n Virtual disk of 1 MB initialized successfully\n");
+    printf("\n\t\t%s", vfs_strerror(err));
 }
 
-// Allocate space using first-fit
-int findContiguousSpace(int requiredSize) {
-    MEMBLOCK *curr = blockList;
+// Create a file and store its initial content
+int makeFile(char path[], unsigned int perm)
+{
+    char buffer[MAX_CONTENT_SIZE];
+    int fd, len, ret;
     
-    while (curr != NULL) {
-        if (curr->available && curr->blockSize >= requiredSize) {
-            int allocatedPos = curr->offset;
-            
-            if (curr->blockSize == requiredSize) {
-                curr->available = 0;
-            } else {
-                // Split block
-                MEMBLOCK *newBlock = (MEMBLOCK *)malloc(sizeof(MEMBLOCK));
-                newBlock->offset = curr->offset + requiredSize;
-                newBlock->blockSize = curr->blockSize - requiredSize;
-                newBlock->available = 1;
-                newBlock->next = curr->next;
-                
-                curr->blockSize = requiredSize;
-                curr->available = 0;
-                curr->next = newBlock;
-            }
-            
-            printf("\n Allocated %d bytes at offset %d\n", requiredSize, allocatedPos);
-            return allocatedPos;
-        }
-        curr = curr->next;
+    fd = vfs_open(path, VFS_WRITE | VFS_CREAT | VFS_EXCL, perm);
+    if (fd < 0)
+    {
+        reportError(fd);
+        return -1;
     }
     
-    printf("\n No contiguous space available for %d bytes\n", requiredSize);
-    return -1;
-}
-
-// Free space and merge blocks
-void releaseSpace(int position, int size) {
-    MEMBLOCK *curr = blockList;
-    MEMBLOCK *prev = NULL;
+    printf("\n\t\tEnter the content :\n");
+    printf("\n\t\tPlease enter ctrl+d to stop writing contents :-\n");
+    len = readContent(buffer);
+    ret = vfs_write(fd, buffer, len);
+    vfs_close(fd);
+    if (ret < 0)
+    {
+        reportError(ret);
+        vfs_unlink(path);
+        return -1;
+    }
     
-    while (curr != NULL) {
-        if (curr->offset == position && curr->blockSize == size) {
-            curr->available = 1;
-            
-            // Merge with next if available
-            if (curr->next != NULL && curr->next->available) {
-                MEMBLOCK *temp = curr->next;
-                curr->blockSize += temp->blockSize;
-                curr->next = temp->next;
-                free(temp);
-            }
-            
-            // Merge with previous if available
-            if (prev != NULL && prev->available) {
-                prev->blockSize += curr->blockSize;
-                prev->next = curr->next;
-                free(curr);
-            }
-            
-            printf("\n Deallocated %d bytes at offset %d\n", size, position);
-            return;
-        }
-        prev = curr;
-        curr = curr->next;
+    // Reopen with the access the permission grants
+    fd = vfs_open(path, perm == VFS_PERM_READ ? VFS_READ : perm == VFS_PERM_WRITE ? VFS_WRITE : VFS_RDWR, 0);
+    if (fd < 0)
+    {
+        reportError(fd);
+        return -1;
     }
+    printf("\n FILE IS CREATED, file descriptor: %d\n", fd);
+    return fd;
 }
 
-// Show memory layout
-void showMemoryMap() {
-    MEMBLOCK *curr = blockList;
-    int num = 0;
-    
-    printf("\n\n\t=== Memory Map ===");
-    printf("\n\tBlock\tOffset\tSize\tStatus");
-    printf("\n\t-------------------------------------");
+// Display file descriptors
+void showfd()
+{
+    struct vfs_stat st;
+    int fd;
     
-    while (curr != NULL) {
-        printf("\n\t%d\t%d\t%d\t%s", 
-               num++, 
-               curr->offset, 
-               curr->blockSize, 
-               curr->available ? "FREE" : "USED");
-        curr = curr->next;
+    printf("\n\t\tFile FD\tOffset\tSize\tExtents");
+    for (fd = vfs_next_fd(-1); fd != -1; fd = vfs_next_fd(fd))
+    {
+        vfs_fstat(fd, &st);
+        printf("\n\t\t%d\t%ld\t%u\t%d", fd, vfs_lseek(fd, 0, VFS_SEEK_CUR), st.size, st.extentCount);
     }
-    printf("\n\t-------------------------------------\n");
 }
 
-
-// Create file content in pool
-void makeFile(char **dataPtr, int *memOffset, char *fname)
+// Read operation, continues from the descriptor's offset. The bytes are
+// printed straight from views of the pool, one extent at a time.
+int performRead(int fd)
 {
-    char buffer[MAX_CONTENT_SIZE];
-    char ch = '\0';
-    int idx = 0, contentLen;
+    struct vfs_view view;
+    long offset = vfs_lseek(fd, 0, VFS_SEEK_CUR);
+    int bytesToRead = 0, done = 0, ret = 0;
     
-    printf("\n\t\tEnter the content :\n");
-    printf("\n\t\tPlease enter ctrl+d to stop writing contents :-\n");
+    printf("\nHow many bytes of data do you want to see?\n");
+    scanf("%d", &bytesToRead);
     
-    while ((ch = getchar()) != EOF && idx < MAX_CONTENT_SIZE - 1)
+    if (bytesToRead < 0)
     {
-        buffer[idx++] = ch;
+        printf("\nFile size should be positive.");
+        return -1;
     }
-    buffer[idx] = '\0';
-    clearerr(stdin);
-    
-    contentLen = strlen(buffer) + 1;
-    
-    // Find space in pool
-    *memOffset = findContiguousSpace(contentLen);
-    
-    if (*memOffset == -1) {
-        printf("\n Failed to allocate space in memory pool\n");
-        *dataPtr = NULL;
-        return;
+    if (offset < 0)
+    {
+        reportError((int)offset);
+        return -1;
     }
     
-    *dataPtr = mainPool + (*memOffset);
-    strcpy(*dataPtr, buffer);
-    
-    printf("\n FILE IS CREATED at offset %d\n", *memOffset);
-}
-
-// Initialize UFDT
-void makeUFDT(UFDT ****ufdt_ptr, FILETABLE *ft)
-{
-    static int descriptor = 3;
-    UFDT *node = NULL, *temp = NULL;
-    
-    node = (UFDT *)malloc(sizeof(UFDT));
-    node->fdIndex = descriptor++;
-    node->fileTableEntry = ft;
-    node->next = NULL;
-    
-    if (***ufdt_ptr == NULL)
+    printf("\n\t\tFile content:\n\t\t\t");
+    while (done < bytesToRead)
     {
-        ***ufdt_ptr = node;
-        printf("\n USER FILE DESCRIPTOR IS INITIALISED...\n");
+        if ((ret = vfs_map(fd, offset + done, bytesToRead - done, &view)) <= 0)
+            break;
+        fwrite(view.data, 1, view.len, stdout);
+        vfs_unmap(&view);
+        done += ret;
     }
-    else
+    if (ret < 0 && done == 0)
     {
-        for (temp = (***ufdt_ptr); temp->next != NULL; temp = temp->next);
-        temp->next = node;
-        printf("\n USER FILE DESCRIPTOR IS INITIALISED...\n");
+        reportError(ret);
+        return -1;
     }
+    vfs_lseek(fd, offset + done, VFS_SEEK_SET);
+    return done;
 }
 
-// Initialize file table
-void makeFT(FILETABLE ***ft_ptr, UFDT ***ufdt_ptr, INODE *inode)
+// Write operation
+int performWrite(int fd)
 {
-    FILETABLE *node = NULL, *temp = NULL;
+    char buffer[MAX_CONTENT_SIZE];
+    int option, len, ret;
     
-    printf("\n FILE TABLE IS CREATING....\n");
-    node = (FILETABLE *)malloc(sizeof(FILETABLE));
-    node->cnt = 1;
-    node->fileOffset = 0;
-    node->fileMode = 6;
-    node->inodeEntry = inode;
-    node->next = NULL;
+    printf("\n\t\tDo you want to\n\t\t1.Overwrite the file\n\t\t2.Append to the file\n");
+    scanf("%d", &option);
     
-    if (**ft_ptr == NULL)
-        **ft_ptr = node;
-    else
+    if ((option > 2) || (option < 1))
     {
-        for (temp = (**ft_ptr); temp->next != NULL; temp = temp->next);
-        temp->next = node;
+        printf("\n\t\tWrong choice");
+        return -1;
     }
     
-    printf("\n FILE TABLE IS CREATED SUCCESSFULLY...\n");
-    makeUFDT(&ufdt_ptr, node);
-}
-
-// Create inode entry
-int makeInode(INODE **inode_head, FILETABLE **ft_head, UFDT **ufdt_head, char fname[], unsigned int perm)
-{
-    INODE *node = NULL, *temp = NULL;
-    static int inodeCounter = 0;
+    printf("\n\t\tEnter Contents you want to write to the file:");
+    printf("\n\t\tEnter ctrl+d to stop writing:-\n");
+    len = readContent(buffer);
     
-    if ((S.usedInode < S.totalInode) && (S.usedBlock < S.totalBlock))
+    if (option == 1)
     {
-        printf("\n INODE IS CREATING in IIT.......\n");
-        node = (INODE *)malloc(sizeof(INODE));
-        node->inodeNo = ++inodeCounter;
-        node->userId = 10;
-        node->groupId = 10;
-        node->linkCount = 1;
-        node->referenceCount = 1;
-        node->fileSize = 0;
-        strcpy(node->fileType, "regular");
-        node->fileAccessPermission = perm;
-        node->dataPtr = NULL;
-        node->memOffset = -1;
-        
-        printf("\n INODE is CREATED SUCCESSFULLY in IIT.\n");
-        
-        makeFile(&(node->dataPtr), &(node->memOffset), fname);
-        
-        if (node->memOffset == -1) {
-            printf("\n Failed to allocate space for file\n");
-            free(node);
-            return -1;
-        }
-        
-        S.usedBlock++;
-        S.usedInode++;
-        
-        node->fileSize = strlen(node->dataPtr);
-        node->next = NULL;
-        
-        if (*inode_head == NULL)
-            (*inode_head) = node;
-        else
+        if ((ret = vfs_ftruncate(fd, 0)) == VFS_OK)
         {
-            for (temp = *inode_head; temp->next != NULL; temp = temp->next);
-            temp->next = node;
+            vfs_lseek(fd, 0, VFS_SEEK_SET);
+            ret = vfs_write(fd, buffer, len);
         }
-        
-        makeFT(&ft_head, &ufdt_head, node);
-        return 0;
     }
     else
+        ret = vfs_append(fd, buffer, len);
+    if (ret < 0)
     {
-        printf("\nFile System has no enough memory");
+        reportError(ret);
         return -1;
     }
+    return ret;
 }
 
-// Display file descriptors
-void showfd(UFDT *head)
+// List files
+void showFiles()
 {
-    UFDT *uptr = NULL;
-    INODE *iptr = NULL;
-    FILETABLE *fptr = NULL;
+    struct vfs_stat st;
+    int fd;
     
-    printf("\n\t\tFile FD\tOffset\tSize");
-    for (uptr = head; uptr != NULL; uptr = uptr->next)
+    printf("\n\t\tFile FD\tInode\tName");
+    for (fd = vfs_next_fd(-1); fd != -1; fd = vfs_next_fd(fd))
     {
-        fptr = (FILETABLE *)(uptr->fileTableEntry);
-        iptr = (INODE *)(fptr->inodeEntry);
-        printf("\n\t\t%d\t%d\t%d", uptr->fdIndex, iptr->memOffset, iptr->fileSize);
+        vfs_fstat(fd, &st);
+        printf("\n\t\t%d\t%u\t%s", fd, st.inodeNo, st.name);
     }
 }
 
-// Read operation
-int performRead(int fd, UFDT *ufdt_head)
+// Remove file, open descriptors keep it alive until they are closed
+void removeFile(char path[])
 {
-    INODE *iptr = NULL;
-    FILETABLE *fptr = NULL;
-    char buffer[1024] = {'\0'};
-    int found = 0, bytesToRead = 0;
-    UFDT *uptr = ufdt_head;
+    int option, ret;
     
-    for (; uptr != NULL; uptr = uptr->next)
-    {
-        fptr = (FILETABLE *)(uptr->fileTableEntry);
-        iptr = (INODE *)(fptr->inodeEntry);
-        if (uptr->fdIndex == fd)
-        {
-            found = 1;
-            break;
-        }
-    }
+    printf("\n\tDo you want to delete %s?\n\tPress 1 for yes / 0 for no:\n", path);
+    scanf("%d", &option);
     
-    if (found == 0)
+    if (option == 1)
     {
-        printf("\n\t\tWrong file descriptor");
-        return -1;
+        ret = vfs_unlink(path);
+        if (ret < 0)
+            reportError(ret);
+        else
+            printf("\n\t\tFile has been deleted successfully.");
     }
+}
+
+// Show inode details for a path
+void statPath(char path[])
+{
+    struct vfs_stat st;
+    int ret = vfs_stat(path, &st);
     
-    if ((iptr->fileAccessPermission == 744) || (iptr->fileAccessPermission == 766))
+    if (ret < 0)
     {
-        printf("\nHow many bytes of data do you want to see?\n");
-        scanf("%d", &bytesToRead);
-        
-        if (bytesToRead < 0)
-        {
-            printf("\nFile size should be positive.");
-            return -1;
-        }
-        
-        if (iptr->fileSize < bytesToRead)
-        {
-            strncpy(buffer, iptr->dataPtr, iptr->fileSize);
-            buffer[iptr->fileSize] = '\0';
-            printf("\n\t\tFile content:\n\t\t\t%s", buffer);
-            return iptr->fileSize;
-        }
-        
-        printf("\n\t\tFile content:");
-        strncpy(buffer, iptr->dataPtr, bytesToRead);
-        buffer[bytesToRead] = '\0';
-        printf("\n\t\t\t%s", buffer);
-        return bytesToRead;
+        reportError(ret);
+        return;
     }
+    printf("\n\t\tInode:\t\t%u", st.inodeNo);
+    printf("\n\t\tType:\t\t%s", st.isDirectory ? "directory" : "regular");
+    printf("\n\t\tSize:\t\t%u", st.size);
+    printf("\n\t\tLinks:\t\t%u", st.linkCount);
+    printf("\n\t\tOpen:\t\t%u", st.openCount);
+    printf("\n\t\tPermission:\t%u", st.permission);
+    if (!st.isDirectory)
+        printf("\n\t\tExtents:\t%d", st.extentCount);
+    if (st.packedSize)
+        printf("\n\t\tPacked:\t\t%u bytes", st.packedSize);
+    if (st.spilled)
+        printf("\n\t\tSpilled:\tin the backing file");
+    if (st.corrupt)
+        printf("\n\t\tCorrupt:\tfailed its checksum");
+}
+
+void printEntry(const char *name, const struct vfs_stat *st, void *arg)
+{
+    (void)arg;
+    printf("\n\t\t%u\t%u\t%s%s", st->inodeNo, st->size, name, st->isDirectory ? "/" : "");
+}
+
+void printMatch(unsigned int inodeNo, const char *name, long offset, void *arg)
+{
+    (void)arg;
+    printf("\n\t\t%u\t%ld\t%s", inodeNo, offset, name);
+}
+
+// Every place a word turns up, across all files at once
+void findPattern()
+{
+    char pattern[255];
+    int ret;
+    
+    printf("\n\t\tEnter text to find: ");
+    scanf("%254s", pattern);
+    printf("\n\t\tInode\tOffset\tName");
+    ret = vfs_search(pattern, strlen(pattern), printMatch, NULL);
+    if (ret < 0)
+        reportError(ret);
     else
-    {
-        printf("\n\t\tYou do not have access to read this file");
-        return -1;
-    }
+        printf("\n\t\t%d matches (%s scan)", ret, vfs_search_kernel());
 }
 
-// Write operation
-int performWrite(int fd, UFDT *ufdt_head)
+// Move a descriptor's offset for the next read or write
+void seekFile(int fd)
+{
+    long offset, ret;
+    int whence;
+    
+    printf("\n\t\tOffset: ");
+    scanf("%ld", &offset);
+    printf("\n\t\tFrom 0.start  1.current  2.end: ");
+    scanf("%d", &whence);
+    
+    ret = vfs_lseek(fd, offset, whence);
+    if (ret < 0)
+        reportError((int)ret);
+    else
+        printf("\n\t\tOffset is now %ld", ret);
+}
+
+// Summary of the engine counters followed by the JSON dump
+void showStats()
 {
-    INODE *iptr = NULL;
-    FILETABLE *fptr = NULL;
-    int found = 0, option, idx = 0, newContentSize;
-    char buffer[1024], ch = '\0';
-    int oldPos, oldLen;
-    UFDT *uptr = ufdt_head;
+    struct vfs_stats st;
+    int op;
     
-    for (; uptr != NULL; uptr = uptr->next)
+    if (vfs_get_stats(&st) < 0)
+        return;
+    printf("\n\t\tPool:\t\t%zu used / %zu free of %zu bytes", st.usedBytes, st.freeBytes, st.poolBytes);
+    printf("\n\t\tArenas:\t\t%u, growing up to %zu bytes", st.arenas, st.poolLimit);
+    printf("\n\t\tAllocator:\t%s, %zu bytes of slack", vfs_alloc_name(st.allocPolicy), st.slackBytes);
+    printf("\n\t\tLargest free:\t%zu bytes (fragmentation %.2f)", st.largestFree, st.fragmentation);
+    printf("\n\t\tBlocks:\t\t%u used, %u free", st.usedBlocks, st.freeBlocks);
+    printf("\n\t\tAlloc failures:\t%llu", st.allocFailures);
+    printf("\n\t\tCompacted:\t%llu bytes", st.compactedBytes);
+    printf("\n\t\tShared:\t\t%u blocks, %llu references, %zu bytes saved", st.dedupBlocks, st.dedupRefs, st.dedupSaved);
+    printf("\n\t\tPacked:\t\t%u files, %zu bytes in %zu, %zu cached (%llu hits, %llu misses)",
+           st.packedFiles, st.packedRaw, st.packedBytes, st.packCacheBytes, st.packCacheHits, st.packCacheMisses);
+    printf("\n\t\tInline:\t\t%u files, %zu bytes", st.inlineFiles, st.inlineBytes);
+    printf("\n\t\tViews:\t\t%u blocks pinned, %u of them freed", st.pinnedBlocks, st.parkedBlocks);
+    printf("\n\t\tSpilled:\t%u files, %zu bytes in a %zu byte file (%llu evictions, %llu faults, %llu disk reads)",
+           st.spilledFiles, st.spilledBytes, st.spillFileBytes, st.spillEvictions, st.spillFaults, st.spillDiskReads);
+    printf("\n\t\tJournal:\t%llu records in %llu commits, %zu bytes, %llu checkpoints, %llu replayed in %llu us",
+           st.journalRecords, st.journalCommits, st.journalFileBytes, st.journalCheckpoints,
+           st.journalReplayed, st.journalReplayUs);
+    printf("\n\t\tChecksums:\t%u corrupt files, %llu failed checks, %llu scrub passes over %llu bytes",
+           st.corruptInodes, st.checksumErrors, st.scrubPasses, st.scrubBytes);
+    printf("\n\t\tInodes:\t\t%u / %u, %u open", st.inodesUsed, st.inodesTotal, st.openFiles);
+    printf("\n\t\tSlab\t\tIn use\tCapacity\tBytes");
+    for (op = 0; op < VFS_SLAB_COUNT; op++)
     {
-        fptr = (FILETABLE *)(uptr->fileTableEntry);
-        iptr = (INODE *)(fptr->inodeEntry);
-        if (uptr->fdIndex == fd)
-        {
-            found = 1;
-            break;
-        }
+        const struct vfs_slab_stats *s = &st.slabs[op];
+        
+        printf("\n\t\t%-9s\t%u\t%u\t\t%zu", vfs_slab_name(op), s->inUse, s->capacity, s->bytes);
     }
-    
-    if (found == 0)
+    printf("\n\t\tOperation\tCount\tErrors\tMean ns");
+    for (op = 0; op < VFS_OP_COUNT; op++)
     {
-        printf("\n\t\t\tWrong file descriptor");
-        return -1;
+        const struct vfs_op_stats *s = &st.ops[op];
+        
+        if (s->count)
+            printf("\n\t\t%s\t\t%llu\t%llu\t%llu", vfs_op_name(op), s->count, s->errors, s->totalNs / s->count);
     }
+    printf("\n\n");
+    vfs_dump_stats_json(stdout);
+}
+
+// Save to the image, only what changed when it is already attached
+void syncImage(const char *image)
+{
+    char path[255];
+    int ret = vfs_sync();
     
-    if ((iptr->fileAccessPermission == 722) || (iptr->fileAccessPermission == 766))
+    if (ret == VFS_EINVAL)
     {
-        printf("\n\t\tDo you want to\n\t\t1.Overwrite the file\n\t\t2.Append to the file\n");
-        scanf("%d", &option);
-        
-        if ((option > 2) || (option < 1))
+        if (image == NULL)
         {
-            printf("\n\t\tWrong choice");
-            return -1;
-        }
-        
-        printf("\n\t\tEnter Contents you want to write to the file:");
-        printf("\n\t\tEnter ctrl+d to stop writing:-\n");
-        
-        while ((ch = getchar()) != EOF && idx < 1023)
-        {
-            buffer[idx++] = ch;
-        }
-        buffer[idx] = '\0';
-        clearerr(stdin);
-        
-        oldPos = iptr->memOffset;
-        oldLen = iptr->fileSize;
-        
-        switch (option)
-        {
-        case 1: // Overwrite
-            newContentSize = strlen(buffer) + 1;
-            
-            releaseSpace(oldPos, oldLen + 1);
-            
-            iptr->memOffset = findContiguousSpace(newContentSize);
-            if (iptr->memOffset == -1)
-            {
-                printf("\n Failed to allocate space\n");
-                return -1;
-            }
-            
-            iptr->dataPtr = mainPool + iptr->memOffset;
-            strcpy(iptr->dataPtr, buffer);
-            iptr->fileSize = strlen(buffer);
-            return iptr->fileSize;
-            
-        case 2: // Append
-            newContentSize = oldLen + strlen(buffer) + 1;
-            
-            if (newContentSize > 1024)
-            {
-                printf("\n File size exceeds maximum limit\n");
-                return -1;
-            }
-            
-            releaseSpace(oldPos, oldLen + 1);
-            
-            iptr->memOffset = findContiguousSpace(newContentSize);
-            if (iptr->memOffset == -1)
-            {
-                printf("\n Failed to allocate space\n");
-                return -1;
-            }
-            
-            // Copy old + new data
-            char *prevData = (char *)malloc(oldLen + 1);
-            strncpy(prevData, mainPool + oldPos, oldLen);
-            prevData[oldLen] = '\0';
-            
-            iptr->dataPtr = mainPool + iptr->memOffset;
-            strcpy(iptr->dataPtr, prevData);
-            strcat(iptr->dataPtr, buffer);
-            iptr->fileSize = strlen(iptr->dataPtr);
-            
-            free(prevData);
-            return strlen(buffer);
+            printf("\n\t\tEnter image path: ");
+            scanf("%254s", path);
+            image = path;
         }
+        ret = vfs_snapshot(image);
     }
+    if (ret < 0)
+        reportError(ret);
     else
-    {
-        printf("\n\t\tAccess Denied");
-        return -1;
-    }
+        printf("\n\t\tImage is up to date.");
 }
 
-// List files
-void showFiles(UFDT *ufdt_head)
+// Start recording operations to a trace file, or stop the one running
+void toggleTrace(int *tracing)
 {
-    INODE *iptr = NULL;
-    FILETABLE *fptr = NULL;
-    UFDT *uptr;
+    char path[255];
+    int ret;
     
-    printf("\n\t\tFile FD");
-    for (uptr = ufdt_head; uptr != NULL; uptr = uptr->next)
+    if (*tracing)
+    {
+        ret = vfs_trace_stop();
+        *tracing = 0;
+        if (ret < 0)
+            reportError(ret);
+        else
+            printf("\n\t\tTrace saved, replay it with vfs_bench -r.");
+        return;
+    }
+    printf("\n\t\tEnter trace path: ");
+    scanf("%254s", path);
+    if ((ret = vfs_trace_start(path)) < 0)
+        reportError(ret);
+    else
     {
-        fptr = (FILETABLE *)(uptr->fileTableEntry);
-        iptr = (INODE *)(fptr->inodeEntry);
-        printf("\n\t\t%d", uptr->fdIndex);
+        *tracing = 1;
+        printf("\n\t\tRecording operations until the next trace command.");
     }
 }
 
-// Remove file
-void removeFile(INODE **inode_head, FILETABLE **ft_head, UFDT **ufdt_head, int fd)
+// Main function, an optional argument names the image to load and save,
+// changes since its last sync are journaled next to it in <image>.journal;
+// a second argument names the backing file cold files spill to once the
+// pool is full
+int main(int argc, char *argv[])
 {
-    UFDT *uptr = NULL, *uprev = NULL;
-    INODE *iptr = NULL, *iprev = NULL, *inode_del = NULL;
-    FILETABLE *fptr = NULL, *fprev = NULL, *ft_del = NULL;
-    UFDT *ufdt_del = NULL;
-    int option, found = 0;
-    int position, length;
-    
-    // Locate entry
-    for (uptr = *ufdt_head; uptr != NULL; uprev = uptr, uptr = uptr->next)
+    char filename[255] = {'\0'}, target[255], confirm;
+    int choice, permChoice, descriptor, ret, tracing = 0;
+    unsigned int permission;
+    const char *image = (argc > 1) ? argv[1] : NULL;
+    struct vfs_spill_policy spill = { (argc > 2) ? argv[2] : NULL, 4096, 4 };
+    struct vfs_config config = { POOL_SIZE, MAX_POOL_SIZE, 0, VFS_INIT_DEDUP | VFS_INIT_CHECKSUM, VFS_ALLOC_SEGREGATED };
+    struct vfs_compress_policy policy = { VFS_COMPRESS_FAST, 2, 1024, 256 * 1024 };
+    struct vfs_journal_policy journal = { NULL, image, 2000, 64 * 1024, 1024 * 1024, 0 };
+    struct vfs_scrub_policy scrub = { 1, 0 };
+    char journalPath[270];
+    
+    if (image != NULL && (ret = vfs_load(image)) != VFS_ENOENT)
     {
-        if (uptr->fdIndex == fd)
+        if (ret < 0)
         {
-            found = 1;
-            ufdt_del = uptr;
-            ft_del = (FILETABLE *)(uptr->fileTableEntry);
-            inode_del = (INODE *)(ft_del->inodeEntry);
-            position = inode_del->memOffset;
-            length = inode_del->fileSize;
-            break;
+            printf("Failed to load %s: %s\n", image, vfs_strerror(ret));
+            exit(1);
         }
+        printf("\n Image %s loaded successfully\n", image);
     }
-    
-    if (found == 0)
+    else if (vfs_init_config(&config) != VFS_OK)
     {
-        printf("\n\t\tInvalid File descriptor !!");
-        return;
+        printf("Failed to allocate memory pool!\n");
+        exit(1);
     }
-    
-    printf("\n\tDo you want to delete the file with fd %d?\n\tPress 1 for yes / 0 for no:\n", fd);
-    scanf("%d", &option);
-    
-    if (option == 1)
+    else
+        printf("\n Virtual disk of 1 MB (growing up to 64 MB) initialized successfully\n");
+    vfs_set_compression(&policy);
+    vfs_set_scrub(&scrub);
+    if (spill.path != NULL && (ret = vfs_set_spill(&spill)) < 0)
+        printf("Cannot spill to %s: %s\n", spill.path, vfs_strerror(ret));
+    if (image != NULL)
     {
-        releaseSpace(position, length + 1);
-        
-        // Remove inode
-        iprev = NULL;
-        for (iptr = *inode_head; iptr != NULL; iprev = iptr, iptr = iptr->next)
-        {
-            if (iptr == inode_del)
-            {
-                if (iptr == *inode_head)
-                    *inode_head = iptr->next;
-                else
-                    iprev->next = iptr->next;
-                free(iptr);
-                break;
-            }
-        }
-        
-        // Remove file table entry
-        fprev = NULL;
-        for (fptr = *ft_head; fptr != NULL; fprev = fptr, fptr = fptr->next)
-        {
-            if (fptr == ft_del)
-            {
-                if (fptr == *ft_head)
-                    *ft_head = fptr->next;
-                else
-                    fprev->next = fptr->next;
-                free(fptr);
-                break;
-            }
-        }
-        
-        // Remove UFDT entry
-        uprev = NULL;
-        for (uptr = *ufdt_head; uptr != NULL; uprev = uptr, uptr = uptr->next)
-        {
-            if (uptr == ufdt_del)
-            {
-                if (uptr == *ufdt_head)
-                    *ufdt_head = uptr->next;
-                else
-                    uprev->next = uptr->next;
-                free(uptr);
-                break;
-            }
-        }
-        
-        S.usedInode--;
-        S.usedBlock--;
-        
-        printf("\n\t\tFile has been deleted successfully.");
+        snprintf(journalPath, sizeof(journalPath), "%s.journal", image);
+        journal.path = journalPath;
+        if ((ret = vfs_set_journal(&journal)) < 0)
+            printf("Cannot journal to %s: %s\n", journalPath, vfs_strerror(ret));
     }
-}
-
-// Main function
-int main()
-{
-    char filename[255] = {'\0'}, command[10], confirm;
-    int choice, permChoice, descriptor;
-    unsigned int permission;
-    INODE *inode_list = NULL;
-    FILETABLE *ft_list = NULL;
-    UFDT *ufdt_list = NULL;
-    
-    setupMemoryPool();
-    
-    S.totalBlock = 1024;
-    S.usedBlock = 0;
-    S.totalInode = 1024;
-    S.usedInode = 0;
     
     printf("\t///////////////////////////////////\n");
     printf("\t//      Virtual File System      //\n");
@@ -633,7 +412,22 @@ int main()
         printf("\t4. list    - List files with File Descriptor\n");
         printf("\t5. delete  - Delete existing file\n");
         printf("\t6. memmap  - Display memory allocation map\n");
-        printf("\t7. quit    - Exit FileSystem\n");
+        printf("\t7. defrag  - Compact the memory pool\n");
+        printf("\t8. mkdir   - Create a directory\n");
+        printf("\t9. rmdir   - Remove an empty directory\n");
+        printf("\t10. open   - Open existing file by path\n");
+        printf("\t11. close  - Close a file descriptor\n");
+        printf("\t12. stat   - Show file details by path\n");
+        printf("\t13. ls     - List directory contents\n");
+        printf("\t14. stats  - Show engine statistics\n");
+        printf("\t15. seek   - Move a file descriptor's offset\n");
+        printf("\t16. sync   - Save changes to the image file\n");
+        printf("\t17. link   - Give a file another name\n");
+        printf("\t18. pack   - Compress files not used lately\n");
+        printf("\t19. trace  - %s\n", tracing ? "Stop recording the trace" : "Record operations to a trace file");
+        printf("\t20. search - Find text in every file\n");
+        printf("\t21. scrub  - Check every file against its checksum\n");
+        printf("\t22. quit   - Exit FileSystem\n");
         
         printf("\n\tEnter operation code: ");
         scanf("%d", &choice);
@@ -651,82 +445,185 @@ int main()
             switch (permChoice)
             {
             case 1:
-                permission = 744;
+                permission = VFS_PERM_READ;
                 break;
             case 2:
-                permission = 722;
+                permission = VFS_PERM_WRITE;
                 break;
             case 3:
-                permission = 766;
+                permission = VFS_PERM_RDWR;
                 break;
             default:
                 printf("\n\t\tInvalid permission code");
                 continue;
             }
             
-            makeInode(&inode_list, &ft_list, &ufdt_list, filename, permission);
+            makeFile(filename, permission);
             break;
-            
+        
         case 2: // Read file
-            if (ufdt_list == NULL)
+            if (vfs_next_fd(-1) == -1)
             {
                 printf("\n No files in the system\n");
                 break;
             }
-            showfd(ufdt_list);
+            showfd();
             printf("\n\tEnter file descriptor: ");
             scanf("%d", &descriptor);
-            performRead(descriptor, ufdt_list);
+            performRead(descriptor);
             break;
-            
+        
         case 3: // Write to file
-            if (ufdt_list == NULL)
+            if (vfs_next_fd(-1) == -1)
             {
                 printf("\n No files in the system\n");
                 break;
             }
-            showfd(ufdt_list);
+            showfd();
             printf("\n\tEnter file descriptor: ");
             scanf("%d", &descriptor);
-            performWrite(descriptor, ufdt_list);
+            performWrite(descriptor);
             break;
-            
+        
         case 4: // List files
-            if (ufdt_list == NULL)
+            if (vfs_next_fd(-1) == -1)
             {
                 printf("\n No files in the system\n");
                 break;
             }
-            showFiles(ufdt_list);
+            showFiles();
             break;
-            
+        
         case 5: // Delete file
-            if (ufdt_list == NULL)
+            printf("\n\t\tEnter file path: ");
+            scanf("%s", filename);
+            removeFile(filename);
+            break;
+        
+        case 6: // Memory map
+            vfs_dump_memory_map(stdout);
+            break;
+        
+        case 7: // Compact pool
+            printf("\n Moved %d bytes, fragmentation now %.2f\n",
+                   vfs_defragment(POOL_SIZE), vfs_fragmentation());
+            break;
+        
+        case 8: // Make directory
+            printf("\n\t\tEnter directory path: ");
+            scanf("%s", filename);
+            if ((ret = vfs_mkdir(filename)) < 0)
+                reportError(ret);
+            break;
+        
+        case 9: // Remove directory
+            printf("\n\t\tEnter directory path: ");
+            scanf("%s", filename);
+            if ((ret = vfs_rmdir(filename)) < 0)
+                reportError(ret);
+            break;
+        
+        case 10: // Open by path
+            printf("\n\t\tEnter file path: ");
+            scanf("%s", filename);
+            printf("\n\t\t1.read only   2.write only  3.read and write: ");
+            scanf("%d", &permChoice);
+            if (permChoice < 1 || permChoice > 3)
+            {
+                printf("\n\t\tInvalid choice");
+                break;
+            }
+            descriptor = vfs_open(filename, permChoice == 1 ? VFS_READ : permChoice == 2 ? VFS_WRITE : VFS_RDWR, 0);
+            if (descriptor < 0)
+                reportError(descriptor);
+            else
+                printf("\n\t\tFile descriptor: %d", descriptor);
+            break;
+        
+        case 11: // Close descriptor
+            showfd();
+            printf("\n\tEnter file descriptor: ");
+            scanf("%d", &descriptor);
+            if ((ret = vfs_close(descriptor)) < 0)
+                reportError(ret);
+            break;
+        
+        case 12: // Stat
+            printf("\n\t\tEnter path: ");
+            scanf("%s", filename);
+            statPath(filename);
+            break;
+        
+        case 13: // List directory
+            printf("\n\t\tEnter directory path: ");
+            scanf("%s", filename);
+            printf("\n\t\tInode\tSize\tName");
+            if ((ret = vfs_readdir(filename, printEntry, NULL)) < 0)
+                reportError(ret);
+            break;
+        
+        case 14: // Statistics
+            showStats();
+            break;
+        
+        case 15: // Seek
+            if (vfs_next_fd(-1) == -1)
             {
                 printf("\n No files in the system\n");
                 break;
             }
-            showfd(ufdt_list);
+            showfd();
             printf("\n\tEnter file descriptor: ");
             scanf("%d", &descriptor);
-            removeFile(&inode_list, &ft_list, &ufdt_list, descriptor);
+            seekFile(descriptor);
             break;
-            
-        case 6: // Memory map
-            showMemoryMap();
+        
+        case 16: // Save image
+            syncImage(image);
             break;
-            
-        case 7: // Exit
+        
+        case 17: // Hard link
+            printf("\n\t\tEnter existing file path: ");
+            scanf("%s", filename);
+            printf("\n\t\tEnter new path: ");
+            scanf("%254s", target);
+            if ((ret = vfs_link(filename, target)) < 0)
+                reportError(ret);
+            break;
+        
+        case 18: // Compress cold files
+            printf("\n Freed %ld bytes, %s\n", vfs_compress_cold(),
+                   "files untouched for two passes are compressed");
+            break;
+        
+        case 19: // Trace
+            toggleTrace(&tracing);
+            break;
+        
+        case 20: // Search
+            findPattern();
+            break;
+        
+        case 21: // Scrub
+            if ((ret = vfs_scrub()) < 0)
+                reportError(ret);
+            else
+                printf("\n\t\t%d damaged files (%s checksums)", ret, vfs_checksum_kernel());
+            break;
+        
+        case 22: // Exit
             printf("\tDo you want to exit? (Y/N): ");
             confirm = getchar();
             confirm = getchar();
             if (confirm == 'Y' || confirm == 'y')
             {
-                free(mainPool);
+                if (tracing)
+                    vfs_trace_stop();
+                vfs_shutdown();
                 exit(0);
             }
             break;
-            
+        
         default:
             printf("\n\t\tInvalid choice");
             break;
@@ -0,0 +1,1341 @@
+#define _DEFAULT_SOURCE
+
+#include "vfs_internal.h"
+
+#include <sys/mman.h>
+
+// Global memory storage. The pool is one reservation of poolReserve bytes
+// of address space, of which the first poolSize are in use; growing it
+// commits more and never moves what is already there.
+char *mainPool = NULL;
+long long poolSize = 0;
+long long poolReserve = 0;
+static long long poolCommitted = 0;
+
+// One slice of the pool with its own block list, free lists and lock.
+// Single-threaded mode uses one arena spanning the whole pool.
+typedef struct Arena {
+    pthread_mutex_t lock;
+    long long base;                 // pool offset of the first byte
+    int size;                       // at most ARENA_MAX_SIZE
+    MEMBLOCK *blocks;               // physical block list, in address order
+    
+    // Segregated free lists, class i holds free blocks of size [2^i, 2^(i+1)).
+    // TLSF splits every class into TLSF_SUBCLASSES lists, the other policies
+    // use one list per class.
+    MEMBLOCK **freeLists;
+    unsigned int freeClassMap;
+    unsigned int subClassMap[SIZE_CLASSES];
+    
+    // Offset -> block index used by releaseSpace
+    MEMBLOCK **blockIndex;
+    unsigned int indexBuckets;
+    unsigned int blockCount;
+    
+    // Free byte total and the compaction cursor; every block below the cursor is in use
+    int freeBytes;
+    int largestFree;                // biggest block on the free lists, read without the lock
+    MEMBLOCK *compactCursor;
+    MEMBLOCK *claimHint;            // last block claimed while rebuilding from an image
+    MEMBLOCK *rover;                // where next-fit resumes, NULL for the first block
+    SLABCACHE blockCache;           // MEMBLOCK nodes, guarded by the arena lock
+} ARENA;
+
+// Allocation policy: which free block serves a request and how freed
+// blocks merge. The block list, index and free lists are shared by all.
+typedef struct AllocPolicy {
+    const char *name;
+    int listsPerClass;
+    int aligned;                                    // blocks are naturally aligned powers of two,
+                                                    // never moved or grown in place
+    int (*blockSize)(int requiredSize);             // size of the block handed out
+    MEMBLOCK *(*findFree)(ARENA *a, int size);      // a free block of at least size bytes
+    void (*carve)(ARENA *a, MEMBLOCK *block, int size);
+    MEMBLOCK *(*coalesce)(ARENA *a, MEMBLOCK *block);
+    void (*prepare)(ARENA *a);                      // shape a new arena's free space, may be NULL
+} ALLOCPOLICY;
+
+static const ALLOCPOLICY policies[VFS_ALLOC_COUNT];
+static const ALLOCPOLICY *policy;
+
+// Arenas are only ever appended, into slots allocated up front, so their
+// addresses stay put and readers load arenaCount with acquire
+static ARENA *arenas = NULL;
+static int arenaSlots = 0;
+static int arenaCount = 0;
+static int initialArenas = 0;       // arenas set up at init, the rest were grown
+static long long initialSize = 0;
+static int arenaSpan = 0;           // size of every initial arena but the last
+static int largestArena = 0;
+static pthread_mutex_t growLock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t metaBytes = 0;
+size_t metaPeak = 0;
+
+// Allocator telemetry
+unsigned int freeBlockCount = 0;
+unsigned int usedBlockCount = 0;
+unsigned long long allocFailures = 0;
+unsigned long long compactedBytes = 0;
+long long slackBytes = 0;
+
+// Blocks held by views, and those among them already released
+unsigned int pinnedBlocks = 0;
+unsigned int parkedBlocks = 0;
+
+long long freeBytes = 0;
+int vfsConcurrent = 0;
+
+// Set when the pool memory belongs to someone else, e.g. a mapped image
+static int poolBorrowed = 0;
+
+static __thread int threadSlot = -1;
+static int nextThreadSlot = 0;
+
+// Small per-thread number used to pick an arena and a statistics shard
+int currentSlot() {
+    if (threadSlot < 0)
+        threadSlot = __atomic_fetch_add(&nextThreadSlot, 1, __ATOMIC_RELAXED);
+    return threadSlot;
+}
+
+static void metaCharge(size_t size) {
+    size_t now, peak;
+    
+    if (!vfsConcurrent) {
+        metaBytes += size;
+        if (metaBytes > metaPeak)
+            metaPeak = metaBytes;
+        return;
+    }
+    now = __atomic_add_fetch(&metaBytes, size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&metaPeak, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&metaPeak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void *metaAlloc(size_t size) {
+    void *ptr = malloc(size);
+    
+    if (ptr != NULL)
+        metaCharge(size);
+    return ptr;
+}
+
+void *metaCalloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    
+    if (ptr != NULL)
+        metaCharge(count * size);
+    return ptr;
+}
+
+void *metaRealloc(void *ptr, size_t oldSize, size_t newSize) {
+    void *res = realloc(ptr, newSize);
+    
+    if (res != NULL) {
+        COUNTER_ADD(metaBytes, -oldSize);
+        metaCharge(newSize);
+    }
+    return res;
+}
+
+void *metaAlignedAlloc(size_t align, size_t size) {
+    void *ptr;
+    
+    if (posix_memalign(&ptr, align, size) != 0)
+        return NULL;
+    metaCharge(size);
+    return ptr;
+}
+
+void metaFree(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+    COUNTER_ADD(metaBytes, -size);
+    free(ptr);
+}
+
+// Size class of a block, floor(log2(size))
+static int sizeClass(int size) {
+    return 31 - __builtin_clz((unsigned int)size);
+}
+
+static int liveArenas() {
+    return __atomic_load_n(&arenaCount, __ATOMIC_ACQUIRE);
+}
+
+static ARENA *arenaOf(long long position) {
+    int lo, hi;
+    
+    if (position < initialSize) {
+        long long idx = position / arenaSpan;
+        return &arenas[idx < initialArenas ? idx : initialArenas - 1];
+    }
+    // Grown arenas differ in size, search them by base
+    lo = initialArenas;
+    hi = liveArenas() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (arenas[mid].base <= position)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &arenas[lo];
+}
+
+// Second-level list of a size within its class, always 0 outside TLSF
+static int subClass(int size, int cls) {
+    if (policy->listsPerClass == 1 || cls < TLSF_SUB_BITS)
+        return 0;
+    return (size >> (cls - TLSF_SUB_BITS)) & (TLSF_SUBCLASSES - 1);
+}
+
+static int freeListIndex(int size) {
+    int cls = sizeClass(size);
+    
+    return cls * policy->listsPerClass + subClass(size, cls);
+}
+
+// Rescan the highest non-empty list for the arena's biggest free block
+static void findLargestFree(ARENA *a) {
+    int largest = 0;
+    
+    if (a->freeClassMap != 0) {
+        int cls = 31 - __builtin_clz(a->freeClassMap);
+        int sub = 31 - __builtin_clz(a->subClassMap[cls]);
+        MEMBLOCK *curr;
+        
+        for (curr = a->freeLists[cls * policy->listsPerClass + sub]; curr != NULL; curr = curr->freeNext) {
+            if (curr->blockSize > largest)
+                largest = curr->blockSize;
+        }
+    }
+    __atomic_store_n(&a->largestFree, largest, __ATOMIC_RELAXED);
+}
+
+static void freeListInsert(ARENA *a, MEMBLOCK *block) {
+    int cls = sizeClass(block->blockSize), sub = subClass(block->blockSize, cls);
+    MEMBLOCK **head = &a->freeLists[cls * policy->listsPerClass + sub];
+    
+    block->freePrev = NULL;
+    block->freeNext = *head;
+    if (*head != NULL)
+        (*head)->freePrev = block;
+    *head = block;
+    a->subClassMap[cls] |= 1u << sub;
+    a->freeClassMap |= 1u << cls;
+    if (block->blockSize > a->largestFree)
+        __atomic_store_n(&a->largestFree, block->blockSize, __ATOMIC_RELAXED);
+    COUNTER_ADD(freeBlockCount, 1);
+}
+
+static void freeListRemove(ARENA *a, MEMBLOCK *block) {
+    int cls = sizeClass(block->blockSize), sub = subClass(block->blockSize, cls);
+    MEMBLOCK **head = &a->freeLists[cls * policy->listsPerClass + sub];
+    
+    if (block->freePrev != NULL)
+        block->freePrev->freeNext = block->freeNext;
+    else
+        *head = block->freeNext;
+    if (block->freeNext != NULL)
+        block->freeNext->freePrev = block->freePrev;
+    if (*head == NULL) {
+        a->subClassMap[cls] &= ~(1u << sub);
+        if (a->subClassMap[cls] == 0)
+            a->freeClassMap &= ~(1u << cls);
+    }
+    block->freeNext = block->freePrev = NULL;
+    if (block->blockSize == a->largestFree)
+        findLargestFree(a);
+    COUNTER_ADD(freeBlockCount, -1);
+}
+
+// First list of the lowest non-empty class at or above cls
+static MEMBLOCK *lowestFreeList(ARENA *a, int cls) {
+    unsigned int mask = (cls < SIZE_CLASSES) ? (a->freeClassMap & (~0u << cls)) : 0;
+    
+    if (mask == 0)
+        return NULL;
+    cls = __builtin_ctz(mask);
+    return a->freeLists[cls * policy->listsPerClass + __builtin_ctz(a->subClassMap[cls])];
+}
+
+static unsigned int indexSlot(long long offset, unsigned int buckets) {
+    return ((unsigned int)(offset ^ (offset >> 32)) * 2654435761u) & (buckets - 1);
+}
+
+static void indexResize(ARENA *a, unsigned int buckets) {
+    MEMBLOCK **table = (MEMBLOCK **)metaCalloc(buckets, sizeof(MEMBLOCK *));
+    unsigned int i;
+    
+    if (table == NULL)
+        return;
+    for (i = 0; i < a->indexBuckets; i++) {
+        MEMBLOCK *curr = a->blockIndex[i];
+        while (curr != NULL) {
+            MEMBLOCK *nxt = curr->hashNext;
+            unsigned int slot = indexSlot(curr->offset, buckets);
+            curr->hashNext = table[slot];
+            table[slot] = curr;
+            curr = nxt;
+        }
+    }
+    metaFree(a->blockIndex, a->indexBuckets * sizeof(MEMBLOCK *));
+    a->blockIndex = table;
+    a->indexBuckets = buckets;
+}
+
+static void indexInsert(ARENA *a, MEMBLOCK *block) {
+    unsigned int slot;
+    
+    if (a->blockCount >= a->indexBuckets)
+        indexResize(a, a->indexBuckets * 2);
+    slot = indexSlot(block->offset, a->indexBuckets);
+    block->hashNext = a->blockIndex[slot];
+    a->blockIndex[slot] = block;
+    a->blockCount++;
+}
+
+static void indexRemove(ARENA *a, MEMBLOCK *block) {
+    MEMBLOCK **link = &a->blockIndex[indexSlot(block->offset, a->indexBuckets)];
+    
+    while (*link != NULL) {
+        if (*link == block) {
+            *link = block->hashNext;
+            a->blockCount--;
+            return;
+        }
+        link = &(*link)->hashNext;
+    }
+}
+
+static MEMBLOCK *indexLookup(ARENA *a, long long offset) {
+    MEMBLOCK *curr = a->blockIndex[indexSlot(offset, a->indexBuckets)];
+    
+    while (curr != NULL && curr->offset != offset)
+        curr = curr->hashNext;
+    return curr;
+}
+
+// Split 'size' bytes off the front of block, the rest becomes a new free block after it
+static void splitBlock(ARENA *a, MEMBLOCK *block, int size) {
+    MEMBLOCK *rest = (MEMBLOCK *)slabAlloc(&a->blockCache);
+    
+    rest->offset = block->offset + size;
+    rest->blockSize = block->blockSize - size;
+    rest->requested = 0;
+    rest->available = 1;
+    rest->owner = NULL;
+    rest->pins = 0;
+    rest->parked = 0;
+    rest->next = block->next;
+    rest->prev = block;
+    if (block->next != NULL)
+        block->next->prev = rest;
+    block->next = rest;
+    block->blockSize = size;
+    indexInsert(a, rest);
+    freeListInsert(a, rest);
+}
+
+// Fold the block after 'lower' into it; neither is on a free list
+static void absorbNext(ARENA *a, MEMBLOCK *lower) {
+    MEMBLOCK *upper = lower->next;
+    
+    indexRemove(a, upper);
+    lower->blockSize += upper->blockSize;
+    lower->next = upper->next;
+    if (upper->next != NULL)
+        upper->next->prev = lower;
+    if (upper == a->compactCursor)
+        a->compactCursor = lower;
+    if (upper == a->rover)
+        a->rover = lower;
+    slabFree(&a->blockCache, upper);
+}
+
+// One free block covering [base, base + size)
+static void arenaInit(ARENA *a, long long base, int size) {
+    MEMBLOCK *block;
+    
+    pthread_mutex_init(&a->lock, NULL);
+    slabInit(&a->blockCache, sizeof(MEMBLOCK), 0);
+    block = (MEMBLOCK *)slabAlloc(&a->blockCache);
+    a->base = base;
+    a->size = size;
+    a->blockIndex = (MEMBLOCK **)metaCalloc(INDEX_MIN_BUCKETS, sizeof(MEMBLOCK *));
+    a->indexBuckets = INDEX_MIN_BUCKETS;
+    a->freeLists = (MEMBLOCK **)metaCalloc(SIZE_CLASSES * policy->listsPerClass, sizeof(MEMBLOCK *));
+    
+    block->offset = a->base;
+    block->blockSize = a->size;
+    block->requested = 0;
+    block->available = 1;
+    block->next = NULL;
+    block->prev = NULL;
+    block->owner = NULL;
+    block->pins = 0;
+    block->parked = 0;
+    indexInsert(a, block);
+    freeListInsert(a, block);
+    a->blocks = block;
+    a->freeBytes = a->size;
+    a->compactCursor = block;
+    a->claimHint = block;
+    a->rover = NULL;
+    if (policy->prepare != NULL)
+        policy->prepare(a);
+}
+
+static long long roundPage(long long size) {
+    return (size + IMAGE_PAGE - 1) / IMAGE_PAGE * IMAGE_PAGE;
+}
+
+// Reserve 'reserve' bytes of address space and commit the first 'size'.
+// A fixed pool that is a whole number of huge pages tries MAP_HUGETLB,
+// anything else asks for transparent huge pages.
+static char *mapPool(long long size, long long reserve, int hugePages) {
+    char *mem = (char *)MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugePages && size == reserve && size % HUGE_PAGE == 0)
+        mem = (char *)mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (mem != (char *)MAP_FAILED) {
+        poolCommitted = reserve;
+        return mem;
+    }
+    mem = (char *)mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == (char *)MAP_FAILED)
+        return NULL;
+    if (mprotect(mem, size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(mem, reserve);
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugePages)
+        madvise(mem, reserve, MADV_HUGEPAGE);
+#endif
+    poolCommitted = roundPage(size);
+    return mem;
+}
+
+// Arena slots, counters and allocation policy for a pool of 'size' bytes
+static int poolInit(long long size, long long reserve, int slots, int allocPolicy) {
+    if ((arenas = (ARENA *)metaCalloc(slots, sizeof(ARENA))) == NULL)
+        return VFS_ENOMEM;
+    policy = &policies[allocPolicy];
+    arenaSlots = slots;
+    poolSize = size;
+    poolReserve = reserve;
+    freeBlockCount = usedBlockCount = 0;
+    allocFailures = compactedBytes = 0;
+    slackBytes = 0;
+    pinnedBlocks = parkedBlocks = 0;
+    freeBytes = size;
+    return VFS_OK;
+}
+
+// Setup memory storage split into 'count' arenas, able to grow up to
+// 'reserve' bytes, handing out blocks with one of the VFS_ALLOC_* policies
+int setupMemoryPool(long long size, long long reserve, int count, int hugePages, int allocPolicy) {
+    int minCount, i;
+    
+    reserve = (reserve > size) ? roundPage(reserve) : size;
+    if ((mainPool = mapPool(size, reserve, hugePages)) == NULL)
+        return VFS_ENOMEM;
+    poolBorrowed = 0;
+    
+    // Arenas stay below ARENA_MAX_SIZE so block sizes fit an int
+    minCount = (int)((size + ARENA_MAX_SIZE - 1) / ARENA_MAX_SIZE);
+    if (count > size / ARENA_MIN_SIZE)
+        count = (int)(size / ARENA_MIN_SIZE);
+    if (count < minCount)
+        count = minCount;
+    if (count < 1)
+        count = 1;
+    if (poolInit(size, reserve, count + ((reserve > size) ? GROW_ARENAS : 0), allocPolicy) != VFS_OK) {
+        munmap(mainPool, reserve);
+        mainPool = NULL;
+        return VFS_ENOMEM;
+    }
+    
+    arenaCount = initialArenas = count;
+    initialSize = size;
+    arenaSpan = (int)(size / count);
+    for (i = 0; i < count; i++)
+        arenaInit(&arenas[i], (long long)i * arenaSpan, (i == count - 1) ? (int)(size - (long long)i * arenaSpan) : arenaSpan);
+    largestArena = arenas[count - 1].size;
+    
+    VFS_LOG("pool: %lld bytes initialized in %d arenas, %lld reserved, %s allocator\n", size, count, reserve, policy->name);
+    return VFS_OK;
+}
+
+// Setup memory storage over the caller's memory, e.g. a mapped image, with
+// the arena sizes it was saved with. Someone else's mapping cannot grow.
+// Saved blocks are not aligned for buddy, so images use the default policy.
+int mountMemoryPool(char *memory, long long size, const int *sizes, int count) {
+    long long base = 0;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (sizes[i] <= 0)
+            return VFS_EINVAL;
+        base += sizes[i];
+    }
+    if (count < 1 || base != size)
+        return VFS_EINVAL;
+    if (poolInit(size, size, count, VFS_ALLOC_SEGREGATED) != VFS_OK)
+        return VFS_ENOMEM;
+    mainPool = memory;
+    poolBorrowed = 1;
+    poolCommitted = size;
+    
+    // Arbitrary sizes, arenaOf searches them all by base
+    arenaCount = count;
+    initialArenas = 0;
+    initialSize = 0;
+    for (base = 0, i = 0; i < count; base += sizes[i++]) {
+        arenaInit(&arenas[i], base, sizes[i]);
+        if (sizes[i] > largestArena)
+            largestArena = sizes[i];
+    }
+    return VFS_OK;
+}
+
+// Arena sizes in address order, returns how many there are
+int poolLayout(int *sizes, int max) {
+    int count = liveArenas(), i;
+    
+    for (i = 0; i < count && i < max; i++)
+        sizes[i] = arenas[i].size;
+    return count;
+}
+
+// Append an arena of at least requiredSize bytes, doubling the pool until
+// arenas reach ARENA_MAX_SIZE. 'seen' is the arena count the caller
+// searched; returns 1 when there is a new arena to try.
+static int growPool(int requiredSize, int seen) {
+    long long size, end;
+    int grown = 0;
+    
+    MUTEX_LOCK(&growLock);
+    if (arenaCount != seen) {
+        // Someone else grew the pool meanwhile
+        MUTEX_UNLOCK(&growLock);
+        return 1;
+    }
+    size = (poolSize < ARENA_MAX_SIZE) ? poolSize : ARENA_MAX_SIZE;
+    if (size < requiredSize)
+        size = requiredSize;
+    if (size < ARENA_MIN_SIZE)
+        size = ARENA_MIN_SIZE;
+    if (size > poolReserve - poolSize)
+        size = poolReserve - poolSize;
+    end = roundPage(poolSize + size);
+    
+    if (arenaCount < arenaSlots && size >= requiredSize &&
+        (end <= poolCommitted ||
+         mprotect(mainPool + poolCommitted, end - poolCommitted, PROT_READ | PROT_WRITE) == 0)) {
+        ARENA *a = &arenas[arenaCount];
+        
+        if (end > poolCommitted)
+            poolCommitted = end;
+        arenaInit(a, poolSize, (int)size);
+        if (a->size > largestArena)
+            __atomic_store_n(&largestArena, a->size, __ATOMIC_RELAXED);
+        COUNTER_ADD(freeBytes, size);
+        __atomic_store_n(&poolSize, poolSize + size, __ATOMIC_RELEASE);
+        __atomic_store_n(&arenaCount, arenaCount + 1, __ATOMIC_RELEASE);
+        // Older images may hold metadata where the new arena lands
+        MARK_DIRTY(a->base, a->size);
+        VFS_LOG("pool: grew by %lld bytes to %lld in %d arenas\n", size, poolSize, arenaCount);
+        grown = 1;
+    }
+    MUTEX_UNLOCK(&growLock);
+    return grown;
+}
+
+// Release memory storage
+void teardownMemoryPool() {
+    int i;
+    
+    for (i = 0; i < arenaCount; i++) {
+        slabDestroy(&arenas[i].blockCache);
+        metaFree(arenas[i].blockIndex, arenas[i].indexBuckets * sizeof(MEMBLOCK *));
+        metaFree(arenas[i].freeLists, SIZE_CLASSES * policy->listsPerClass * sizeof(MEMBLOCK *));
+        pthread_mutex_destroy(&arenas[i].lock);
+    }
+    metaFree(arenas, arenaSlots * sizeof(ARENA));
+    if (!poolBorrowed)
+        munmap(mainPool, poolReserve);
+    poolBorrowed = 0;
+    arenas = NULL;
+    arenaSlots = arenaCount = initialArenas = arenaSpan = largestArena = 0;
+    mainPool = NULL;
+    poolSize = poolReserve = poolCommitted = initialSize = freeBytes = 0;
+}
+
+// Largest request a single allocation can satisfy, counting arenas the
+// pool could still grow
+int maxAllocation() {
+    long long room = __atomic_load_n(&poolReserve, __ATOMIC_RELAXED) - __atomic_load_n(&poolSize, __ATOMIC_ACQUIRE);
+    int largest = __atomic_load_n(&largestArena, __ATOMIC_RELAXED);
+    
+    if (room > ARENA_MAX_SIZE)
+        room = ARENA_MAX_SIZE;
+    if (room > largest && liveArenas() < arenaSlots)
+        largest = (int)room;
+    // Buddy blocks are powers of two, the arena's remainder is never one
+    if (policy->aligned)
+        largest = 1 << (31 - __builtin_clz(largest));
+    return largest;
+}
+
+int poolArenas() {
+    return liveArenas();
+}
+
+static int exactSize(int requiredSize) {
+    return requiredSize;
+}
+
+// Take the front of the block, the tail stays free
+static void splitFront(ARENA *a, MEMBLOCK *block, int size) {
+    if (block->blockSize > size)
+        splitBlock(a, block, size);
+}
+
+// Merge a freed block with whichever neighbours are free
+static MEMBLOCK *mergeNeighbours(ARENA *a, MEMBLOCK *curr) {
+    if (curr->next != NULL && curr->next->available) {
+        freeListRemove(a, curr->next);
+        absorbNext(a, curr);
+    }
+    if (curr->prev != NULL && curr->prev->available) {
+        curr = curr->prev;
+        freeListRemove(a, curr);
+        absorbNext(a, curr);
+    }
+    return curr;
+}
+
+// Segregated fit: any block in a class above the request's is large
+// enough, otherwise only the request's own class may still hold a fit
+static MEMBLOCK *segregatedFind(ARENA *a, int requiredSize) {
+    int cls = sizeClass(requiredSize);
+    MEMBLOCK *curr = lowestFreeList(a, (requiredSize & (requiredSize - 1)) ? cls + 1 : cls);
+    
+    if (curr != NULL)
+        return curr;
+    for (curr = a->freeLists[cls]; curr != NULL; curr = curr->freeNext) {
+        if (curr->blockSize >= requiredSize)
+            return curr;
+    }
+    return NULL;
+}
+
+// Lowest-addressed free block that fits
+static MEMBLOCK *firstFitFind(ARENA *a, int requiredSize) {
+    MEMBLOCK *curr;
+    
+    for (curr = a->blocks; curr != NULL; curr = curr->next) {
+        if (curr->available && curr->blockSize >= requiredSize)
+            return curr;
+    }
+    return NULL;
+}
+
+// First fit resuming where the last allocation left off
+static MEMBLOCK *nextFitFind(ARENA *a, int requiredSize) {
+    MEMBLOCK *start = (a->rover != NULL) ? a->rover : a->blocks, *curr = start;
+    
+    do {
+        if (curr->available && curr->blockSize >= requiredSize) {
+            a->rover = curr->next;
+            return curr;
+        }
+        curr = (curr->next != NULL) ? curr->next : a->blocks;
+    } while (curr != start);
+    return NULL;
+}
+
+// Smallest free block that fits. Classes are ordered, so only the first
+// class holding a fit needs a full scan.
+static MEMBLOCK *bestFitFind(ARENA *a, int requiredSize) {
+    unsigned int mask = a->freeClassMap & (~0u << sizeClass(requiredSize));
+    
+    while (mask != 0) {
+        MEMBLOCK *curr, *best = NULL;
+        
+        for (curr = a->freeLists[__builtin_ctz(mask)]; curr != NULL; curr = curr->freeNext) {
+            if (curr->blockSize >= requiredSize && (best == NULL || curr->blockSize < best->blockSize))
+                best = curr;
+        }
+        if (best != NULL)
+            return best;
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+// Binary buddy: requests round up to a power of two no smaller than
+// BUDDY_MIN_BLOCK, and a block only ever merges with its buddy
+static int buddySize(int requiredSize) {
+    int size = BUDDY_MIN_BLOCK;
+    
+    while (size < requiredSize && size < (1 << 30))
+        size <<= 1;
+    return size;
+}
+
+static MEMBLOCK *buddyFind(ARENA *a, int requiredSize) {
+    return lowestFreeList(a, sizeClass(requiredSize));
+}
+
+// Halve the block until it is the requested size, the upper halves stay free
+static void buddySplit(ARENA *a, MEMBLOCK *block, int size) {
+    while (block->blockSize > size)
+        splitBlock(a, block, block->blockSize / 2);
+}
+
+// Free neighbours of the same size at the buddy position merge, repeatedly
+static MEMBLOCK *buddyMerge(ARENA *a, MEMBLOCK *curr) {
+    for (;;) {
+        int lower = ((curr->offset - a->base) & curr->blockSize) == 0;
+        MEMBLOCK *buddy = lower ? curr->next : curr->prev;
+        
+        if (buddy == NULL || !buddy->available || buddy->blockSize != curr->blockSize)
+            return curr;
+        freeListRemove(a, buddy);
+        if (!lower)
+            curr = buddy;
+        absorbNext(a, curr);
+    }
+}
+
+// Cut the arena into naturally aligned powers of two, largest first
+static void buddyPrepare(ARENA *a) {
+    MEMBLOCK *curr = a->blocks;
+    
+    freeListRemove(a, curr);
+    while (curr->blockSize & (curr->blockSize - 1)) {
+        splitBlock(a, curr, 1 << sizeClass(curr->blockSize));
+        curr = curr->next;
+        freeListRemove(a, curr);
+    }
+    freeListInsert(a, curr);
+}
+
+// TLSF: every class has TLSF_SUBCLASSES lists of equal size ranges, and
+// rounding the request up to the next range means the head of any list at
+// or above it fits, found with two bitmap scans
+static MEMBLOCK *tlsfFind(ARENA *a, int requiredSize) {
+    int cls = sizeClass(requiredSize), sub;
+    unsigned int mask;
+    MEMBLOCK *curr;
+    
+    if (cls < TLSF_SUB_BITS) {
+        // Tiny classes have a single list, look through it
+        for (curr = a->freeLists[cls * TLSF_SUBCLASSES]; curr != NULL; curr = curr->freeNext) {
+            if (curr->blockSize >= requiredSize)
+                return curr;
+        }
+        return lowestFreeList(a, cls + 1);
+    }
+    if (requiredSize <= (1 << 30) - (1 << (cls - TLSF_SUB_BITS)))
+        requiredSize += (1 << (cls - TLSF_SUB_BITS)) - 1;
+    cls = sizeClass(requiredSize);
+    sub = subClass(requiredSize, cls);
+    mask = a->subClassMap[cls] & (~0u << sub);
+    if (mask != 0)
+        return a->freeLists[cls * TLSF_SUBCLASSES + __builtin_ctz(mask)];
+    return lowestFreeList(a, cls + 1);
+}
+
+static const ALLOCPOLICY policies[VFS_ALLOC_COUNT] = {
+    { "segregated", 1, 0, exactSize, segregatedFind, splitFront, mergeNeighbours, NULL },
+    { "first_fit", 1, 0, exactSize, firstFitFind, splitFront, mergeNeighbours, NULL },
+    { "next_fit", 1, 0, exactSize, nextFitFind, splitFront, mergeNeighbours, NULL },
+    { "best_fit", 1, 0, exactSize, bestFitFind, splitFront, mergeNeighbours, NULL },
+    { "buddy", 1, 1, buddySize, buddyFind, buddySplit, buddyMerge, buddyPrepare },
+    { "tlsf", TLSF_SUBCLASSES, 0, exactSize, tlsfFind, splitFront, mergeNeighbours, NULL },
+};
+
+const char *allocPolicyName(int allocPolicy) {
+    if (allocPolicy < 0 || allocPolicy >= VFS_ALLOC_COUNT)
+        return "unknown";
+    return policies[allocPolicy].name;
+}
+
+int poolPolicy() {
+    return (int)(policy - policies);
+}
+
+static int arenaCompact(ARENA *a, int budget);
+
+// Allocate from one arena, the caller holds its lock
+static long long arenaAllocate(ARENA *a, int requiredSize) {
+    int size = policy->blockSize(requiredSize);
+    MEMBLOCK *curr = policy->findFree(a, size);
+    
+    if (curr == NULL && a->freeBytes >= size && !policy->aligned) {
+        // Enough space in total, compact until a large enough hole appears
+        arenaCompact(a, -size);
+        curr = policy->findFree(a, size);
+    }
+    if (curr == NULL)
+        return -1;
+    
+    freeListRemove(a, curr);
+    policy->carve(a, curr, size);
+    curr->available = 0;
+    curr->owner = NULL;
+    curr->requested = requiredSize;
+    a->freeBytes -= size;
+    COUNTER_ADD(freeBytes, -size);
+    COUNTER_ADD(slackBytes, size - requiredSize);
+    COUNTER_ADD(usedBlockCount, 1);
+    if (curr == a->compactCursor)
+        a->compactCursor = curr->next;
+    return curr->offset;
+}
+
+// Allocate space, from the calling thread's arena first and then any other.
+// With 'grow' set the pool adds an arena when none of them has room.
+long long findContiguousSpace(int requiredSize, int grow) {
+    long long offset = -1;
+    int count, home, i;
+    
+    if (requiredSize <= 0)
+        return -1;
+    
+    do {
+        count = liveArenas();
+        home = (count > 1) ? currentSlot() % count : 0;
+        for (i = 0; i < count && offset == -1; i++) {
+            ARENA *a = &arenas[(home + i) % count];
+            
+            if (a->size < requiredSize)
+                continue;
+            MUTEX_LOCK(&a->lock);
+            offset = arenaAllocate(a, requiredSize);
+            MUTEX_UNLOCK(&a->lock);
+        }
+    } while (offset == -1 && grow && growPool(policy->blockSize(requiredSize), count));
+    
+    if (offset == -1) {
+        VFS_LOG("pool: no contiguous space for %d bytes\n", requiredSize);
+        COUNTER_ADD(allocFailures, 1);
+        return -1;
+    }
+    VFS_LOG("pool: allocated %d bytes at offset %lld\n", requiredSize, offset);
+    return offset;
+}
+
+// Free space and merge it as the policy allows, the caller holds the arena lock
+static void arenaRelease(ARENA *a, long long position, int size) {
+    MEMBLOCK *curr = indexLookup(a, position);
+    
+    if (curr == NULL || curr->available || curr->requested != size)
+        return;
+    // A pinned block stays where its views point until the last one goes
+    if (curr->pins > 0) {
+        if (!curr->parked)
+            COUNTER_ADD(parkedBlocks, 1);
+        curr->parked = 1;
+        curr->owner = NULL;
+        return;
+    }
+    
+    curr->available = 1;
+    curr->owner = NULL;
+    a->freeBytes += curr->blockSize;
+    COUNTER_ADD(freeBytes, curr->blockSize);
+    COUNTER_ADD(slackBytes, -(curr->blockSize - size));
+    COUNTER_ADD(usedBlockCount, -1);
+    curr = policy->coalesce(a, curr);
+    
+    freeListInsert(a, curr);
+    if (a->compactCursor == NULL || curr->offset < a->compactCursor->offset)
+        a->compactCursor = curr;
+    VFS_LOG("pool: released %d bytes at offset %lld\n", size, position);
+}
+
+void releaseSpace(long long position, int size) {
+    ARENA *a = arenaOf(position);
+    
+    MUTEX_LOCK(&a->lock);
+    arenaRelease(a, position, size);
+    MUTEX_UNLOCK(&a->lock);
+}
+
+static int compareSpans(const void *x, const void *y) {
+    long long p = ((const SPAN *)x)->position, q = ((const SPAN *)y)->position;
+    
+    return (p > q) - (p < q);
+}
+
+// Free many blocks, taking each arena's lock once. In address order,
+// neighbours freed together merge as each one goes back.
+void releaseSpans(SPAN *spans, int count) {
+    int i = 0;
+    
+    qsort(spans, count, sizeof(SPAN), compareSpans);
+    while (i < count) {
+        ARENA *a = arenaOf(spans[i].position);
+        
+        MUTEX_LOCK(&a->lock);
+        for (; i < count && spans[i].position < a->base + a->size; i++)
+            arenaRelease(a, spans[i].position, spans[i].size);
+        MUTEX_UNLOCK(&a->lock);
+    }
+}
+
+// Mark [position, position + size) in use while rebuilding the block list
+// from a saved image. Regions must be claimed in ascending offset order.
+int claimSpace(long long position, int size) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *curr = a->claimHint;
+    
+    while (curr != NULL && curr->offset + curr->blockSize <= position)
+        curr = curr->next;
+    if (curr == NULL || !curr->available || size <= 0 || position < curr->offset ||
+        position + size > curr->offset + curr->blockSize)
+        return -1;
+    
+    freeListRemove(a, curr);
+    if (position > curr->offset) {
+        // Leave the gap in front free and carry on with the part after it
+        MEMBLOCK *gap = curr;
+        splitBlock(a, gap, (int)(position - curr->offset));
+        curr = gap->next;
+        freeListRemove(a, curr);
+        freeListInsert(a, gap);
+    }
+    if (curr->blockSize > size)
+        splitBlock(a, curr, size);
+    curr->available = 0;
+    curr->requested = size;
+    a->freeBytes -= size;
+    freeBytes -= size;
+    usedBlockCount++;
+    if (curr == a->compactCursor)
+        a->compactCursor = curr->next;
+    a->claimHint = curr;
+    return 0;
+}
+
+// Grow an allocated block in place by taking bytes from a free successor
+int extendSpace(long long position, int extra) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *curr, *next;
+    
+    if (policy->aligned)
+        return -1;
+    MUTEX_LOCK(&a->lock);
+    curr = indexLookup(a, position);
+    if (curr == NULL || curr->available || extra <= 0) {
+        MUTEX_UNLOCK(&a->lock);
+        return -1;
+    }
+    next = curr->next;
+    if (next == NULL || !next->available || next->blockSize < extra) {
+        MUTEX_UNLOCK(&a->lock);
+        return -1;
+    }
+    
+    freeListRemove(a, next);
+    indexRemove(a, next);
+    if (next->blockSize == extra) {
+        curr->next = next->next;
+        if (next->next != NULL)
+            next->next->prev = curr;
+        if (next == a->compactCursor)
+            a->compactCursor = curr->next;
+        if (next == a->rover)
+            a->rover = curr->next;
+        slabFree(&a->blockCache, next);
+    } else {
+        next->offset += extra;
+        next->blockSize -= extra;
+        indexInsert(a, next);
+        freeListInsert(a, next);
+    }
+    curr->blockSize += extra;
+    curr->requested += extra;
+    a->freeBytes -= extra;
+    COUNTER_ADD(freeBytes, -extra);
+    MUTEX_UNLOCK(&a->lock);
+    return 0;
+}
+
+// Record which file owns an allocated block so compaction can relocate it
+void setBlockOwner(long long position, INODE *owner) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *block;
+    
+    MUTEX_LOCK(&a->lock);
+    block = indexLookup(a, position);
+    if (block != NULL && !block->available)
+        block->owner = owner;
+    MUTEX_UNLOCK(&a->lock);
+}
+
+// Hold the allocated block at position in place for a view: compaction
+// skips it and releasing it waits for unpinSpace. Returns -1 when there
+// is no such block.
+int pinSpace(long long position) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *block;
+    int ret = -1;
+    
+    MUTEX_LOCK(&a->lock);
+    block = indexLookup(a, position);
+    if (block != NULL && !block->available && !block->parked) {
+        if (block->pins++ == 0)
+            COUNTER_ADD(pinnedBlocks, 1);
+        ret = 0;
+    }
+    MUTEX_UNLOCK(&a->lock);
+    return ret;
+}
+
+// Drop a view's pin, freeing the block if it was released meanwhile
+void unpinSpace(long long position) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *block;
+    
+    MUTEX_LOCK(&a->lock);
+    block = indexLookup(a, position);
+    if (block != NULL && !block->available && block->pins > 0 && --block->pins == 0) {
+        COUNTER_ADD(pinnedBlocks, -1);
+        if (block->parked) {
+            block->parked = 0;
+            COUNTER_ADD(parkedBlocks, -1);
+            arenaRelease(a, position, block->requested);
+        }
+    }
+    MUTEX_UNLOCK(&a->lock);
+}
+
+// Whether a view pins the block at position; cheap while nothing is pinned
+int spacePinned(long long position) {
+    ARENA *a;
+    MEMBLOCK *block;
+    int pinned;
+    
+    if (__atomic_load_n(&pinnedBlocks, __ATOMIC_RELAXED) == 0)
+        return 0;
+    a = arenaOf(position);
+    MUTEX_LOCK(&a->lock);
+    block = indexLookup(a, position);
+    pinned = (block != NULL && !block->available && block->pins > 0);
+    MUTEX_UNLOCK(&a->lock);
+    return pinned;
+}
+
+// Size of the biggest free block. Each arena keeps its own figure current
+// under its lock, so this takes none and may trail a concurrent free.
+int largestFreeBlock() {
+    int largest = 0, count = liveArenas(), i;
+    
+    for (i = 0; i < count; i++) {
+        int size = __atomic_load_n(&arenas[i].largestFree, __ATOMIC_RELAXED);
+        if (size > largest)
+            largest = size;
+    }
+    return largest;
+}
+
+// 0 when all free space is one block, approaching 1 as it splinters
+double fragmentationRatio() {
+    long long total = __atomic_load_n(&freeBytes, __ATOMIC_RELAXED);
+    
+    if (total == 0)
+        return 0.0;
+    return 1.0 - (double)largestFreeBlock() / total;
+}
+
+// Slide the used block after a hole down into it, returns the hole's new position
+static MEMBLOCK *compactStep(ARENA *a, MEMBLOCK *hole) {
+    MEMBLOCK *used = hole->next;
+    MEMBLOCK *after;
+    long long holeOffset = hole->offset;
+    int holeSize = hole->blockSize;
+    int usedSize = used->blockSize;
+    int i;
+    
+    memmove(mainPool + holeOffset, mainPool + used->offset, usedSize);
+    MARK_DIRTY(holeOffset, usedSize);
+    
+    freeListRemove(a, hole);
+    indexRemove(a, hole);
+    indexRemove(a, used);
+    
+    // The lower node now describes the moved data, the upper one the hole
+    hole->blockSize = usedSize;
+    hole->requested = used->requested;
+    hole->available = 0;
+    hole->owner = used->owner;
+    used->offset = holeOffset + usedSize;
+    used->blockSize = holeSize;
+    used->requested = 0;
+    used->available = 1;
+    used->owner = NULL;
+    indexInsert(a, hole);
+    indexInsert(a, used);
+    
+    if (hole->owner->packOffset == holeOffset + holeSize) {
+        hole->owner->packOffset = holeOffset;
+    } else {
+        for (i = 0; i < hole->owner->extentCount; i++) {
+            if (hole->owner->extents[i].memOffset == holeOffset + holeSize) {
+                hole->owner->extents[i].memOffset = holeOffset;
+                break;
+            }
+        }
+        if (i == 0) {
+            hole->owner->memOffset = holeOffset;
+            hole->owner->dataPtr = mainPool + holeOffset;
+        }
+    }
+    
+    after = used->next;
+    if (after != NULL && after->available) {
+        freeListRemove(a, after);
+        absorbNext(a, used);
+    }
+    freeListInsert(a, used);
+    return used;
+}
+
+// Compact one arena, the caller holds its lock. Blocks whose owner is busy
+// in another thread (or in the caller) end the pass.
+static int arenaCompact(ARENA *a, int budget) {
+    MEMBLOCK *curr = a->compactCursor;
+    int moved = 0;
+    int target = (budget < 0) ? -budget : 0;
+    
+    // Buddy blocks must stay on their alignment, sliding them would break it
+    if (policy->aligned)
+        return 0;
+    while (curr != NULL) {
+        INODE *owner;
+        
+        if (!curr->available) {
+            curr = curr->next;
+            continue;
+        }
+        if (target > 0 && curr->blockSize >= target)
+            break;
+        if (curr->next == NULL)
+            break;
+        if ((owner = curr->next->owner) == NULL || curr->next->pins > 0) {
+            // Nothing to relocate it with, or a view needs it here: leave the hole behind
+            curr = curr->next;
+            continue;
+        }
+        // Always make progress, even when a single block exceeds the budget
+        if (target == 0 && moved > 0 && moved + curr->next->blockSize > budget)
+            break;
+        if (vfsConcurrent && pthread_rwlock_trywrlock(&owner->lock) != 0)
+            break;
+        moved += curr->next->blockSize;
+        SEQ_BEGIN(owner);
+        curr = compactStep(a, curr);
+        SEQ_END(owner);
+        if (vfsConcurrent)
+            pthread_rwlock_unlock(&owner->lock);
+    }
+    
+    a->compactCursor = curr;
+    COUNTER_ADD(compactedBytes, moved);
+    return moved;
+}
+
+// Move live data toward low offsets, copying at most 'budget' bytes.
+// A negative budget means run until a hole of -budget bytes exists.
+int defragmentMemory(int budget) {
+    int moved = 0, count = liveArenas(), i;
+    
+    for (i = 0; i < count; i++) {
+        ARENA *a = &arenas[i];
+        
+        if (budget > 0 && moved >= budget)
+            break;
+        MUTEX_LOCK(&a->lock);
+        moved += arenaCompact(a, budget > 0 ? budget - moved : budget);
+        MUTEX_UNLOCK(&a->lock);
+    }
+    return moved;
+}
+
+// Background work for foreground operations, bounded per call
+void compactIfFragmented() {
+    if (fragmentationRatio() > COMPACT_THRESHOLD)
+        defragmentMemory(COMPACT_STEP_BUDGET);
+}
+
+// Walk every arena and check the block lists, free lists and counters,
+// returns the number of problems found
+int checkPool(FILE *out) {
+    int problems = 0, count = liveArenas(), i;
+    long long totalFree = 0;
+    unsigned int freeCount = 0, usedCount = 0, orphans = 0;
+    
+    for (i = 0; i < count; i++) {
+        ARENA *a = &arenas[i];
+        MEMBLOCK *curr, *prev = NULL;
+        long long expect = a->base;
+        int arenaFree = 0, arenaLargest = 0, list;
+        unsigned int listed = 0, blocks = 0, freeHere = 0;
+        
+        MUTEX_LOCK(&a->lock);
+        for (curr = a->blocks; curr != NULL; prev = curr, curr = curr->next) {
+            blocks++;
+            if (curr->offset != expect || curr->blockSize <= 0 || curr->prev != prev) {
+                fprintf(out, "arena %d: block at %lld breaks the chain (expected %lld)\n", i, curr->offset, expect);
+                problems++;
+            }
+            if (indexLookup(a, curr->offset) != curr) {
+                fprintf(out, "arena %d: block at %lld missing from the index\n", i, curr->offset);
+                problems++;
+            }
+            if (curr->available) {
+                arenaFree += curr->blockSize;
+                freeHere++;
+                if (curr->blockSize > arenaLargest)
+                    arenaLargest = curr->blockSize;
+                // Buddies of different sizes stay apart
+                if (prev != NULL && prev->available && !policy->aligned) {
+                    fprintf(out, "arena %d: adjacent free blocks at %lld\n", i, curr->offset);
+                    problems++;
+                }
+            } else {
+                usedCount++;
+                if (curr->owner == NULL)
+                    orphans++;
+                if (curr->requested <= 0 || curr->requested > curr->blockSize) {
+                    fprintf(out, "arena %d: block at %lld holds %d of %d bytes\n", i, curr->offset, curr->requested, curr->blockSize);
+                    problems++;
+                }
+            }
+            expect = curr->offset + curr->blockSize;
+        }
+        if (expect != a->base + a->size || blocks != a->blockCount || arenaFree != a->freeBytes) {
+            fprintf(out, "arena %d: ends at %lld, %u blocks, %d free (expected %lld, %u, %d)\n",
+                    i, expect, blocks, arenaFree, a->base + a->size, a->blockCount, a->freeBytes);
+            problems++;
+        }
+        if (arenaLargest != a->largestFree) {
+            fprintf(out, "arena %d: largest free block is %d bytes, recorded as %d\n", i, arenaLargest, a->largestFree);
+            problems++;
+        }
+        for (list = 0; list < SIZE_CLASSES * policy->listsPerClass; list++) {
+            for (curr = a->freeLists[list]; curr != NULL; curr = curr->freeNext) {
+                listed++;
+                if (!curr->available || freeListIndex(curr->blockSize) != list) {
+                    fprintf(out, "arena %d: block at %lld on the wrong free list\n", i, curr->offset);
+                    problems++;
+                }
+            }
+        }
+        if (listed != freeHere) {
+            fprintf(out, "arena %d: %u blocks on free lists, %u free\n", i, listed, freeHere);
+            problems++;
+        }
+        totalFree += arenaFree;
+        freeCount += freeHere;
+        MUTEX_UNLOCK(&a->lock);
+    }
+    // Only blocks waiting out lock-free readers or views, or in the dedup
+    // index, may be left without an owner
+    if (orphans != retiredBlocks + parkedBlocks + dedupBlocks) {
+        fprintf(out, "pool: %u used blocks have no owner, %u are retired, %u held by views, %u shared\n",
+                orphans, retiredBlocks, parkedBlocks, dedupBlocks);
+        problems++;
+    }
+    if (totalFree != freeBytes || freeCount != freeBlockCount || usedCount != usedBlockCount) {
+        fprintf(out, "pool: %lld free bytes in %u blocks, %u used (counters say %lld, %u, %u)\n",
+                totalFree, freeCount, usedCount, freeBytes, freeBlockCount, usedBlockCount);
+        problems++;
+    }
+    return problems;
+}
+
+// Size and owner of the allocated block at position, -1 if there is none
+int usedBlockInfo(long long position, INODE **owner) {
+    ARENA *a = arenaOf(position);
+    MEMBLOCK *block;
+    int size = -1;
+    
+    MUTEX_LOCK(&a->lock);
+    block = indexLookup(a, position);
+    if (block != NULL && !block->available) {
+        size = block->requested;
+        *owner = block->owner;
+    }
+    MUTEX_UNLOCK(&a->lock);
+    return size;
+}
+
+// Show memory layout
+void showMemoryMap(FILE *out) {
+    int num = 0, count = liveArenas(), i;
+    
+    fprintf(out, "\n\n\t=== Memory Map (%s) ===", policy->name);
+    fprintf(out, "\n\tBlock\tOffset\tSize\tStatus");
+    fprintf(out, "\n\t-------------------------------------");
+    
+    for (i = 0; i < count; i++) {
+        MEMBLOCK *curr;
+        
+        MUTEX_LOCK(&arenas[i].lock);
+        if (count > 1)
+            fprintf(out, "\n\tArena %d", i);
+        for (curr = arenas[i].blocks; curr != NULL; curr = curr->next) {
+            unsigned int refs = (!curr->available && curr->owner == NULL) ? dedupRefCount(curr->offset) : 0;
+            fprintf(out, "\n\t%d\t%lld\t%d\t%s",
+                   num++,
+                   curr->offset,
+                   curr->blockSize,
+                   curr->available ? "FREE" : "USED");
+            if (!curr->available && curr->requested < curr->blockSize)
+                fprintf(out, " (%d requested)", curr->requested);
+            if (refs > 1)
+                fprintf(out, " SHARED x%u", refs);
+            else if (curr->owner != NULL && curr->owner->packOffset == curr->offset)
+                fprintf(out, " PACKED inode %u, %u bytes raw", curr->owner->inodeNo, curr->owner->fileSize);
+        }
+        MUTEX_UNLOCK(&arenas[i].lock);
+    }
+    fprintf(out, "\n\t-------------------------------------");
+    fprintf(out, "\n\tFree: %lld bytes\tFragmentation: %.2f\n", freeBytes, fragmentationRatio());
+    if (dedupBlocks > 0) {
+        unsigned int shared;
+        unsigned long long refs, saved;
+        long long used = poolSize - freeBytes;
+        
+        dedupUsage(&shared, &refs, &saved);
+        fprintf(out, "\tShared: %u blocks, %llu references\tDedup ratio: %.2f\n",
+                shared, refs, used > 0 ? (double)(used + (long long)saved) / used : 1.0);
+    }
+    if (packedFiles > 0)
+        fprintf(out, "\tPacked: %u files, %llu bytes in %llu\tCompression ratio: %.2f\n",
+                packedFiles, packedRaw, packedBytes, packedBytes > 0 ? (double)packedRaw / packedBytes : 1.0);
+}
+
+// MEMBLOCK slab usage summed over the arenas
+void blockSlabUsage(struct vfs_slab_stats *st) {
+    int count = liveArenas(), i;
+    
+    for (i = 0; i < count; i++) {
+        MUTEX_LOCK(&arenas[i].lock);
+        slabUsage(&arenas[i].blockCache, st);
+        MUTEX_UNLOCK(&arenas[i].lock);
+    }
+}
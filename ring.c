@@ -0,0 +1,180 @@
+#include "vfs_internal.h"
+
+// Submission and completion rings. vfs_ring_sqe hands out slots in the
+// submission ring and vfs_submit publishes them; a batch of up to
+// RING_BATCH_MAX entries is copied out, run through runBatch (vfs.c) and
+// its results posted to the completion ring. Batches run on the
+// submitting thread, or on the ring's workers when it has any.
+//
+// An entry's slot is free again once its batch has been copied out, and
+// no more entries may be in flight than the completion ring holds, so
+// neither ring can overflow.
+
+struct vfs_ring
+{
+    unsigned int mask;
+    struct vfs_sqe *sq;
+    struct vfs_cqe *cq;
+    unsigned int sqTail;            // next slot vfs_ring_sqe hands out
+    unsigned int sqSubmitted;       // slots before this one were submitted
+    unsigned int sqHead;            // slots before this one were taken by a batch
+    unsigned int cqTail;            // completions posted
+    unsigned int cqHead;            // completions reaped
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // submissions waiting for a worker
+    pthread_cond_t done;            // completions waiting for vfs_ring_reap
+    pthread_t *workers;
+    int workerSlots;
+    int workerCount;                // workers started
+    int stopping;
+};
+
+// Run one batch of submitted entries, returns 0 when there were none.
+// Called with the ring's lock held, which it drops while the batch runs.
+static int ringBatch(struct vfs_ring *ring)
+{
+    struct vfs_sqe batch[RING_BATCH_MAX];
+    int results[RING_BATCH_MAX];
+    int count = 0, i;
+    
+    while (ring->sqHead != ring->sqSubmitted && count < RING_BATCH_MAX)
+        batch[count++] = ring->sq[ring->sqHead++ & ring->mask];
+    if (count == 0)
+        return 0;
+    pthread_mutex_unlock(&ring->lock);
+    
+    runBatch(batch, results, count);
+    
+    pthread_mutex_lock(&ring->lock);
+    for (i = 0; i < count; i++)
+    {
+        struct vfs_cqe *cqe = &ring->cq[ring->cqTail++ & ring->mask];
+        
+        cqe->userData = batch[i].userData;
+        cqe->result = results[i];
+    }
+    pthread_cond_broadcast(&ring->done);
+    return 1;
+}
+
+static void *ringWorker(void *arg)
+{
+    struct vfs_ring *ring = (struct vfs_ring *)arg;
+    
+    pthread_mutex_lock(&ring->lock);
+    for (;;)
+    {
+        if (ringBatch(ring))
+            continue;
+        // Submitted work is finished before the ring goes away
+        if (ring->stopping)
+            break;
+        pthread_cond_wait(&ring->work, &ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+struct vfs_ring *vfs_ring_create(unsigned int entries, int workers)
+{
+    struct vfs_ring *ring;
+    unsigned int size = 1;
+    
+    if (mainPool == NULL || entries == 0 || entries > (1u << 20) || workers < 0 || (workers > 0 && !vfsConcurrent))
+        return NULL;
+    while (size < entries)
+        size <<= 1;
+    if ((ring = (struct vfs_ring *)metaCalloc(1, sizeof(struct vfs_ring))) == NULL)
+        return NULL;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->work, NULL);
+    pthread_cond_init(&ring->done, NULL);
+    ring->mask = size - 1;
+    ring->workerSlots = workers;
+    ring->sq = (struct vfs_sqe *)metaCalloc(size, sizeof(struct vfs_sqe));
+    ring->cq = (struct vfs_cqe *)metaCalloc(size, sizeof(struct vfs_cqe));
+    if (workers > 0)
+        ring->workers = (pthread_t *)metaCalloc(workers, sizeof(pthread_t));
+    if (ring->sq == NULL || ring->cq == NULL || (workers > 0 && ring->workers == NULL))
+    {
+        vfs_ring_destroy(ring);
+        return NULL;
+    }
+    for (; ring->workerCount < workers; ring->workerCount++)
+    {
+        if (pthread_create(&ring->workers[ring->workerCount], NULL, ringWorker, ring) != 0)
+        {
+            vfs_ring_destroy(ring);
+            return NULL;
+        }
+    }
+    return ring;
+}
+
+// Waits for submitted entries to finish; their completions are dropped
+void vfs_ring_destroy(struct vfs_ring *ring)
+{
+    int i;
+    
+    if (ring == NULL)
+        return;
+    pthread_mutex_lock(&ring->lock);
+    ring->stopping = 1;
+    pthread_cond_broadcast(&ring->work);
+    pthread_mutex_unlock(&ring->lock);
+    for (i = 0; i < ring->workerCount; i++)
+        pthread_join(ring->workers[i], NULL);
+    pthread_cond_destroy(&ring->work);
+    pthread_cond_destroy(&ring->done);
+    pthread_mutex_destroy(&ring->lock);
+    metaFree(ring->workers, ring->workerSlots * sizeof(pthread_t));
+    metaFree(ring->sq, (ring->mask + 1) * sizeof(struct vfs_sqe));
+    metaFree(ring->cq, (ring->mask + 1) * sizeof(struct vfs_cqe));
+    metaFree(ring, sizeof(struct vfs_ring));
+}
+
+struct vfs_sqe *vfs_ring_sqe(struct vfs_ring *ring)
+{
+    struct vfs_sqe *sqe;
+    unsigned int reaped = __atomic_load_n(&ring->cqHead, __ATOMIC_ACQUIRE);
+    
+    // cqHead only moves on the submitting thread, or under the lock
+    if (ring->sqTail - reaped > ring->mask)
+        return NULL;
+    sqe = &ring->sq[ring->sqTail++ & ring->mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int vfs_submit(struct vfs_ring *ring)
+{
+    int count;
+    
+    pthread_mutex_lock(&ring->lock);
+    count = (int)(ring->sqTail - ring->sqSubmitted);
+    ring->sqSubmitted = ring->sqTail;
+    if (ring->workerCount > 0)
+        pthread_cond_broadcast(&ring->work);
+    else
+    {
+        while (ringBatch(ring))
+            ;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return count;
+}
+
+int vfs_ring_reap(struct vfs_ring *ring, struct vfs_cqe *cqes, int max, int wait)
+{
+    unsigned int head;
+    int count = 0;
+    
+    pthread_mutex_lock(&ring->lock);
+    while (wait && ring->cqHead == ring->cqTail && ring->cqTail != ring->sqSubmitted)
+        pthread_cond_wait(&ring->done, &ring->lock);
+    for (head = ring->cqHead; count < max && head != ring->cqTail; head++)
+        cqes[count++] = ring->cq[head & ring->mask];
+    __atomic_store_n(&ring->cqHead, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring->lock);
+    return count;
+}
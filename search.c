@@ -0,0 +1,505 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+#include "vfs_internal.h"
+
+// Content search. vfs_search (vfs.c) hands over every regular file while
+// it holds the namespace, and each one is scanned where its data lies:
+// extent by extent straight out of the pool, inline files out of their
+// inode, packed files decompressed whole into a buffer of the worker's
+// own and spilled files through fileRead a chunk at a time. A
+// match running from one extent into the next is found in a small stitch
+// buffer holding the last patLen - 1 bytes of one and the first of the
+// other. Scanning does not count as an access, so a search leaves the
+// compressor, its cache and the spill CLOCK alone.
+//
+// The kernel compares the pattern's first and last bytes against 32 or 16
+// positions at once with AVX2 or SSE2, whichever the CPU has, and checks
+// the rest only where both match; without either memchr finds candidates.
+// VFS_SEARCH_KERNEL=sse2 or scalar in the environment forces a narrower one.
+//
+// In concurrent mode the caller and a pool of helper threads, started on
+// first use, claim files in turn. Each thread keeps its matches in a list
+// of its own and the caller hands them to the callback once all are done.
+
+typedef struct SearchJob SEARCHJOB;
+
+// One thread's share of a search
+typedef struct SearchWorker
+{
+    SEARCHJOB *job;
+    int *matches;           // file offsets, grouped by file in the order they were claimed
+    int matchCount;
+    int matchCapacity;
+    char *stitch;           // tail of the previous run, then the head of the next
+    int carry;              // bytes of the previous run at the front of stitch
+    int carryPos;           // file position of stitch[0]
+    char *chunk;            // spilled files are read through here
+    char *raw;              // a packed file's decompressed contents
+    int rawSize;
+    unsigned long long bytes;
+    int failed;             // the match list could not grow
+} SEARCHWORKER;
+
+// Where one file's matches ended up
+typedef struct SearchHit
+{
+    int worker;
+    int first;
+    int count;
+    int err;
+} SEARCHHIT;
+
+struct SearchJob
+{
+    INODE **files;
+    SEARCHHIT *hits;
+    int fileCount;
+    int nextFile;           // next file to claim
+    int workerCount;        // the caller and the helpers taking part
+    const char *pattern;
+    int patLen;
+    SEARCHWORKER workers[SEARCH_WORKERS_MAX];
+};
+
+typedef void (*SEARCHKERNEL)(SEARCHWORKER *w, const char *data, int len, int pos);
+
+// Totals for the statistics
+static unsigned long long searches = 0;
+static unsigned long long searchBytes = 0;
+static unsigned long long searchNs = 0;
+
+// One search at a time, the kernel is picked under it
+static pthread_mutex_t searchLock = PTHREAD_MUTEX_INITIALIZER;
+static SEARCHKERNEL searchKernel = NULL;
+static const char *kernelName = "scalar";
+
+// Helper threads, guarded by helperLock
+static pthread_mutex_t helperLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helperWake = PTHREAD_COND_INITIALIZER;   // a job was posted
+static pthread_cond_t helperDone = PTHREAD_COND_INITIALIZER;   // the last helper finished it
+static pthread_t helpers[SEARCH_WORKERS_MAX - 1];
+static unsigned int helperSeen[SEARCH_WORKERS_MAX - 1];        // last job each one ran
+static int helperCount = 0;
+static int helpersBusy = 0;
+static int helpersStopping = 0;
+static unsigned int jobSerial = 0;
+static SEARCHJOB *currentJob = NULL;
+
+static long long nowNs()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void addMatch(SEARCHWORKER *w, int pos)
+{
+    if (w->matchCount == w->matchCapacity)
+    {
+        int capacity = w->matchCapacity ? w->matchCapacity * 2 : 64;
+        int *grown = (int *)metaRealloc(w->matches, w->matchCapacity * sizeof(int), capacity * sizeof(int));
+        
+        if (grown == NULL)
+        {
+            w->failed = 1;
+            return;
+        }
+        w->matches = grown;
+        w->matchCapacity = capacity;
+    }
+    w->matches[w->matchCount++] = pos;
+}
+
+// Every match in data, which holds the file bytes from pos on
+static void scanScalar(SEARCHWORKER *w, const char *data, int len, int pos)
+{
+    const char *pat = w->job->pattern;
+    int m = w->job->patLen;
+    const char *p = data, *last;
+    
+    if (len < m)
+        return;
+    for (last = data + len - m; p <= last; p++)
+    {
+        if ((p = (const char *)memchr(p, pat[0], last - p + 1)) == NULL)
+            break;
+        if (memcmp(p + 1, pat + 1, m - 1) == 0)
+            addMatch(w, pos + (int)(p - data));
+    }
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("sse2")))
+static void scanSse2(SEARCHWORKER *w, const char *data, int len, int pos)
+{
+    const char *pat = w->job->pattern;
+    int m = w->job->patLen, i = 0;
+    __m128i first = _mm_set1_epi8(pat[0]), last = _mm_set1_epi8(pat[m - 1]);
+    
+    for (; len - m >= 15 && i <= len - m - 15; i += 16)
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + m - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit + 1, pat + 1, m - 1) == 0)
+                addMatch(w, pos + i + bit);
+            mask &= mask - 1;
+        }
+    }
+    scanScalar(w, data + i, len - i, pos + i);
+}
+
+__attribute__((target("avx2")))
+static void scanAvx2(SEARCHWORKER *w, const char *data, int len, int pos)
+{
+    const char *pat = w->job->pattern;
+    int m = w->job->patLen, i = 0;
+    __m256i first = _mm256_set1_epi8(pat[0]), last = _mm256_set1_epi8(pat[m - 1]);
+    
+    for (; len - m >= 31 && i <= len - m - 31; i += 32)
+    {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + m - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit + 1, pat + 1, m - 1) == 0)
+                addMatch(w, pos + i + bit);
+            mask &= mask - 1;
+        }
+    }
+    scanScalar(w, data + i, len - i, pos + i);
+}
+#endif
+
+// The widest kernel this CPU runs, or the one VFS_SEARCH_KERNEL names if
+// it runs it; the caller holds searchLock
+static void pickKernel()
+{
+    const char *want = getenv("VFS_SEARCH_KERNEL");
+    
+    if (searchKernel != NULL)
+        return;
+    searchKernel = scanScalar;
+    if (want != NULL && strcmp(want, "scalar") == 0)
+        return;
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (want == NULL || strcmp(want, "sse2") != 0))
+    {
+        searchKernel = scanAvx2;
+        kernelName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        searchKernel = scanSse2;
+        kernelName = "sse2";
+    }
+#endif
+}
+
+// Scan the next len bytes of a file, at file position pos. Runs come in
+// file order with no gaps, the stitch catches matches across their seams.
+static void scanRun(SEARCHWORKER *w, const char *data, int len, int pos)
+{
+    int keep = w->job->patLen - 1, take = (len < keep) ? len : keep, total;
+    
+    w->bytes += len;
+    if (w->carry == 0)
+        w->carryPos = pos;
+    memcpy(w->stitch + w->carry, data, take);
+    // Only matches starting in the carried bytes fit in the stitch
+    if (w->carry > 0)
+        searchKernel(w, w->stitch, w->carry + take, w->carryPos);
+    searchKernel(w, data, len, pos);
+    
+    if (len >= keep)
+    {
+        memcpy(w->stitch, data + len - keep, keep);
+        w->carry = keep;
+        w->carryPos = pos + len - keep;
+        return;
+    }
+    total = w->carry + len;
+    if (total > keep)
+    {
+        memmove(w->stitch, w->stitch + total - keep, keep);
+        w->carryPos += total - keep;
+        total = keep;
+    }
+    w->carry = total;
+}
+
+// Decompress a packed file once, taking the cached copy if there is one.
+// A file bigger than the cache would otherwise be decompressed per chunk,
+// and a smaller one would push hot files out of it.
+static int scanPacked(SEARCHWORKER *w, INODE *node)
+{
+    int size = node->fileSize;
+    
+    if (size > w->rawSize)
+    {
+        if (w->raw != NULL)
+            metaFree(w->raw, w->rawSize);
+        w->rawSize = 0;
+        if ((w->raw = (char *)metaAlloc(size)) == NULL)
+            return VFS_ENOMEM;
+        w->rawSize = size;
+    }
+    if (packCachePeek(node, w->raw, size) != size &&
+        lzDecompress(mainPool + node->packOffset, node->packedSize, w->raw, size) != 0)
+        return VFS_EIO;
+    scanRun(w, w->raw, size, 0);
+    return VFS_OK;
+}
+
+static void scanFile(SEARCHWORKER *w, int idx)
+{
+    INODE *node = w->job->files[idx];
+    SEARCHHIT *hit = &w->job->hits[idx];
+    int i, n, pos;
+    
+    hit->worker = (int)(w - w->job->workers);
+    hit->first = w->matchCount;
+    w->carry = 0;
+    READ_LOCK(&node->lock);
+    if (node->spillOffset == -1 && node->packOffset != -1)
+        hit->err = scanPacked(w, node);
+    else if (node->spillOffset != -1)
+    {
+        if (w->chunk == NULL && (w->chunk = (char *)metaAlloc(SEARCH_CHUNK)) == NULL)
+            hit->err = VFS_ENOMEM;
+        for (pos = 0; hit->err == VFS_OK && pos < (int)node->fileSize; pos += n)
+        {
+            if ((n = fileRead(node, pos, w->chunk, SEARCH_CHUNK)) <= 0)
+                hit->err = (n < 0) ? n : VFS_EIO;
+            else
+                scanRun(w, w->chunk, n, pos);
+        }
+    }
+    else if (node->extentCount == 0)
+        scanRun(w, node->inlineData, node->fileSize, 0);
+    else
+    {
+        for (i = 0; i < node->extentCount; i++)
+            scanRun(w, mainPool + node->extents[i].memOffset, node->extents[i].length, node->extents[i].start);
+    }
+    RW_UNLOCK(&node->lock);
+    hit->count = w->matchCount - hit->first;
+    if (w->failed && hit->err == VFS_OK)
+        hit->err = VFS_ENOMEM;
+}
+
+// Claim and scan files until none are left
+static void scanShare(SEARCHWORKER *w)
+{
+    SEARCHJOB *job = w->job;
+    int idx;
+    
+    while ((idx = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED)) < job->fileCount)
+        scanFile(w, idx);
+}
+
+static void *helperMain(void *arg)
+{
+    int slot = (int)(long)arg;
+    
+    pthread_mutex_lock(&helperLock);
+    for (;;)
+    {
+        while (helperSeen[slot] == jobSerial && !helpersStopping)
+            pthread_cond_wait(&helperWake, &helperLock);
+        if (helpersStopping)
+            break;
+        helperSeen[slot] = jobSerial;
+        pthread_mutex_unlock(&helperLock);
+        
+        if (slot + 1 < currentJob->workerCount)
+            scanShare(&currentJob->workers[slot + 1]);
+        
+        pthread_mutex_lock(&helperLock);
+        if (--helpersBusy == 0)
+            pthread_cond_signal(&helperDone);
+    }
+    pthread_mutex_unlock(&helperLock);
+    return NULL;
+}
+
+// One helper per further core, the caller holds searchLock
+static void startHelpers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = (cpus < 1) ? 0 : (cpus > SEARCH_WORKERS_MAX) ? SEARCH_WORKERS_MAX - 1 : (int)cpus - 1;
+    
+    pthread_mutex_lock(&helperLock);
+    while (helperCount < wanted)
+    {
+        helperSeen[helperCount] = jobSerial;
+        if (pthread_create(&helpers[helperCount], NULL, helperMain, (void *)(long)helperCount) != 0)
+            break;
+        helperCount++;
+    }
+    pthread_mutex_unlock(&helperLock);
+}
+
+// Bytes to scan, to tell whether waking the helpers pays. Writers may be
+// changing the sizes meanwhile, a guess is all it takes.
+__attribute__((no_sanitize_thread))
+static unsigned long long guessBytes(INODE **files, int count)
+{
+    unsigned long long total = 0;
+    int i;
+    
+    for (i = 0; i < count; i++)
+        total += files[i]->fileSize;
+    return total;
+}
+
+// Scan count files for pattern and report what was found, the caller
+// holds the namespace. Returns the number of matches.
+int searchFiles(INODE **files, int count, const char *pattern, int len,
+                vfs_search_callback callback, void *arg)
+{
+    SEARCHJOB job;
+    unsigned long long total = 0;
+    long long start = nowNs();
+    int i, k, workers = 1, matches = 0, err = VFS_OK;
+    
+    memset(&job, 0, sizeof(job));
+    job.files = files;
+    job.fileCount = count;
+    job.pattern = pattern;
+    job.patLen = len;
+    if ((job.hits = (SEARCHHIT *)metaCalloc(count + 1, sizeof(SEARCHHIT))) == NULL)
+        return VFS_ENOMEM;
+    total = guessBytes(files, count);
+    
+    pthread_mutex_lock(&searchLock);
+    pickKernel();
+    // Small searches are over before helpers would have woken up
+    if (vfsConcurrent && total >= SEARCH_PARALLEL_MIN && count > 1)
+    {
+        startHelpers();
+        workers = helperCount + 1;
+    }
+    for (i = 0; i < workers; i++)
+    {
+        job.workers[i].job = &job;
+        if ((job.workers[i].stitch = (char *)metaAlloc(2 * len)) == NULL)
+        {
+            workers = i;
+            break;
+        }
+    }
+    if (workers == 0)
+    {
+        pthread_mutex_unlock(&searchLock);
+        metaFree(job.hits, (count + 1) * sizeof(SEARCHHIT));
+        return VFS_ENOMEM;
+    }
+    job.workerCount = workers;
+    if (workers > 1)
+    {
+        pthread_mutex_lock(&helperLock);
+        currentJob = &job;
+        helpersBusy = helperCount;
+        jobSerial++;
+        pthread_cond_broadcast(&helperWake);
+        pthread_mutex_unlock(&helperLock);
+    }
+    scanShare(&job.workers[0]);
+    if (workers > 1)
+    {
+        pthread_mutex_lock(&helperLock);
+        while (helpersBusy > 0)
+            pthread_cond_wait(&helperDone, &helperLock);
+        currentJob = NULL;
+        pthread_mutex_unlock(&helperLock);
+    }
+    pthread_mutex_unlock(&searchLock);
+    
+    for (i = 0; i < count; i++)
+    {
+        SEARCHHIT *hit = &job.hits[i];
+        const int *found = job.workers[hit->worker].matches + hit->first;
+        
+        if (hit->err != VFS_OK && err == VFS_OK)
+            err = hit->err;
+        for (k = 0; k < hit->count; k++)
+            callback(files[i]->inodeNo, files[i]->name, found[k], arg);
+        matches += hit->count;
+    }
+    total = 0;
+    for (i = 0; i < workers; i++)
+    {
+        SEARCHWORKER *w = &job.workers[i];
+        
+        total += w->bytes;
+        metaFree(w->matches, w->matchCapacity * sizeof(int));
+        metaFree(w->stitch, 2 * len);
+        if (w->chunk != NULL)
+            metaFree(w->chunk, SEARCH_CHUNK);
+        if (w->raw != NULL)
+            metaFree(w->raw, w->rawSize);
+    }
+    metaFree(job.hits, (count + 1) * sizeof(SEARCHHIT));
+    __atomic_fetch_add(&searches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&searchBytes, total, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&searchNs, nowNs() - start, __ATOMIC_RELAXED);
+    return (err != VFS_OK) ? err : matches;
+}
+
+const char *vfs_search_kernel(void)
+{
+    pthread_mutex_lock(&searchLock);
+    pickKernel();
+    pthread_mutex_unlock(&searchLock);
+    return kernelName;
+}
+
+void searchUsage(struct vfs_stats *st)
+{
+    st->searches = __atomic_load_n(&searches, __ATOMIC_RELAXED);
+    st->searchBytes = __atomic_load_n(&searchBytes, __ATOMIC_RELAXED);
+    st->searchNs = __atomic_load_n(&searchNs, __ATOMIC_RELAXED);
+}
+
+void searchResetStats()
+{
+    __atomic_store_n(&searches, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&searchBytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&searchNs, 0, __ATOMIC_RELAXED);
+}
+
+// Stop the helpers, vfs_shutdown calls it once no search can be running
+void searchTeardown()
+{
+    int i;
+    
+    pthread_mutex_lock(&helperLock);
+    helpersStopping = 1;
+    pthread_cond_broadcast(&helperWake);
+    pthread_mutex_unlock(&helperLock);
+    for (i = 0; i < helperCount; i++)
+        pthread_join(helpers[i], NULL);
+    helperCount = 0;
+    helpersStopping = 0;
+    searchResetStats();
+}
@@ -0,0 +1,164 @@
+#include "vfs_internal.h"
+
+#include <stdint.h>
+
+// Fixed-size caches for metadata nodes. Objects are carved from SLAB_BYTES
+// slabs aligned to their own size, so masking an object's address finds its
+// slab. Each object starts on a cache line and free ones are chained by index.
+
+typedef struct Slab
+{
+    SLABCACHE *cache;
+    struct Slab *next;              // every slab of the cache
+    struct Slab *prev;
+    struct Slab *partialNext;       // slabs with at least one free object
+    struct Slab *partialPrev;
+    int freeHead;                   // first free object, -1 when full
+    unsigned int inUse;
+} SLAB;
+
+// Objects start after the header, on a cache line
+#define SLAB_HEADER (((sizeof(SLAB) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE)
+
+void slabInit(SLABCACHE *cache, size_t size, int locked)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (locked)
+        pthread_mutex_init(&cache->lock, NULL);
+    cache->locked = locked;
+    cache->size = size;
+}
+
+static char *slabObject(SLAB *slab, int idx)
+{
+    return (char *)slab + SLAB_HEADER + (size_t)idx * slab->cache->stride;
+}
+
+static void partialInsert(SLABCACHE *cache, SLAB *slab)
+{
+    slab->partialPrev = NULL;
+    slab->partialNext = cache->partial;
+    if (cache->partial != NULL)
+        cache->partial->partialPrev = slab;
+    cache->partial = slab;
+}
+
+static void partialRemove(SLABCACHE *cache, SLAB *slab)
+{
+    if (slab->partialPrev != NULL)
+        slab->partialPrev->partialNext = slab->partialNext;
+    else
+        cache->partial = slab->partialNext;
+    if (slab->partialNext != NULL)
+        slab->partialNext->partialPrev = slab->partialPrev;
+    slab->partialNext = slab->partialPrev = NULL;
+}
+
+// Add an empty slab to the cache, NULL when the host is out of memory
+static SLAB *slabGrow(SLABCACHE *cache)
+{
+    SLAB *slab;
+    int i;
+    
+    if (cache->perSlab == 0)
+    {
+        // Sized on first use so caches can be initialized statically
+        cache->stride = ((cache->size + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE;
+        cache->perSlab = (SLAB_BYTES - SLAB_HEADER) / cache->stride;
+    }
+    if ((slab = (SLAB *)metaAlignedAlloc(SLAB_BYTES, SLAB_BYTES)) == NULL)
+        return NULL;
+    slab->cache = cache;
+    slab->inUse = 0;
+    slab->freeHead = 0;
+    for (i = 0; i < (int)cache->perSlab; i++)
+        *(int *)slabObject(slab, i) = (i + 1 < (int)cache->perSlab) ? i + 1 : -1;
+    
+    slab->prev = NULL;
+    slab->next = cache->slabs;
+    if (cache->slabs != NULL)
+        cache->slabs->prev = slab;
+    cache->slabs = slab;
+    cache->slabCount++;
+    partialInsert(cache, slab);
+    return slab;
+}
+
+static void slabRelease(SLABCACHE *cache, SLAB *slab)
+{
+    partialRemove(cache, slab);
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        cache->slabs = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    cache->slabCount--;
+    metaFree(slab, SLAB_BYTES);
+}
+
+// Uninitialized object from the cache
+void *slabAlloc(SLABCACHE *cache)
+{
+    SLAB *slab;
+    char *obj = NULL;
+    
+    if (cache->locked)
+        MUTEX_LOCK(&cache->lock);
+    if ((slab = cache->partial) != NULL || (slab = slabGrow(cache)) != NULL)
+    {
+        obj = slabObject(slab, slab->freeHead);
+        slab->freeHead = *(int *)obj;
+        slab->inUse++;
+        cache->inUse++;
+        if (slab->freeHead == -1)
+            partialRemove(cache, slab);
+    }
+    if (cache->locked)
+        MUTEX_UNLOCK(&cache->lock);
+    return obj;
+}
+
+void slabFree(SLABCACHE *cache, void *obj)
+{
+    SLAB *slab;
+    
+    if (obj == NULL)
+        return;
+    slab = (SLAB *)((uintptr_t)obj & ~(uintptr_t)(SLAB_BYTES - 1));
+    if (cache->locked)
+        MUTEX_LOCK(&cache->lock);
+    *(int *)obj = slab->freeHead;
+    if (slab->freeHead == -1)
+        partialInsert(cache, slab);
+    slab->freeHead = (int)(((char *)obj - slabObject(slab, 0)) / cache->stride);
+    slab->inUse--;
+    cache->inUse--;
+    // Keep the last partial slab even when empty, so alloc/free pairs don't thrash
+    if (slab->inUse == 0 && (cache->partial != slab || slab->partialNext != NULL))
+        slabRelease(cache, slab);
+    if (cache->locked)
+        MUTEX_UNLOCK(&cache->lock);
+}
+
+// Free every slab at once, whatever is still allocated from them
+void slabDestroy(SLABCACHE *cache)
+{
+    while (cache->slabs != NULL)
+        slabRelease(cache, cache->slabs);
+    cache->inUse = 0;
+}
+
+// Add the cache's usage to st
+void slabUsage(SLABCACHE *cache, struct vfs_slab_stats *st)
+{
+    if (cache->locked)
+        MUTEX_LOCK(&cache->lock);
+    st->objectSize = (unsigned int)((cache->stride != 0) ? cache->stride : cache->size);
+    st->inUse += cache->inUse;
+    st->capacity += cache->slabCount * cache->perSlab;
+    st->slabs += cache->slabCount;
+    st->bytes += (size_t)cache->slabCount * SLAB_BYTES;
+    if (cache->locked)
+        MUTEX_UNLOCK(&cache->lock);
+}
@@ -0,0 +1,349 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vfs_internal.h"
+
+// Second storage tier. When a write finds the pool full the engine evicts
+// files it has not seen touched lately (see evictCold in vfs.c): each one's
+// whole contents go to one run of the backing file and its inode keeps the
+// run's offset instead of extents. Reading a spilled file brings it back.
+// In concurrent mode that is left to a fault worker, fed inode numbers
+// through a small queue, while readers are served straight from the file.
+//
+// Free runs of the backing file are kept sorted by offset and coalesced;
+// new runs go to the first that fits, or the end of the file.
+
+// A fault queued for the worker
+typedef struct FaultRequest
+{
+    unsigned int inodeNo;
+    int evict;          // may evict colder files to make room
+} FAULTREQUEST;
+
+// Unused run of the backing file
+typedef struct SpillRange
+{
+    long long offset;
+    long long size;
+} SPILLRANGE;
+
+int spillEnabled = 0;
+struct vfs_spill_policy spillPolicy = { NULL, 4096, 4 };
+unsigned int spilledFiles = 0;
+unsigned long long spilledBytes = 0;
+unsigned long long spillEvictions = 0;
+unsigned long long spillFaults = 0;
+unsigned long long spillDiskReads = 0;
+
+// Guards everything below
+static pthread_mutex_t spillLock = PTHREAD_MUTEX_INITIALIZER;
+static int spillFd = -1;
+static char *spillPath = NULL;
+static long long spillEnd = 0;
+static SPILLRANGE *freeRanges = NULL;
+static int rangeCount = 0;
+static int rangeCapacity = 0;
+
+// Inodes waiting for the fault worker
+static pthread_cond_t faultReady = PTHREAD_COND_INITIALIZER;
+static FAULTREQUEST faultQueue[SPILL_QUEUE];
+static unsigned int faultHead = 0;
+static unsigned int faultTail = 0;
+static pthread_t faultWorker;
+static int workerRunning = 0;
+static int workerStopping = 0;
+
+// Take size bytes of the backing file, the caller holds spillLock
+static long long spillAlloc(int size)
+{
+    long long offset;
+    int i;
+    
+    for (i = 0; i < rangeCount; i++)
+    {
+        if (freeRanges[i].size < size)
+            continue;
+        offset = freeRanges[i].offset;
+        freeRanges[i].offset += size;
+        freeRanges[i].size -= size;
+        if (freeRanges[i].size == 0)
+        {
+            memmove(freeRanges + i, freeRanges + i + 1, (rangeCount - i - 1) * sizeof(SPILLRANGE));
+            rangeCount--;
+        }
+        return offset;
+    }
+    offset = spillEnd;
+    spillEnd += size;
+    return offset;
+}
+
+// Write data to a new run of the backing file, returns its offset or -1
+long long spillStore(const char *data, int size)
+{
+    long long offset;
+    int done = 0;
+    
+    pthread_mutex_lock(&spillLock);
+    if (spillFd < 0)
+    {
+        pthread_mutex_unlock(&spillLock);
+        return -1;
+    }
+    offset = spillAlloc(size);
+    pthread_mutex_unlock(&spillLock);
+    
+    // The run is ours now, the copy needs no lock
+    while (done < size)
+    {
+        ssize_t n = pwrite(spillFd, data + done, size - done, offset + done);
+        if (n <= 0)
+        {
+            spillFree(offset, size);
+            return -1;
+        }
+        done += n;
+    }
+    return offset;
+}
+
+// Copy len bytes from the backing file at offset, 0 on success
+int spillLoad(long long offset, char *buf, int len)
+{
+    int done = 0;
+    
+    while (done < len)
+    {
+        ssize_t n = pread(spillFd, buf + done, len - done, offset + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Give a run of the backing file back, merging it with its neighbours
+void spillFree(long long offset, int size)
+{
+    SPILLRANGE *ranges;
+    int i;
+    
+    pthread_mutex_lock(&spillLock);
+    for (i = 0; i < rangeCount && freeRanges[i].offset < offset; i++)
+        ;
+    if (i > 0 && freeRanges[i - 1].offset + freeRanges[i - 1].size == offset)
+    {
+        freeRanges[i - 1].size += size;
+        if (i < rangeCount && offset + size == freeRanges[i].offset)
+        {
+            freeRanges[i - 1].size += freeRanges[i].size;
+            memmove(freeRanges + i, freeRanges + i + 1, (rangeCount - i - 1) * sizeof(SPILLRANGE));
+            rangeCount--;
+        }
+    }
+    else if (i < rangeCount && offset + size == freeRanges[i].offset)
+    {
+        freeRanges[i].offset = offset;
+        freeRanges[i].size += size;
+    }
+    else
+    {
+        if (rangeCount == rangeCapacity)
+        {
+            int cap = rangeCapacity ? rangeCapacity * 2 : 16;
+            ranges = (SPILLRANGE *)metaRealloc(freeRanges, rangeCapacity * sizeof(SPILLRANGE),
+                                               cap * sizeof(SPILLRANGE));
+            if (ranges == NULL)
+            {
+                // The run is lost until the backing file is replaced
+                pthread_mutex_unlock(&spillLock);
+                return;
+            }
+            freeRanges = ranges;
+            rangeCapacity = cap;
+        }
+        memmove(freeRanges + i + 1, freeRanges + i, (rangeCount - i) * sizeof(SPILLRANGE));
+        freeRanges[i].offset = offset;
+        freeRanges[i].size = size;
+        rangeCount++;
+    }
+    
+    // A free run at the end just shortens the file
+    if (rangeCount > 0 && freeRanges[rangeCount - 1].offset + freeRanges[rangeCount - 1].size == spillEnd)
+    {
+        spillEnd = freeRanges[rangeCount - 1].offset;
+        rangeCount--;
+    }
+    pthread_mutex_unlock(&spillLock);
+}
+
+// Ask the fault worker to bring inodeNo back, dropped when the queue is
+// full or it is already waiting
+void spillQueue(unsigned int inodeNo, int evict)
+{
+    unsigned int i;
+    
+    pthread_mutex_lock(&spillLock);
+    if (!workerRunning || faultTail - faultHead == SPILL_QUEUE)
+    {
+        pthread_mutex_unlock(&spillLock);
+        return;
+    }
+    for (i = faultHead; i != faultTail; i++)
+    {
+        if (faultQueue[i % SPILL_QUEUE].inodeNo == inodeNo)
+        {
+            faultQueue[i % SPILL_QUEUE].evict |= evict;
+            pthread_mutex_unlock(&spillLock);
+            return;
+        }
+    }
+    faultQueue[faultTail % SPILL_QUEUE].inodeNo = inodeNo;
+    faultQueue[faultTail++ % SPILL_QUEUE].evict = evict;
+    pthread_cond_signal(&faultReady);
+    pthread_mutex_unlock(&spillLock);
+}
+
+static void *faultMain(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&spillLock);
+    for (;;)
+    {
+        FAULTREQUEST req;
+        
+        while (faultHead == faultTail && !workerStopping)
+            pthread_cond_wait(&faultReady, &spillLock);
+        if (workerStopping)
+            break;
+        req = faultQueue[faultHead++ % SPILL_QUEUE];
+        pthread_mutex_unlock(&spillLock);
+        faultInode(req.inodeNo, req.evict);
+        pthread_mutex_lock(&spillLock);
+    }
+    pthread_mutex_unlock(&spillLock);
+    return NULL;
+}
+
+static void startWorker()
+{
+    pthread_mutex_lock(&spillLock);
+    faultHead = faultTail = 0;
+    workerStopping = 0;
+    workerRunning = (pthread_create(&faultWorker, NULL, faultMain, NULL) == 0);
+    pthread_mutex_unlock(&spillLock);
+}
+
+// Faults still queued are dropped, the files stay readable from the file
+static void stopWorker()
+{
+    int running;
+    
+    pthread_mutex_lock(&spillLock);
+    running = workerRunning;
+    workerStopping = 1;
+    workerRunning = 0;
+    pthread_cond_signal(&faultReady);
+    pthread_mutex_unlock(&spillLock);
+    if (running)
+        pthread_join(faultWorker, NULL);
+}
+
+// Close the backing file and forget its runs
+static void closeSpill()
+{
+    if (spillFd >= 0)
+        close(spillFd);
+    if (spillPath != NULL)
+        metaFree(spillPath, strlen(spillPath) + 1);
+    metaFree(freeRanges, rangeCapacity * sizeof(SPILLRANGE));
+    spillFd = -1;
+    spillPath = NULL;
+    freeRanges = NULL;
+    rangeCount = rangeCapacity = 0;
+    spillEnd = 0;
+    spillEnabled = 0;
+}
+
+void spillUsage(struct vfs_stats *st)
+{
+    st->spilledFiles = spilledFiles;
+    st->spilledBytes = (size_t)spilledBytes;
+    st->spillEvictions = spillEvictions;
+    st->spillFaults = spillFaults;
+    st->spillDiskReads = spillDiskReads;
+    pthread_mutex_lock(&spillLock);
+    st->spillFileBytes = (size_t)spillEnd;
+    pthread_mutex_unlock(&spillLock);
+}
+
+void spillResetStats()
+{
+    spillEvictions = spillFaults = spillDiskReads = 0;
+}
+
+// Spilled data is simply dropped, the inodes are going away
+void spillTeardown()
+{
+    stopWorker();
+    closeSpill();
+    spillPolicy.path = NULL;
+    spillPolicy.minSize = 4096;
+    spillPolicy.prefetch = 4;
+    spilledFiles = 0;
+    spilledBytes = 0;
+    spillResetStats();
+}
+
+// Open policy->path as the new backing file, the caller holds the namespace
+static int openSpill(const struct vfs_spill_policy *policy)
+{
+    char *path = (char *)metaAlloc(strlen(policy->path) + 1);
+    int fd;
+    
+    if (path == NULL)
+        return VFS_ENOMEM;
+    if ((fd = open(policy->path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        metaFree(path, strlen(policy->path) + 1);
+        return VFS_EIO;
+    }
+    strcpy(path, policy->path);
+    spillFd = fd;
+    spillPath = path;
+    spillPolicy.minSize = policy->minSize;
+    spillPolicy.prefetch = policy->prefetch;
+    spillEnabled = 1;
+    return VFS_OK;
+}
+
+int vfs_set_spill(const struct vfs_spill_policy *policy)
+{
+    int err;
+    
+    if (mainPool == NULL || policy == NULL)
+        return VFS_EINVAL;
+    // Same file, new thresholds
+    if (spillEnabled && policy->path != NULL && strcmp(policy->path, spillPath) == 0)
+    {
+        spillPolicy.minSize = policy->minSize;
+        spillPolicy.prefetch = policy->prefetch;
+        return VFS_OK;
+    }
+    
+    stopWorker();
+    lockNamespace();
+    // Nothing may stay behind in a file that is going away
+    if ((err = faultAll()) == VFS_OK)
+    {
+        closeSpill();
+        if (policy->path != NULL)
+            err = openSpill(policy);
+    }
+    unlockNamespace();
+    if (spillEnabled && vfsConcurrent)
+        startWorker();
+    return err;
+}
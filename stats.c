@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "vfs_internal.h"
+
+// Threads update their own shard, readers sum them
+static struct vfs_op_stats opStats[STAT_SHARDS][VFS_OP_COUNT];
+
+static const char *opNames[VFS_OP_COUNT] = {
+    "open", "close", "read", "write", "append", "unlink", "mkdir", "rmdir", "stat", "truncate", "link"
+};
+
+static const char *slabNames[VFS_SLAB_COUNT] = { "inode", "filetable", "memblock" };
+
+long long statStart()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Account one call of op that began at start, passing its result through
+int statEnd(int op, long long start, int ret)
+{
+    struct vfs_op_stats *s = &opStats[vfsConcurrent ? currentSlot() % STAT_SHARDS : 0][op];
+    long long ns = statStart() - start;
+    int bucket = 0;
+    
+    if (ns > 1)
+        bucket = 63 - __builtin_clzll((unsigned long long)ns);
+    if (bucket >= VFS_HIST_BUCKETS)
+        bucket = VFS_HIST_BUCKETS - 1;
+    
+    COUNTER_ADD(s->count, 1);
+    COUNTER_ADD(s->totalNs, ns);
+    COUNTER_ADD(s->histogram[bucket], 1);
+    if (ret < 0)
+        COUNTER_ADD(s->errors, 1);
+    return ret;
+}
+
+void resetStats()
+{
+    memset(opStats, 0, sizeof(opStats));
+}
+
+void vfs_reset_stats(void)
+{
+    resetStats();
+    packResetStats();
+    spillResetStats();
+    journalResetStats();
+    searchResetStats();
+    checksumResetStats();
+    allocFailures = 0;
+    compactedBytes = 0;
+}
+
+int vfs_get_stats(struct vfs_stats *st)
+{
+    unsigned long long saved;
+    int shard, op, i;
+    
+    if (mainPool == NULL)
+        return VFS_EINVAL;
+    
+    st->poolBytes = __atomic_load_n(&poolSize, __ATOMIC_ACQUIRE);
+    st->poolLimit = poolReserve;
+    st->arenas = poolArenas();
+    st->allocPolicy = poolPolicy();
+    st->freeBytes = freeBytes;
+    st->usedBytes = st->poolBytes - st->freeBytes;
+    st->largestFree = largestFreeBlock();
+    st->fragmentation = fragmentationRatio();
+    st->freeBlocks = freeBlockCount;
+    st->usedBlocks = usedBlockCount;
+    st->allocFailures = allocFailures;
+    st->compactedBytes = compactedBytes;
+    st->slackBytes = (size_t)slackBytes;
+    st->inodesUsed = S.usedInode;
+    st->inodesTotal = S.totalInode;
+    st->openFiles = openFileCount;
+    st->metaBytes = metaBytes;
+    st->metaPeak = metaPeak;
+    dedupUsage(&st->dedupBlocks, &st->dedupRefs, &saved);
+    st->dedupSaved = (size_t)saved;
+    packUsage(st);
+    st->inlineFiles = inlineFiles;
+    st->inlineBytes = (size_t)inlineBytes;
+    st->pinnedBlocks = pinnedBlocks;
+    st->parkedBlocks = parkedBlocks;
+    spillUsage(st);
+    journalUsage(st);
+    searchUsage(st);
+    checksumUsage(st);
+    memset(st->slabs, 0, sizeof(st->slabs));
+    slabUsage(&inodeCache, &st->slabs[VFS_SLAB_INODE]);
+    slabUsage(&fileTableCache, &st->slabs[VFS_SLAB_FILETABLE]);
+    blockSlabUsage(&st->slabs[VFS_SLAB_MEMBLOCK]);
+    memset(st->ops, 0, sizeof(st->ops));
+    for (shard = 0; shard < STAT_SHARDS; shard++)
+    {
+        for (op = 0; op < VFS_OP_COUNT; op++)
+        {
+            const struct vfs_op_stats *s = &opStats[shard][op];
+            
+            st->ops[op].count += s->count;
+            st->ops[op].errors += s->errors;
+            st->ops[op].totalNs += s->totalNs;
+            for (i = 0; i < VFS_HIST_BUCKETS; i++)
+                st->ops[op].histogram[i] += s->histogram[i];
+        }
+    }
+    return VFS_OK;
+}
+
+// Upper bound of the histogram bucket holding quantile q
+static unsigned long long histogramQuantile(const struct vfs_op_stats *s, double q)
+{
+    unsigned long long seen = 0, target = (unsigned long long)(q * s->count);
+    int i;
+    
+    for (i = 0; i < VFS_HIST_BUCKETS; i++)
+    {
+        seen += s->histogram[i];
+        if (seen > target)
+            return 2ULL << i;
+    }
+    return 2ULL << (VFS_HIST_BUCKETS - 1);
+}
+
+int vfs_dump_stats_json(FILE *out)
+{
+    struct vfs_stats st;
+    int op, i, err;
+    
+    if ((err = vfs_get_stats(&st)) != VFS_OK)
+        return err;
+    
+    fprintf(out, "{\"pool\":{\"bytes\":%zu,\"limit\":%zu,\"arenas\":%u,\"policy\":\"%s\",\"used\":%zu,\"free\":%zu,"
+            "\"largest_free\":%zu,\"fragmentation\":%.4f,\"free_blocks\":%u,\"used_blocks\":%u,"
+            "\"slack\":%zu,\"alloc_failures\":%llu,\"compacted_bytes\":%llu},",
+            st.poolBytes, st.poolLimit, st.arenas, vfs_alloc_name(st.allocPolicy), st.usedBytes, st.freeBytes,
+            st.largestFree, st.fragmentation, st.freeBlocks, st.usedBlocks, st.slackBytes,
+            st.allocFailures, st.compactedBytes);
+    fprintf(out, "\"dedup\":{\"blocks\":%u,\"refs\":%llu,\"saved\":%zu},",
+            st.dedupBlocks, st.dedupRefs, st.dedupSaved);
+    fprintf(out, "\"compression\":{\"files\":%u,\"raw\":%zu,\"bytes\":%zu,\"cache_bytes\":%zu,"
+            "\"cache_hits\":%llu,\"cache_misses\":%llu},",
+            st.packedFiles, st.packedRaw, st.packedBytes, st.packCacheBytes,
+            st.packCacheHits, st.packCacheMisses);
+    fprintf(out, "\"inline\":{\"files\":%u,\"bytes\":%zu},", st.inlineFiles, st.inlineBytes);
+    fprintf(out, "\"views\":{\"pinned\":%u,\"parked\":%u},", st.pinnedBlocks, st.parkedBlocks);
+    fprintf(out, "\"spill\":{\"files\":%u,\"bytes\":%zu,\"file_bytes\":%zu,\"evictions\":%llu,"
+            "\"faults\":%llu,\"disk_reads\":%llu},",
+            st.spilledFiles, st.spilledBytes, st.spillFileBytes, st.spillEvictions,
+            st.spillFaults, st.spillDiskReads);
+    fprintf(out, "\"journal\":{\"records\":%llu,\"commits\":%llu,\"checkpoints\":%llu,\"file_bytes\":%zu,"
+            "\"replayed\":%llu,\"replay_us\":%llu},",
+            st.journalRecords, st.journalCommits, st.journalCheckpoints, st.journalFileBytes,
+            st.journalReplayed, st.journalReplayUs);
+    fprintf(out, "\"search\":{\"searches\":%llu,\"bytes\":%llu,\"ns\":%llu},",
+            st.searches, st.searchBytes, st.searchNs);
+    fprintf(out, "\"checksum\":{\"corrupt_inodes\":%u,\"errors\":%llu,\"scrub_passes\":%llu,\"scrub_bytes\":%llu},",
+            st.corruptInodes, st.checksumErrors, st.scrubPasses, st.scrubBytes);
+    fprintf(out, "\"inodes\":{\"used\":%u,\"total\":%u},\"open_files\":%u,"
+            "\"metadata\":{\"bytes\":%zu,\"peak\":%zu,\"slabs\":{",
+            st.inodesUsed, st.inodesTotal, st.openFiles, st.metaBytes, st.metaPeak);
+    for (i = 0; i < VFS_SLAB_COUNT; i++)
+    {
+        struct vfs_slab_stats *s = &st.slabs[i];
+        
+        fprintf(out, "%s\"%s\":{\"object_size\":%u,\"in_use\":%u,\"capacity\":%u,\"slabs\":%u,\"bytes\":%zu}",
+                i ? "," : "", slabNames[i], s->objectSize, s->inUse, s->capacity, s->slabs, s->bytes);
+    }
+    fprintf(out, "}},\"ops\":{");
+    
+    for (op = 0; op < VFS_OP_COUNT; op++)
+    {
+        struct vfs_op_stats *s = &st.ops[op];
+        int last = VFS_HIST_BUCKETS - 1;
+        
+        while (last > 0 && s->histogram[last] == 0)
+            last--;
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"mean_ns\":%llu,"
+                "\"p50_ns_max\":%llu,\"p99_ns_max\":%llu,\"histogram\":[",
+                op ? "," : "", opNames[op], s->count, s->errors,
+                s->count ? s->totalNs / s->count : 0,
+                histogramQuantile(s, 0.5), histogramQuantile(s, 0.99));
+        for (i = 0; i <= last; i++)
+            fprintf(out, "%s%llu", i ? "," : "", s->histogram[i]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+    return VFS_OK;
+}
+
+const char *vfs_op_name(int op)
+{
+    if (op < 0 || op >= VFS_OP_COUNT)
+        return "unknown";
+    return opNames[op];
+}
+
+const char *vfs_slab_name(int slab)
+{
+    if (slab < 0 || slab >= VFS_SLAB_COUNT)
+        return "unknown";
+    return slabNames[slab];
+}
+
+const char *vfs_alloc_name(int policy)
+{
+    return allocPolicyName(policy);
+}
@@ -0,0 +1,395 @@
+#include "vfs_internal.h"
+
+// Operation traces. The recorder appends one fixed-size record per call,
+// followed by the path it named, to a buffer flushed to the trace file;
+// data is never recorded, only sizes. The replayer loads whole traces into
+// host memory and runs them through the public API as fast as it can,
+// mapping each recorded descriptor to the one its open returned this time.
+
+#define TRACE_MAGIC "VFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (64 * 1024)
+#define TRACE_PREFIX 32
+
+typedef struct TraceHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int recordSize;
+} TRACEHEADER;
+
+typedef struct TraceRecord
+{
+    unsigned char op;           // TRACE_*
+    unsigned char pad;
+    unsigned short pathLen;     // path bytes after the record, "old\0new" for link
+    int fd;                     // descriptor, open flags for open
+    int len;                    // bytes asked for, perm for open, whence for seek
+    int result;                 // what the call returned
+    long long offset;           // pread/pwrite/seek offset, truncate size
+} TRACERECORD;
+
+// One trace being replayed, on its own thread in multi-stream mode
+typedef struct ReplayStream
+{
+    pthread_t thread;
+    char *data;                 // the whole trace file
+    size_t size;
+    unsigned long long records;
+    int *fdMap;                 // recorded descriptor -> replayed one
+    int fdSlots;
+    char *buf;                  // read and write payload
+    int bufSize;
+    char prefix[TRACE_PREFIX];  // directory the stream's paths live under
+    long long *ns;              // latency of every call
+    unsigned long long mismatches;
+} REPLAYSTREAM;
+
+int traceEnabled = 0;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *traceFile = NULL;
+static char traceBuf[TRACE_BUFFER];
+static size_t traceFill = 0;
+static int traceFailed = 0;
+
+static void traceFlush()
+{
+    if (traceFill > 0 && fwrite(traceBuf, 1, traceFill, traceFile) != traceFill)
+        traceFailed = 1;
+    traceFill = 0;
+}
+
+void traceRecord(int op, int fd, long long len, long long offset, int result,
+                 const char *path, const char *path2)
+{
+    TRACERECORD rec;
+    size_t first = (path != NULL) ? strlen(path) : 0;
+    size_t second = (path2 != NULL) ? strlen(path2) + 1 : 0;
+    
+    if (first > MAX_PATH)
+        first = MAX_PATH;
+    if (second > MAX_PATH)
+        second = MAX_PATH;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = (unsigned char)op;
+    rec.pathLen = (unsigned short)(first + second);
+    rec.fd = fd;
+    rec.len = (len > 0x7fffffff) ? 0x7fffffff : (int)len;
+    rec.result = result;
+    rec.offset = offset;
+    
+    MUTEX_LOCK(&traceLock);
+    if (traceFile != NULL)
+    {
+        if (traceFill + sizeof(rec) + rec.pathLen > TRACE_BUFFER)
+            traceFlush();
+        memcpy(traceBuf + traceFill, &rec, sizeof(rec));
+        if (first > 0)
+            memcpy(traceBuf + traceFill + sizeof(rec), path, first);
+        if (second > 0)
+        {
+            traceBuf[traceFill + sizeof(rec) + first] = '\0';
+            memcpy(traceBuf + traceFill + sizeof(rec) + first + 1, path2, second - 1);
+        }
+        traceFill += sizeof(rec) + rec.pathLen;
+    }
+    MUTEX_UNLOCK(&traceLock);
+}
+
+int vfs_trace_start(const char *path)
+{
+    TRACEHEADER hdr;
+    
+    if (path == NULL || traceFile != NULL)
+        return VFS_EINVAL;
+    if ((traceFile = fopen(path, "wb")) == NULL)
+        return VFS_EIO;
+    // Records are buffered here already
+    setvbuf(traceFile, NULL, _IONBF, 0);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.recordSize = sizeof(TRACERECORD);
+    traceFill = 0;
+    traceFailed = fwrite(&hdr, sizeof(hdr), 1, traceFile) != 1;
+    __atomic_store_n(&traceEnabled, 1, __ATOMIC_RELEASE);
+    return VFS_OK;
+}
+
+int vfs_trace_stop(void)
+{
+    int failed;
+    
+    if (traceFile == NULL)
+        return VFS_EINVAL;
+    __atomic_store_n(&traceEnabled, 0, __ATOMIC_RELEASE);
+    MUTEX_LOCK(&traceLock);
+    traceFlush();
+    failed = traceFailed;
+    if (fclose(traceFile) != 0)
+        failed = 1;
+    traceFile = NULL;
+    MUTEX_UNLOCK(&traceLock);
+    return failed ? VFS_EIO : VFS_OK;
+}
+
+// Read a trace and size the stream's descriptor map and payload buffer
+static int replayLoad(REPLAYSTREAM *s, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    TRACEHEADER hdr;
+    TRACERECORD rec;
+    long end;
+    size_t pos;
+    int i;
+    
+    if (fp == NULL)
+        return VFS_ENOENT;
+    if (fseek(fp, 0, SEEK_END) != 0 || (end = ftell(fp)) < (long)sizeof(hdr) ||
+        fseek(fp, 0, SEEK_SET) != 0 || fread(&hdr, sizeof(hdr), 1, fp) != 1)
+    {
+        fclose(fp);
+        return VFS_EIO;
+    }
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != TRACE_VERSION ||
+        hdr.recordSize != sizeof(TRACERECORD))
+    {
+        fclose(fp);
+        return VFS_ECORRUPT;
+    }
+    s->size = (size_t)end - sizeof(hdr);
+    if ((s->data = (char *)malloc(s->size + 1)) == NULL)
+    {
+        fclose(fp);
+        return VFS_ENOMEM;
+    }
+    if (fread(s->data, 1, s->size, fp) != s->size)
+    {
+        fclose(fp);
+        return VFS_EIO;
+    }
+    fclose(fp);
+    
+    s->fdSlots = 1;
+    s->bufSize = 1;
+    for (pos = 0; pos < s->size; pos += sizeof(rec) + rec.pathLen)
+    {
+        // A recorder that died mid-write leaves a partial record, drop it
+        if (s->size - pos < sizeof(rec))
+            break;
+        memcpy(&rec, s->data + pos, sizeof(rec));
+        if (rec.op >= TRACE_OP_COUNT || rec.pathLen > 2 * MAX_PATH)
+            return VFS_ECORRUPT;
+        if (s->size - pos - sizeof(rec) < rec.pathLen)
+            break;
+        if (rec.op == TRACE_OPEN && rec.result >= s->fdSlots)
+            s->fdSlots = rec.result + 1;
+        if (rec.op != TRACE_OPEN && rec.op != TRACE_SEEK && rec.len > s->bufSize)
+            s->bufSize = rec.len;
+        s->records++;
+    }
+    
+    s->fdMap = (int *)malloc(s->fdSlots * sizeof(int));
+    s->buf = (char *)malloc(s->bufSize);
+    s->ns = (long long *)malloc((s->records + 1) * sizeof(long long));
+    if (s->fdMap == NULL || s->buf == NULL || s->ns == NULL)
+        return VFS_ENOMEM;
+    for (i = 0; i < s->fdSlots; i++)
+        s->fdMap[i] = -1;
+    for (i = 0; i < s->bufSize; i++)
+        s->buf[i] = 'a' + i % 26;
+    return VFS_OK;
+}
+
+static int replayFd(REPLAYSTREAM *s, int fd)
+{
+    return (fd >= 0 && fd < s->fdSlots) ? s->fdMap[fd] : -1;
+}
+
+// The recorded path under the stream's prefix
+static const char *replayPath(REPLAYSTREAM *s, const char *path, int len, char *out)
+{
+    int used = (int)strlen(s->prefix);
+    
+    memcpy(out, s->prefix, used);
+    if (len == 0 || path[0] != '/')
+        out[used++] = '/';
+    memcpy(out + used, path, len);
+    out[used + len] = '\0';
+    return out;
+}
+
+static void *replayRun(void *arg)
+{
+    REPLAYSTREAM *s = (REPLAYSTREAM *)arg;
+    char path[TRACE_PREFIX + 2 * MAX_PATH + 2], path2[TRACE_PREFIX + 2 * MAX_PATH + 2];
+    TRACERECORD rec;
+    unsigned long long i;
+    size_t pos = 0;
+    
+    for (i = 0; i < s->records; i++, pos += sizeof(rec) + rec.pathLen)
+    {
+        const char *name = s->data + pos + sizeof(rec);
+        int nameLen, fd, ret = VFS_EINVAL;
+        long long start;
+    
+        memcpy(&rec, s->data + pos, sizeof(rec));
+        nameLen = (int)strnlen(name, rec.pathLen);
+        fd = replayFd(s, rec.fd);
+        start = statStart();
+        switch (rec.op)
+        {
+        case TRACE_OPEN:
+            ret = vfs_open(replayPath(s, name, nameLen, path), rec.fd, (unsigned int)rec.len);
+            break;
+        case TRACE_CLOSE:
+            ret = vfs_close(fd);
+            break;
+        case TRACE_READ:
+            ret = vfs_read(fd, s->buf, rec.len);
+            break;
+        case TRACE_WRITE:
+            ret = vfs_write(fd, s->buf, rec.len);
+            break;
+        case TRACE_APPEND:
+            ret = vfs_append(fd, s->buf, rec.len);
+            break;
+        case TRACE_PREAD:
+            ret = vfs_pread(fd, s->buf, rec.len, (long)rec.offset);
+            break;
+        case TRACE_PWRITE:
+            ret = vfs_pwrite(fd, s->buf, rec.len, (long)rec.offset);
+            break;
+        case TRACE_SEEK:
+            ret = (int)vfs_lseek(fd, (long)rec.offset, rec.len);
+            break;
+        case TRACE_TRUNCATE:
+            ret = vfs_ftruncate(fd, (long)rec.offset);
+            break;
+        case TRACE_UNLINK:
+            ret = vfs_unlink(replayPath(s, name, nameLen, path));
+            break;
+        case TRACE_LINK:
+            replayPath(s, name, nameLen, path);
+            if (nameLen < rec.pathLen)
+                ret = vfs_link(path, replayPath(s, name + nameLen + 1, rec.pathLen - nameLen - 1, path2));
+            break;
+        case TRACE_MKDIR:
+            ret = vfs_mkdir(replayPath(s, name, nameLen, path));
+            break;
+        case TRACE_RMDIR:
+            ret = vfs_rmdir(replayPath(s, name, nameLen, path));
+            break;
+        }
+        s->ns[i] = statStart() - start;
+    
+        if ((ret < 0) != (rec.result < 0))
+            s->mismatches++;
+        if (rec.op == TRACE_OPEN && rec.result >= 0)
+            s->fdMap[rec.result] = (ret >= 0) ? ret : -1;
+        else if (rec.op == TRACE_CLOSE && rec.fd >= 0 && rec.fd < s->fdSlots)
+            s->fdMap[rec.fd] = -1;
+    }
+    return NULL;
+}
+
+static int compareNs(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    
+    return (x > y) - (x < y);
+}
+
+static unsigned long long quantile(const long long *ns, unsigned long long count, double q)
+{
+    return count ? (unsigned long long)ns[(unsigned long long)(q * (count - 1) + 0.5)] : 0;
+}
+
+static void replayFree(REPLAYSTREAM *s)
+{
+    free(s->data);
+    free(s->fdMap);
+    free(s->buf);
+    free(s->ns);
+}
+
+int vfs_replay_streams(const char *const *paths, int count, struct vfs_replay_stats *st)
+{
+    REPLAYSTREAM *streams;
+    struct vfs_stats pool;
+    long long start, *all = NULL;
+    unsigned long long total = 0, at = 0;
+    int err = VFS_OK, started = 0, i;
+    
+    if (mainPool == NULL || paths == NULL || st == NULL || count < 1 || (count > 1 && !vfsConcurrent))
+        return VFS_EINVAL;
+    if ((streams = (REPLAYSTREAM *)calloc(count, sizeof(REPLAYSTREAM))) == NULL)
+        return VFS_ENOMEM;
+    for (i = 0; i < count && err == VFS_OK; i++)
+    {
+        err = replayLoad(&streams[i], paths[i]);
+        total += streams[i].records;
+        // Independent traces may use the same names, give each a directory
+        if (count > 1 && err == VFS_OK)
+        {
+            snprintf(streams[i].prefix, TRACE_PREFIX, "/stream%d", i);
+            if ((err = vfs_mkdir(streams[i].prefix)) == VFS_EEXIST)
+                err = VFS_OK;
+        }
+    }
+    if (err == VFS_OK && (all = (long long *)malloc((total + 1) * sizeof(long long))) == NULL)
+        err = VFS_ENOMEM;
+    
+    start = statStart();
+    if (err == VFS_OK && count == 1)
+        replayRun(&streams[0]);
+    else if (err == VFS_OK)
+    {
+        for (started = 0; started < count; started++)
+        {
+            if (pthread_create(&streams[started].thread, NULL, replayRun, &streams[started]) != 0)
+            {
+                err = VFS_ENOMEM;
+                break;
+            }
+        }
+        for (i = 0; i < started; i++)
+            pthread_join(streams[i].thread, NULL);
+    }
+    
+    if (err == VFS_OK)
+    {
+        memset(st, 0, sizeof(*st));
+        st->seconds = (statStart() - start) / 1e9;
+        st->streams = count;
+        for (i = 0; i < count; i++)
+        {
+            memcpy(all + at, streams[i].ns, streams[i].records * sizeof(long long));
+            at += streams[i].records;
+            st->mismatches += streams[i].mismatches;
+        }
+        qsort(all, total, sizeof(long long), compareNs);
+        st->ops = total;
+        st->opsPerSec = (st->seconds > 0) ? total / st->seconds : 0;
+        st->p50Ns = quantile(all, total, 0.5);
+        st->p99Ns = quantile(all, total, 0.99);
+        st->p999Ns = quantile(all, total, 0.999);
+        st->maxNs = total ? (unsigned long long)all[total - 1] : 0;
+        if (vfs_get_stats(&pool) == VFS_OK)
+        {
+            st->poolUsed = pool.usedBytes;
+            st->fragmentation = pool.fragmentation;
+        }
+    }
+    free(all);
+    for (i = 0; i < count; i++)
+        replayFree(&streams[i]);
+    free(streams);
+    return err;
+}
+
+int vfs_replay(const char *path, struct vfs_replay_stats *st)
+{
+    return vfs_replay_streams(&path, 1, st);
+}
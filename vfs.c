@@ -0,0 +1,3001 @@
+#include "vfs_internal.h"
+
+#include <unistd.h>
+
+struct SuperBlock S;
+
+// Inode and open file table lists
+INODE *inodeList = NULL;
+FILETABLE *fileTableList = NULL;
+
+// Inode table indexed by inodeNo
+INODE **inodeTable = NULL;
+unsigned int inodeTableSize = 0;
+static unsigned int inodeCounter = 0;
+
+// Numbers of destroyed inodes, reused first so the inode table stays dense
+static unsigned int *freeInodeNos = NULL;
+static unsigned int freeInodeCount = 0;
+static unsigned int freeInodeCapacity = 0;
+
+// Inode and file table nodes come from their own slabs
+SLABCACHE inodeCache = SLAB_CACHE_INIT(INODE);
+SLABCACHE fileTableCache = SLAB_CACHE_INIT(FILETABLE);
+
+// Descriptor table indexed by fd, with a bitmap of descriptors in use
+static UFDT *ufdtTable = NULL;
+static unsigned long long *fdMap = NULL;
+static int fdCapacity = 0;
+static int fdFreeHint = 0;     // lowest bitmap word that may have a clear bit
+unsigned int openFileCount = 0;
+
+// Files small enough to live in their inode, and the bytes they hold
+unsigned int inlineFiles = 0;
+unsigned long long inlineBytes = 0;
+
+// Next slot of the inode table the spill CLOCK hand looks at
+static unsigned int spillHand = 0;
+
+static DCACHE dcache[DCACHE_SIZE];
+static unsigned int dcacheGeneration = 1;
+
+// Concurrent mode lock order: nsLock, fdLock, an inode's lock, then pool arenas.
+// nsLock covers directories, the inode table and link/reference counts;
+// fdLock covers the descriptor table and is held shared across writes.
+// Reads take neither, see optimisticRead and epoch.c.
+static pthread_rwlock_t nsLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t fdLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t dcacheLocks[DCACHE_LOCKS];
+
+// Extent holding file position pos, or extentCount when pos is at or past the end
+static int findExtent(INODE *inode, int pos)
+{
+    int lo = 0, hi = inode->extentCount;
+    
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        EXTENT *ext = &inode->extents[mid];
+        if (pos < ext->start)
+            hi = mid;
+        else if (pos >= ext->start + ext->capacity)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return inode->extentCount;
+}
+
+static void syncFirstExtent(INODE *inode)
+{
+    if (inode->extentCount > 0)
+    {
+        inode->memOffset = inode->extents[0].memOffset;
+        inode->dataPtr = mainPool + inode->memOffset;
+    }
+    else
+    {
+        inode->memOffset = -1;
+        inode->dataPtr = NULL;
+    }
+}
+
+// Make extent idx private before its bytes change: take a block only this
+// file references back from the dedup index, or copy a shared one or one
+// a view has pinned. Returns -1 when there is no pool space for the copy.
+static int ownExtent(INODE *inode, int idx)
+{
+    EXTENT *ext = &inode->extents[idx];
+    unsigned int refs = dedupUnshare(ext->memOffset);
+    int pinned = spacePinned(ext->memOffset);
+    long long copy;
+    
+    if (refs == 1)
+        setBlockOwner(ext->memOffset, inode);
+    if (refs <= 1 && !pinned)
+        return 0;
+    if ((copy = findContiguousSpace(ext->capacity, 1)) == -1)
+        return -1;
+    memcpy(mainPool + copy, mainPool + ext->memOffset, ext->length);
+    MARK_DIRTY(copy, ext->length);
+    setBlockOwner(copy, inode);
+    if (dedupRelease(ext->memOffset))
+        retireSpace(ext->memOffset, ext->capacity);
+    ext->memOffset = copy;
+    syncFirstExtent(inode);
+    return 0;
+}
+
+// Offer the full extent idx to the dedup index, switching it to an
+// identical block when there is one
+static void shareExtent(INODE *inode, int idx)
+{
+    EXTENT *ext = &inode->extents[idx];
+    long long shared;
+    
+    // Indexed blocks have no owner, so compaction never moves them
+    setBlockOwner(ext->memOffset, NULL);
+    shared = dedupBlock(ext->memOffset, ext->capacity);
+    if (shared == -1)
+        setBlockOwner(ext->memOffset, inode);
+    else if (shared != ext->memOffset)
+    {
+        retireSpace(ext->memOffset, ext->capacity);
+        ext->memOffset = shared;
+        syncFirstExtent(inode);
+    }
+}
+
+// Give up the pool block of an extent, unless other files still share it
+static void releaseExtent(EXTENT *ext)
+{
+    if (dedupRelease(ext->memOffset))
+        retireSpace(ext->memOffset, ext->capacity);
+}
+
+// Reserve room for 'needed' more bytes at the tail, returns bytes gained
+static int growTail(INODE *inode, int needed)
+{
+    long long offset;
+    int want;
+    EXTENT *ext;
+    
+    if (needed > maxAllocation())
+        needed = maxAllocation();
+    want = needed;
+    // Grow geometrically so a stream of appends costs O(log n) allocations
+    if ((int)inode->fileSize > want)
+        want = (inode->fileSize < EXTENT_MAX) ? (int)inode->fileSize : EXTENT_MAX;
+    if (want < needed)
+        want = needed;
+    
+    // A block in the dedup index keeps its size
+    if (inode->extentCount > 0 && dedupRefCount(inode->extents[inode->extentCount - 1].memOffset) == 0)
+    {
+        ext = &inode->extents[inode->extentCount - 1];
+        if (extendSpace(ext->memOffset, want) == 0)
+        {
+            ext->capacity += want;
+            return want;
+        }
+        if (want != needed && extendSpace(ext->memOffset, needed) == 0)
+        {
+            ext->capacity += needed;
+            return needed;
+        }
+    }
+    
+    if (inode->extentCount == inode->extentCapacity)
+    {
+        // A fresh array rather than realloc, lock-free readers may still be walking the old one
+        int cap = inode->extentCapacity ? inode->extentCapacity * 2 : 4;
+        EXTENT *arr = (EXTENT *)metaAlloc(cap * sizeof(EXTENT));
+        if (arr == NULL)
+            return 0;
+        if (inode->extentCount > 0)
+            memcpy(arr, inode->extents, inode->extentCount * sizeof(EXTENT));
+        retireMeta(inode->extents, inode->extentCapacity * sizeof(EXTENT));
+        __atomic_store_n(&inode->extents, arr, __ATOMIC_RELEASE);
+        inode->extentCapacity = cap;
+    }
+    
+    // Only grow the pool for what is strictly needed
+    offset = (want != needed) ? findContiguousSpace(want, 0) : -1;
+    if (offset == -1)
+        offset = findContiguousSpace(want = needed, 1);
+    if (offset == -1)
+        return 0;
+    setBlockOwner(offset, inode);
+    
+    ext = &inode->extents[inode->extentCount];
+    ext->memOffset = offset;
+    ext->start = inode->fileSize;
+    ext->length = 0;
+    ext->capacity = want;
+    ext->crc = 0;
+    // Published after the array, so a reader never sees more extents than it holds
+    __atomic_store_n(&inode->extentCount, inode->extentCount + 1, __ATOMIC_RELEASE);
+    syncFirstExtent(inode);
+    return want;
+}
+
+// Keep the inline totals in step with an inline file's size
+static void inlineResize(int oldSize, int newSize)
+{
+    COUNTER_ADD(inlineFiles, (newSize > 0) - (oldSize > 0));
+    COUNTER_ADD(inlineBytes, newSize - oldSize);
+}
+
+// Move an inline file's bytes into a pool extent with room for 'extra'
+// more. Returns -1, leaving the file inline, when the pool is full.
+static int promoteInline(INODE *inode, int extra)
+{
+    int size = inode->fileSize;
+    EXTENT *ext;
+    
+    // growTail starts the extent at the file size
+    inode->fileSize = 0;
+    if (growTail(inode, size + extra) == 0)
+    {
+        inode->fileSize = size;
+        return -1;
+    }
+    ext = &inode->extents[0];
+    memcpy(mainPool + ext->memOffset, inode->inlineData, size);
+    MARK_DIRTY(ext->memOffset, size);
+    ext->length = size;
+    if (checksumEnabled)
+        ext->crc = crc32c(0, inode->inlineData, size);
+    inode->fileSize = size;
+    inlineResize(size, 0);
+    return 0;
+}
+
+// Add len bytes from buf to the end of the file, zeros when buf is NULL.
+// Spare tail capacity is filled before allocating more.
+static int fileExtend(INODE *inode, const char *buf, int len)
+{
+    int done = 0;
+    
+    // Tiny files stay in the inode until they outgrow it
+    if (inode->extentCount == 0 && len > 0)
+    {
+        if (len <= INLINE_MAX - (int)inode->fileSize)
+        {
+            if (buf != NULL)
+                memcpy(inode->inlineData + inode->fileSize, buf, len);
+            else
+                memset(inode->inlineData + inode->fileSize, 0, len);
+            inlineResize(inode->fileSize, inode->fileSize + len);
+            inode->fileSize += len;
+            return len;
+        }
+        if (promoteInline(inode, len) != 0)
+            return 0;
+    }
+    
+    while (done < len)
+    {
+        EXTENT *ext;
+        int chunk;
+        
+        if (inode->extentCount == 0 ||
+            inode->extents[inode->extentCount - 1].length == inode->extents[inode->extentCount - 1].capacity)
+        {
+            if (growTail(inode, len - done) == 0)
+                break;
+        }
+        // A tail shortened by truncate may still be shared
+        if (ownExtent(inode, inode->extentCount - 1) != 0)
+            break;
+        ext = &inode->extents[inode->extentCount - 1];
+        chunk = ext->capacity - ext->length;
+        if (chunk > len - done)
+            chunk = len - done;
+        if (buf != NULL)
+            memcpy(mainPool + ext->memOffset + ext->length, buf + done, chunk);
+        else
+            memset(mainPool + ext->memOffset + ext->length, 0, chunk);
+        MARK_DIRTY(ext->memOffset + ext->length, chunk);
+        if (checksumEnabled)
+            ext->crc = crc32c(ext->crc, mainPool + ext->memOffset + ext->length, chunk);
+        ext->length += chunk;
+        inode->fileSize += chunk;
+        done += chunk;
+        if (dedupEnabled && ext->length == ext->capacity)
+            shareExtent(inode, inode->extentCount - 1);
+    }
+    return done;
+}
+
+// Count a failed check against the file
+static void noteCorrupt(INODE *inode)
+{
+    COUNTER_ADD(checksumErrors, 1);
+    if (__atomic_exchange_n(&inode->corrupt, 1, __ATOMIC_RELAXED) == 0)
+    {
+        COUNTER_ADD(corruptInodes, 1);
+        VFS_LOG("inode %u failed its checksum\n", inode->inodeNo);
+    }
+}
+
+// Check the extents holding [pos, pos + len) against their checksums, the
+// caller holds the inode's lock. Returns the bytes checked, or VFS_EIO.
+static long checkExtents(INODE *inode, int pos, int len)
+{
+    long bytes = 0;
+    int idx;
+    
+    for (idx = findExtent(inode, pos); idx < inode->extentCount && inode->extents[idx].start < (long)pos + len; idx++)
+    {
+        EXTENT *ext = &inode->extents[idx];
+        if (crc32c(0, mainPool + ext->memOffset, ext->length) != ext->crc)
+        {
+            noteCorrupt(inode);
+            return VFS_EIO;
+        }
+        bytes += ext->length;
+    }
+    return bytes;
+}
+
+// Same for the compressed block of a packed file
+static int checkPacked(INODE *inode)
+{
+    if (crc32c(0, mainPool + inode->packOffset, inode->packedSize) == inode->packCrc)
+        return VFS_OK;
+    noteCorrupt(inode);
+    return VFS_EIO;
+}
+
+// Undo a partial fileExtend of a packed or spilled file being brought
+// back, its other copy stays the only one
+static void dropExtents(INODE *inode)
+{
+    while (inode->extentCount > 0)
+    {
+        releaseExtent(&inode->extents[inode->extentCount - 1]);
+        inode->extentCount--;
+    }
+    syncFirstExtent(inode);
+}
+
+// Give up the compressed copy of a packed file
+static void dropPacked(INODE *inode)
+{
+    packCacheDrop(inode);
+    retireSpace(inode->packOffset, inode->packedSize);
+    COUNTER_ADD(packedFiles, -1);
+    COUNTER_ADD(packedRaw, -(unsigned long long)inode->fileSize);
+    COUNTER_ADD(packedBytes, -(unsigned long long)inode->packedSize);
+    inode->packOffset = -1;
+    inode->packedSize = 0;
+}
+
+// Store a packed file as extents again before it changes. Returns -1,
+// leaving it packed, when the pool has no room for the raw data.
+static int unpackFile(INODE *inode)
+{
+    int size = inode->fileSize;
+    char *raw = (char *)metaAlloc(size);
+    
+    if (raw == NULL)
+        return -1;
+    // A damaged block is still unpacked, the file stays flagged
+    if (checksumEnabled)
+        checkPacked(inode);
+    if (packCacheRead(inode, 0, raw, size) < 0 &&
+        lzDecompress(mainPool + inode->packOffset, inode->packedSize, raw, size) != 0)
+    {
+        metaFree(raw, size);
+        return -1;
+    }
+    // packOffset stays set meanwhile, so compaction can still move the block
+    inode->fileSize = 0;
+    if (fileExtend(inode, raw, size) < size)
+    {
+        dropExtents(inode);
+        inode->fileSize = size;
+        metaFree(raw, size);
+        return -1;
+    }
+    metaFree(raw, size);
+    dropPacked(inode);
+    return 0;
+}
+
+// Replace the extents of a file with one compressed block, returns the
+// pool bytes freed or 0 when compressing would not pay off
+static long packFile(INODE *inode)
+{
+    int size = inode->fileSize, cap = size - size / 8, packed, i;
+    long long offset;
+    long footprint = 0;
+    char *raw, *dst;
+    
+    if (inode->dir != NULL || inode->packOffset != -1 || inode->extentCount == 0 ||
+        size < (int)packPolicy.minSize || size > PACK_MAX_SIZE)
+        return 0;
+    if ((raw = (char *)malloc(size)) == NULL)
+        return 0;
+    if ((dst = (char *)malloc(cap)) == NULL)
+    {
+        free(raw);
+        return 0;
+    }
+    fileRead(inode, 0, raw, size);
+    packed = lzCompress(raw, size, dst, cap, packPolicy.level);
+    free(raw);
+    if (packed <= 0 || (offset = findContiguousSpace(packed, 0)) == -1)
+    {
+        free(dst);
+        return 0;
+    }
+    memcpy(mainPool + offset, dst, packed);
+    MARK_DIRTY(offset, packed);
+    free(dst);
+    if (checksumEnabled)
+        inode->packCrc = crc32c(0, mainPool + offset, packed);
+    setBlockOwner(offset, inode);
+    
+    // Shared blocks stay in use for the other files
+    for (i = 0; i < inode->extentCount; i++)
+    {
+        if (dedupRefCount(inode->extents[i].memOffset) <= 1)
+            footprint += inode->extents[i].capacity;
+    }
+    SEQ_BEGIN(inode);
+    fileTruncate(inode, 0);
+    inode->fileSize = size;
+    inode->packOffset = offset;
+    inode->packedSize = packed;
+    SEQ_END(inode);
+    COUNTER_ADD(packedFiles, 1);
+    COUNTER_ADD(packedRaw, size);
+    COUNTER_ADD(packedBytes, packed);
+    VFS_LOG("inode %u packed, %d bytes in %d\n", inode->inodeNo, size, packed);
+    return footprint - packed;
+}
+
+// Copy from a packed file, decompressing it into the cache on a miss
+static int packedRead(INODE *inode, int pos, char *buf, int len)
+{
+    int size = inode->fileSize;
+    char *raw;
+    
+    if (packCacheRead(inode, pos, buf, len) == len)
+        return len;
+    if (VERIFY_READS() && checkPacked(inode) != VFS_OK)
+        return VFS_EIO;
+    if ((raw = (char *)metaAlloc(size)) == NULL)
+        return VFS_ENOMEM;
+    if (lzDecompress(mainPool + inode->packOffset, inode->packedSize, raw, size) != 0)
+    {
+        metaFree(raw, size);
+        return VFS_EIO;
+    }
+    memcpy(buf, raw + pos, len);
+    packCacheInsert(inode, raw, size);
+    return len;
+}
+
+// Give up the backing file copy of a spilled file
+static void dropSpilled(INODE *inode)
+{
+    spillFree(inode->spillOffset, inode->fileSize);
+    COUNTER_ADD(spilledFiles, -1);
+    COUNTER_ADD(spilledBytes, -(unsigned long long)inode->fileSize);
+    __atomic_store_n(&inode->spillOffset, -1, __ATOMIC_RELAXED);
+}
+
+// Bring a spilled file back into the pool. Returns -1, leaving it in the
+// backing file, when the pool has no room for it.
+static int faultFile(INODE *inode)
+{
+    int size = inode->fileSize;
+    char *raw = (char *)metaAlloc(size);
+    
+    if (raw == NULL)
+        return -1;
+    if (spillLoad(inode->spillOffset, raw, size) != 0)
+    {
+        metaFree(raw, size);
+        return -1;
+    }
+    inode->fileSize = 0;
+    if (fileExtend(inode, raw, size) < size)
+    {
+        dropExtents(inode);
+        inode->fileSize = size;
+        metaFree(raw, size);
+        return -1;
+    }
+    metaFree(raw, size);
+    dropSpilled(inode);
+    COUNTER_ADD(spillFaults, 1);
+    return 0;
+}
+
+// Move a file's contents to the backing file, returns the pool bytes
+// freed or 0 when it stays. Files with mapped blocks stay.
+static long spillFile(INODE *inode)
+{
+    int size = inode->fileSize, i;
+    long long offset;
+    long footprint = 0;
+    char *raw;
+    
+    if (inode->dir != NULL || inode->spillOffset != -1 || (inode->extentCount == 0 && inode->packOffset == -1) ||
+        size < (int)spillPolicy.minSize)
+        return 0;
+    for (i = 0; i < inode->extentCount; i++)
+    {
+        if (spacePinned(inode->extents[i].memOffset))
+            return 0;
+    }
+    if ((raw = (char *)metaAlloc(size)) == NULL)
+        return 0;
+    if (fileRead(inode, 0, raw, size) != size || (offset = spillStore(raw, size)) == -1)
+    {
+        metaFree(raw, size);
+        return 0;
+    }
+    metaFree(raw, size);
+    
+    // Shared blocks stay in use for the other files
+    if (inode->packOffset != -1)
+        footprint = inode->packedSize;
+    for (i = 0; i < inode->extentCount; i++)
+    {
+        if (dedupRefCount(inode->extents[i].memOffset) <= 1)
+            footprint += inode->extents[i].capacity;
+    }
+    SEQ_BEGIN(inode);
+    fileTruncate(inode, 0);
+    inode->fileSize = size;
+    __atomic_store_n(&inode->spillOffset, offset, __ATOMIC_RELAXED);
+    SEQ_END(inode);
+    COUNTER_ADD(spilledFiles, 1);
+    COUNTER_ADD(spilledBytes, size);
+    COUNTER_ADD(spillEvictions, 1);
+    VFS_LOG("inode %u spilled, %d bytes at %lld\n", inode->inodeNo, size, offset);
+    return footprint;
+}
+
+// Copy from a spilled file straight out of the backing file
+static int spilledRead(INODE *inode, int pos, char *buf, int len)
+{
+    if (spillLoad(inode->spillOffset + pos, buf, len) != 0)
+        return VFS_EIO;
+    COUNTER_ADD(spillDiskReads, 1);
+    return len;
+}
+
+// Write len bytes at pos, touching only the extents involved. A gap past
+// the end of the file is filled with zeros first.
+int fileWrite(INODE *inode, int pos, const char *buf, int len)
+{
+    int done = 0, idx, oldSize = inode->fileSize;
+    
+    if (pos < 0 || len < 0)
+        return -1;
+    if (inode->spillOffset != -1 && faultFile(inode) != 0)
+        return -1;
+    if (inode->packOffset != -1 && unpackFile(inode) != 0)
+        return -1;
+    if (inode->extentCount == 0 && len > 0)
+    {
+        if (len <= INLINE_MAX - pos)
+        {
+            if (pos > oldSize)
+                memset(inode->inlineData + oldSize, 0, pos - oldSize);
+            memcpy(inode->inlineData + pos, buf, len);
+            if (pos + len > oldSize)
+            {
+                inlineResize(oldSize, pos + len);
+                inode->fileSize = pos + len;
+            }
+            return len;
+        }
+        // Overwriting part of an inline file that will not fit any more
+        if (pos < oldSize && promoteInline(inode, pos + len - oldSize) != 0)
+            return -1;
+    }
+    if (pos > oldSize && len > 0 && fileExtend(inode, NULL, pos - oldSize) < pos - oldSize)
+    {
+        fileTruncate(inode, oldSize);
+        return -1;
+    }
+    
+    // Overwrite existing bytes in place
+    for (idx = findExtent(inode, pos); done < len && pos < (int)inode->fileSize; idx++)
+    {
+        EXTENT *ext = &inode->extents[idx];
+        int skip = pos - ext->start;
+        int chunk = ext->length - skip;
+        if (chunk > len - done)
+            chunk = len - done;
+        if (ownExtent(inode, idx) != 0)
+            break;
+        if (checksumEnabled)
+            ext->crc = crc32cPatch(ext->crc, mainPool + ext->memOffset + skip, buf + done, chunk,
+                                   ext->length - skip - chunk);
+        memcpy(mainPool + ext->memOffset + skip, buf + done, chunk);
+        MARK_DIRTY(ext->memOffset + skip, chunk);
+        done += chunk;
+        pos += chunk;
+    }
+    
+    if (pos >= (int)inode->fileSize)
+        done += fileExtend(inode, buf + done, len - done);
+    if (done == 0 && len > 0)
+    {
+        fileTruncate(inode, oldSize);
+        return -1;
+    }
+    return done;
+}
+
+// Copy up to len bytes from pos, returns the byte count or a negative
+// error when a packed or spilled file cannot be read
+int fileRead(INODE *inode, int pos, char *buf, int len)
+{
+    int done = 0, idx;
+    
+    if (pos < 0 || pos >= (int)inode->fileSize || len <= 0)
+        return 0;
+    if (len > (int)inode->fileSize - pos)
+        len = inode->fileSize - pos;
+    if (inode->spillOffset != -1)
+        return spilledRead(inode, pos, buf, len);
+    if (inode->packOffset != -1)
+        return packedRead(inode, pos, buf, len);
+    if (inode->extentCount == 0)
+    {
+        memcpy(buf, inode->inlineData + pos, len);
+        return len;
+    }
+    
+    for (idx = findExtent(inode, pos); done < len; idx++)
+    {
+        EXTENT *ext = &inode->extents[idx];
+        int skip = pos - ext->start;
+        int chunk = ext->length - skip;
+        if (chunk > len - done)
+            chunk = len - done;
+        memcpy(buf + done, mainPool + ext->memOffset + skip, chunk);
+        done += chunk;
+        pos += chunk;
+    }
+    return done;
+}
+
+// Copy like fileRead without the inode lock. The copy only counts if no
+// writer touched the inode meanwhile, -1 means it has to be retried.
+// Torn reads are expected here and caught by the sequence check.
+__attribute__((no_sanitize_thread))
+static int optimisticRead(INODE *inode, int pos, char *buf, int len)
+{
+    unsigned int seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+    const EXTENT *extents;
+    int count, size, lo, hi, done = 0;
+    
+    if (seq & 1)
+        return -1;
+    size = inode->fileSize;
+    count = __atomic_load_n(&inode->extentCount, __ATOMIC_ACQUIRE);
+    extents = __atomic_load_n(&inode->extents, __ATOMIC_ACQUIRE);
+    if (pos >= size || len <= 0)
+        len = 0;
+    else if (len > size - pos)
+        len = size - pos;
+    
+    // findExtent over the snapshot; the sanitizer must not see it either
+    for (lo = 0, hi = count; lo < hi; )
+    {
+        int mid = (lo + hi) / 2;
+        if (pos < extents[mid].start)
+            hi = mid;
+        else if (pos >= extents[mid].start + extents[mid].capacity)
+            lo = mid + 1;
+        else
+            lo = hi = mid;
+    }
+    
+    // Inline data is copied straight from the inode, packed and spilled files need the lock
+    if (count == 0 && len > 0)
+    {
+        if (__atomic_load_n(&inode->packOffset, __ATOMIC_RELAXED) != -1 ||
+            __atomic_load_n(&inode->spillOffset, __ATOMIC_RELAXED) != -1 || pos > INLINE_MAX - len)
+            return -1;
+        memcpy(buf, inode->inlineData + pos, len);
+        done = len;
+    }
+    for (; done < len; lo++)
+    {
+        EXTENT ext;
+        int skip, chunk;
+        
+        // Bail out on anything a writer left half done before touching the pool
+        if (lo >= count)
+            return -1;
+        ext = extents[lo];
+        skip = pos - ext.start;
+        chunk = ext.length - skip;
+        if (skip < 0 || chunk <= 0 || ext.memOffset < 0 ||
+            ext.memOffset > __atomic_load_n(&poolSize, __ATOMIC_ACQUIRE) - ext.length)
+            return -1;
+        if (chunk > len - done)
+            chunk = len - done;
+        memcpy(buf + done, mainPool + ext.memOffset + skip, chunk);
+        done += chunk;
+        pos += chunk;
+    }
+    
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED) == seq) ? done : -1;
+}
+
+// Drop file data past 'size', releasing extents that become empty. A
+// packed or spilled file can only be emptied, anything else brings it
+// back first. A file cut down to INLINE_MAX bytes or less moves back
+// into its inode.
+void fileTruncate(INODE *inode, int size)
+{
+    int wasInline = (inode->extentCount == 0 && inode->packOffset == -1 && inode->spillOffset == -1);
+    
+    if (size < 0 || size >= (int)inode->fileSize)
+        return;
+    if (inode->spillOffset != -1)
+        dropSpilled(inode);
+    if (inode->packOffset != -1)
+        dropPacked(inode);
+    if (inode->extentCount > 0 && size <= INLINE_MAX)
+        fileRead(inode, 0, inode->inlineData, size);
+    
+    while (inode->extentCount > 0)
+    {
+        EXTENT *ext = &inode->extents[inode->extentCount - 1];
+        if (ext->start < size && size > INLINE_MAX)
+            break;
+        releaseExtent(ext);
+        inode->extentCount--;
+    }
+    if (inode->extentCount > 0)
+    {
+        EXTENT *ext = &inode->extents[inode->extentCount - 1];
+        int keep = size - ext->start;
+        
+        // The part cut off still counts towards the check of the whole
+        if (checksumEnabled && keep < ext->length)
+        {
+            unsigned int crc = crc32c(0, mainPool + ext->memOffset, keep);
+            if (crc32c(crc, mainPool + ext->memOffset + keep, ext->length - keep) != ext->crc)
+                noteCorrupt(inode);
+            ext->crc = crc;
+        }
+        ext->length = keep;
+    }
+    else
+        inlineResize(wasInline ? (int)inode->fileSize : 0, size);
+    inode->fileSize = size;
+    syncFirstExtent(inode);
+}
+
+// Grow the descriptor table and its bitmap, keeping existing slots
+static int growFdTable(int capacity)
+{
+    UFDT *table = (UFDT *)metaAlloc(capacity * sizeof(UFDT));
+    unsigned long long *map;
+    int words = capacity / FD_WORD_BITS, oldWords = fdCapacity / FD_WORD_BITS;
+    
+    if (table == NULL)
+        return -1;
+    map = (unsigned long long *)metaRealloc(fdMap, oldWords * sizeof(unsigned long long),
+                                           words * sizeof(unsigned long long));
+    if (map == NULL)
+    {
+        metaFree(table, capacity * sizeof(UFDT));
+        return -1;
+    }
+    fdMap = map;
+    
+    // Lock-free readers may still index the old table, it is retired rather than freed
+    if (fdCapacity > 0)
+        memcpy(table, ufdtTable, fdCapacity * sizeof(UFDT));
+    memset(table + fdCapacity, 0, (capacity - fdCapacity) * sizeof(UFDT));
+    memset(fdMap + oldWords, 0, (words - oldWords) * sizeof(unsigned long long));
+    if (fdCapacity == 0)
+        fdMap[0] = 0x7;     // stdin, stdout and stderr are never handed out
+    retireMeta(ufdtTable, fdCapacity * sizeof(UFDT));
+    __atomic_store_n(&ufdtTable, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&fdCapacity, capacity, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Claim the lowest free descriptor
+static int allocFd()
+{
+    int word, words = fdCapacity / FD_WORD_BITS;
+    
+    for (word = fdFreeHint; word < words; word++)
+    {
+        if (~fdMap[word] != 0)
+            break;
+    }
+    if (word == words)
+    {
+        if (growFdTable(fdCapacity ? fdCapacity * 2 : FD_MIN_CAPACITY) == -1)
+            return -1;
+    }
+    fdFreeHint = word;
+    
+    int bit = __builtin_ctzll(~fdMap[word]);
+    fdMap[word] |= 1ULL << bit;
+    return word * FD_WORD_BITS + bit;
+}
+
+static void releaseFd(int fd)
+{
+    fdMap[fd / FD_WORD_BITS] &= ~(1ULL << (fd % FD_WORD_BITS));
+    __atomic_store_n(&ufdtTable[fd].fileTableEntry, NULL, __ATOMIC_RELEASE);
+    openFileCount--;
+    if (fd / FD_WORD_BITS < fdFreeHint)
+        fdFreeHint = fd / FD_WORD_BITS;
+}
+
+// Descriptor slot for fd, NULL when fd is not open. Safe without fdLock
+// inside an epoch; the capacity is read first so the table is at least that big.
+UFDT *lookupFd(int fd)
+{
+    UFDT *table;
+    
+    if (fd < 0 || fd >= __atomic_load_n(&fdCapacity, __ATOMIC_ACQUIRE))
+        return NULL;
+    table = __atomic_load_n(&ufdtTable, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&table[fd].fileTableEntry, __ATOMIC_ACQUIRE) == NULL)
+        return NULL;
+    return &table[fd];
+}
+
+// FNV-1a hash of a name
+static unsigned int hashName(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+    
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static DIRTABLE *dirCreate()
+{
+    DIRTABLE *dir = (DIRTABLE *)metaAlloc(sizeof(DIRTABLE));
+    
+    dir->table[0] = (DIRENTRY **)metaCalloc(DIR_MIN_BUCKETS, sizeof(DIRENTRY *));
+    dir->buckets[0] = DIR_MIN_BUCKETS;
+    dir->table[1] = NULL;
+    dir->buckets[1] = 0;
+    dir->count = 0;
+    dir->rehashIdx = -1;
+    return dir;
+}
+
+// Move a few buckets into the new table, finishing the resize when empty
+static void dirRehashStep(DIRTABLE *dir)
+{
+    int steps = DIR_REHASH_STEP;
+    
+    while (dir->rehashIdx != -1 && steps-- > 0)
+    {
+        DIRENTRY *ent = dir->table[0][dir->rehashIdx];
+        while (ent != NULL)
+        {
+            DIRENTRY *nxt = ent->next;
+            unsigned int slot = ent->hash & (dir->buckets[1] - 1);
+            ent->next = dir->table[1][slot];
+            dir->table[1][slot] = ent;
+            ent = nxt;
+        }
+        dir->table[0][dir->rehashIdx++] = NULL;
+        
+        if ((unsigned int)dir->rehashIdx == dir->buckets[0])
+        {
+            metaFree(dir->table[0], dir->buckets[0] * sizeof(DIRENTRY *));
+            dir->table[0] = dir->table[1];
+            dir->buckets[0] = dir->buckets[1];
+            dir->table[1] = NULL;
+            dir->buckets[1] = 0;
+            dir->rehashIdx = -1;
+        }
+    }
+}
+
+static DIRENTRY **dirFindLink(DIRTABLE *dir, const char *name, int len, unsigned int hash)
+{
+    int t;
+    
+    for (t = 0; t < 2; t++)
+    {
+        DIRENTRY **link;
+        if (dir->table[t] == NULL)
+            continue;
+        link = &dir->table[t][hash & (dir->buckets[t] - 1)];
+        for (; *link != NULL; link = &(*link)->next)
+        {
+            if ((*link)->hash == hash && strncmp((*link)->name, name, len) == 0 && (*link)->name[len] == '\0')
+                return link;
+        }
+    }
+    return NULL;
+}
+
+// Inode number for name in dir, 0 when absent
+static unsigned int dirFind(DIRTABLE *dir, const char *name, int len)
+{
+    DIRENTRY **link;
+    
+    if (dir->rehashIdx != -1)
+        dirRehashStep(dir);
+    link = dirFindLink(dir, name, len, hashName(name, len));
+    return (link != NULL) ? (*link)->inodeNo : 0;
+}
+
+static void dirInsert(DIRTABLE *dir, const char *name, unsigned int inodeNo)
+{
+    DIRENTRY *ent = (DIRENTRY *)metaAlloc(sizeof(DIRENTRY));
+    int len = strlen(name), t;
+    unsigned int slot;
+    
+    if (dir->rehashIdx == -1 && dir->count >= dir->buckets[0])
+    {
+        dir->buckets[1] = dir->buckets[0] * 2;
+        dir->table[1] = (DIRENTRY **)metaCalloc(dir->buckets[1], sizeof(DIRENTRY *));
+        dir->rehashIdx = 0;
+    }
+    if (dir->rehashIdx != -1)
+        dirRehashStep(dir);
+    
+    ent->name = (char *)metaAlloc(len + 1);
+    memcpy(ent->name, name, len + 1);
+    ent->hash = hashName(name, len);
+    ent->inodeNo = inodeNo;
+    
+    // New entries go straight to the table being grown into
+    t = (dir->rehashIdx != -1) ? 1 : 0;
+    slot = ent->hash & (dir->buckets[t] - 1);
+    ent->next = dir->table[t][slot];
+    dir->table[t][slot] = ent;
+    dir->count++;
+}
+
+static void dirRemove(DIRTABLE *dir, const char *name)
+{
+    int len = strlen(name);
+    DIRENTRY **link = dirFindLink(dir, name, len, hashName(name, len));
+    DIRENTRY *ent;
+    
+    if (link == NULL)
+        return;
+    ent = *link;
+    *link = ent->next;
+    metaFree(ent->name, strlen(ent->name) + 1);
+    metaFree(ent, sizeof(DIRENTRY));
+    dir->count--;
+}
+
+static void dirDestroy(DIRTABLE *dir)
+{
+    metaFree(dir->table[0], dir->buckets[0] * sizeof(DIRENTRY *));
+    metaFree(dir->table[1], dir->buckets[1] * sizeof(DIRENTRY *));
+    metaFree(dir, sizeof(DIRTABLE));
+}
+
+// Resolve the first len bytes of path from the root directory, consulting
+// the lookup cache first
+static INODE *lookupPrefix(const char *path, int len)
+{
+    unsigned int hash = hashName(path, len);
+    DCACHE *slot = &dcache[hash & (DCACHE_SIZE - 1)];
+    pthread_mutex_t *slotLock = &dcacheLocks[(hash & (DCACHE_SIZE - 1)) % DCACHE_LOCKS];
+    INODE *curr = inodeTable[ROOT_INODE];
+    const char *p = path, *stop = path + len;
+    
+    MUTEX_LOCK(slotLock);
+    if (slot->generation == dcacheGeneration && slot->hash == hash &&
+        strncmp(slot->path, path, len) == 0 && slot->path[len] == '\0')
+    {
+        curr = inodeTable[slot->inodeNo];
+        MUTEX_UNLOCK(slotLock);
+        return curr;
+    }
+    MUTEX_UNLOCK(slotLock);
+    
+    while (curr != NULL)
+    {
+        const char *end;
+        unsigned int ino;
+        
+        while (p < stop && *p == '/')
+            p++;
+        if (p == stop)
+            break;
+        if (curr->dir == NULL)
+            return NULL;
+        for (end = p; end < stop && *end != '/'; end++);
+        ino = dirFind(curr->dir, p, end - p);
+        curr = (ino != 0) ? inodeTable[ino] : NULL;
+        p = end;
+    }
+    
+    if (curr != NULL)
+    {
+        MUTEX_LOCK(slotLock);
+        if (slot->path != NULL)
+            metaFree(slot->path, strlen(slot->path) + 1);
+        slot->path = (char *)metaAlloc(len + 1);
+        memcpy(slot->path, path, len);
+        slot->path[len] = '\0';
+        slot->hash = hash;
+        slot->generation = dcacheGeneration;
+        slot->inodeNo = curr->inodeNo;
+        MUTEX_UNLOCK(slotLock);
+    }
+    return curr;
+}
+
+INODE *lookupPath(const char *path)
+{
+    return lookupPrefix(path, strlen(path));
+}
+
+// Split path into its parent directory and final component. Every
+// component is held to MAX_NAME and the whole path to MAX_PATH.
+static INODE *lookupParent(const char *path, char leaf[], int *err)
+{
+    const char *slash = strrchr(path, '/'), *p, *end;
+    int len;
+    INODE *dir;
+    
+    *err = VFS_ENAMETOOLONG;
+    if (strlen(path) > MAX_PATH)
+        return NULL;
+    for (p = path; *p != '\0'; p = end)
+    {
+        while (*p == '/')
+            p++;
+        for (end = p; *end != '\0' && *end != '/'; end++);
+        if (end - p > MAX_NAME)
+            return NULL;
+    }
+    if (slash == NULL)
+    {
+        dir = inodeTable[ROOT_INODE];
+        slash = path - 1;
+    }
+    else
+    {
+        dir = lookupPrefix(path, slash - path);
+    }
+    
+    len = strlen(slash + 1);
+    *err = (dir == NULL) ? VFS_ENOENT : (dir->dir == NULL) ? VFS_ENOTDIR : VFS_EINVAL;
+    if (len == 0 || dir == NULL || dir->dir == NULL)
+        return NULL;
+    memcpy(leaf, slash + 1, len + 1);
+    *err = VFS_OK;
+    return dir;
+}
+
+// Create inode number inodeNo and register it in the inode list and table
+static INODE *newInode(unsigned int inodeNo, const char *type, unsigned int perm)
+{
+    INODE *node;
+    
+    if (inodeNo >= inodeTableSize)
+    {
+        unsigned int size = inodeTableSize ? inodeTableSize * 2 : 64;
+        INODE **table;
+        while (size <= inodeNo)
+            size *= 2;
+        table = (INODE **)metaRealloc(inodeTable, inodeTableSize * sizeof(INODE *),
+                                              size * sizeof(INODE *));
+        if (table == NULL)
+            return NULL;
+        memset(table + inodeTableSize, 0, (size - inodeTableSize) * sizeof(INODE *));
+        inodeTable = table;
+        inodeTableSize = size;
+    }
+    
+    node = (INODE *)slabAlloc(&inodeCache);
+    if (node == NULL)
+        return NULL;
+    node->inodeNo = inodeNo;
+    if (inodeNo > inodeCounter)
+        inodeCounter = inodeNo;
+    node->userId = 10;
+    node->groupId = 10;
+    node->linkCount = 1;
+    node->referenceCount = 0;
+    node->fileSize = 0;
+    strcpy(node->fileType, type);
+    node->fileAccessPermission = perm;
+    node->dataPtr = NULL;
+    node->memOffset = -1;
+    node->extents = NULL;
+    node->extentCount = 0;
+    node->extentCapacity = 0;
+    node->packOffset = -1;
+    node->packedSize = 0;
+    node->packCrc = 0;
+    node->corrupt = 0;
+    node->lastAccess = packTick;
+    node->spillOffset = -1;
+    node->referenced = 1;
+    node->name[0] = '\0';
+    node->parentNo = 0;
+    node->links = NULL;
+    node->dir = NULL;
+    pthread_rwlock_init(&node->lock, NULL);
+    node->seq = 0;
+    
+    node->prev = NULL;
+    node->next = inodeList;
+    if (inodeList != NULL)
+        inodeList->prev = node;
+    inodeList = node;
+    inodeTable[node->inodeNo] = node;
+    COUNTER_ADD(S.usedInode, 1);
+    if (strcmp(type, "regular") == 0)
+        COUNTER_ADD(S.usedBlock, 1);
+    VFS_LOG("inode %u created\n", node->inodeNo);
+    return node;
+}
+
+static INODE *allocInode(const char *type, unsigned int perm)
+{
+    INODE *node;
+    
+    if (freeInodeCount == 0)
+        return newInode(inodeCounter + 1, type, perm);
+    node = newInode(freeInodeNos[freeInodeCount - 1], type, perm);
+    if (node != NULL)
+        freeInodeCount--;
+    return node;
+}
+
+// Remember a destroyed inode's number for reuse
+static void recycleInodeNo(unsigned int inodeNo)
+{
+    if (freeInodeCount == freeInodeCapacity)
+    {
+        unsigned int cap = freeInodeCapacity ? freeInodeCapacity * 2 : 64;
+        unsigned int *nos = (unsigned int *)metaRealloc(freeInodeNos, freeInodeCapacity * sizeof(unsigned int),
+                                                        cap * sizeof(unsigned int));
+        if (nos == NULL)
+            return;     // the number is simply not reused
+        freeInodeNos = nos;
+        freeInodeCapacity = cap;
+    }
+    freeInodeNos[freeInodeCount++] = inodeNo;
+}
+
+// Recreate an inode saved in an image. Its extents are copied as given, the
+// caller claims their pool space; inlineData holds an inline file's bytes.
+INODE *restoreInode(unsigned int inodeNo, int isDirectory, unsigned int perm,
+                    unsigned int fileSize, const EXTENT *extents, int extentCount, const char *inlineData)
+{
+    INODE *node;
+    
+    if (inodeNo == 0 || (inodeNo < inodeTableSize && inodeTable[inodeNo] != NULL) ||
+        (inlineData != NULL && fileSize > INLINE_MAX))
+        return NULL;
+    if ((node = newInode(inodeNo, isDirectory ? "directory" : "regular", perm)) == NULL)
+        return NULL;
+    if (isDirectory)
+        node->dir = dirCreate();
+    if (extentCount > 0)
+    {
+        node->extents = (EXTENT *)metaAlloc(extentCount * sizeof(EXTENT));
+        if (node->extents == NULL)
+            return NULL;
+        memcpy(node->extents, extents, extentCount * sizeof(EXTENT));
+        node->extentCount = node->extentCapacity = extentCount;
+    }
+    if (inlineData != NULL)
+    {
+        memcpy(node->inlineData, inlineData, fileSize);
+        inlineResize(0, fileSize);
+    }
+    node->fileSize = fileSize;
+    syncFirstExtent(node);
+    return node;
+}
+
+// Release an inode's data and metadata
+static void destroyInode(INODE *node)
+{
+    // Keeps compaction from moving the blocks while they are released
+    WRITE_LOCK(&node->lock);
+    SEQ_BEGIN(node);
+    fileTruncate(node, 0);
+    SEQ_END(node);
+    RW_UNLOCK(&node->lock);
+    if (__atomic_load_n(&node->corrupt, __ATOMIC_RELAXED))
+        COUNTER_ADD(corruptInodes, -1);
+    retireMeta(node->extents, node->extentCapacity * sizeof(EXTENT));
+    if (node->dir != NULL)
+        dirDestroy(node->dir);
+    
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        inodeList = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    inodeTable[node->inodeNo] = NULL;
+    recycleInodeNo(node->inodeNo);
+    COUNTER_ADD(S.usedInode, -1);
+    if (strcmp(node->fileType, "regular") == 0)
+        COUNTER_ADD(S.usedBlock, -1);
+    // A reader that resolved a descriptor just before it closed may still hold it
+    retireInode(node);
+}
+
+// Enter node under 'leaf' in its parent directory
+void linkInode(INODE *parent, INODE *node, const char *leaf)
+{
+    strcpy(node->name, leaf);
+    node->parentNo = parent->inodeNo;
+    dirInsert(parent->dir, leaf, node->inodeNo);
+}
+
+// Give node the further name 'leaf' in directory parentNo, the caller
+// enters it in the directory
+int addLink(INODE *node, unsigned int parentNo, const char *leaf)
+{
+    HARDLINK *link = (HARDLINK *)metaAlloc(sizeof(HARDLINK));
+    int len = strlen(leaf);
+    
+    if (link == NULL || (link->name = (char *)metaAlloc(len + 1)) == NULL)
+    {
+        metaFree(link, sizeof(HARDLINK));
+        return VFS_ENOMEM;
+    }
+    memcpy(link->name, leaf, len + 1);
+    link->parentNo = parentNo;
+    link->next = node->links;
+    node->links = link;
+    return VFS_OK;
+}
+
+static void freeLink(HARDLINK *link)
+{
+    metaFree(link->name, strlen(link->name) + 1);
+    metaFree(link, sizeof(HARDLINK));
+}
+
+// Enter the further names of a restored inode in their directories
+int restoreLinks(INODE *node)
+{
+    HARDLINK *link;
+    
+    for (link = node->links; link != NULL; link = link->next)
+    {
+        INODE *parent = (link->parentNo < inodeTableSize) ? inodeTable[link->parentNo] : NULL;
+        if (parent == NULL || parent->dir == NULL || dirFind(parent->dir, link->name, strlen(link->name)) != 0)
+            return VFS_EINVAL;
+        dirInsert(parent->dir, link->name, node->inodeNo);
+    }
+    return VFS_OK;
+}
+
+// Remove the name 'leaf' of node from parent, freeing node once nothing
+// references it
+static void unlinkInode(INODE *parent, const char *leaf, INODE *node)
+{
+    HARDLINK **link = &node->links, *gone = NULL;
+    
+    dirRemove(parent->dir, leaf);
+    if (parent->inodeNo == node->parentNo && strcmp(node->name, leaf) == 0)
+    {
+        // Another name takes the place of the one kept in the inode
+        if ((gone = node->links) != NULL)
+        {
+            WRITE_LOCK(&node->lock);
+            node->parentNo = gone->parentNo;
+            strcpy(node->name, gone->name);
+            node->links = gone->next;
+            RW_UNLOCK(&node->lock);
+        }
+    }
+    else
+    {
+        while (*link != NULL && ((*link)->parentNo != parent->inodeNo || strcmp((*link)->name, leaf) != 0))
+            link = &(*link)->next;
+        if ((gone = *link) != NULL)
+            *link = gone->next;
+    }
+    if (gone != NULL)
+        freeLink(gone);
+    dcacheGeneration++;
+    node->linkCount--;
+    if (node->linkCount == 0 && node->referenceCount == 0)
+        destroyInode(node);
+}
+
+// Initialize file table
+static FILETABLE *makeFT(INODE *inode, int mode)
+{
+    FILETABLE *node = (FILETABLE *)slabAlloc(&fileTableCache);
+    
+    if (node == NULL)
+        return NULL;
+    node->cnt = 1;
+    node->fileOffset = 0;
+    node->fileMode = mode;
+    node->inodeEntry = inode;
+    node->prev = NULL;
+    node->next = fileTableList;
+    if (fileTableList != NULL)
+        fileTableList->prev = node;
+    fileTableList = node;
+    return node;
+}
+
+static void freeFT(FILETABLE *ft)
+{
+    if (ft->prev != NULL)
+        ft->prev->next = ft->next;
+    else
+        fileTableList = ft->next;
+    if (ft->next != NULL)
+        ft->next->prev = ft->prev;
+    retireObject(&fileTableCache, ft);
+}
+
+// Initialize UFDT
+static int makeUFDT(FILETABLE *ft)
+{
+    int fd = allocFd();
+    
+    if (fd == -1)
+        return VFS_ENOMEM;
+    ufdtTable[fd].fdIndex = fd;
+    __atomic_store_n(&ufdtTable[fd].fileTableEntry, ft, __ATOMIC_RELEASE);
+    openFileCount++;
+    VFS_LOG("fd %d opened on inode %u\n", fd, ft->inodeEntry->inodeNo);
+    return fd;
+}
+
+// Whether a file's permission allows the requested access bits
+static int permAllows(unsigned int perm, int mode)
+{
+    if ((mode & VFS_READ) && perm != VFS_PERM_READ && perm != VFS_PERM_RDWR)
+        return 0;
+    if ((mode & VFS_WRITE) && perm != VFS_PERM_WRITE && perm != VFS_PERM_RDWR)
+        return 0;
+    return 1;
+}
+
+static void fillStat(INODE *node, struct vfs_stat *st)
+{
+    st->inodeNo = node->inodeNo;
+    st->isDirectory = (node->dir != NULL);
+    st->size = node->fileSize;
+    st->linkCount = node->linkCount;
+    st->openCount = node->referenceCount;
+    st->permission = node->fileAccessPermission;
+    st->extentCount = node->extentCount;
+    st->memOffset = (node->packOffset != -1) ? node->packOffset : node->memOffset;
+    st->packedSize = node->packedSize;
+    st->spilled = (node->spillOffset != -1);
+    st->corrupt = (int)__atomic_load_n(&node->corrupt, __ATOMIC_RELAXED);
+    strcpy(st->name, node->name);
+}
+
+int vfs_init(size_t poolSize)
+{
+    return vfs_init_flags(poolSize, 0);
+}
+
+int vfs_init_flags(size_t poolSize, int flags)
+{
+    struct vfs_config config;
+    
+    memset(&config, 0, sizeof(config));
+    config.poolSize = poolSize;
+    config.flags = flags;
+    return vfs_init_config(&config);
+}
+
+int vfs_init_config(const struct vfs_config *config)
+{
+    INODE *root;
+    size_t limit;
+    unsigned int inodes;
+    int err, arenaCount = 1, flags, i;
+    
+    if (mainPool != NULL || config == NULL || config->poolSize == 0 ||
+        (config->maxPoolSize != 0 && config->maxPoolSize < config->poolSize) ||
+        config->maxInodes > 0x7fffffff ||
+        config->allocPolicy < 0 || config->allocPolicy >= VFS_ALLOC_COUNT)
+        return VFS_EINVAL;
+    flags = config->flags;
+    limit = config->maxPoolSize ? config->maxPoolSize : config->poolSize;
+    inodes = config->maxInodes ? config->maxInodes : VFS_DEFAULT_INODES;
+    if (flags & VFS_INIT_CONCURRENT)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arenaCount = (cpus < 1) ? 1 : (cpus > MAX_ARENAS) ? MAX_ARENAS : (int)cpus;
+        for (i = 0; i < DCACHE_LOCKS; i++)
+            pthread_mutex_init(&dcacheLocks[i], NULL);
+    }
+    metaPeak = metaBytes;
+    if ((err = setupMemoryPool(config->poolSize, limit, arenaCount,
+                               (flags & VFS_INIT_HUGEPAGES) != 0, config->allocPolicy)) != VFS_OK)
+        return err;
+    vfsConcurrent = (flags & VFS_INIT_CONCURRENT) != 0;
+    dedupSetup((flags & VFS_INIT_DEDUP) != 0);
+    checksumSetup((flags & VFS_INIT_CHECKSUM) != 0);
+    resetStats();
+    
+    S.totalBlock = (int)inodes;
+    S.usedBlock = 0;
+    S.totalInode = (int)inodes;
+    S.usedInode = 0;
+    
+    root = allocInode("directory", VFS_PERM_RDWR);
+    if (root == NULL)
+    {
+        teardownMemoryPool();
+        return VFS_ENOMEM;
+    }
+    root->dir = dirCreate();
+    root->parentNo = ROOT_INODE;
+    strcpy(root->name, "/");
+    return VFS_OK;
+}
+
+void vfs_shutdown(void)
+{
+    int i;
+    
+    // Whatever is still buffered goes to the journal, and the fault worker
+    // and the scrubber must be gone before the inodes
+    journalTeardown();
+    spillTeardown();
+    searchTeardown();
+    checksumTeardown();
+    while (fileTableList != NULL)
+        freeFT(fileTableList);
+    while (inodeList != NULL)
+    {
+        INODE *node = inodeList;
+        inodeList = node->next;
+        metaFree(node->extents, node->extentCapacity * sizeof(EXTENT));
+        while (node->links != NULL)
+        {
+            HARDLINK *link = node->links;
+            node->links = link->next;
+            freeLink(link);
+        }
+        if (node->dir != NULL)
+        {
+            unsigned int b;
+            int t;
+            for (t = 0; t < 2; t++)
+            {
+                for (b = 0; node->dir->table[t] != NULL && b < node->dir->buckets[t]; b++)
+                {
+                    DIRENTRY *ent = node->dir->table[t][b];
+                    while (ent != NULL)
+                    {
+                        DIRENTRY *nxt = ent->next;
+                        metaFree(ent->name, strlen(ent->name) + 1);
+                        metaFree(ent, sizeof(DIRENTRY));
+                        ent = nxt;
+                    }
+                }
+            }
+            dirDestroy(node->dir);
+        }
+        pthread_rwlock_destroy(&node->lock);
+        slabFree(&inodeCache, node);
+    }
+    for (i = 0; i < DCACHE_SIZE; i++)
+    {
+        if (dcache[i].path != NULL)
+            metaFree(dcache[i].path, strlen(dcache[i].path) + 1);
+        dcache[i].path = NULL;
+    }
+    dcacheGeneration++;
+    
+    metaFree(inodeTable, inodeTableSize * sizeof(INODE *));
+    metaFree(ufdtTable, fdCapacity * sizeof(UFDT));
+    metaFree(fdMap, fdCapacity / FD_WORD_BITS * sizeof(unsigned long long));
+    metaFree(freeInodeNos, freeInodeCapacity * sizeof(unsigned int));
+    inodeTable = NULL;
+    inodeTableSize = inodeCounter = 0;
+    freeInodeNos = NULL;
+    freeInodeCount = freeInodeCapacity = 0;
+    ufdtTable = NULL;
+    fdMap = NULL;
+    fdCapacity = fdFreeHint = 0;
+    openFileCount = 0;
+    inlineFiles = 0;
+    inlineBytes = 0;
+    spillHand = 0;
+    memset(&S, 0, sizeof(S));
+    epochDrain();
+    slabDestroy(&inodeCache);
+    slabDestroy(&fileTableCache);
+    dedupTeardown();
+    packTeardown();
+    teardownMemoryPool();
+    imageDetach();
+    if (vfsConcurrent)
+    {
+        for (i = 0; i < DCACHE_LOCKS; i++)
+            pthread_mutex_destroy(&dcacheLocks[i]);
+        vfsConcurrent = 0;
+    }
+}
+
+static int openPath(const char *path, int flags, unsigned int perm)
+{
+    char leaf[MAX_NAME + 1];
+    INODE *node = lookupPath(path), *parent;
+    FILETABLE *ft;
+    int mode = flags & (VFS_RDWR | VFS_APPEND), err, fd;
+    
+    if ((mode & VFS_RDWR) == 0)
+        return VFS_EINVAL;
+    
+    if (node == NULL)
+    {
+        if (!(flags & VFS_CREAT))
+            return VFS_ENOENT;
+        if ((parent = lookupParent(path, leaf, &err)) == NULL)
+            return err;
+        if (perm != VFS_PERM_READ && perm != VFS_PERM_WRITE && perm != VFS_PERM_RDWR)
+            return VFS_EINVAL;
+        if (S.usedInode >= S.totalInode || S.usedBlock >= S.totalBlock)
+            return VFS_ENOSPC;
+        if ((node = allocInode("regular", perm)) == NULL)
+            return VFS_ENOMEM;
+        linkInode(parent, node, leaf);
+        JOURNAL_OP(JOURNAL_CREATE, node->inodeNo, perm, 0, path, NULL, NULL, 0);
+    }
+    else
+    {
+        if ((flags & VFS_CREAT) && (flags & VFS_EXCL))
+            return VFS_EEXIST;
+        if (node->dir != NULL)
+            return VFS_EISDIR;
+        if (!permAllows(node->fileAccessPermission, mode & VFS_RDWR))
+            return VFS_EACCES;
+        if ((flags & VFS_TRUNC) && (mode & VFS_WRITE))
+        {
+            WRITE_LOCK(&node->lock);
+            SEQ_BEGIN(node);
+            fileTruncate(node, 0);
+            JOURNAL_OP(JOURNAL_TRUNCATE, node->inodeNo, 0, 0, NULL, NULL, NULL, 0);
+            SEQ_END(node);
+            RW_UNLOCK(&node->lock);
+        }
+    }
+    
+    if ((ft = makeFT(node, mode)) == NULL)
+        return VFS_ENOMEM;
+    WRITE_LOCK(&fdLock);
+    fd = makeUFDT(ft);
+    RW_UNLOCK(&fdLock);
+    if (fd < 0)
+    {
+        freeFT(ft);
+        return fd;
+    }
+    node->referenceCount++;
+    return fd;
+}
+
+static int closeFd(int fd)
+{
+    UFDT *uptr;
+    FILETABLE *ft;
+    INODE *node;
+    
+    // Waits for I/O in flight on any descriptor to drain
+    WRITE_LOCK(&fdLock);
+    if ((uptr = lookupFd(fd)) == NULL)
+    {
+        RW_UNLOCK(&fdLock);
+        return VFS_EBADF;
+    }
+    ft = uptr->fileTableEntry;
+    releaseFd(fd);
+    RW_UNLOCK(&fdLock);
+    
+    node = ft->inodeEntry;
+    freeFT(ft);
+    node->referenceCount--;
+    if (node->linkCount == 0 && node->referenceCount == 0)
+    {
+        destroyInode(node);
+        compactIfFragmented();
+    }
+    epochCollect();
+    return VFS_OK;
+}
+
+// Resolve fd and check it was opened with the given access, the caller holds fdLock
+static FILETABLE *accessFd(int fd, int mode, int *err)
+{
+    UFDT *uptr = lookupFd(fd);
+    
+    if (uptr == NULL)
+    {
+        *err = VFS_EBADF;
+        return NULL;
+    }
+    if ((uptr->fileTableEntry->fileMode & mode) != mode)
+    {
+        *err = VFS_EACCES;
+        return NULL;
+    }
+    return uptr->fileTableEntry;
+}
+
+// Clamp a request to the int range the extents work in
+static int clampLength(size_t len)
+{
+    return (len > 0x7fffffff) ? 0x7fffffff : (int)len;
+}
+
+// Compress the files nobody touched during the last coldPasses compressor
+// passes, other than busy. Without wait, files whose lock is taken are
+// skipped. The caller holds nsLock; returns the pool bytes freed.
+static long packColdFiles(INODE *busy, int wait)
+{
+    unsigned int tick = __atomic_load_n(&packTick, __ATOMIC_RELAXED);
+    INODE *node;
+    long freed = 0;
+    
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        if (node == busy || node->dir != NULL || node->linkCount == 0 ||
+            tick - __atomic_load_n(&node->lastAccess, __ATOMIC_RELAXED) < packPolicy.coldPasses)
+            continue;
+        if (vfsConcurrent)
+        {
+            if (!wait && pthread_rwlock_trywrlock(&node->lock) != 0)
+                continue;
+            if (wait)
+                pthread_rwlock_wrlock(&node->lock);
+        }
+        freed += packFile(node);
+        RW_UNLOCK(&node->lock);
+    }
+    return freed;
+}
+
+// On-demand pass for a write that found the pool full. The writer holds
+// fdLock and its inode's lock already, so nothing here may wait.
+static long reclaimCold(INODE *busy)
+{
+    long freed;
+    
+    if (vfsConcurrent && pthread_rwlock_tryrdlock(&nsLock) != 0)
+        return 0;
+    freed = packColdFiles(busy, 0);
+    RW_UNLOCK(&nsLock);
+    return freed;
+}
+
+// Evict files other than busy to the backing file until 'needed' pool
+// bytes are free, in CLOCK order: a file touched since the hand last passed
+// it is spared this time round. The caller holds nsLock and may hold
+// busy's lock, so nothing here waits.
+static long evictLocked(INODE *busy, long needed)
+{
+    unsigned int steps, limit = 2 * inodeTableSize;
+    long freed = 0;
+    
+    for (steps = 0; steps < limit && freed < needed; steps++)
+    {
+        unsigned int inodeNo = __atomic_fetch_add(&spillHand, 1, __ATOMIC_RELAXED) % inodeTableSize;
+        INODE *node = inodeTable[inodeNo];
+        
+        if (node == NULL || node == busy || node->dir != NULL || node->linkCount == 0)
+            continue;
+        if (__atomic_load_n(&node->referenced, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&node->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (vfsConcurrent && pthread_rwlock_trywrlock(&node->lock) != 0)
+            continue;
+        freed += spillFile(node);
+        RW_UNLOCK(&node->lock);
+    }
+    // The space must be back in the pool before the caller retries; it
+    // went out in this epoch, so only the second advance can release it
+    if (freed > 0)
+    {
+        epochCollect();
+        epochCollect();
+    }
+    return freed;
+}
+
+// On-demand eviction for a write that found the pool full, see reclaimCold
+static long evictCold(INODE *busy, long needed)
+{
+    long freed;
+    
+    if (vfsConcurrent && pthread_rwlock_tryrdlock(&nsLock) != 0)
+        return 0;
+    freed = evictLocked(busy, needed);
+    RW_UNLOCK(&nsLock);
+    return freed;
+}
+
+// Bring a spilled file back before it changes, evicting colder files if
+// the pool has no room. Returns -1 when it still does not fit.
+static int faultRoom(INODE *node)
+{
+    int round;
+    
+    for (round = 0; faultFile(node) != 0; round++)
+    {
+        if (round == SPILL_EVICT_ROUNDS || evictCold(node, node->fileSize) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Bring back a spilled file that is being read, evicting colder ones if
+// need be, and the next spillPolicy.prefetch inodes as readahead for files
+// created along with it if they fit. In concurrent mode the fault worker
+// does it and the reader is served from the backing file meanwhile.
+static void faultAhead(INODE *node)
+{
+    unsigned int inodeNo;
+    
+    for (inodeNo = node->inodeNo; inodeNo - node->inodeNo <= spillPolicy.prefetch; inodeNo++)
+    {
+        if (vfsConcurrent)
+            spillQueue(inodeNo, inodeNo == node->inodeNo);
+        else
+            faultInode(inodeNo, inodeNo == node->inodeNo);
+    }
+}
+
+static int readFile(FILETABLE *ft, void *buf, size_t len, long offset)
+{
+    INODE *node = ft->inodeEntry;
+    int ret, tries;
+    
+    if (offset < 0 || offset > 0x7fffffff)
+        return VFS_EINVAL;
+    // A spilled file comes back on its second read since the CLOCK hand
+    // passed it, a one-off read is served from the backing file
+    if (__atomic_load_n(&node->spillOffset, __ATOMIC_RELAXED) != -1 &&
+        __atomic_load_n(&node->referenced, __ATOMIC_RELAXED))
+        faultAhead(node);
+    TOUCH_INODE(node);
+    if (vfsConcurrent && !VERIFY_READS())
+    {
+        // Readers normally never touch the lock, it is the fallback when
+        // writers keep getting in the way
+        for (tries = 0; tries < SEQ_READ_TRIES; tries++)
+        {
+            if ((ret = optimisticRead(node, (int)offset, (char *)buf, clampLength(len))) >= 0)
+                return ret;
+        }
+    }
+    READ_LOCK(&node->lock);
+    if (VERIFY_READS() && checkExtents(node, (int)offset, clampLength(len)) < 0)
+        ret = VFS_EIO;
+    else
+        ret = fileRead(node, (int)offset, (char *)buf, clampLength(len));
+    RW_UNLOCK(&node->lock);
+    return ret;
+}
+
+// Pin the bytes at offset for a view, up to len of them and no further than
+// the end of their extent. A packed or spilled file is stored raw in the
+// pool again first.
+static int mapFile(FILETABLE *ft, long offset, size_t len, struct vfs_view *view)
+{
+    INODE *node = ft->inodeEntry;
+    int pos = (int)offset, n = clampLength(len), err = 0;
+    
+    view->data = view->inlineCopy;
+    view->len = 0;
+    view->block = -1;
+    if (offset < 0 || offset > 0x7fffffff)
+        return VFS_EINVAL;
+    TOUCH_INODE(node);
+    READ_LOCK(&node->lock);
+    while (node->packOffset != -1 || node->spillOffset != -1)
+    {
+        RW_UNLOCK(&node->lock);
+        WRITE_LOCK(&node->lock);
+        SEQ_BEGIN(node);
+        if (node->spillOffset != -1)
+            err = faultRoom(node);
+        else if (node->packOffset != -1)
+            err = unpackFile(node);
+        SEQ_END(node);
+        RW_UNLOCK(&node->lock);
+        if (err != 0)
+            return VFS_ENOSPC;
+        READ_LOCK(&node->lock);
+    }
+    
+    if (pos >= (int)node->fileSize)
+        n = 0;
+    else if (n > (int)node->fileSize - pos)
+        n = node->fileSize - pos;
+    if (n > 0 && node->extentCount == 0)
+    {
+        // A few bytes from the inode are cheaper to copy than to pin
+        memcpy(view->inlineCopy, node->inlineData + pos, n);
+    }
+    else if (n > 0)
+    {
+        EXTENT *ext = &node->extents[findExtent(node, pos)];
+        
+        if (n > ext->start + ext->length - pos)
+            n = ext->start + ext->length - pos;
+        if ((VERIFY_READS() && checkExtents(node, pos, n) < 0) || pinSpace(ext->memOffset) != 0)
+            n = VFS_EIO;
+        else
+        {
+            view->block = ext->memOffset;
+            view->data = mainPool + ext->memOffset + (pos - ext->start);
+        }
+    }
+    RW_UNLOCK(&node->lock);
+    if (n > 0)
+        view->len = n;
+    return n;
+}
+
+// Retry the part of a write at pos that did not fit the first time
+static int writeRest(INODE *node, long pos, const char *buf, int len, int written)
+{
+    int done = (written > 0) ? written : 0;
+    int more = fileWrite(node, (int)pos + done, buf + done, len - done);
+    
+    return (more > 0) ? done + more : written;
+}
+
+// Write at *pos, or at the end of the file when *pos is -1, and leave *pos
+// just past the bytes written. The caller holds the inode's lock and
+// brackets the change with SEQ_BEGIN/SEQ_END.
+static int writeLocked(INODE *node, const void *buf, size_t len, long *pos)
+{
+    int written, round;
+    
+    if (len > 0x7fffffff)
+        return VFS_EINVAL;
+    if (*pos == -1)
+        *pos = node->fileSize;
+    if (*pos < 0 || *pos > 0x7fffffff - (long)len)
+        return VFS_EINVAL;
+    TOUCH_INODE(node);
+    if (node->spillOffset != -1 && faultRoom(node) != 0)
+        return VFS_ENOSPC;
+    written = fileWrite(node, (int)*pos, (const char *)buf, (int)len);
+    // Make room by compressing cold files, then by evicting them to the
+    // backing file, and write what is left
+    if (written < (int)len && packPolicy.level != VFS_COMPRESS_OFF && reclaimCold(node) > 0)
+        written = writeRest(node, *pos, (const char *)buf, (int)len, written);
+    for (round = 0; round < SPILL_EVICT_ROUNDS && written < (int)len && spillEnabled; round++)
+    {
+        if (evictCold(node, (long)len - ((written > 0) ? written : 0)) == 0)
+            break;
+        written = writeRest(node, *pos, (const char *)buf, (int)len, written);
+    }
+    if (written < 0)
+        return VFS_ENOSPC;
+    JOURNAL_OP(JOURNAL_WRITE, node->inodeNo, 0, *pos, NULL, NULL, (const char *)buf, written);
+    *pos += written;
+    return written;
+}
+
+static int writeFile(INODE *node, const void *buf, size_t len, long *pos)
+{
+    int ret;
+    
+    WRITE_LOCK(&node->lock);
+    SEQ_BEGIN(node);
+    ret = writeLocked(node, buf, len, pos);
+    SEQ_END(node);
+    RW_UNLOCK(&node->lock);
+    
+    compactIfFragmented();
+    epochCollect();
+    return ret;
+}
+
+static int preadFd(int fd, void *buf, size_t len, long offset)
+{
+    FILETABLE *ft;
+    int err;
+    
+    int token;
+    
+    token = epochEnter();
+    if ((ft = accessFd(fd, VFS_READ, &err)) != NULL)
+        err = readFile(ft, buf, len, offset);
+    epochExit(token);
+    return err;
+}
+
+static int mapFd(int fd, long offset, size_t len, struct vfs_view *view)
+{
+    FILETABLE *ft;
+    int err;
+    
+    READ_LOCK(&fdLock);
+    if ((ft = accessFd(fd, VFS_READ, &err)) != NULL)
+        err = mapFile(ft, offset, len, view);
+    RW_UNLOCK(&fdLock);
+    return err;
+}
+
+static int pwriteFd(int fd, const void *buf, size_t len, long offset)
+{
+    FILETABLE *ft;
+    int err;
+    
+    if (offset < 0)
+        return VFS_EINVAL;
+    READ_LOCK(&fdLock);
+    if ((ft = accessFd(fd, VFS_WRITE, &err)) != NULL)
+        err = writeFile(ft->inodeEntry, buf, len, &offset);
+    RW_UNLOCK(&fdLock);
+    return err;
+}
+
+static int readFd(int fd, void *buf, size_t len)
+{
+    FILETABLE *ft;
+    int ret, token;
+    
+    token = epochEnter();
+    if ((ft = accessFd(fd, VFS_READ, &ret)) != NULL)
+    {
+        ret = readFile(ft, buf, len, ft->fileOffset);
+        if (ret > 0)
+            ft->fileOffset += ret;
+    }
+    epochExit(token);
+    return ret;
+}
+
+static int writeFd(int fd, const void *buf, size_t len)
+{
+    FILETABLE *ft;
+    long pos;
+    int ret;
+    
+    READ_LOCK(&fdLock);
+    if ((ft = accessFd(fd, VFS_WRITE, &ret)) != NULL)
+    {
+        pos = (ft->fileMode & VFS_APPEND) ? -1 : ft->fileOffset;
+        ret = writeFile(ft->inodeEntry, buf, len, &pos);
+        if (ret >= 0)
+            ft->fileOffset = (int)pos;
+    }
+    RW_UNLOCK(&fdLock);
+    return ret;
+}
+
+// Write at the end of the file whatever the open flags, leaving the offset there
+static int appendFd(int fd, const void *buf, size_t len)
+{
+    FILETABLE *ft;
+    long pos = -1;
+    int ret;
+    
+    READ_LOCK(&fdLock);
+    if ((ft = accessFd(fd, VFS_WRITE, &ret)) != NULL)
+    {
+        ret = writeFile(ft->inodeEntry, buf, len, &pos);
+        if (ret >= 0)
+            ft->fileOffset = (int)pos;
+    }
+    RW_UNLOCK(&fdLock);
+    return ret;
+}
+
+static int truncateFile(INODE *node, long size)
+{
+    int oldSize, ret = VFS_OK, round;
+    
+    if (size < 0 || size > 0x7fffffff)
+        return VFS_EINVAL;
+    WRITE_LOCK(&node->lock);
+    TOUCH_INODE(node);
+    SEQ_BEGIN(node);
+    oldSize = node->fileSize;
+    if (node->spillOffset != -1 && size != 0 && faultRoom(node) != 0)
+        ret = VFS_ENOSPC;
+    else if (node->packOffset != -1 && size != 0 && unpackFile(node) != 0)
+        ret = VFS_ENOSPC;
+    else if (size < oldSize)
+        fileTruncate(node, (int)size);
+    else
+    {
+        // Evicting cold files may make room for the zeros
+        for (round = 0; fileExtend(node, NULL, (int)size - oldSize) < (int)size - oldSize; round++)
+        {
+            fileTruncate(node, oldSize);
+            if (!spillEnabled || round == SPILL_EVICT_ROUNDS || evictCold(node, (long)size - oldSize) == 0)
+            {
+                ret = VFS_ENOSPC;
+                break;
+            }
+        }
+    }
+    if (ret == VFS_OK)
+        JOURNAL_OP(JOURNAL_TRUNCATE, node->inodeNo, 0, size, NULL, NULL, NULL, 0);
+    SEQ_END(node);
+    RW_UNLOCK(&node->lock);
+    compactIfFragmented();
+    epochCollect();
+    return ret;
+}
+
+static int truncateFd(int fd, long size)
+{
+    FILETABLE *ft;
+    int err;
+    
+    READ_LOCK(&fdLock);
+    if ((ft = accessFd(fd, VFS_WRITE, &err)) != NULL)
+        err = truncateFile(ft->inodeEntry, size);
+    RW_UNLOCK(&fdLock);
+    return err;
+}
+
+static int unlinkPath(const char *path)
+{
+    char leaf[MAX_NAME + 1];
+    INODE *node = lookupPath(path), *parent;
+    int err;
+    
+    if (node == NULL)
+        return VFS_ENOENT;
+    if (node->dir != NULL)
+        return VFS_EISDIR;
+    if ((parent = lookupParent(path, leaf, &err)) == NULL)
+        return err;
+    JOURNAL_OP(JOURNAL_UNLINK, node->inodeNo, 0, 0, path, NULL, NULL, 0);
+    unlinkInode(parent, leaf, node);
+    compactIfFragmented();
+    epochCollect();
+    return VFS_OK;
+}
+
+static int makeDirectory(const char *path)
+{
+    char leaf[MAX_NAME + 1];
+    INODE *parent, *node;
+    int err;
+    
+    if ((parent = lookupParent(path, leaf, &err)) == NULL)
+        return err;
+    if (dirFind(parent->dir, leaf, strlen(leaf)) != 0)
+        return VFS_EEXIST;
+    if (S.usedInode >= S.totalInode)
+        return VFS_ENOSPC;
+    if ((node = allocInode("directory", VFS_PERM_RDWR)) == NULL)
+        return VFS_ENOMEM;
+    node->dir = dirCreate();
+    linkInode(parent, node, leaf);
+    JOURNAL_OP(JOURNAL_MKDIR, node->inodeNo, 0, 0, path, NULL, NULL, 0);
+    return VFS_OK;
+}
+
+static int removeDirectory(const char *path)
+{
+    INODE *node = lookupPath(path);
+    
+    if (node == NULL)
+        return VFS_ENOENT;
+    if (node->dir == NULL)
+        return VFS_ENOTDIR;
+    if (node->inodeNo == ROOT_INODE)
+        return VFS_EINVAL;
+    if (node->dir->count != 0)
+        return VFS_ENOTEMPTY;
+    JOURNAL_OP(JOURNAL_RMDIR, node->inodeNo, 0, 0, path, NULL, NULL, 0);
+    unlinkInode(inodeTable[node->parentNo], node->name, node);
+    return VFS_OK;
+}
+
+// Enter the regular file at oldPath under newPath as well
+static int linkPath(const char *oldPath, const char *newPath)
+{
+    char leaf[MAX_NAME + 1];
+    INODE *node = lookupPath(oldPath), *parent;
+    int err;
+    
+    if (node == NULL)
+        return VFS_ENOENT;
+    if (node->dir != NULL)
+        return VFS_EISDIR;
+    if ((parent = lookupParent(newPath, leaf, &err)) == NULL)
+        return err;
+    if (dirFind(parent->dir, leaf, strlen(leaf)) != 0)
+        return VFS_EEXIST;
+    if ((err = addLink(node, parent->inodeNo, leaf)) != VFS_OK)
+        return err;
+    dirInsert(parent->dir, leaf, node->inodeNo);
+    node->linkCount++;
+    JOURNAL_OP(JOURNAL_LINK, node->inodeNo, 0, 0, oldPath, newPath, NULL, 0);
+    return VFS_OK;
+}
+
+static int statPath(const char *path, struct vfs_stat *st)
+{
+    INODE *node = lookupPath(path);
+    
+    if (node == NULL)
+        return VFS_ENOENT;
+    READ_LOCK(&node->lock);
+    fillStat(node, st);
+    RW_UNLOCK(&node->lock);
+    return VFS_OK;
+}
+
+// Public entry points, timed into the per-operation statistics
+int vfs_open(const char *path, int flags, unsigned int perm)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = openPath(path, flags, perm);
+    // Recorded under the lock so descriptor reuse keeps its order
+    TRACE_OP(TRACE_OPEN, flags, perm, 0, ret, path, NULL);
+    RW_UNLOCK(&nsLock);
+    JOURNAL_SETTLE();
+    return statEnd(VFS_OP_OPEN, start, ret);
+}
+
+int vfs_close(int fd)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = closeFd(fd);
+    TRACE_OP(TRACE_CLOSE, fd, 0, 0, ret, NULL, NULL);
+    RW_UNLOCK(&nsLock);
+    return statEnd(VFS_OP_CLOSE, start, ret);
+}
+
+int vfs_read(int fd, void *buf, size_t len)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_READ, start, readFd(fd, buf, len));
+    
+    TRACE_OP(TRACE_READ, fd, len, 0, ret, NULL, NULL);
+    return ret;
+}
+
+int vfs_write(int fd, const void *buf, size_t len)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_WRITE, start, writeFd(fd, buf, len));
+    
+    TRACE_OP(TRACE_WRITE, fd, len, 0, ret, NULL, NULL);
+    JOURNAL_SETTLE();
+    return ret;
+}
+
+int vfs_append(int fd, const void *buf, size_t len)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_APPEND, start, appendFd(fd, buf, len));
+    
+    TRACE_OP(TRACE_APPEND, fd, len, 0, ret, NULL, NULL);
+    JOURNAL_SETTLE();
+    return ret;
+}
+
+int vfs_pread(int fd, void *buf, size_t len, long offset)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_READ, start, preadFd(fd, buf, len, offset));
+    
+    TRACE_OP(TRACE_PREAD, fd, len, offset, ret, NULL, NULL);
+    return ret;
+}
+
+// Traced as a pread of the bytes it covered
+int vfs_map(int fd, long offset, size_t len, struct vfs_view *view)
+{
+    long long start = statStart();
+    int ret;
+    
+    if (view == NULL)
+        return VFS_EINVAL;
+    ret = statEnd(VFS_OP_READ, start, mapFd(fd, offset, len, view));
+    TRACE_OP(TRACE_PREAD, fd, (ret > 0) ? (long long)ret : (long long)len, offset, ret, NULL, NULL);
+    return ret;
+}
+
+void vfs_unmap(struct vfs_view *view)
+{
+    if (view == NULL)
+        return;
+    if (view->block != -1)
+        unpinSpace(view->block);
+    view->data = NULL;
+    view->len = 0;
+    view->block = -1;
+}
+
+int vfs_pwrite(int fd, const void *buf, size_t len, long offset)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_WRITE, start, pwriteFd(fd, buf, len, offset));
+    
+    TRACE_OP(TRACE_PWRITE, fd, len, offset, ret, NULL, NULL);
+    JOURNAL_SETTLE();
+    return ret;
+}
+
+int vfs_ftruncate(int fd, long size)
+{
+    long long start = statStart();
+    int ret = statEnd(VFS_OP_TRUNCATE, start, truncateFd(fd, size));
+    
+    TRACE_OP(TRACE_TRUNCATE, fd, 0, size, ret, NULL, NULL);
+    JOURNAL_SETTLE();
+    return ret;
+}
+
+static long seekFd(int fd, long offset, int whence)
+{
+    UFDT *uptr;
+    long base, ret;
+    
+    READ_LOCK(&fdLock);
+    if ((uptr = lookupFd(fd)) == NULL)
+    {
+        RW_UNLOCK(&fdLock);
+        return VFS_EBADF;
+    }
+    if (whence == VFS_SEEK_SET)
+        base = 0;
+    else if (whence == VFS_SEEK_CUR)
+        base = uptr->fileTableEntry->fileOffset;
+    else if (whence == VFS_SEEK_END)
+        base = uptr->fileTableEntry->inodeEntry->fileSize;
+    else
+        base = -1;
+    
+    // Seeking past the end is allowed, a later write fills the gap with zeros
+    if (base < 0 || base + offset < 0 || base + offset > 0x7fffffff)
+        ret = VFS_EINVAL;
+    else
+        ret = uptr->fileTableEntry->fileOffset = (int)(base + offset);
+    RW_UNLOCK(&fdLock);
+    return ret;
+}
+
+long vfs_lseek(int fd, long offset, int whence)
+{
+    long ret = seekFd(fd, offset, whence);
+    
+    TRACE_OP(TRACE_SEEK, fd, whence, offset, (int)ret, NULL, NULL);
+    return ret;
+}
+
+int vfs_unlink(const char *path)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = unlinkPath(path);
+    TRACE_OP(TRACE_UNLINK, -1, 0, 0, ret, path, NULL);
+    RW_UNLOCK(&nsLock);
+    JOURNAL_SETTLE();
+    return statEnd(VFS_OP_UNLINK, start, ret);
+}
+
+int vfs_link(const char *oldPath, const char *newPath)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = linkPath(oldPath, newPath);
+    TRACE_OP(TRACE_LINK, -1, 0, 0, ret, oldPath, newPath);
+    RW_UNLOCK(&nsLock);
+    JOURNAL_SETTLE();
+    return statEnd(VFS_OP_LINK, start, ret);
+}
+
+int vfs_mkdir(const char *path)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = makeDirectory(path);
+    TRACE_OP(TRACE_MKDIR, -1, 0, 0, ret, path, NULL);
+    RW_UNLOCK(&nsLock);
+    JOURNAL_SETTLE();
+    return statEnd(VFS_OP_MKDIR, start, ret);
+}
+
+int vfs_rmdir(const char *path)
+{
+    long long start = statStart();
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = removeDirectory(path);
+    TRACE_OP(TRACE_RMDIR, -1, 0, 0, ret, path, NULL);
+    RW_UNLOCK(&nsLock);
+    JOURNAL_SETTLE();
+    return statEnd(VFS_OP_RMDIR, start, ret);
+}
+
+int vfs_stat(const char *path, struct vfs_stat *st)
+{
+    long long start = statStart();
+    int ret;
+    
+    READ_LOCK(&nsLock);
+    ret = statPath(path, st);
+    RW_UNLOCK(&nsLock);
+    return statEnd(VFS_OP_STAT, start, ret);
+}
+
+int vfs_fstat(int fd, struct vfs_stat *st)
+{
+    UFDT *uptr;
+    INODE *node;
+    
+    READ_LOCK(&fdLock);
+    if ((uptr = lookupFd(fd)) == NULL)
+    {
+        RW_UNLOCK(&fdLock);
+        return VFS_EBADF;
+    }
+    node = uptr->fileTableEntry->inodeEntry;
+    READ_LOCK(&node->lock);
+    fillStat(node, st);
+    RW_UNLOCK(&node->lock);
+    RW_UNLOCK(&fdLock);
+    return VFS_OK;
+}
+
+int vfs_readdir(const char *path, vfs_dir_callback callback, void *arg)
+{
+    INODE *node, *child;
+    struct vfs_stat st;
+    DIRENTRY *ent;
+    unsigned int b;
+    int t;
+    
+    READ_LOCK(&nsLock);
+    node = lookupPath(path);
+    if (node == NULL || node->dir == NULL)
+    {
+        RW_UNLOCK(&nsLock);
+        return (node == NULL) ? VFS_ENOENT : VFS_ENOTDIR;
+    }
+    for (t = 0; t < 2; t++)
+    {
+        for (b = 0; node->dir->table[t] != NULL && b < node->dir->buckets[t]; b++)
+        {
+            for (ent = node->dir->table[t][b]; ent != NULL; ent = ent->next)
+            {
+                child = inodeTable[ent->inodeNo];
+                READ_LOCK(&child->lock);
+                fillStat(child, &st);
+                RW_UNLOCK(&child->lock);
+                callback(ent->name, &st, arg);
+            }
+        }
+    }
+    RW_UNLOCK(&nsLock);
+    return VFS_OK;
+}
+
+// Regular files in inode order go to the scan (search.c), which holds
+// each one's lock while it reads it
+int vfs_search(const void *pattern, size_t len, vfs_search_callback callback, void *arg)
+{
+    INODE **files;
+    unsigned int i;
+    int count = 0, ret;
+    
+    if (mainPool == NULL || pattern == NULL || len == 0 || len > 0x7fffffff || callback == NULL)
+        return VFS_EINVAL;
+    READ_LOCK(&nsLock);
+    for (i = 0; i < inodeTableSize; i++)
+    {
+        if (inodeTable[i] != NULL && inodeTable[i]->dir == NULL)
+            count++;
+    }
+    if ((files = (INODE **)metaAlloc((count + 1) * sizeof(INODE *))) == NULL)
+    {
+        RW_UNLOCK(&nsLock);
+        return VFS_ENOMEM;
+    }
+    for (i = 0, count = 0; i < inodeTableSize; i++)
+    {
+        if (inodeTable[i] != NULL && inodeTable[i]->dir == NULL)
+            files[count++] = inodeTable[i];
+    }
+    ret = searchFiles(files, count, (const char *)pattern, (int)len, callback, arg);
+    RW_UNLOCK(&nsLock);
+    metaFree(files, (count + 1) * sizeof(INODE *));
+    return ret;
+}
+
+// Ring entries (ring.c) run in batches. Runs of open, close and unlink
+// share one hold of the namespace lock; runs of reads and writes share the
+// descriptor table lock and an epoch, resolve each descriptor once for as
+// long as consecutive entries use it, and write to one file under a single
+// hold of its lock. Cleanup that synchronous calls do per call happens once
+// per batch.
+
+static int ringNamespaceOp(int op)
+{
+    return op == VFS_RING_OPEN || op == VFS_RING_CLOSE || op == VFS_RING_UNLINK;
+}
+
+static int ringWriteOp(int op)
+{
+    return op == VFS_RING_WRITE || op == VFS_RING_PWRITE || op == VFS_RING_APPEND;
+}
+
+static int runNamespaceOps(const struct vfs_sqe *sqes, int *results, int i, int count)
+{
+    WRITE_LOCK(&nsLock);
+    for (; i < count && ringNamespaceOp(sqes[i].op); i++)
+    {
+        const struct vfs_sqe *e = &sqes[i];
+        long long start = statStart();
+        
+        if (e->op == VFS_RING_OPEN)
+        {
+            results[i] = statEnd(VFS_OP_OPEN, start, openPath(e->path, e->flags, e->perm));
+            TRACE_OP(TRACE_OPEN, e->flags, e->perm, 0, results[i], e->path, NULL);
+        }
+        else if (e->op == VFS_RING_CLOSE)
+        {
+            results[i] = statEnd(VFS_OP_CLOSE, start, closeFd(e->fd));
+            TRACE_OP(TRACE_CLOSE, e->fd, 0, 0, results[i], NULL, NULL);
+        }
+        else
+        {
+            results[i] = statEnd(VFS_OP_UNLINK, start, unlinkPath(e->path));
+            TRACE_OP(TRACE_UNLINK, -1, 0, 0, results[i], e->path, NULL);
+        }
+    }
+    RW_UNLOCK(&nsLock);
+    return i;
+}
+
+// Take room for a run of writes through one descriptor in one allocation,
+// rather than one per write, when together they extend the file
+static void reserveRun(INODE *node, FILETABLE *ft, const struct vfs_sqe *e, int count)
+{
+    long end = node->fileSize, offset = ft->fileOffset;
+    EXTENT *tail;
+    int i;
+    
+    if (count < 2 || node->packOffset != -1 || node->spillOffset != -1)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        long pos = (e[i].op == VFS_RING_PWRITE) ? e[i].offset :
+                   (e[i].op == VFS_RING_APPEND || (ft->fileMode & VFS_APPEND)) ? end : offset;
+        
+        if (pos < 0 || e[i].len > 0x7fffffff || pos > 0x7fffffff - (long)e[i].len)
+            return;
+        if (pos + (long)e[i].len > end)
+            end = pos + (long)e[i].len;
+        if (e[i].op != VFS_RING_PWRITE)
+            offset = pos + (long)e[i].len;
+    }
+    // A run that stays inline needs no pool space, one that outgrows the
+    // inode moves it out once
+    if (node->extentCount == 0)
+    {
+        if (end > INLINE_MAX)
+            promoteInline(node, (int)(end - node->fileSize));
+        return;
+    }
+    // A tail with room left is filled first, a new extent must follow a full one
+    tail = &node->extents[node->extentCount - 1];
+    if (end > (long)node->fileSize && tail->length == tail->capacity)
+        growTail(node, (int)(end - node->fileSize));
+}
+
+// Entries i to end write through ft, all under one hold of the inode's lock
+static void runWrites(const struct vfs_sqe *sqes, int *results, int i, int end, FILETABLE *ft)
+{
+    INODE *node = ft->inodeEntry;
+    
+    WRITE_LOCK(&node->lock);
+    SEQ_BEGIN(node);
+    reserveRun(node, ft, sqes + i, end - i);
+    for (; i < end; i++)
+    {
+        const struct vfs_sqe *e = &sqes[i];
+        long long start = statStart();
+        long pos;
+        int ret;
+        
+        if (e->op == VFS_RING_PWRITE)
+            pos = e->offset;
+        else
+            pos = (e->op == VFS_RING_APPEND || (ft->fileMode & VFS_APPEND)) ? -1 : ft->fileOffset;
+        if (e->op == VFS_RING_PWRITE && pos < 0)
+            ret = VFS_EINVAL;
+        else if ((ret = writeLocked(node, e->buf, e->len, &pos)) >= 0 && e->op != VFS_RING_PWRITE)
+            ft->fileOffset = (int)pos;
+        results[i] = statEnd(e->op == VFS_RING_APPEND ? VFS_OP_APPEND : VFS_OP_WRITE, start, ret);
+        TRACE_OP(e->op == VFS_RING_WRITE ? TRACE_WRITE : e->op == VFS_RING_APPEND ? TRACE_APPEND : TRACE_PWRITE,
+                 e->fd, e->len, e->op == VFS_RING_PWRITE ? e->offset : 0, ret, NULL, NULL);
+    }
+    SEQ_END(node);
+    RW_UNLOCK(&node->lock);
+}
+
+static int runDataOps(const struct vfs_sqe *sqes, int *results, int i, int count)
+{
+    FILETABLE *ft = NULL;
+    int lastFd = -1, lastMode = 0, err = VFS_EBADF, token;
+    
+    token = epochEnter();
+    READ_LOCK(&fdLock);
+    while (i < count && !ringNamespaceOp(sqes[i].op))
+    {
+        const struct vfs_sqe *e = &sqes[i];
+        int mode = ringWriteOp(e->op) ? VFS_WRITE : VFS_READ;
+        long long start;
+        int end;
+        
+        if (e->op <= VFS_RING_NOP || e->op >= VFS_RING_OP_COUNT)
+        {
+            results[i++] = (e->op == VFS_RING_NOP) ? VFS_OK : VFS_EINVAL;
+            continue;
+        }
+        if (e->fd != lastFd || mode != lastMode)
+        {
+            ft = accessFd(e->fd, mode, &err);
+            lastFd = e->fd;
+            lastMode = mode;
+        }
+        if (ft == NULL)
+        {
+            results[i++] = err;
+            continue;
+        }
+        if (mode == VFS_WRITE)
+        {
+            for (end = i + 1; end < count && ringWriteOp(sqes[end].op) && sqes[end].fd == e->fd; end++)
+                ;
+            runWrites(sqes, results, i, end, ft);
+            i = end;
+            continue;
+        }
+        start = statStart();
+        if (e->op == VFS_RING_PREAD)
+            results[i] = readFile(ft, e->buf, e->len, e->offset);
+        else if ((results[i] = readFile(ft, e->buf, e->len, ft->fileOffset)) > 0)
+            ft->fileOffset += results[i];
+        statEnd(VFS_OP_READ, start, results[i]);
+        TRACE_OP(e->op == VFS_RING_PREAD ? TRACE_PREAD : TRACE_READ, e->fd, e->len,
+                 e->op == VFS_RING_PREAD ? e->offset : 0, results[i], NULL, NULL);
+        i++;
+    }
+    RW_UNLOCK(&fdLock);
+    epochExit(token);
+    return i;
+}
+
+// Run count entries in order, leaving each one's return value in results
+void runBatch(const struct vfs_sqe *sqes, int *results, int count)
+{
+    int i = 0;
+    
+    while (i < count)
+    {
+        if (ringNamespaceOp(sqes[i].op))
+            i = runNamespaceOps(sqes, results, i, count);
+        else
+            i = runDataOps(sqes, results, i, count);
+    }
+    compactIfFragmented();
+    epochCollect();
+    JOURNAL_SETTLE();
+}
+
+int vfs_next_fd(int fd)
+{
+    READ_LOCK(&fdLock);
+    for (fd = (fd < 0) ? 0 : fd + 1; fd < fdCapacity; fd++)
+    {
+        if (ufdtTable[fd].fileTableEntry != NULL)
+            break;
+    }
+    RW_UNLOCK(&fdLock);
+    return (fd < fdCapacity) ? fd : -1;
+}
+
+int vfs_defragment(int budget)
+{
+    if (budget <= 0)
+        return VFS_EINVAL;
+    return defragmentMemory(budget);
+}
+
+double vfs_fragmentation(void)
+{
+    return fragmentationRatio();
+}
+
+void vfs_dump_memory_map(FILE *out)
+{
+    showMemoryMap(out);
+}
+
+long vfs_compress_cold(void)
+{
+    long freed = 0;
+    
+    if (mainPool == NULL)
+        return VFS_EINVAL;
+    READ_LOCK(&nsLock);
+    if (packPolicy.level != VFS_COMPRESS_OFF)
+        freed = packColdFiles(NULL, 1);
+    __atomic_add_fetch(&packTick, 1, __ATOMIC_RELAXED);
+    RW_UNLOCK(&nsLock);
+    compactIfFragmented();
+    epochCollect();
+    return freed;
+}
+
+// Bring inode inodeNo back from the backing file if it is still spilled
+// and there is room, or with evict set, once colder files made room
+void faultInode(unsigned int inodeNo, int evict)
+{
+    INODE *node;
+    int round;
+    
+    READ_LOCK(&nsLock);
+    node = (inodeNo < inodeTableSize) ? inodeTable[inodeNo] : NULL;
+    if (node != NULL && __atomic_load_n(&node->spillOffset, __ATOMIC_RELAXED) != -1)
+    {
+        WRITE_LOCK(&node->lock);
+        SEQ_BEGIN(node);
+        for (round = 0; node->spillOffset != -1 && faultFile(node) != 0; round++)
+        {
+            if (!evict || round == SPILL_EVICT_ROUNDS || evictLocked(node, node->fileSize) == 0)
+                break;
+        }
+        SEQ_END(node);
+        RW_UNLOCK(&node->lock);
+    }
+    RW_UNLOCK(&nsLock);
+}
+
+// Check every byte of inode inodeNo in the pool against its checksums, for
+// the scrubber (checksum.c). Returns 1 when it failed, 0 when it passed or
+// there is no such file, -1 past the end of the inode table.
+int scrubInode(unsigned int inodeNo, unsigned long long *bytes)
+{
+    INODE *node;
+    long ret = 0;
+    
+    *bytes = 0;
+    READ_LOCK(&nsLock);
+    if (inodeNo >= inodeTableSize)
+    {
+        RW_UNLOCK(&nsLock);
+        return -1;
+    }
+    node = inodeTable[inodeNo];
+    if (node != NULL && node->dir == NULL)
+    {
+        READ_LOCK(&node->lock);
+        if (node->packOffset != -1 && (ret = checkPacked(node)) == VFS_OK)
+            *bytes = node->packedSize;
+        else if (node->packOffset == -1 && (ret = checkExtents(node, 0, node->fileSize)) > 0)
+            *bytes = ret;
+        RW_UNLOCK(&node->lock);
+    }
+    RW_UNLOCK(&nsLock);
+    return ret < 0;
+}
+
+// Bring every spilled file back, the caller holds the namespace. Returns
+// VFS_ENOSPC when the pool cannot take them all.
+int faultAll()
+{
+    INODE *node;
+    int err = VFS_OK;
+    
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        if (node->spillOffset == -1)
+            continue;
+        WRITE_LOCK(&node->lock);
+        SEQ_BEGIN(node);
+        if (faultFile(node) != 0)
+            err = VFS_ENOSPC;
+        SEQ_END(node);
+        RW_UNLOCK(&node->lock);
+    }
+    return err;
+}
+
+// Journal replay (journal.c) recreates files at the inode numbers they
+// were logged with, so later records still find them by number
+static int createAt(const char *path, unsigned int inodeNo, unsigned int perm, int isDirectory)
+{
+    char leaf[MAX_NAME + 1];
+    INODE *parent, *node;
+    unsigned int i;
+    int err;
+    
+    if ((parent = lookupParent(path, leaf, &err)) == NULL)
+        return err;
+    if (inodeNo == 0 || (inodeNo < inodeTableSize && inodeTable[inodeNo] != NULL) ||
+        dirFind(parent->dir, leaf, strlen(leaf)) != 0)
+        return VFS_EEXIST;
+    if ((node = newInode(inodeNo, isDirectory ? "directory" : "regular", perm)) == NULL)
+        return VFS_ENOMEM;
+    // The number may be waiting for reuse
+    for (i = 0; i < freeInodeCount; i++)
+    {
+        if (freeInodeNos[i] == inodeNo)
+        {
+            freeInodeNos[i] = freeInodeNos[--freeInodeCount];
+            break;
+        }
+    }
+    if (isDirectory)
+        node->dir = dirCreate();
+    linkInode(parent, node, leaf);
+    return VFS_OK;
+}
+
+int replayCreate(const char *path, unsigned int inodeNo, unsigned int perm, int isDirectory)
+{
+    int ret;
+    
+    WRITE_LOCK(&nsLock);
+    ret = createAt(path, inodeNo, perm, isDirectory);
+    RW_UNLOCK(&nsLock);
+    return ret;
+}
+
+static INODE *replayInode(unsigned int inodeNo)
+{
+    INODE *node = (inodeNo < inodeTableSize) ? inodeTable[inodeNo] : NULL;
+    
+    return (node != NULL && node->dir == NULL) ? node : NULL;
+}
+
+// A file unlinked while open is gone by the time its writes replay
+int replayWrite(unsigned int inodeNo, const char *buf, int len, long pos)
+{
+    INODE *node = replayInode(inodeNo);
+    
+    return (node != NULL) ? writeFile(node, buf, len, &pos) : VFS_ENOENT;
+}
+
+int replayTruncate(unsigned int inodeNo, long size)
+{
+    INODE *node = replayInode(inodeNo);
+    
+    return (node != NULL) ? truncateFile(node, size) : VFS_ENOENT;
+}
+
+int vfs_prefetch(const char *path)
+{
+    INODE *node;
+    unsigned int inodeNo = 0;
+    int err = VFS_OK;
+    
+    if (mainPool == NULL || path == NULL)
+        return VFS_EINVAL;
+    READ_LOCK(&nsLock);
+    if ((node = lookupPath(path)) == NULL)
+        err = VFS_ENOENT;
+    else if (node->dir != NULL)
+        err = VFS_EISDIR;
+    else
+        inodeNo = node->inodeNo;
+    RW_UNLOCK(&nsLock);
+    if (err != VFS_OK)
+        return err;
+    if (vfsConcurrent)
+        spillQueue(inodeNo, 1);
+    else
+        faultInode(inodeNo, 1);
+    return VFS_OK;
+}
+
+// Cross-check inodes against the pool blocks they claim to own
+static int checkInodes(FILE *out)
+{
+    INODE *node;
+    unsigned int inodes = 0, regular = 0, blocks = 0, shared;
+    unsigned long long refs, saved;
+    int problems = 0, i;
+    
+    for (node = inodeList; node != NULL; node = node->next)
+    {
+        int pos = 0;
+        
+        inodes++;
+        if (strcmp(node->fileType, "regular") == 0)
+            regular++;
+        if (node->inodeNo >= inodeTableSize || inodeTable[node->inodeNo] != node)
+        {
+            fprintf(out, "inode %u: not in the inode table\n", node->inodeNo);
+            problems++;
+        }
+        if (node->spillOffset != -1)
+        {
+            if (node->extentCount != 0 || node->packOffset != -1)
+            {
+                fprintf(out, "inode %u: spilled but still holds pool data\n", node->inodeNo);
+                problems++;
+            }
+            pos = node->fileSize;
+        }
+        else if (node->packOffset != -1)
+        {
+            INODE *owner = NULL;
+            
+            blocks++;
+            if (node->extentCount != 0 || usedBlockInfo(node->packOffset, &owner) != node->packedSize ||
+                owner != node)
+            {
+                fprintf(out, "inode %u: packed data at %lld is not its %d byte block\n",
+                        node->inodeNo, node->packOffset, node->packedSize);
+                problems++;
+            }
+            pos = node->fileSize;
+        }
+        else if (node->extentCount == 0)
+        {
+            if (node->fileSize > INLINE_MAX)
+            {
+                fprintf(out, "inode %u: %u bytes held inline\n", node->inodeNo, node->fileSize);
+                problems++;
+            }
+            pos = node->fileSize;
+        }
+        for (i = 0; i < node->extentCount; i++)
+        {
+            EXTENT *ext = &node->extents[i];
+            INODE *owner = NULL;
+            
+            blocks++;
+            if (usedBlockInfo(ext->memOffset, &owner) != ext->capacity ||
+                (owner != node && (owner != NULL || dedupRefCount(ext->memOffset) == 0)))
+            {
+                fprintf(out, "inode %u: extent %d at %lld is not its %d byte block\n",
+                        node->inodeNo, i, ext->memOffset, ext->capacity);
+                problems++;
+            }
+            if (ext->start != pos || ext->length > ext->capacity ||
+                (i < node->extentCount - 1 && ext->length != ext->capacity))
+            {
+                fprintf(out, "inode %u: extent %d covers [%d, %d) after %d\n",
+                        node->inodeNo, i, ext->start, ext->start + ext->length, pos);
+                problems++;
+            }
+            pos += ext->length;
+        }
+        if (pos != (int)node->fileSize)
+        {
+            fprintf(out, "inode %u: extents hold %d bytes, size is %u\n", node->inodeNo, pos, node->fileSize);
+            problems++;
+        }
+        if (node->linkCount > 0 && node->inodeNo != ROOT_INODE)
+        {
+            INODE *parent = (node->parentNo < inodeTableSize) ? inodeTable[node->parentNo] : NULL;
+            if (parent == NULL || parent->dir == NULL ||
+                dirFind(parent->dir, node->name, strlen(node->name)) != node->inodeNo)
+            {
+                fprintf(out, "inode %u: missing from its parent directory\n", node->inodeNo);
+                problems++;
+            }
+        }
+        if (node->linkCount > 0)
+        {
+            HARDLINK *link;
+            unsigned int names = 1;
+            for (link = node->links; link != NULL; link = link->next, names++)
+            {
+                INODE *parent = (link->parentNo < inodeTableSize) ? inodeTable[link->parentNo] : NULL;
+                if (parent == NULL || parent->dir == NULL ||
+                    dirFind(parent->dir, link->name, strlen(link->name)) != node->inodeNo)
+                {
+                    fprintf(out, "inode %u: link %s missing from its directory\n", node->inodeNo, link->name);
+                    problems++;
+                }
+            }
+            if (names != node->linkCount)
+            {
+                fprintf(out, "inode %u: %u names, link count is %u\n", node->inodeNo, names, node->linkCount);
+                problems++;
+            }
+        }
+    }
+    // Blocks of deleted data stay in use until readers are done with them,
+    // shared blocks are counted once however many extents use them
+    dedupUsage(&shared, &refs, &saved);
+    blocks += retiredBlocks + parkedBlocks + shared - (unsigned int)refs;
+    if ((int)inodes != S.usedInode || (int)regular != S.usedBlock || blocks != usedBlockCount)
+    {
+        fprintf(out, "superblock: %u inodes, %u files, %u blocks (counters say %d, %d, %u)\n",
+                inodes, regular, blocks, S.usedInode, S.usedBlock, usedBlockCount);
+        problems++;
+    }
+    return problems;
+}
+
+int vfs_check(FILE *out)
+{
+    int problems;
+    
+    if (mainPool == NULL)
+        return VFS_EINVAL;
+    WRITE_LOCK(&nsLock);
+    WRITE_LOCK(&fdLock);
+    problems = checkPool(out) + checkInodes(out);
+    RW_UNLOCK(&fdLock);
+    RW_UNLOCK(&nsLock);
+    return problems ? VFS_ECORRUPT : VFS_OK;
+}
+
+// Hold the namespace still while an image is written
+void lockNamespace()
+{
+    WRITE_LOCK(&nsLock);
+    WRITE_LOCK(&fdLock);
+}
+
+void unlockNamespace()
+{
+    RW_UNLOCK(&fdLock);
+    RW_UNLOCK(&nsLock);
+}
+
+size_t vfs_metadata_bytes(size_t *peak)
+{
+    if (peak != NULL)
+        *peak = metaPeak;
+    return metaBytes;
+}
+
+const char *vfs_strerror(int err)
+{
+    switch (err)
+    {
+    case VFS_OK:            return "Success";
+    case VFS_ENOENT:        return "No such file or directory";
+    case VFS_EEXIST:        return "File already exists";
+    case VFS_ENOTDIR:       return "Not a directory";
+    case VFS_EISDIR:        return "Is a directory";
+    case VFS_ENOTEMPTY:     return "Directory is not empty";
+    case VFS_EBADF:         return "Wrong file descriptor";
+    case VFS_EACCES:        return "Access denied";
+    case VFS_ENOSPC:        return "File system has no enough memory";
+    case VFS_ENOMEM:        return "Out of host memory";
+    case VFS_EINVAL:        return "Invalid argument";
+    case VFS_ENAMETOOLONG:  return "Name too long";
+    case VFS_EIO:           return "I/O error or checksum mismatch";
+    case VFS_ECORRUPT:      return "Consistency check failed";
+    default:                return "Unknown error";
+    }
+}
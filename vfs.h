@@ -0,0 +1,454 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Error codes, every call returns a negative one of these on failure
+enum vfs_error
+{
+    VFS_OK = 0,
+    VFS_ENOENT = -1,        // no such file or directory
+    VFS_EEXIST = -2,        // name already exists
+    VFS_ENOTDIR = -3,       // path component is not a directory
+    VFS_EISDIR = -4,        // operation needs a regular file
+    VFS_ENOTEMPTY = -5,     // directory still has entries
+    VFS_EBADF = -6,         // descriptor is not open
+    VFS_EACCES = -7,        // permission or open mode forbids it
+    VFS_ENOSPC = -8,        // pool or inode table is full
+    VFS_ENOMEM = -9,        // host allocation failed
+    VFS_EINVAL = -10,       // bad argument
+    VFS_ENAMETOOLONG = -11, // path component longer than VFS_MAX_NAME, or path longer than VFS_MAX_PATH
+    VFS_EIO = -12,          // file I/O failed, or data did not match its checksum
+    VFS_ECORRUPT = -13      // vfs_check found inconsistent state
+};
+
+#define VFS_MAX_NAME 255    // bytes in one path component
+#define VFS_MAX_PATH 4096   // bytes in a whole path
+#define VFS_INLINE_MAX 64   // files up to this size are kept in their inode
+
+// Open flags, the access bits match FILETABLE.fileMode
+#define VFS_READ    4
+#define VFS_WRITE   2
+#define VFS_RDWR    (VFS_READ | VFS_WRITE)
+#define VFS_CREAT   0x100
+#define VFS_EXCL    0x200
+#define VFS_TRUNC   0x400
+#define VFS_APPEND  0x800   // every vfs_write goes to the end of the file
+
+// vfs_lseek origins
+#define VFS_SEEK_SET 0
+#define VFS_SEEK_CUR 1
+#define VFS_SEEK_END 2
+
+// File permissions understood by the engine
+#define VFS_PERM_READ   744
+#define VFS_PERM_WRITE  722
+#define VFS_PERM_RDWR   766
+
+struct vfs_stat
+{
+    unsigned int inodeNo;
+    int isDirectory;
+    unsigned int size;
+    unsigned int linkCount;
+    unsigned int openCount;
+    unsigned int permission;
+    int extentCount;
+    long long memOffset;
+    unsigned int packedSize;    // pool bytes of a compressed file, 0 otherwise
+    int spilled;                // the data is in the backing file, not the pool
+    int corrupt;                // failed a checksum
+    char name[VFS_MAX_NAME + 1];
+};
+
+// Read-only bytes of a file handed out by vfs_map
+struct vfs_view
+{
+    const char *data;
+    size_t len;
+    long long block;                    // pinned pool block, -1 for none
+    char inlineCopy[VFS_INLINE_MAX];    // data of an inline file points here
+};
+
+// Operations tracked by the statistics
+enum vfs_op
+{
+    VFS_OP_OPEN,
+    VFS_OP_CLOSE,
+    VFS_OP_READ,
+    VFS_OP_WRITE,
+    VFS_OP_APPEND,
+    VFS_OP_UNLINK,
+    VFS_OP_MKDIR,
+    VFS_OP_RMDIR,
+    VFS_OP_STAT,
+    VFS_OP_TRUNCATE,
+    VFS_OP_LINK,
+    VFS_OP_COUNT
+};
+
+// Latency histogram bucket i counts calls that took [2^i, 2^(i+1)) ns
+#define VFS_HIST_BUCKETS 32
+
+struct vfs_op_stats
+{
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long totalNs;
+    unsigned long long histogram[VFS_HIST_BUCKETS];
+};
+
+// Metadata slab caches
+enum vfs_slab
+{
+    VFS_SLAB_INODE,
+    VFS_SLAB_FILETABLE,
+    VFS_SLAB_MEMBLOCK,
+    VFS_SLAB_COUNT
+};
+
+struct vfs_slab_stats
+{
+    unsigned int objectSize;        // bytes per object, padded to a cache line
+    unsigned int inUse;
+    unsigned int capacity;          // objects the current slabs can hold
+    unsigned int slabs;
+    size_t bytes;                   // host memory held by the slabs
+};
+
+struct vfs_stats
+{
+    size_t poolBytes;
+    size_t poolLimit;               // size the pool may grow to
+    unsigned int arenas;
+    int allocPolicy;                // VFS_ALLOC_*
+    size_t usedBytes;
+    size_t freeBytes;
+    size_t largestFree;
+    double fragmentation;           // 1 - largestFree / freeBytes
+    unsigned int freeBlocks;        // free-list length
+    unsigned int usedBlocks;
+    unsigned long long allocFailures;
+    unsigned long long compactedBytes;
+    size_t slackBytes;              // allocated beyond what was asked for
+    unsigned int inodesUsed;
+    unsigned int inodesTotal;
+    unsigned int openFiles;
+    size_t metaBytes;
+    size_t metaPeak;
+    struct vfs_slab_stats slabs[VFS_SLAB_COUNT];
+    unsigned int dedupBlocks;       // pool blocks in the dedup index
+    unsigned long long dedupRefs;   // extents pointing at them
+    size_t dedupSaved;              // pool bytes sharing saves
+    unsigned int packedFiles;       // files held compressed
+    size_t packedRaw;               // their size
+    size_t packedBytes;             // pool bytes they take
+    size_t packCacheBytes;          // decompressed files kept for reads
+    unsigned long long packCacheHits;
+    unsigned long long packCacheMisses;
+    unsigned int inlineFiles;       // files kept in their inode, no pool block
+    size_t inlineBytes;             // their size
+    unsigned int pinnedBlocks;      // pool blocks held in place by vfs_map views
+    unsigned int parkedBlocks;      // of those, freed blocks waiting for vfs_unmap
+    unsigned int spilledFiles;      // files evicted to the backing file
+    size_t spilledBytes;            // their size
+    size_t spillFileBytes;          // backing file length, free ranges included
+    unsigned long long spillEvictions;
+    unsigned long long spillFaults;     // files brought back into the pool
+    unsigned long long spillDiskReads;  // reads served from the backing file
+    unsigned long long journalRecords;  // changes logged since the last reset
+    unsigned long long journalCommits;  // flushes to the journal, each one fdatasync
+    unsigned long long journalCheckpoints;
+    size_t journalFileBytes;        // journal length since the last checkpoint
+    unsigned long long journalReplayed; // records applied when the journal was opened
+    unsigned long long journalReplayUs; // how long that took
+    unsigned long long searches;    // vfs_search calls
+    unsigned long long searchBytes; // file bytes they scanned
+    unsigned long long searchNs;    // time they took
+    unsigned int corruptInodes;     // files that failed a checksum
+    unsigned long long checksumErrors;  // checks that failed, by reads or the scrubber
+    unsigned long long scrubPasses; // times the scrubber went through every file
+    unsigned long long scrubBytes;  // bytes it checked
+    struct vfs_op_stats ops[VFS_OP_COUNT];
+};
+
+typedef void (*vfs_dir_callback)(const char *name, const struct vfs_stat *st, void *arg);
+typedef void (*vfs_search_callback)(unsigned int inodeNo, const char *name, long offset, void *arg);
+
+// vfs_init_flags options
+#define VFS_INIT_CONCURRENT 1   // thread-safe engine with one pool arena per core
+#define VFS_INIT_HUGEPAGES 2    // back the pool with huge pages where the host allows
+#define VFS_INIT_DEDUP 4        // share the pool blocks of identical file data
+#define VFS_INIT_CHECKSUM 8     // keep a CRC32C of all file data in the pool
+
+#define VFS_DEFAULT_INODES 1024
+
+// Pool allocation policies
+enum vfs_alloc
+{
+    VFS_ALLOC_SEGREGATED,       // power-of-two class free lists, the default
+    VFS_ALLOC_FIRST_FIT,        // lowest-addressed block that fits
+    VFS_ALLOC_NEXT_FIT,         // first fit resuming after the last allocation
+    VFS_ALLOC_BEST_FIT,         // smallest block that fits
+    VFS_ALLOC_BUDDY,            // power-of-two blocks merging with their buddy, never compacted
+    VFS_ALLOC_TLSF,             // two-level segregated fit, constant time
+    VFS_ALLOC_COUNT
+};
+
+// Cold file compression levels
+#define VFS_COMPRESS_OFF 0
+#define VFS_COMPRESS_FAST 1     // one match candidate per position
+#define VFS_COMPRESS_BEST 2     // searches chains of candidates, slower but smaller
+
+struct vfs_compress_policy
+{
+    int level;                  // VFS_COMPRESS_*
+    unsigned int coldPasses;    // compressor passes a file must go untouched
+    unsigned int minSize;       // smaller files stay as they are
+    size_t cacheBytes;          // host memory for decompressed files being read
+};
+
+// Second tier for files that do not fit in the pool
+struct vfs_spill_policy
+{
+    const char *path;           // backing file, created or truncated; NULL turns spilling off
+    unsigned int minSize;       // smaller files always stay in the pool
+    unsigned int prefetch;      // a fault also brings back up to this many inodes numbered after it
+};
+
+// Write-ahead journal of namespace and data changes
+struct vfs_journal_policy
+{
+    const char *path;           // journal file; NULL turns journaling off
+    const char *image;          // checkpoint target while no image is attached, may be NULL
+    unsigned int commitMicros;  // longest a change waits in memory before its group is flushed
+    size_t commitBytes;         // flush sooner once this much is waiting
+    size_t checkpointBytes;     // checkpoint once the journal is this long, 0 never
+    int waitCommit;             // calls return only once their change is on disk
+};
+
+// Checking file data against its checksums, needs VFS_INIT_CHECKSUM
+struct vfs_scrub_policy
+{
+    int verifyReads;            // reads fail with VFS_EIO on data that does not match
+    size_t bytesPerSec;         // background scrubbing rate in concurrent mode, 0 = none
+};
+
+struct vfs_config
+{
+    size_t poolSize;            // bytes available at start
+    size_t maxPoolSize;         // the pool grows by whole arenas up to this, 0 = fixed size
+    unsigned int maxInodes;     // 0 for VFS_DEFAULT_INODES
+    int flags;                  // VFS_INIT_*
+    int allocPolicy;            // VFS_ALLOC_*, images always load with the default
+};
+
+// Set up an empty filesystem over a pool of poolSize bytes. In concurrent
+// mode every call below may be made from any thread, except init, shutdown,
+// load and snapshot. Threads sharing one descriptor's offset must bring
+// their own ordering, or use vfs_pread/vfs_pwrite.
+int vfs_init(size_t poolSize);
+int vfs_init_flags(size_t poolSize, int flags);
+int vfs_init_config(const struct vfs_config *config);
+void vfs_shutdown(void);
+
+// Returns a descriptor, creating the file with perm when VFS_CREAT is given
+int vfs_open(const char *path, int flags, unsigned int perm);
+int vfs_close(int fd);
+
+// Read or write len bytes at the descriptor's offset and advance it.
+// Data is binary, nothing looks for a terminating NUL.
+int vfs_read(int fd, void *buf, size_t len);
+int vfs_write(int fd, const void *buf, size_t len);
+// Add buf to the end of the file and move the offset there
+int vfs_append(int fd, const void *buf, size_t len);
+// Positional I/O, the descriptor's offset is left alone
+int vfs_pread(int fd, void *buf, size_t len, long offset);
+int vfs_pwrite(int fd, const void *buf, size_t len, long offset);
+// View up to len bytes at offset without copying, returns how many. A view
+// stops at the end of the pool extent holding offset, so long ranges take
+// several. Its bytes stay where they are and as they were until vfs_unmap:
+// compaction leaves them alone, writes go to a copy and freed space waits.
+// An inline file's bytes are copied into the view, which must not be moved
+// while mapped. Mapping a compressed file stores it raw again.
+int vfs_map(int fd, long offset, size_t len, struct vfs_view *view);
+void vfs_unmap(struct vfs_view *view);
+// Returns the new offset
+long vfs_lseek(int fd, long offset, int whence);
+// Cut the file to size, or extend it with zeros
+int vfs_ftruncate(int fd, long size);
+
+int vfs_unlink(const char *path);
+// Another name for the regular file at oldPath, in any directory
+int vfs_link(const char *oldPath, const char *newPath);
+int vfs_mkdir(const char *path);
+int vfs_rmdir(const char *path);
+int vfs_stat(const char *path, struct vfs_stat *st);
+int vfs_fstat(int fd, struct vfs_stat *st);
+// The callback must not create or remove names
+int vfs_readdir(const char *path, vfs_dir_callback callback, void *arg);
+// Find every occurrence of the len bytes at pattern in every regular file,
+// overlapping ones included, and return how many there were. The callback
+// gets them once the scan is over, on the calling thread, file by file in
+// inode order with offsets ascending; it must not create or remove names.
+// In concurrent mode files are scanned on a pool of threads, one per core.
+int vfs_search(const void *pattern, size_t len, vfs_search_callback callback, void *arg);
+// Substring kernel picked for this CPU: "avx2", "sse2" or "scalar"
+const char *vfs_search_kernel(void);
+
+// Next open descriptor after fd, -1 when there are no more
+int vfs_next_fd(int fd);
+
+// Compact the pool copying at most budget bytes, returns bytes moved
+int vfs_defragment(int budget);
+double vfs_fragmentation(void);
+void vfs_dump_memory_map(FILE *out);
+
+// Files nobody read or wrote during the last coldPasses calls of
+// vfs_compress_cold are stored compressed, and so are cold files whenever
+// a write finds the pool full. Reads decompress them, a write stores the
+// file raw again. Compression starts off.
+int vfs_set_compression(const struct vfs_compress_policy *policy);
+// One compressor pass, returns the pool bytes it freed
+long vfs_compress_cold(void);
+
+// When a write finds the pool full, even after compression, files not
+// touched lately are evicted to a backing file in CLOCK order. Reading one
+// brings it back; in concurrent mode a background thread does that while
+// the reader is served from the file. Changing or turning off the backing
+// file brings every spilled file back first, VFS_ENOSPC if they do not fit.
+int vfs_set_spill(const struct vfs_spill_policy *policy);
+// Start bringing a spilled file back ahead of its first read
+int vfs_prefetch(const char *path);
+
+// Log every change to path before the call returns, flushing groups of
+// them at most commitMicros apart. A journal left by an earlier run on top
+// of the image now loaded (or of an empty filesystem) is replayed first,
+// so call it right after vfs_init or vfs_load, before opening anything.
+int vfs_set_journal(const struct vfs_journal_policy *policy);
+// Wait until every change made so far is on disk
+int vfs_commit(void);
+// Sync the attached image, or snapshot to the policy's image, and start
+// the journal over. vfs_snapshot and vfs_sync do the same.
+int vfs_checkpoint(void);
+
+// With VFS_INIT_CHECKSUM every extent carries a CRC32C that writes keep
+// current. Reads may check it, and in concurrent mode a thread at idle
+// priority rechecks every file within the policy's rate. Files failing a
+// check show up in the statistics and as corrupt in vfs_stat until they
+// are removed. Inline and spilled files are not covered.
+int vfs_set_scrub(const struct vfs_scrub_policy *policy);
+// Check every file now, returns how many failed
+int vfs_scrub(void);
+// CRC32C kernel picked for this CPU: "sse4.2" or "table"
+const char *vfs_checksum_kernel(void);
+
+// Host memory held by engine metadata, peak is since vfs_init
+size_t vfs_metadata_bytes(size_t *peak);
+
+// Write the whole filesystem to an image file and keep it attached,
+// so later vfs_sync calls only write what changed since. Images hold the
+// pool only, both calls bring spilled files back first.
+int vfs_snapshot(const char *path);
+// Bring the attached image up to date, writing only dirty pool pages
+int vfs_sync(void);
+// Start from an image instead of vfs_init. The pool is mapped straight
+// from the file and the image stays attached.
+int vfs_load(const char *path);
+
+// Snapshot of the counters, cheap enough to poll
+int vfs_get_stats(struct vfs_stats *st);
+void vfs_reset_stats(void);
+// Write the statistics as one JSON object
+int vfs_dump_stats_json(FILE *out);
+const char *vfs_op_name(int op);
+const char *vfs_slab_name(int slab);
+const char *vfs_alloc_name(int policy);
+
+// Check the block lists, free lists and inodes against each other, reporting
+// problems to out. Returns VFS_ECORRUPT if any were found.
+int vfs_check(FILE *out);
+
+const char *vfs_strerror(int err);
+
+// Asynchronous operations through a submission and a completion ring
+enum vfs_ring_op
+{
+    VFS_RING_NOP,
+    VFS_RING_READ,              // at the descriptor's offset, advancing it
+    VFS_RING_WRITE,
+    VFS_RING_PREAD,             // at offset
+    VFS_RING_PWRITE,
+    VFS_RING_APPEND,
+    VFS_RING_OPEN,              // path, flags and perm; the result is the descriptor
+    VFS_RING_CLOSE,
+    VFS_RING_UNLINK,            // path
+    VFS_RING_OP_COUNT
+};
+
+struct vfs_sqe
+{
+    int op;                     // VFS_RING_*
+    int fd;
+    void *buf;                  // must stay valid until the completion is reaped
+    size_t len;
+    long offset;
+    const char *path;
+    int flags;
+    unsigned int perm;
+    unsigned long long userData;    // handed back in the completion
+};
+
+struct vfs_cqe
+{
+    unsigned long long userData;
+    int result;                 // what the synchronous call would have returned
+};
+
+struct vfs_ring;
+
+// A ring with room for 'entries' operations in flight, rounded up to a
+// power of two. With workers > 0 that many threads run submissions, which
+// needs VFS_INIT_CONCURRENT; without, vfs_submit runs them itself. One
+// thread submits to and reaps from a ring; rings go before vfs_shutdown.
+struct vfs_ring *vfs_ring_create(unsigned int entries, int workers);
+void vfs_ring_destroy(struct vfs_ring *ring);
+// A cleared entry to fill in, NULL while the ring is full
+struct vfs_sqe *vfs_ring_sqe(struct vfs_ring *ring);
+// Hand over the entries filled since the last call, returns how many.
+// Entries run in submission order, except that several workers may run
+// different batches at once.
+int vfs_submit(struct vfs_ring *ring);
+// Take up to max completions, returns how many. With wait set it blocks
+// until at least one is there, unless nothing is in flight.
+int vfs_ring_reap(struct vfs_ring *ring, struct vfs_cqe *cqes, int max, int wait);
+
+// Record every open, close, read, write, seek, truncate and namespace
+// change to a binary trace file, sizes and descriptors but no data.
+// vfs_map is recorded as a pread of the bytes it covered and replays as one.
+int vfs_trace_start(const char *path);
+int vfs_trace_stop(void);
+
+struct vfs_replay_stats
+{
+    int streams;
+    unsigned long long ops;
+    unsigned long long mismatches;  // calls that failed where the recording succeeded, or the reverse
+    double seconds;
+    double opsPerSec;
+    unsigned long long p50Ns;
+    unsigned long long p99Ns;
+    unsigned long long p999Ns;
+    unsigned long long maxNs;
+    size_t poolUsed;                // after the replay
+    double fragmentation;
+};
+
+// Run a trace against the initialised engine with no output. Several
+// traces replay at once on their own threads, each under a /streamN
+// directory, which needs VFS_INIT_CONCURRENT.
+int vfs_replay(const char *path, struct vfs_replay_stats *st);
+int vfs_replay_streams(const char *const *paths, int count, struct vfs_replay_stats *st);
+
+#endif
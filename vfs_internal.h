@@ -0,0 +1,490 @@
+#ifndef VFS_INTERNAL_H
+#define VFS_INTERNAL_H
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "vfs.h"
+
+#define DEFAULT_POOL_SIZE (1024 * 1024)
+#define SIZE_CLASSES 32
+#define INDEX_MIN_BUCKETS 64
+#define COMPACT_STEP_BUDGET (64 * 1024)
+#define COMPACT_THRESHOLD 0.5
+#define EXTENT_MAX (64 * 1024)
+#define FD_MIN_CAPACITY 64
+#define FD_WORD_BITS 64
+#define MAX_NAME VFS_MAX_NAME
+#define MAX_PATH VFS_MAX_PATH
+#define ROOT_INODE 1
+#define DIR_MIN_BUCKETS 8
+#define DIR_REHASH_STEP 4
+#define DCACHE_SIZE 1024
+#define IMAGE_PAGE 4096
+#define ARENA_MIN_SIZE (256 * 1024)
+#define ARENA_MAX_SIZE (1024 * 1024 * 1024)
+#define MAX_ARENAS 64
+#define GROW_ARENAS 64
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define DCACHE_LOCKS 64
+#define STAT_SHARDS 16
+#define EPOCH_SHARDS 16
+#define SEQ_READ_TRIES 4
+#define CACHE_LINE 64
+#define SLAB_BYTES (16 * 1024)
+#define PACK_MAX_SIZE (4 * 1024 * 1024)
+#define TLSF_SUB_BITS 4
+#define TLSF_SUBCLASSES (1 << TLSF_SUB_BITS)
+#define BUDDY_MIN_BLOCK 16
+#define RECLAIM_BATCH 64
+#define RING_BATCH_MAX 64
+#define INLINE_MAX VFS_INLINE_MAX
+#define SPILL_QUEUE 256
+#define SPILL_EVICT_ROUNDS 64
+#define SEARCH_WORKERS_MAX 16
+#define SEARCH_PARALLEL_MIN (256 * 1024)
+#define SEARCH_CHUNK (64 * 1024)
+
+// Diagnostics, compiled out unless built with -DVFS_DEBUG
+#ifdef VFS_DEBUG
+#define VFS_LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define VFS_LOG(...) ((void)0)
+#endif
+
+// Locking and shared counters only cost anything in concurrent mode
+#define MUTEX_LOCK(m) do { if (vfsConcurrent) pthread_mutex_lock(m); } while (0)
+#define MUTEX_UNLOCK(m) do { if (vfsConcurrent) pthread_mutex_unlock(m); } while (0)
+#define READ_LOCK(l) do { if (vfsConcurrent) pthread_rwlock_rdlock(l); } while (0)
+#define WRITE_LOCK(l) do { if (vfsConcurrent) pthread_rwlock_wrlock(l); } while (0)
+#define RW_UNLOCK(l) do { if (vfsConcurrent) pthread_rwlock_unlock(l); } while (0)
+#define COUNTER_ADD(var, n) \
+    do { if (vfsConcurrent) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED); else (var) += (n); } while (0)
+
+// Writers holding an inode's lock bracket their changes to its size,
+// extents and data, so lock-free readers can tell their copy is torn
+#define SEQ_BEGIN(node) \
+    do { if (vfsConcurrent) { __atomic_store_n(&(node)->seq, (node)->seq + 1, __ATOMIC_RELAXED); \
+                              __atomic_thread_fence(__ATOMIC_RELEASE); } } while (0)
+#define SEQ_END(node) \
+    do { if (vfsConcurrent) __atomic_store_n(&(node)->seq, (node)->seq + 1, __ATOMIC_RELEASE); } while (0)
+
+// Note an access for the cold file compressor and the spill CLOCK
+#define TOUCH_INODE(node) \
+    do { unsigned int t_ = __atomic_load_n(&packTick, __ATOMIC_RELAXED); \
+         if (__atomic_load_n(&(node)->lastAccess, __ATOMIC_RELAXED) != t_) \
+             __atomic_store_n(&(node)->lastAccess, t_, __ATOMIC_RELAXED); \
+         if (!__atomic_load_n(&(node)->referenced, __ATOMIC_RELAXED)) \
+             __atomic_store_n(&(node)->referenced, 1, __ATOMIC_RELAXED); } while (0)
+
+// Log a call while a trace is being recorded
+#define TRACE_OP(op, fd, len, offset, result, path, path2) \
+    do { if (traceEnabled) traceRecord((op), (fd), (len), (offset), (result), (path), (path2)); } while (0)
+
+// Log a change while the journal is on, from under the lock that ordered it
+#define JOURNAL_OP(op, inodeNo, perm, offset, path, path2, data, len) \
+    do { if (journalEnabled) journalRecord((op), (inodeNo), (perm), (offset), (path), (path2), (data), (len)); } while (0)
+// After the call's locks are dropped: wait for its commit, checkpoint if due
+#define JOURNAL_SETTLE() \
+    do { if (journalEnabled) journalSettle(); } while (0)
+
+// Reads check what they copy against the checksums (checksum.c)
+#define VERIFY_READS() (checksumEnabled && __atomic_load_n(&scrubPolicy.verifyReads, __ATOMIC_RELAXED))
+
+// Record pool bytes that changed since the image was last written
+#define MARK_DIRTY(offset, len) \
+    do { if (dirtyMap != NULL) markDirty((offset), (len)); } while (0)
+
+struct inode;
+struct Slab;
+
+// Cache of fixed-size metadata objects (slab.c)
+typedef struct SlabCache
+{
+    pthread_mutex_t lock;
+    int locked;                 // 0 when the owner already serialises access
+    size_t size;                // object size as requested
+    size_t stride;              // rounded up to a cache line, set on first use
+    unsigned int perSlab;
+    struct Slab *slabs;
+    struct Slab *partial;       // slabs with free objects
+    unsigned int slabCount;
+    unsigned int inUse;
+} SLABCACHE;
+
+#define SLAB_CACHE_INIT(type) { PTHREAD_MUTEX_INITIALIZER, 1, sizeof(type), 0, 0, NULL, NULL, 0, 0 }
+
+// Block tracking structure
+typedef struct MemoryBlock {
+    long long offset;
+    int blockSize;
+    int requested;                  // bytes asked for, below blockSize when rounded up
+    int available;
+    struct MemoryBlock *next;       // physical neighbours, in address order
+    struct MemoryBlock *prev;
+    struct MemoryBlock *freeNext;   // size-class free list links
+    struct MemoryBlock *freePrev;
+    struct MemoryBlock *hashNext;   // offset index chain
+    struct inode *owner;            // file whose data lives here, NULL if free
+    int pins;                       // vfs_map views holding it in place
+    int parked;                     // released while pinned, freed by the last unpin
+} MEMBLOCK;
+
+// Pool block on its way back, for releaseSpans
+typedef struct Span
+{
+    long long position;
+    int size;
+} SPAN;
+
+// Contiguous run of file data in the pool
+typedef struct Extent
+{
+    long long memOffset;
+    int start;       // file position of the first byte
+    int length;      // bytes of file data held
+    int capacity;    // bytes reserved in the pool
+    unsigned int crc;   // CRC32C of the bytes held, while checksums are on
+} EXTENT;
+
+// Directory entry, chained in a directory hash bucket
+typedef struct DirEntry
+{
+    char *name;
+    unsigned int hash;
+    unsigned int inodeNo;
+    struct DirEntry *next;
+} DIRENTRY;
+
+// Per-directory name index. While growing, entries move from table[0]
+// to table[1] a few buckets per operation.
+typedef struct DirTable
+{
+    DIRENTRY **table[2];
+    unsigned int buckets[2];
+    unsigned int count;
+    int rehashIdx;     // next table[0] bucket to move, -1 when not resizing
+} DIRTABLE;
+
+// Name of a hard-linked file other than the one kept in the inode
+typedef struct HardLink
+{
+    unsigned int parentNo;
+    char *name;
+    struct HardLink *next;
+} HARDLINK;
+
+// Inode structure
+typedef struct inode
+{
+    unsigned int inodeNo;
+    unsigned int userId;
+    unsigned int groupId;
+    unsigned int linkCount;
+    unsigned int referenceCount;
+    unsigned int fileSize;
+    char fileType[20];
+    char inlineData[INLINE_MAX];    // contents of a file with no extents and not packed
+    char *dataPtr;      // first extent, NULL for an empty or inline file
+    long long memOffset;
+    EXTENT *extents;    // every extent but the last is full
+    int extentCount;
+    int extentCapacity;
+    long long packOffset;       // compressed contents, -1 unless the file is packed
+    int packedSize;
+    unsigned int packCrc;       // CRC32C of the packed block
+    unsigned int corrupt;       // failed a checksum, set until the file is removed
+    unsigned int lastAccess;    // packTick when last read or written
+    long long spillOffset;      // contents in the backing file, -1 unless the file is spilled
+    unsigned int referenced;    // touched since the spill CLOCK hand last passed
+    unsigned fileAccessPermission;
+    char name[MAX_NAME + 1];    // name in the parent directory
+    unsigned int parentNo;
+    HARDLINK *links;            // further names, linkCount - 1 of them
+    DIRTABLE *dir;              // entries of a directory, NULL for regular files
+    pthread_rwlock_t lock;      // guards size and extents in concurrent mode
+    unsigned int seq;           // odd while a writer is changing them
+    struct inode *next;
+    struct inode *prev;
+} INODE;
+
+// File Table Structure
+typedef struct FileTable
+{
+    int cnt;
+    int fileOffset;
+    int fileMode;
+    INODE *inodeEntry;
+    struct FileTable *next;
+    struct FileTable *prev;
+} FILETABLE;
+
+// UFDT Structure, one slot per descriptor
+typedef struct UFDTable
+{
+    int fdIndex;
+    FILETABLE *fileTableEntry;    // NULL while the descriptor is closed
+} UFDT;
+
+// Path lookup cache, entries from an older generation are stale
+typedef struct DentryCache
+{
+    char *path;
+    unsigned int hash;
+    unsigned int generation;
+    unsigned int inodeNo;
+} DCACHE;
+
+struct SuperBlock
+{
+    int totalBlock;
+    int usedBlock;
+    int totalInode;
+    int usedInode;
+};
+
+// Host memory used for metadata, everything except the pool itself (pool.c)
+extern size_t metaBytes;
+extern size_t metaPeak;
+void *metaAlloc(size_t size);
+void *metaCalloc(size_t count, size_t size);
+void *metaRealloc(void *ptr, size_t oldSize, size_t newSize);
+void *metaAlignedAlloc(size_t align, size_t size);
+void metaFree(void *ptr, size_t size);
+
+// slab.c
+void slabInit(SLABCACHE *cache, size_t size, int locked);
+void *slabAlloc(SLABCACHE *cache);
+void slabFree(SLABCACHE *cache, void *obj);
+void slabDestroy(SLABCACHE *cache);
+void slabUsage(SLABCACHE *cache, struct vfs_slab_stats *st);
+
+// Pool state (pool.c)
+extern char *mainPool;
+extern long long poolSize;
+extern long long poolReserve;
+extern long long freeBytes;
+extern unsigned int freeBlockCount;
+extern unsigned int usedBlockCount;
+extern unsigned long long allocFailures;
+extern unsigned long long compactedBytes;
+extern long long slackBytes;
+extern unsigned int pinnedBlocks;
+extern unsigned int parkedBlocks;
+extern int vfsConcurrent;
+
+// File system state (vfs.c)
+extern struct SuperBlock S;
+extern INODE *inodeList;
+extern FILETABLE *fileTableList;
+extern INODE **inodeTable;
+extern unsigned int inodeTableSize;
+extern unsigned int openFileCount;
+extern unsigned int inlineFiles;
+extern unsigned long long inlineBytes;
+extern SLABCACHE inodeCache;
+extern SLABCACHE fileTableCache;
+
+// Dirty pool pages, one bit per IMAGE_PAGE, NULL without an image (image.c)
+extern unsigned long long *dirtyMap;
+
+// Pool blocks retired but not yet released (epoch.c)
+extern unsigned int retiredBlocks;
+
+// Content index of shared blocks (dedup.c)
+extern int dedupEnabled;
+extern unsigned int dedupBlocks;
+
+// Backing file for evicted files (spill.c)
+extern int spillEnabled;
+extern struct vfs_spill_policy spillPolicy;
+extern unsigned int spilledFiles;
+extern unsigned long long spilledBytes;
+extern unsigned long long spillEvictions;
+extern unsigned long long spillFaults;
+extern unsigned long long spillDiskReads;
+
+// Checksums and the scrubber (checksum.c)
+extern int checksumEnabled;
+extern struct vfs_scrub_policy scrubPolicy;
+extern unsigned int corruptInodes;
+extern unsigned long long checksumErrors;
+
+// Set while vfs_trace_start is recording (trace.c)
+extern int traceEnabled;
+
+// Set while changes are journaled (journal.c)
+extern int journalEnabled;
+
+// Compression policy and totals (compress.c); packTick advances with
+// every compressor pass
+extern struct vfs_compress_policy packPolicy;
+extern unsigned int packTick;
+extern unsigned int packedFiles;
+extern unsigned long long packedRaw;
+extern unsigned long long packedBytes;
+
+// pool.c
+int setupMemoryPool(long long size, long long reserve, int count, int hugePages, int allocPolicy);
+int mountMemoryPool(char *memory, long long size, const int *sizes, int count);
+int poolLayout(int *sizes, int max);
+void teardownMemoryPool();
+long long findContiguousSpace(int requiredSize, int grow);
+void releaseSpace(long long position, int size);
+void releaseSpans(SPAN *spans, int count);
+int extendSpace(long long position, int extra);
+int claimSpace(long long position, int size);
+int maxAllocation();
+int poolArenas();
+int usedBlockInfo(long long position, INODE **owner);
+int checkPool(FILE *out);
+int currentSlot();
+void setBlockOwner(long long position, INODE *owner);
+int pinSpace(long long position);
+void unpinSpace(long long position);
+int spacePinned(long long position);
+int defragmentMemory(int budget);
+int largestFreeBlock();
+double fragmentationRatio();
+const char *allocPolicyName(int allocPolicy);
+int poolPolicy();
+void compactIfFragmented();
+void showMemoryMap(FILE *out);
+void blockSlabUsage(struct vfs_slab_stats *st);
+
+// stats.c
+long long statStart();
+int statEnd(int op, long long start, int ret);
+void resetStats();
+
+// epoch.c
+int epochEnter();
+void epochExit(int token);
+void epochCollect();
+void epochDrain();
+void retireMeta(void *ptr, size_t size);
+void retireObject(SLABCACHE *cache, void *obj);
+void retireInode(INODE *node);
+void retireSpace(long long position, int size);
+
+// dedup.c
+void dedupSetup(int enabled);
+void dedupTeardown();
+long long dedupBlock(long long offset, int size);
+unsigned int dedupUnshare(long long offset);
+int dedupRelease(long long offset);
+unsigned int dedupRefCount(long long offset);
+int dedupRestore(long long offset, int size, unsigned int refs);
+void dedupUsage(unsigned int *blocks, unsigned long long *refs, unsigned long long *saved);
+
+// compress.c
+int lzCompress(const char *src, int size, char *dst, int cap, int level);
+int lzDecompress(const char *src, int size, char *dst, int rawSize);
+int packCacheRead(INODE *node, int pos, char *buf, int len);
+int packCachePeek(INODE *node, char *buf, int size);
+void packCacheInsert(INODE *node, char *data, int size);
+void packCacheDrop(INODE *node);
+void packUsage(struct vfs_stats *st);
+void packResetStats();
+void packTeardown();
+
+// spill.c
+long long spillStore(const char *data, int size);
+int spillLoad(long long offset, char *buf, int len);
+void spillFree(long long offset, int size);
+void spillQueue(unsigned int inodeNo, int evict);
+void spillUsage(struct vfs_stats *st);
+void spillResetStats();
+void spillTeardown();
+
+// trace.c
+enum trace_op
+{
+    TRACE_OPEN,
+    TRACE_CLOSE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_APPEND,
+    TRACE_PREAD,
+    TRACE_PWRITE,
+    TRACE_SEEK,
+    TRACE_TRUNCATE,
+    TRACE_UNLINK,
+    TRACE_LINK,
+    TRACE_MKDIR,
+    TRACE_RMDIR,
+    TRACE_OP_COUNT
+};
+
+void traceRecord(int op, int fd, long long len, long long offset, int result,
+                 const char *path, const char *path2);
+
+// journal.c
+enum journal_op
+{
+    JOURNAL_CREATE,
+    JOURNAL_MKDIR,
+    JOURNAL_WRITE,
+    JOURNAL_TRUNCATE,
+    JOURNAL_UNLINK,
+    JOURNAL_RMDIR,
+    JOURNAL_LINK,
+    JOURNAL_OP_COUNT
+};
+
+void journalRecord(int op, unsigned int inodeNo, unsigned int perm, long long offset,
+                   const char *path, const char *path2, const char *data, int len);
+void journalSettle();
+int journalRestart(unsigned long long generation);
+void journalUsage(struct vfs_stats *st);
+void journalResetStats();
+void journalTeardown();
+
+// search.c
+int searchFiles(INODE **files, int count, const char *pattern, int len,
+                vfs_search_callback callback, void *arg);
+void searchUsage(struct vfs_stats *st);
+void searchResetStats();
+void searchTeardown();
+
+// checksum.c
+unsigned int crc32c(unsigned int crc, const char *buf, int len);
+unsigned int crc32cPatch(unsigned int crc, const char *before, const char *after, int len, int tail);
+void checksumSetup(int enabled);
+void checksumUsage(struct vfs_stats *st);
+void checksumResetStats();
+void checksumTeardown();
+
+// image.c
+void markDirty(long long offset, int len);
+void imageDetach();
+unsigned long long imageGeneration();
+
+// vfs.c
+int fileWrite(INODE *inode, int pos, const char *buf, int len);
+int fileRead(INODE *inode, int pos, char *buf, int len);
+void fileTruncate(INODE *inode, int size);
+INODE *lookupPath(const char *path);
+UFDT *lookupFd(int fd);
+void linkInode(INODE *parent, INODE *node, const char *leaf);
+int addLink(INODE *node, unsigned int parentNo, const char *leaf);
+int restoreLinks(INODE *node);
+void lockNamespace();
+void unlockNamespace();
+INODE *restoreInode(unsigned int inodeNo, int isDirectory, unsigned int perm,
+                    unsigned int fileSize, const EXTENT *extents, int extentCount, const char *inlineData);
+void runBatch(const struct vfs_sqe *sqes, int *results, int count);
+void faultInode(unsigned int inodeNo, int evict);
+int faultAll();
+int scrubInode(unsigned int inodeNo, unsigned long long *bytes);
+int replayCreate(const char *path, unsigned int inodeNo, unsigned int perm, int isDirectory);
+int replayWrite(unsigned int inodeNo, const char *buf, int len, long pos);
+int replayTruncate(unsigned int inodeNo, long size);
+
+#endif